@@ -0,0 +1,190 @@
+/* 
+ *  Copyright (c) 2012 Daisuke Okanohara
+  * 
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ * 
+ *   1. Redistributions of source code must retain the above Copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above Copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the authors nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ */
+
+#include <cassert>
+#include <cstdlib>
+#include <algorithm>
+#include <new>
+#include "Arena.hpp"
+
+using namespace std;
+
+namespace prefixsum{
+
+const uint64_t Arena::MIN_SLAB_BYTES;
+const uint64_t Arena::MAX_SLAB_BYTES;
+const uint64_t Arena::MAX_CLASS_BYTES;
+
+namespace {
+uint64_t GetWordNum(uint64_t bytes){
+  return (bytes + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+}
+
+// hold lock in the scope
+class Guard{
+public:
+  explicit Guard(VersionLock& lock) : lock_(lock){
+    lock_.Lock();
+  }
+
+  ~Guard(){
+    lock_.Unlock();
+  }
+
+private:
+  Guard(const Guard&);
+  Guard& operator=(const Guard&);
+
+  VersionLock& lock_;
+};
+}
+
+Arena::Arena() : free_lists_(MAX_CLASS_BYTES / sizeof(uint64_t) + 1, NULL),
+                 cur_(NULL), end_(NULL), next_slab_bytes_(MIN_SLAB_BYTES),
+                 slab_bytes_(0), large_bytes_(0), used_bytes_(0){
+}
+
+Arena::~Arena(){
+  Clear();
+}
+
+void Arena::NewSlab(uint64_t bytes){
+  uint64_t* slab = static_cast<uint64_t*>(malloc(bytes));
+  if (slab == NULL) throw std::bad_alloc();
+  slabs_.push_back(slab);
+  cur_ = slab;
+  end_ = slab + bytes / sizeof(uint64_t);
+  slab_bytes_ += bytes;
+}
+
+void* Arena::Allocate(uint64_t bytes){
+  if (bytes == 0) return NULL;
+  if (bytes > MAX_CLASS_BYTES){
+    void* ptr = malloc(bytes);
+    if (ptr == NULL) throw std::bad_alloc();
+    large_blocks_.push_back(ptr);
+    large_bytes_ += bytes;
+    used_bytes_ += bytes;
+    return ptr;
+  }
+
+  const uint64_t words = GetWordNum(bytes);
+  used_bytes_ += words * sizeof(uint64_t);
+  void*& head = free_lists_[words];
+  if (head != NULL){
+    void* ptr = head;
+    head = *static_cast<void**>(ptr);
+    return ptr;
+  }
+  if (static_cast<uint64_t>(end_ - cur_) < words){
+    NewSlab(next_slab_bytes_);
+    next_slab_bytes_ = min(next_slab_bytes_ * 2, MAX_SLAB_BYTES);
+  }
+  void* ptr = cur_;
+  cur_ += words;
+  return ptr;
+}
+
+void Arena::Free(void* ptr, uint64_t bytes){
+  if (ptr == NULL) return;
+  if (bytes > MAX_CLASS_BYTES){
+    vector<void*>::iterator it = find(large_blocks_.begin(), large_blocks_.end(), ptr);
+    assert(it != large_blocks_.end());
+    large_blocks_.erase(it);
+    free(ptr);
+    large_bytes_ -= bytes;
+    used_bytes_ -= bytes;
+    return;
+  }
+  const uint64_t words = GetWordNum(bytes);
+  used_bytes_ -= words * sizeof(uint64_t);
+  *static_cast<void**>(ptr) = free_lists_[words];
+  free_lists_[words] = ptr;
+}
+
+void Arena::Clear(){
+  for (uint64_t i = 0; i < slabs_.size(); ++i){
+    free(slabs_[i]);
+  }
+  for (uint64_t i = 0; i < large_blocks_.size(); ++i){
+    free(large_blocks_[i]);
+  }
+  slabs_.clear();
+  large_blocks_.clear();
+  fill(free_lists_.begin(), free_lists_.end(), static_cast<void*>(NULL));
+  cur_ = NULL;
+  end_ = NULL;
+  next_slab_bytes_ = MIN_SLAB_BYTES;
+  slab_bytes_ = 0;
+  large_bytes_ = 0;
+  used_bytes_ = 0;
+}
+
+uint64_t Arena::GetAllocatedBytes() const{
+  return slab_bytes_ + large_bytes_ + 
+    sizeof(free_lists_[0]) * free_lists_.size() +
+    sizeof(slabs_[0]) * slabs_.capacity() + 
+    sizeof(large_blocks_[0]) * large_blocks_.capacity() + sizeof(*this);
+}
+
+ConcurrentArena::ConcurrentArena() : retired_bytes_(0){
+}
+
+ConcurrentArena::~ConcurrentArena(){
+}
+
+void* ConcurrentArena::Allocate(uint64_t bytes){
+  Guard guard(lock_);
+  return arena_.Allocate(bytes);
+}
+
+void ConcurrentArena::Free(void* ptr, uint64_t bytes){
+  if (ptr == NULL) return;
+  Guard guard(lock_);
+  retired_.push_back(make_pair(ptr, bytes));
+  retired_bytes_ += bytes;
+}
+
+void ConcurrentArena::Clear(){
+  Guard guard(lock_);
+  arena_.Clear();
+  retired_.clear();
+  retired_bytes_ = 0;
+}
+
+uint64_t ConcurrentArena::GetAllocatedBytes() const{
+  Guard guard(lock_);
+  return arena_.GetAllocatedBytes() + sizeof(retired_[0]) * retired_.capacity();
+}
+
+void ConcurrentArena::Reclaim(){
+  Guard guard(lock_);
+  for (uint64_t i = 0; i < retired_.size(); ++i){
+    arena_.Free(retired_[i].first, retired_[i].second);
+  }
+  retired_.clear();
+  retired_bytes_ = 0;
+}
+
+uint64_t ConcurrentArena::GetRetiredBytes() const{
+  Guard guard(lock_);
+  return retired_bytes_;
+}
+
+} // namespace prefixsum
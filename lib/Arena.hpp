@@ -0,0 +1,143 @@
+/* 
+ *  Copyright (c) 2012 Daisuke Okanohara
+  * 
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ * 
+ *   1. Redistributions of source code must retain the above Copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above Copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the authors nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ */
+
+#ifndef PREFIX_SUM_ARENA_HPP_
+#define PREFIX_SUM_ARENA_HPP_
+
+#include <utility>
+#include <vector>
+#include <stdint.h>
+#include "VersionLock.hpp"
+
+namespace prefixsum{
+
+/**
+ * Memory allocator interface used by PrefixSum for nodes, leaves and
+ * bit arrays. Clear() must release every memory returned by Allocate()
+ * at once, so that a PrefixSum can be cleared without visiting its nodes.
+ */
+class Allocator{
+public:
+  virtual ~Allocator(){}
+
+  /**
+   * Return the memory of bytes (8 byte aligned)
+   */
+  virtual void* Allocate(uint64_t bytes) = 0;
+
+  /**
+   * Return ptr (allocated by Allocate(bytes)) to the allocator
+   */
+  virtual void Free(void* ptr, uint64_t bytes) = 0;
+
+  /**
+   * Release all memory
+   */
+  virtual void Clear() = 0;
+
+  /**
+   * Return the bytes reserved from the system
+   */
+  virtual uint64_t GetAllocatedBytes() const = 0;
+};
+
+/**
+ * Slab allocator.
+ * Small requests are rounded to 8 byte words and carved from slabs whose
+ * sizes grow geometrically from MIN_SLAB_BYTES to MAX_SLAB_BYTES.
+ * Freed memory is kept in a free list per size class and reused.
+ */
+class Arena : public Allocator{
+public:
+  static const uint64_t MIN_SLAB_BYTES  = 4096;
+  static const uint64_t MAX_SLAB_BYTES  = 1 << 18;
+  static const uint64_t MAX_CLASS_BYTES = 4096;
+
+  Arena();
+  ~Arena();
+
+  void* Allocate(uint64_t bytes);
+  void Free(void* ptr, uint64_t bytes);
+  void Clear();
+  uint64_t GetAllocatedBytes() const;
+
+  /**
+   * Return the bytes currently allocated and not freed
+   */
+  uint64_t GetUsedBytes() const{
+    return used_bytes_;
+  }
+
+private:
+  Arena(const Arena&);
+  Arena& operator=(const Arena&);
+
+  void NewSlab(uint64_t bytes);
+
+  std::vector<void*> free_lists_;
+  std::vector<uint64_t*> slabs_;
+  std::vector<void*> large_blocks_;
+  uint64_t* cur_;
+  uint64_t* end_;
+  uint64_t next_slab_bytes_;
+  uint64_t slab_bytes_;
+  uint64_t large_bytes_;
+  uint64_t used_bytes_;
+};
+
+/**
+ * Arena shared by threads, whose Allocate and Free hold a lock.
+ * A freed block is only retired: it keeps its contents and is not
+ * reused until Reclaim(), so that a reader which has not yet noticed
+ * the change may still read it. Reclaim() must not run concurrently
+ * with such readers.
+ */
+class ConcurrentArena : public Allocator{
+public:
+  ConcurrentArena();
+  ~ConcurrentArena();
+
+  void* Allocate(uint64_t bytes);
+  void Free(void* ptr, uint64_t bytes);
+  void Clear();
+  uint64_t GetAllocatedBytes() const;
+
+  /**
+   * Return the retired blocks to the arena for reuse
+   */
+  void Reclaim();
+
+  /**
+   * Return the bytes of the blocks retired since the last Reclaim()
+   */
+  uint64_t GetRetiredBytes() const;
+
+private:
+  ConcurrentArena(const ConcurrentArena&);
+  ConcurrentArena& operator=(const ConcurrentArena&);
+
+  Arena arena_;
+  std::vector<std::pair<void*, uint64_t> > retired_;
+  uint64_t retired_bytes_;
+  mutable VersionLock lock_;
+};
+
+} // namespace prefixsum
+
+#endif // PREFIX_SUM_ARENA_HPP_
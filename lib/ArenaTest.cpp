@@ -0,0 +1,106 @@
+/* 
+ *  Copyright (c) 2012 Daisuke Okanohara
+  * 
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ * 
+ *   1. Redistributions of source code must retain the above Copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above Copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the authors nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ */
+
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <gtest/gtest.h>
+#include "Arena.hpp"
+
+using namespace std;
+using namespace prefixsum;
+
+TEST(Arena, trivial){
+  Arena arena;
+  ASSERT_EQ(0, arena.GetUsedBytes());
+  ASSERT_TRUE(arena.Allocate(0) == NULL);
+  void* p = arena.Allocate(10);
+  ASSERT_TRUE(p != NULL);
+  ASSERT_EQ(16, arena.GetUsedBytes());
+  arena.Free(p, 10);
+  ASSERT_EQ(0, arena.GetUsedBytes());
+  void* q = arena.Allocate(16);
+  ASSERT_EQ(p, q);
+  arena.Clear();
+  ASSERT_EQ(0, arena.GetUsedBytes());
+}
+
+TEST(Arena, large){
+  Arena arena;
+  void* p = arena.Allocate(Arena::MAX_CLASS_BYTES + 1);
+  ASSERT_TRUE(p != NULL);
+  memset(p, 0xff, Arena::MAX_CLASS_BYTES + 1);
+  ASSERT_EQ(Arena::MAX_CLASS_BYTES + 1, arena.GetUsedBytes());
+  arena.Free(p, Arena::MAX_CLASS_BYTES + 1);
+  ASSERT_EQ(0, arena.GetUsedBytes());
+}
+
+TEST(Arena, random){
+  Arena arena;
+  vector<pair<uint64_t*, uint64_t> > blocks;
+  for (uint64_t i = 0; i < 100000; ++i){
+    if (blocks.empty() || rand() % 3 > 0){
+      uint64_t words = rand() % 300 + 1;
+      uint64_t* p = static_cast<uint64_t*>(arena.Allocate(words * sizeof(uint64_t)));
+      for (uint64_t j = 0; j < words; ++j){
+        p[j] = blocks.size();
+      }
+      blocks.push_back(make_pair(p, words));
+    } else {
+      uint64_t ind = rand() % blocks.size();
+      arena.Free(blocks[ind].first, blocks[ind].second * sizeof(uint64_t));
+      blocks[ind] = blocks.back();
+      blocks.pop_back();
+      if (ind < blocks.size()){
+        fill(blocks[ind].first, blocks[ind].first + blocks[ind].second, ind);
+      }
+    }
+  }
+  uint64_t used = 0;
+  for (uint64_t i = 0; i < blocks.size(); ++i){
+    for (uint64_t j = 0; j < blocks[i].second; ++j){
+      ASSERT_EQ(i, blocks[i].first[j]);
+    }
+    used += blocks[i].second * sizeof(uint64_t);
+  }
+  ASSERT_EQ(used, arena.GetUsedBytes());
+  ASSERT_LE(used, arena.GetAllocatedBytes());
+}
+
+TEST(ConcurrentArena, retire){
+  ConcurrentArena arena;
+  uint64_t* p = static_cast<uint64_t*>(arena.Allocate(64));
+  for (uint64_t i = 0; i < 8; ++i){
+    p[i] = i;
+  }
+  arena.Free(p, 64);
+  ASSERT_EQ(64, arena.GetRetiredBytes());
+  // a retired block keeps its contents and is not reused
+  uint64_t* q = static_cast<uint64_t*>(arena.Allocate(64));
+  ASSERT_TRUE(p != q);
+  for (uint64_t i = 0; i < 8; ++i){
+    ASSERT_EQ(i, p[i]);
+  }
+  arena.Reclaim();
+  ASSERT_EQ(0, arena.GetRetiredBytes());
+  ASSERT_EQ(p, arena.Allocate(64));
+  arena.Clear();
+  ASSERT_EQ(0, arena.GetRetiredBytes());
+}
@@ -0,0 +1,467 @@
+/* 
+ *  Copyright (c) 2012 Daisuke Okanohara
+  * 
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ * 
+ *   1. Redistributions of source code must retain the above Copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above Copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the authors nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ */
+
+#include "BitKernel.hpp"
+#include "BitUtil.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+  (defined(__clang__) || __GNUC__ >= 8)
+#define PREFIX_SUM_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace prefixsum{
+
+const uint64_t BitKernel::LEVEL_NUM;
+
+namespace {
+
+uint64_t PlaneSumScalar(const uint64_t* planes, uint64_t width, uint64_t mask){
+  uint64_t ret = 0;
+  for (uint64_t i = 0; i < width; ++i){
+    ret += BitUtil::PopCount(planes[i] & mask) << i;
+  }
+  return ret;
+}
+
+// count the bytes whose cumulative popcount is at most rank, then
+// drop the preceding ones in the byte (Vigna, Broadword Implementation
+// of Rank/Select Queries)
+uint64_t SelectScalar(uint64_t x, uint64_t rank){
+  const uint64_t ones = 0x0101010101010101LLU;
+  const uint64_t highs = 0x8080808080808080LLU;
+  uint64_t s = x - ((x >> 1) & 0x5555555555555555LLU);
+  s = (s & 0x3333333333333333LLU) + ((s >> 2) & 0x3333333333333333LLU);
+  s = ((s + (s >> 4)) & 0x0F0F0F0F0F0F0F0FLLU) * ones;
+  const uint64_t leqs = (((rank * ones) | highs) - s) & highs;
+  const uint64_t pos = ((leqs >> 7) * ones >> 56) * 8;
+  uint64_t bits = (x >> pos) & 0xFFLLU;
+  for (rank -= ((s << 8) >> pos) & 0xFFLLU; rank > 0; --rank){
+    bits &= bits - 1;
+  }
+  return pos + __builtin_ctzll(bits);
+}
+
+// InsertShift on the planes [beg, end)
+void InsertShiftPlanes(uint64_t* planes, uint64_t stride, uint64_t block_num, uint64_t beg,
+                       uint64_t end, uint64_t offset, uint64_t val, uint64_t* outs){
+  const uint64_t mask = (1LLU << offset) - 1;
+  for (uint64_t shift = beg; shift < end; ++shift){
+    uint64_t& bits = planes[shift];
+    uint64_t carry = bits >> 63;
+    bits = (bits & mask) | ((bits & ~mask) << 1) | BitUtil::GetBit(val, shift) << offset;
+    if (outs != NULL) outs[0] |= carry << shift;
+    for (uint64_t i = 1; i < block_num; ++i){
+      uint64_t& next_bits = planes[i * stride + shift];
+      const uint64_t next_carry = next_bits >> 63;
+      next_bits = (next_bits << 1) | carry;
+      carry = next_carry;
+      if (outs != NULL) outs[i] |= carry << shift;
+    }
+  }
+}
+
+// EraseShift on the planes [beg, end)
+void EraseShiftPlanes(uint64_t* planes, uint64_t stride, uint64_t block_num, uint64_t beg,
+                      uint64_t end, uint64_t offset, uint64_t* ins){
+  const uint64_t mask = (1LLU << offset) - 1;
+  for (uint64_t shift = beg; shift < end; ++shift){
+    for (uint64_t i = 0; i < block_num; ++i){
+      uint64_t& bits = planes[i * stride + shift];
+      const uint64_t next = (i + 1 < block_num) ? planes[(i + 1) * stride + shift] : 0;
+      const uint64_t keep = (i == 0) ? mask : 0;
+      bits = (bits & keep) | ((bits >> 1) & ~keep) | (next << 63);
+      if (ins != NULL) ins[i] |= (next & 1LLU) << shift;
+    }
+  }
+}
+
+void InsertShiftScalar(uint64_t* planes, uint64_t stride, uint64_t block_num, uint64_t width,
+                       uint64_t offset, uint64_t val, uint64_t* outs){
+  InsertShiftPlanes(planes, stride, block_num, 0, width, offset, val, outs);
+}
+
+void EraseShiftScalar(uint64_t* planes, uint64_t stride, uint64_t block_num, uint64_t width,
+                      uint64_t offset, uint64_t* ins){
+  EraseShiftPlanes(planes, stride, block_num, 0, width, offset, ins);
+}
+
+// the widest planes decoded by DecodeBlockBytes
+const uint64_t DECODE_BYTES_WIDTH = 8;
+
+// decode a block of width <= 8 planes, assembling 8 values at a time
+// in the bytes of a word
+void DecodeBlockBytes(const uint64_t* planes, uint64_t width, uint64_t* vals){
+  for (uint64_t i = 0; i < 64; i += 8){
+    uint64_t bytes = 0;
+    for (uint64_t shift = 0; shift < width; ++shift){
+      bytes |= BitUtil::SpreadBits((planes[shift] >> i) & 0xFFLLU) << shift;
+    }
+    for (uint64_t j = 0; j < 8; ++j){
+      vals[i + j] = (bytes >> (j * 8)) & 0xFFLLU;
+    }
+  }
+}
+
+// transpose the 64x64 bit matrix for more planes
+void DecodeBlockScalar(const uint64_t* planes, uint64_t width, uint64_t* vals){
+  if (width <= DECODE_BYTES_WIDTH){
+    DecodeBlockBytes(planes, width, vals);
+    return;
+  }
+  for (uint64_t shift = 0; shift < width; ++shift){
+    vals[shift] = planes[shift];
+  }
+  for (uint64_t shift = width; shift < 64; ++shift){
+    vals[shift] = 0;
+  }
+  BitUtil::Transpose64(vals);
+}
+
+#ifdef PREFIX_SUM_X86_KERNELS
+
+__attribute__((target("popcnt")))
+uint64_t PlaneSumPopcnt(const uint64_t* planes, uint64_t width, uint64_t mask){
+  uint64_t ret = 0;
+  for (uint64_t i = 0; i < width; ++i){
+    ret += static_cast<uint64_t>(__builtin_popcountll(planes[i] & mask)) << i;
+  }
+  return ret;
+}
+
+// deposit the rank-th one of x to its position
+__attribute__((target("bmi,bmi2")))
+uint64_t SelectBmi2(uint64_t x, uint64_t rank){
+  return _tzcnt_u64(_pdep_u64(1LLU << rank, x));
+}
+
+// popcount of each 64-bit lane by looking up nibbles and summing bytes,
+// while a few planes are faster by popcnt
+__attribute__((target("popcnt,avx2")))
+uint64_t PlaneSumAvx2(const uint64_t* planes, uint64_t width, uint64_t mask){
+  if (width < 4) return PlaneSumPopcnt(planes, width, mask);
+  const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                          0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low = _mm256_set1_epi8(0x0F);
+  const __m256i masks = _mm256_set1_epi64x(mask);
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i shifts = _mm256_setr_epi64x(0, 1, 2, 3);
+  __m256i sums = zero;
+  uint64_t i = 0;
+  for (; i + 4 <= width; i += 4){
+    const __m256i v = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(planes + i)), masks);
+    const __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low)),
+                                           _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi64(v, 4), low)));
+    sums = _mm256_add_epi64(sums, _mm256_sllv_epi64(_mm256_sad_epu8(counts, zero), shifts));
+    shifts = _mm256_add_epi64(shifts, _mm256_set1_epi64x(4));
+  }
+  uint64_t lanes[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), sums);
+  _mm256_zeroupper();
+  uint64_t ret = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  for (; i < width; ++i){
+    ret += static_cast<uint64_t>(__builtin_popcountll(planes[i] & mask)) << i;
+  }
+  return ret;
+}
+
+__attribute__((target("avx2")))
+inline uint64_t OrLanes(__m256i v){
+  const __m128i x = _mm_or_si128(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+  return _mm_cvtsi128_si64(x) | _mm_extract_epi64(x, 1);
+}
+
+// shift 4 planes at once, and the rest by the scalar code after
+// clearing the upper halves to avoid the penalty of mixing with SSE
+__attribute__((target("avx2")))
+void InsertShiftAvx2(uint64_t* planes, uint64_t stride, uint64_t block_num, uint64_t width,
+                     uint64_t offset, uint64_t val, uint64_t* outs){
+  const __m256i masks = _mm256_set1_epi64x((1LLU << offset) - 1);
+  const __m128i offsets = _mm_cvtsi64_si128(offset);
+  const __m256i vals = _mm256_set1_epi64x(val);
+  const __m256i ones = _mm256_set1_epi64x(1);
+  __m256i shifts = _mm256_setr_epi64x(0, 1, 2, 3);
+  uint64_t shift = 0;
+  for (; shift + 4 <= width; shift += 4){
+    __m256i* p = reinterpret_cast<__m256i*>(planes + shift);
+    const __m256i bits = _mm256_loadu_si256(p);
+    __m256i carry = _mm256_srli_epi64(bits, 63);
+    const __m256i val_bits = _mm256_sll_epi64(_mm256_and_si256(_mm256_srlv_epi64(vals, shifts), ones), offsets);
+    _mm256_storeu_si256(p, _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(bits, masks),
+                                                           _mm256_slli_epi64(_mm256_andnot_si256(masks, bits), 1)),
+                                           val_bits));
+    if (outs != NULL) outs[0] |= OrLanes(_mm256_sllv_epi64(carry, shifts));
+    for (uint64_t i = 1; i < block_num; ++i){
+      p = reinterpret_cast<__m256i*>(planes + i * stride + shift);
+      const __m256i next_bits = _mm256_loadu_si256(p);
+      _mm256_storeu_si256(p, _mm256_or_si256(_mm256_slli_epi64(next_bits, 1), carry));
+      carry = _mm256_srli_epi64(next_bits, 63);
+      if (outs != NULL) outs[i] |= OrLanes(_mm256_sllv_epi64(carry, shifts));
+    }
+    shifts = _mm256_add_epi64(shifts, _mm256_set1_epi64x(4));
+  }
+  _mm256_zeroupper();
+  InsertShiftPlanes(planes, stride, block_num, shift, width, offset, val, outs);
+}
+
+__attribute__((target("avx2")))
+void EraseShiftAvx2(uint64_t* planes, uint64_t stride, uint64_t block_num, uint64_t width,
+                    uint64_t offset, uint64_t* ins){
+  const __m256i masks = _mm256_set1_epi64x((1LLU << offset) - 1);
+  const __m256i ones = _mm256_set1_epi64x(1);
+  __m256i shifts = _mm256_setr_epi64x(0, 1, 2, 3);
+  uint64_t shift = 0;
+  for (; shift + 4 <= width; shift += 4){
+    __m256i bits = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(planes + shift));
+    for (uint64_t i = 0; i < block_num; ++i){
+      const __m256i next = (i + 1 < block_num) ?
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(planes + (i + 1) * stride + shift)) :
+        _mm256_setzero_si256();
+      __m256i shifted = _mm256_or_si256(_mm256_srli_epi64(bits, 1), _mm256_slli_epi64(next, 63));
+      if (i == 0){
+        shifted = _mm256_or_si256(_mm256_and_si256(bits, masks), _mm256_andnot_si256(masks, shifted));
+      }
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(planes + i * stride + shift), shifted);
+      if (ins != NULL) ins[i] |= OrLanes(_mm256_sllv_epi64(_mm256_and_si256(next, ones), shifts));
+      bits = next;
+    }
+    shifts = _mm256_add_epi64(shifts, _mm256_set1_epi64x(4));
+  }
+  _mm256_zeroupper();
+  EraseShiftPlanes(planes, stride, block_num, shift, width, offset, ins);
+}
+
+// the planes beyond width are masked out of the loads, and a few
+// planes are faster by AVX2 or popcnt
+__attribute__((target("popcnt,avx2,avx512f,avx512vpopcntdq")))
+uint64_t PlaneSumAvx512(const uint64_t* planes, uint64_t width, uint64_t mask){
+  if (width < 8) return PlaneSumAvx2(planes, width, mask);
+  const __m512i masks = _mm512_set1_epi64(mask);
+  __m512i shifts = _mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0);
+  __m512i sums = _mm512_setzero_si512();
+  for (uint64_t i = 0; i < width; i += 8){
+    const __mmask8 k = (width - i >= 8) ? 0xFF : (1U << (width - i)) - 1;
+    const __m512i v = _mm512_and_si512(_mm512_maskz_loadu_epi64(k, planes + i), masks);
+    sums = _mm512_add_epi64(sums, _mm512_maskz_sllv_epi64(0xFF, _mm512_popcnt_epi64(v), shifts));
+    shifts = _mm512_add_epi64(shifts, _mm512_set1_epi64(8));
+  }
+  uint64_t lanes[8];
+  _mm512_storeu_si512(lanes, sums);
+  _mm256_zeroupper();
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + lanes[4] + lanes[5] + lanes[6] + lanes[7];
+}
+
+__attribute__((target("avx2,avx512f")))
+inline uint64_t OrLanes(__m512i v){
+  uint64_t lanes[8];
+  _mm512_storeu_si512(lanes, v);
+  return lanes[0] | lanes[1] | lanes[2] | lanes[3] | lanes[4] | lanes[5] | lanes[6] | lanes[7];
+}
+
+// shift 8 planes at once, masking the planes beyond width
+__attribute__((target("avx2,avx512f")))
+void InsertShiftAvx512(uint64_t* planes, uint64_t stride, uint64_t block_num, uint64_t width,
+                       uint64_t offset, uint64_t val, uint64_t* outs){
+  const __m512i masks = _mm512_set1_epi64((1LLU << offset) - 1);
+  const __m512i not_masks = _mm512_set1_epi64(~((1LLU << offset) - 1));
+  const __m128i offsets = _mm_cvtsi64_si128(offset);
+  const __m512i vals = _mm512_set1_epi64(val);
+  const __m512i ones = _mm512_set1_epi64(1);
+  __m512i shifts = _mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0);
+  for (uint64_t shift = 0; shift < width; shift += 8){
+    const __mmask8 k = (width - shift >= 8) ? 0xFF : (1U << (width - shift)) - 1;
+    const __m512i bits = _mm512_maskz_loadu_epi64(k, planes + shift);
+    __m512i carry = _mm512_maskz_srli_epi64(0xFF, bits, 63);
+    const __m512i val_bits = _mm512_maskz_sll_epi64(0xFF, _mm512_and_si512(_mm512_maskz_srlv_epi64(0xFF, vals, shifts), ones), offsets);
+    _mm512_mask_storeu_epi64(planes + shift, k,
+                             _mm512_or_si512(_mm512_or_si512(_mm512_and_si512(bits, masks),
+                                                             _mm512_maskz_slli_epi64(0xFF, _mm512_and_si512(bits, not_masks), 1)),
+                                             val_bits));
+    if (outs != NULL) outs[0] |= OrLanes(_mm512_maskz_sllv_epi64(0xFF, carry, shifts));
+    for (uint64_t i = 1; i < block_num; ++i){
+      uint64_t* p = planes + i * stride + shift;
+      const __m512i next_bits = _mm512_maskz_loadu_epi64(k, p);
+      _mm512_mask_storeu_epi64(p, k, _mm512_or_si512(_mm512_maskz_slli_epi64(0xFF, next_bits, 1), carry));
+      carry = _mm512_maskz_srli_epi64(0xFF, next_bits, 63);
+      if (outs != NULL) outs[i] |= OrLanes(_mm512_maskz_sllv_epi64(0xFF, carry, shifts));
+    }
+    shifts = _mm512_add_epi64(shifts, _mm512_set1_epi64(8));
+  }
+  _mm256_zeroupper();
+}
+
+__attribute__((target("avx2,avx512f")))
+void EraseShiftAvx512(uint64_t* planes, uint64_t stride, uint64_t block_num, uint64_t width,
+                      uint64_t offset, uint64_t* ins){
+  const __m512i masks = _mm512_set1_epi64((1LLU << offset) - 1);
+  const __m512i not_masks = _mm512_set1_epi64(~((1LLU << offset) - 1));
+  const __m512i ones = _mm512_set1_epi64(1);
+  __m512i shifts = _mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0);
+  for (uint64_t shift = 0; shift < width; shift += 8){
+    const __mmask8 k = (width - shift >= 8) ? 0xFF : (1U << (width - shift)) - 1;
+    __m512i bits = _mm512_maskz_loadu_epi64(k, planes + shift);
+    for (uint64_t i = 0; i < block_num; ++i){
+      const __m512i next = (i + 1 < block_num) ?
+        _mm512_maskz_loadu_epi64(k, planes + (i + 1) * stride + shift) : _mm512_setzero_si512();
+      __m512i shifted = _mm512_or_si512(_mm512_maskz_srli_epi64(0xFF, bits, 1),
+                                        _mm512_maskz_slli_epi64(0xFF, next, 63));
+      if (i == 0){
+        shifted = _mm512_or_si512(_mm512_and_si512(bits, masks), _mm512_and_si512(shifted, not_masks));
+      }
+      _mm512_mask_storeu_epi64(planes + i * stride + shift, k, shifted);
+      if (ins != NULL) ins[i] |= OrLanes(_mm512_maskz_sllv_epi64(0xFF, _mm512_and_si512(next, ones), shifts));
+      bits = next;
+    }
+    shifts = _mm512_add_epi64(shifts, _mm512_set1_epi64(8));
+  }
+  _mm256_zeroupper();
+}
+
+// the widest planes decoded by DecodeBlockBytes in DecodeBlockAvx2
+const uint64_t DECODE_BYTES_WIDTH_AVX2 = 4;
+
+/*
+ * Transpose 32 planes at a time to 8 vectors, where the s-th byte of the
+ * g-th vector is the g-th byte of the s-th plane, so that movemask of the
+ * g-th vector shifted left by 7-k gathers the bits of vals[8g+k].
+ * Each lane of a load has two planes, whose bytes are interleaved by a
+ * shuffle, and unpacking 16, 32 and 64 bits merges the lanes of 2, 4 and 8
+ * loads. Loading planes 2i, 2i+1 and 16+2i, 17+2i to the i-th vector puts
+ * the s-th plane at the s-th byte after the unpacks, and the planes above
+ * width are masked to zeros. A few planes are faster by the scalar code.
+ */
+__attribute__((target("avx2")))
+void DecodeBlockAvx2(const uint64_t* planes, uint64_t width, uint64_t* vals){
+  if (width <= DECODE_BYTES_WIDTH_AVX2){
+    DecodeBlockBytes(planes, width, vals);
+    return;
+  }
+  const __m256i pairs = _mm256_setr_epi8(0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15,
+                                         0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15);
+  for (uint64_t base = 0; base < width; base += 32){
+    const __m256i rest = _mm256_set1_epi64x(width - base);
+    __m256i shifts = _mm256_setr_epi64x(0, 1, 16, 17);
+    __m256i x[8];
+    for (uint64_t i = 0; i < 8; ++i){
+      const __m256i masks = _mm256_cmpgt_epi64(rest, shifts);
+      const __m128i lo = _mm_maskload_epi64(reinterpret_cast<const long long*>(planes + base + i * 2),
+                                            _mm256_castsi256_si128(masks));
+      const __m128i hi = _mm_maskload_epi64(reinterpret_cast<const long long*>(planes + base + 16 + i * 2),
+                                            _mm256_extracti128_si256(masks, 1));
+      x[i] = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1), pairs);
+      shifts = _mm256_add_epi64(shifts, _mm256_set1_epi64x(2));
+    }
+    // los have the bytes 0-3 of 4 planes in each 32 bits, and his the bytes 4-7
+    __m256i los[4];
+    __m256i his[4];
+    for (uint64_t i = 0; i < 4; ++i){
+      los[i] = _mm256_unpacklo_epi16(x[i * 2], x[i * 2 + 1]);
+      his[i] = _mm256_unpackhi_epi16(x[i * 2], x[i * 2 + 1]);
+    }
+    // the t-th pairs have the bytes 2t and 2t+1 of 8 planes in each 64 bits
+    __m256i quads[4][2];
+    for (uint64_t i = 0; i < 2; ++i){
+      quads[0][i] = _mm256_unpacklo_epi32(los[i * 2], los[i * 2 + 1]);
+      quads[1][i] = _mm256_unpackhi_epi32(los[i * 2], los[i * 2 + 1]);
+      quads[2][i] = _mm256_unpacklo_epi32(his[i * 2], his[i * 2 + 1]);
+      quads[3][i] = _mm256_unpackhi_epi32(his[i * 2], his[i * 2 + 1]);
+    }
+    for (uint64_t t = 0; t < 4; ++t){
+      __m256i bytes[2];
+      bytes[0] = _mm256_unpacklo_epi64(quads[t][0], quads[t][1]);
+      bytes[1] = _mm256_unpackhi_epi64(quads[t][0], quads[t][1]);
+      for (uint64_t h = 0; h < 2; ++h){
+        uint64_t* p = vals + (t * 2 + h) * 8;
+        __m256i v = bytes[h];
+        for (uint64_t k = 8; k-- > 0; ){
+          const uint64_t bits = static_cast<uint32_t>(_mm256_movemask_epi8(v));
+          p[k] = (base == 0) ? bits : p[k] | (bits << base);
+          v = _mm256_add_epi8(v, v);
+        }
+      }
+    }
+  }
+  _mm256_zeroupper();
+}
+
+#endif // PREFIX_SUM_X86_KERNELS
+
+}
+
+BitKernel::Table BitKernel::table_ = {PlaneSumScalar, SelectScalar, InsertShiftScalar,
+                                      EraseShiftScalar, DecodeBlockScalar, BitKernel::SCALAR};
+
+namespace {
+
+// switch to the best kernels before main
+struct KernelInitializer{
+  KernelInitializer(){
+    BitKernel::SetLevel(BitKernel::GetSupportedLevel());
+  }
+} kernel_initializer;
+
+}
+
+BitKernel::Level BitKernel::GetSupportedLevel(){
+#ifdef PREFIX_SUM_X86_KERNELS
+  __builtin_cpu_init();
+  if (!__builtin_cpu_supports("popcnt")) return SCALAR;
+  if (!__builtin_cpu_supports("bmi2")) return POPCNT;
+  if (!__builtin_cpu_supports("avx2")) return BMI2;
+  if (!__builtin_cpu_supports("avx512f") || !__builtin_cpu_supports("avx512vpopcntdq")) return AVX2;
+  return AVX512;
+#else
+  return SCALAR;
+#endif
+}
+
+bool BitKernel::SetLevel(Level level){
+  if (level > GetSupportedLevel()) return false;
+  table_ = GetTable(level);
+  return true;
+}
+
+const char* BitKernel::GetLevelName(Level level){
+  static const char* names[LEVEL_NUM] = {"scalar", "popcnt", "bmi2", "avx2", "avx512"};
+  return names[level];
+}
+
+BitKernel::Table BitKernel::GetTable(Level level){
+  Table table = {PlaneSumScalar, SelectScalar, InsertShiftScalar, EraseShiftScalar,
+                 DecodeBlockScalar, SCALAR};
+#ifdef PREFIX_SUM_X86_KERNELS
+  if (level >= POPCNT) table.plane_sum = PlaneSumPopcnt;
+  if (level >= BMI2) table.select = SelectBmi2;
+  if (level >= AVX2){
+    table.plane_sum = PlaneSumAvx2;
+    table.insert_shift = InsertShiftAvx2;
+    table.erase_shift = EraseShiftAvx2;
+    table.decode_block = DecodeBlockAvx2;
+  }
+  if (level >= AVX512){
+    table.plane_sum = PlaneSumAvx512;
+    table.insert_shift = InsertShiftAvx512;
+    table.erase_shift = EraseShiftAvx512;
+  }
+  table.level = level;
+#endif
+  return table;
+}
+
+} // namespace prefixsum
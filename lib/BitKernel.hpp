@@ -0,0 +1,124 @@
+/* 
+ *  Copyright (c) 2012 Daisuke Okanohara
+  * 
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ * 
+ *   1. Redistributions of source code must retain the above Copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above Copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the authors nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ */
+
+#ifndef PREFIX_SUM_BIT_KERNEL_HPP_
+#define PREFIX_SUM_BIT_KERNEL_HPP_
+
+#include <cstddef>
+#include <stdint.h>
+
+namespace prefixsum{
+
+/**
+ * Kernels of the bit operations in leaves, dispatched through a table
+ * chosen by cpuid at startup. Each level adds instructions to the
+ * previous one, and SCALAR is the portable fallback:
+ *   POPCNT : popcnt
+ *   BMI2   : pdep and tzcnt for Select
+ *   AVX2   : PlaneSum (popcount by byte shuffles), shifts on 4 planes at once,
+ *            and DecodeBlock by byte transposes and movemask
+ *   AVX512 : PlaneSum with VPOPCNTDQ and shifts on 8 planes at once
+ * Only SCALAR is available on non-x86 targets.
+ */
+class BitKernel{
+public:
+  enum Level{
+    SCALAR = 0,
+    POPCNT = 1,
+    BMI2   = 2,
+    AVX2   = 3,
+    AVX512 = 4
+  };
+  static const uint64_t LEVEL_NUM = 5;
+
+  // return the sum of PopCount(planes[i] & mask) << i for i < width
+  static uint64_t PlaneSum(const uint64_t* planes, uint64_t width, uint64_t mask){
+    return table_.plane_sum(planes, width, mask);
+  }
+
+  // return the position of the rank-th (0-origin) one in x (rank < PopCount(x))
+  static uint64_t Select(uint64_t x, uint64_t rank){
+    return table_.select(x, rank);
+  }
+
+  /**
+   * Insert a bit into each of the width planes of block_num blocks, where
+   * the planes of the i-th block begin at planes[i * stride]: the bits at
+   * offset or later in the first block move up by one, the top bit of each
+   * block moves into the next block, and the shift-th bit of val is put at
+   * offset of the shift-th plane. If outs is not NULL, the value moved out
+   * of the i-th block is or-ed into outs[i].
+   */
+  static void InsertShift(uint64_t* planes, uint64_t stride, uint64_t block_num, uint64_t width,
+                          uint64_t offset, uint64_t val, uint64_t* outs){
+    table_.insert_shift(planes, stride, block_num, width, offset, val, outs);
+  }
+
+  /**
+   * Remove the bit at offset of the first block from each plane, the
+   * inverse of InsertShift. If ins is not NULL, the value moved into the
+   * i-th block is or-ed into ins[i].
+   */
+  static void EraseShift(uint64_t* planes, uint64_t stride, uint64_t block_num, uint64_t width,
+                         uint64_t offset, uint64_t* ins){
+    table_.erase_shift(planes, stride, block_num, width, offset, ins);
+  }
+
+  /**
+   * vals[i] <- the value whose shift-th bit is the i-th bit of planes[shift]
+   * for i < 64 and shift < width, i.e. transpose a block of bit planes
+   * into 64 horizontal values
+   */
+  static void DecodeBlock(const uint64_t* planes, uint64_t width, uint64_t* vals){
+    table_.decode_block(planes, width, vals);
+  }
+
+  // return the highest level supported by the cpu
+  static Level GetSupportedLevel();
+
+  // return the level of the current kernels
+  static Level GetLevel(){
+    return table_.level;
+  }
+
+  // use the kernels of level, and return false (and keep the current
+  // kernels) if the cpu does not support it. Not thread-safe.
+  static bool SetLevel(Level level);
+
+  static const char* GetLevelName(Level level);
+
+private:
+  struct Table{
+    uint64_t (*plane_sum)(const uint64_t* planes, uint64_t width, uint64_t mask);
+    uint64_t (*select)(uint64_t x, uint64_t rank);
+    void (*insert_shift)(uint64_t* planes, uint64_t stride, uint64_t block_num, uint64_t width,
+                         uint64_t offset, uint64_t val, uint64_t* outs);
+    void (*erase_shift)(uint64_t* planes, uint64_t stride, uint64_t block_num, uint64_t width,
+                        uint64_t offset, uint64_t* ins);
+    void (*decode_block)(const uint64_t* planes, uint64_t width, uint64_t* vals);
+    Level level;
+  };
+
+  static Table GetTable(Level level);
+  static Table table_;
+};
+
+} // namespace prefixsum
+
+#endif // PREFIX_SUM_BIT_KERNEL_HPP_
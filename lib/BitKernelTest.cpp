@@ -0,0 +1,208 @@
+/* 
+ *  Copyright (c) 2012 Daisuke Okanohara
+  * 
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ * 
+ *   1. Redistributions of source code must retain the above Copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above Copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the authors nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ */
+
+#include <vector>
+#include <gtest/gtest.h>
+#include "BitKernel.hpp"
+#include "PrefixSumLeaf.hpp"
+
+using namespace std;
+using namespace prefixsum;
+
+namespace {
+
+uint64_t Rand64(){
+  return (static_cast<uint64_t>(rand()) << 62) ^ (static_cast<uint64_t>(rand()) << 31) ^ rand();
+}
+
+uint64_t NaivePlaneSum(const uint64_t* planes, uint64_t width, uint64_t mask){
+  uint64_t ret = 0;
+  for (uint64_t i = 0; i < width; ++i){
+    for (uint64_t j = 0; j < 64; ++j){
+      if ((planes[i] & mask) >> j & 1LLU) ret += 1LLU << i;
+    }
+  }
+  return ret;
+}
+
+uint64_t NaiveSelect(uint64_t x, uint64_t rank){
+  for (uint64_t pos = 0; pos < 64; ++pos){
+    if ((x >> pos & 1LLU) && rank-- == 0) return pos;
+  }
+  return 64;
+}
+
+}
+
+TEST(BitKernel, supported_level){
+  const BitKernel::Level level = BitKernel::GetSupportedLevel();
+  ASSERT_EQ(level, BitKernel::GetLevel());
+  ASSERT_TRUE(BitKernel::SetLevel(BitKernel::SCALAR));
+  ASSERT_EQ(BitKernel::SCALAR, BitKernel::GetLevel());
+  if (level < BitKernel::AVX512){
+    ASSERT_FALSE(BitKernel::SetLevel(BitKernel::AVX512));
+    ASSERT_EQ(BitKernel::SCALAR, BitKernel::GetLevel());
+  }
+  ASSERT_TRUE(BitKernel::SetLevel(level));
+}
+
+TEST(BitKernel, plane_sum){
+  const BitKernel::Level supported = BitKernel::GetSupportedLevel();
+  vector<uint64_t> planes(64);
+  for (uint64_t l = 0; l <= supported; ++l){
+    ASSERT_TRUE(BitKernel::SetLevel(static_cast<BitKernel::Level>(l)));
+    for (uint64_t i = 0; i < 2000; ++i){
+      for (uint64_t j = 0; j < planes.size(); ++j){
+        planes[j] = (i % 2 == 0) ? Rand64() : 0xFFFFFFFFFFFFFFFFLLU;
+      }
+      const uint64_t width = i % 65;
+      const uint64_t offset = rand() % 65;
+      const uint64_t mask = (offset == 64) ? 0xFFFFFFFFFFFFFFFFLLU : (1LLU << offset) - 1;
+      ASSERT_EQ(NaivePlaneSum(&planes[0], width, mask), BitKernel::PlaneSum(&planes[0], width, mask))
+        << BitKernel::GetLevelName(BitKernel::GetLevel()) << " width=" << width << " offset=" << offset;
+    }
+  }
+  BitKernel::SetLevel(supported);
+}
+
+TEST(BitKernel, select){
+  const BitKernel::Level supported = BitKernel::GetSupportedLevel();
+  for (uint64_t l = 0; l <= supported; ++l){
+    ASSERT_TRUE(BitKernel::SetLevel(static_cast<BitKernel::Level>(l)));
+    for (uint64_t i = 0; i < 2000; ++i){
+      const uint64_t x = (i % 3 == 0) ? Rand64() & Rand64() : Rand64();
+      for (uint64_t rank = 0; NaiveSelect(x, rank) < 64; ++rank){
+        ASSERT_EQ(NaiveSelect(x, rank), BitKernel::Select(x, rank))
+          << BitKernel::GetLevelName(BitKernel::GetLevel()) << " rank=" << rank;
+      }
+    }
+  }
+  BitKernel::SetLevel(supported);
+}
+
+TEST(BitKernel, insert_erase_shift){
+  const BitKernel::Level supported = BitKernel::GetSupportedLevel();
+  const uint64_t stride = 70;
+  vector<uint64_t> planes(stride * 4);
+  for (uint64_t l = 0; l <= supported; ++l){
+    for (uint64_t i = 0; i < 2000; ++i){
+      for (uint64_t j = 0; j < planes.size(); ++j){
+        planes[j] = Rand64();
+      }
+      const uint64_t width = i % 65;
+      const uint64_t block_num = rand() % 4 + 1;
+      const uint64_t offset = rand() % 64;
+      const uint64_t val = Rand64() & ((width == 64) ? 0xFFFFFFFFFFFFFFFFLLU : (1LLU << width) - 1);
+      vector<uint64_t> expected(planes);
+      vector<uint64_t> expected_outs(4);
+      ASSERT_TRUE(BitKernel::SetLevel(BitKernel::SCALAR));
+      BitKernel::InsertShift(&expected[0], stride, block_num, width, offset, val, &expected_outs[0]);
+      vector<uint64_t> actual(planes);
+      vector<uint64_t> outs(4);
+      ASSERT_TRUE(BitKernel::SetLevel(static_cast<BitKernel::Level>(l)));
+      BitKernel::InsertShift(&actual[0], stride, block_num, width, offset, val, &outs[0]);
+      ASSERT_EQ(expected, actual) << BitKernel::GetLevelName(BitKernel::GetLevel()) << " width=" << width;
+      ASSERT_EQ(expected_outs, outs) << BitKernel::GetLevelName(BitKernel::GetLevel()) << " width=" << width;
+
+      // the values shifted into blocks by erase are those shifted out by insert
+      vector<uint64_t> ins(4);
+      BitKernel::EraseShift(&actual[0], stride, block_num, width, offset, &ins[0]);
+      for (uint64_t b = 0; b < block_num; ++b){
+        for (uint64_t shift = 0; shift < width; ++shift){
+          ASSERT_EQ(planes[b * stride + shift] & ((b + 1 == block_num) ? 0x7FFFFFFFFFFFFFFFLLU : 0xFFFFFFFFFFFFFFFFLLU),
+                    actual[b * stride + shift])
+            << BitKernel::GetLevelName(BitKernel::GetLevel()) << " width=" << width << " block=" << b;
+        }
+        if (b + 1 < block_num){
+          ASSERT_EQ(outs[b], ins[b]);
+        }
+      }
+      for (uint64_t j = 0; j < planes.size(); ++j){
+        if (j % stride >= width || j / stride >= block_num){
+          ASSERT_EQ(planes[j], actual[j]);
+        }
+      }
+    }
+  }
+  BitKernel::SetLevel(supported);
+}
+
+TEST(BitKernel, decode_block){
+  const BitKernel::Level supported = BitKernel::GetSupportedLevel();
+  vector<uint64_t> planes(64);
+  vector<uint64_t> vals(64);
+  for (uint64_t l = 0; l <= supported; ++l){
+    ASSERT_TRUE(BitKernel::SetLevel(static_cast<BitKernel::Level>(l)));
+    for (uint64_t i = 0; i < 2000; ++i){
+      const uint64_t width = i % 65;
+      for (uint64_t j = 0; j < planes.size(); ++j){
+        planes[j] = (j < width) ? Rand64() : 0;
+      }
+      BitKernel::DecodeBlock(&planes[0], width, &vals[0]);
+      for (uint64_t j = 0; j < 64; ++j){
+        uint64_t expected = 0;
+        for (uint64_t shift = 0; shift < width; ++shift){
+          expected |= (planes[shift] >> j & 1LLU) << shift;
+        }
+        ASSERT_EQ(expected, vals[j]) << BitKernel::GetLevelName(BitKernel::GetLevel())
+                                     << " width=" << width << " j=" << j;
+      }
+    }
+  }
+  BitKernel::SetLevel(supported);
+}
+
+TEST(BitKernel, leaf){
+  const BitKernel::Level supported = BitKernel::GetSupportedLevel();
+  for (uint64_t l = 0; l <= supported; ++l){
+    ASSERT_TRUE(BitKernel::SetLevel(static_cast<BitKernel::Level>(l)));
+    for (uint64_t maxval = 2; maxval <= (1LLU << 40); maxval <<= 13){
+      vector<uint64_t> vals(PrefixSumLeaf::MAX_NUM - 3);
+      for (uint64_t i = 0; i < vals.size(); ++i){
+        vals[i] = Rand64() % maxval;
+      }
+      PrefixSumLeaf ps;
+      ps.Build(&vals[0], vals.size(), PrefixSumLeaf::BIT_SLICED);
+      uint64_t cum = 0;
+      for (uint64_t i = 0; i < vals.size(); ++i){
+        ASSERT_EQ(cum, ps.GetPrefixSum(i)) << BitKernel::GetLevelName(BitKernel::GetLevel());
+        if (vals[i] > 0){
+          ASSERT_EQ(i, ps.Find(cum)) << BitKernel::GetLevelName(BitKernel::GetLevel());
+          ASSERT_EQ(i, ps.Find(cum + vals[i] - 1)) << BitKernel::GetLevelName(BitKernel::GetLevel());
+        }
+        cum += vals[i];
+      }
+      ASSERT_EQ(cum, ps.Sum());
+      ASSERT_EQ(vals.size(), ps.Find(cum));
+
+      for (uint64_t i = 0; i < 100; ++i){
+        const uint64_t pos = rand() % vals.size();
+        const uint64_t val = Rand64() % maxval;
+        ps.Insert(pos, val);
+        vals.insert(vals.begin() + pos, val);
+        ps.Erase(vals.size() - 1 - pos);
+        vals.erase(vals.end() - 1 - pos);
+      }
+      for (uint64_t i = 0; i < vals.size(); ++i){
+        ASSERT_EQ(vals[i], ps.Get(i)) << BitKernel::GetLevelName(BitKernel::GetLevel());
+      }
+    }
+  }
+  BitKernel::SetLevel(supported);
+}
@@ -30,9 +30,14 @@ public:
   inline static uint64_t GetBit(uint64_t x, uint64_t pos);
   inline static uint64_t GetBits(uint64_t x, uint64_t pos, uint64_t width);
   inline static uint64_t PopCount(uint64_t x);  
+  inline static uint64_t ByteCounts(uint64_t x);
+  inline static uint64_t SpreadBits(uint64_t x);
   inline static uint64_t Num(uint64_t one_num, uint64_t total, uint64_t bit);
   inline static void Insert(uint64_t& x, uint64_t pos, uint64_t bit);
   inline static uint64_t GetBinaryLen(uint64_t x);
+  inline static void Transpose64(uint64_t* x);
+  inline static uint64_t GetPacked(const uint64_t* x, uint64_t pos, uint64_t width);
+  inline static void SetPacked(uint64_t* x, uint64_t pos, uint64_t width, uint64_t val);
   inline static void PrintBit(uint64_t x);
 };
 
@@ -45,10 +50,21 @@ uint64_t BitUtil::GetBits(uint64_t x, uint64_t pos, uint64_t width){
 }
 
 uint64_t BitUtil::PopCount(uint64_t x) {
+  return ByteCounts(x) * 0x0101010101010101LLU >> 56;
+}
+
+// the i-th byte of the result is the number of ones in the i-th byte of x
+uint64_t BitUtil::ByteCounts(uint64_t x) {
   x = x - ((x & 0xAAAAAAAAAAAAAAAALLU) >> 1);
   x = (x & 0x3333333333333333LLU) + ((x >> 2) & 0x3333333333333333LLU);
-  x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FLLU;
-  return x * 0x0101010101010101LLU >> 56;
+  return (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FLLU;
+}
+
+// the i-th byte of the result is bit i of the byte x
+uint64_t BitUtil::SpreadBits(uint64_t x){
+  // move bit i of x to bit 7 of the i-th byte
+  x = ((x * 0x0101010101010101LLU) & 0x8040201008040201LLU) + 0x7F7F7F7F7F7F7F7FLLU;
+  return (x >> 7) & 0x0101010101010101LLU;
 }
 
 uint64_t BitUtil::Num(uint64_t one_num, uint64_t total, uint64_t bit){
@@ -70,11 +86,42 @@ void BitUtil::PrintBit(uint64_t x) {
 }
 
 uint64_t BitUtil::GetBinaryLen(uint64_t x){
-  uint64_t blen = 0;
-  while (x >> blen){
-    ++blen;
+  return (x == 0) ? 0 : 64 - __builtin_clzll(x);
+}
+
+// transpose 64x64 bit matrix : bit j of x[i] <-> bit i of x[j]
+void BitUtil::Transpose64(uint64_t* x){
+  uint64_t m = 0x00000000FFFFFFFFLLU;
+  for (uint64_t j = 32; j != 0; j >>= 1, m ^= (m << j)){
+    for (uint64_t k = 0; k < 64; k = ((k | j) + 1) & ~j){
+      uint64_t t = ((x[k] >> j) ^ x[k | j]) & m;
+      x[k]     ^= t << j;
+      x[k | j] ^= t;
+    }
+  }
+}
+
+// return the pos-th value of width bits packed in x
+uint64_t BitUtil::GetPacked(const uint64_t* x, uint64_t pos, uint64_t width){
+  if (width == 0) return 0;
+  const uint64_t block = pos * width / 64;
+  const uint64_t offset = pos * width % 64;
+  uint64_t ret = x[block] >> offset;
+  if (offset + width > 64){
+    ret |= x[block + 1] << (64 - offset);
+  }
+  return (width == 64) ? ret : ret & ((1LLU << width) - 1);
+}
+
+// set the pos-th value of width bits packed in x (assume the bits are zero)
+void BitUtil::SetPacked(uint64_t* x, uint64_t pos, uint64_t width, uint64_t val){
+  if (width == 0) return;
+  const uint64_t block = pos * width / 64;
+  const uint64_t offset = pos * width % 64;
+  x[block] |= val << offset;
+  if (offset + width > 64){
+    x[block + 1] |= val >> (64 - offset);
   }
-  return blen;
 }
 
 } // prefixsum
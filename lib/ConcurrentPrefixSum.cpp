@@ -0,0 +1,377 @@
+/* 
+ *  Copyright (c) 2012 Daisuke Okanohara
+  * 
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ * 
+ *   1. Redistributions of source code must retain the above Copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above Copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the authors nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ */
+
+#include <cassert>
+#include "ConcurrentPrefixSum.hpp"
+
+namespace prefixsum{
+
+namespace {
+
+static const uint64_t MAX_DEPTH = 64;
+
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+BasicConcurrentPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::BasicConcurrentPrefixSum(IndexT max_num) :
+  root_(0), max_num_(max_num){
+  nodes_.Reserve(GetNodeCapacity(max_num));
+  leaves_.Reserve(GetLeafCapacity(max_num));
+  const uint32_t leaf = NewLeaf();
+  root_ = NewNode();
+  GetNode(root_).InsertChild(0, leaf, 0, 0);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+BasicConcurrentPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::~BasicConcurrentPrefixSum(){
+  // the pools discard the leaves, whose bit arrays are released by arena_
+}
+
+// every leaf but the first one is split from a full leaf, and then only
+// grows, and so does every node but the root
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint64_t BasicConcurrentPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::GetLeafCapacity(uint64_t max_num){
+  return max_num / (Leaf::MAX_NUM / 2) + 1;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint64_t BasicConcurrentPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::GetNodeCapacity(uint64_t max_num){
+  return GetLeafCapacity(max_num) / (Node::MIN_CHILD - 1) + MAX_DEPTH;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint32_t BasicConcurrentPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::NewNode(){
+  pool_lock_.Lock();
+  assert(nodes_.Num() < GetNodeCapacity(max_num_));
+  const uint32_t node = nodes_.Allocate();
+  pool_lock_.Unlock();
+  return node;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint32_t BasicConcurrentPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::NewLeaf(){
+  pool_lock_.Lock();
+  assert(leaves_.Num() < GetLeafCapacity(max_num_));
+  const uint32_t leaf = leaves_.Allocate(static_cast<Allocator*>(&arena_));
+  pool_lock_.Unlock();
+  return leaf | Node::LEAF_TAG;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+bool BasicConcurrentPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::TryQuery(QueryType type, uint64_t key, uint64_t& result) const{
+  const uint64_t root_version = root_lock_.ReadLock();
+  uint32_t child = __atomic_load_n(&root_, __ATOMIC_ACQUIRE);
+  uint64_t version = GetLock(child).ReadLock();
+  if (!root_lock_.Validate(root_version)) return false;
+
+  // key is reduced to the key in child, and acc is the sum or the number
+  // of the values before child
+  uint64_t acc = 0;
+  while (!Node::IsLeaf(child)){
+    const Node& p = GetNode(child);
+    uint64_t i = 0;
+    if (type == FIND){
+      for (; i + 1 < p.num && key >= p.sums[i]; ++i){
+        key -= p.sums[i];
+        acc += p.sizes[i];
+      }
+    } else {
+      for (; i + 1 < p.num && key >= p.sizes[i]; ++i){
+        key -= p.sizes[i];
+        acc += p.sums[i];
+      }
+    }
+    const uint32_t next = p.children[i];
+    // next is valid only if p is unchanged, and it is the child of p
+    // at the version read only if p is still unchanged after
+    if (!GetLock(child).Validate(version)) return false;
+    const uint64_t next_version = GetLock(next).ReadLock();
+    if (!GetLock(child).Validate(version)) return false;
+    child = next;
+    version = next_version;
+  }
+
+  const LeafView<Leaf> view(GetLeaf(child).Image());
+  const Leaf& leaf = view.Get();
+  const uint64_t num = leaf.Num();
+  switch (type){
+  case GET:
+    result = (key < num) ? leaf.Get(key) : 0;
+    break;
+  case PREFIX_SUM:
+    result = acc + leaf.GetPrefixSum((key < num) ? key : num);
+    break;
+  case FIND:
+    result = acc + leaf.Find(key);
+    break;
+  }
+  if (!GetLock(child).Validate(version)) return false;
+  assert(type == FIND || key < num || (type == PREFIX_SUM && key == num));
+  return true;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+SumT BasicConcurrentPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Get(IndexT ind) const{
+  uint64_t result = 0;
+  while (!TryQuery(GET, ind, result)){
+  }
+  return result;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+SumT BasicConcurrentPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::GetPrefixSum(IndexT ind) const{
+  uint64_t result = 0;
+  while (!TryQuery(PREFIX_SUM, ind, result)){
+  }
+  return result;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+IndexT BasicConcurrentPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Find(SumT val) const{
+  uint64_t result = 0;
+  while (!TryQuery(FIND, val, result)){
+  }
+  return result;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+bool BasicConcurrentPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::TryGetTotals(IndexT& num, SumT& sum) const{
+  const uint64_t root_version = root_lock_.ReadLock();
+  const uint32_t root = __atomic_load_n(&root_, __ATOMIC_ACQUIRE);
+  const uint64_t version = GetLock(root).ReadLock();
+  if (!root_lock_.Validate(root_version)) return false;
+  const Node& p = GetNode(root);
+  num = 0;
+  sum = 0;
+  for (uint64_t i = 0; i < p.num; ++i){
+    num += p.sizes[i];
+    sum += p.sums[i];
+  }
+  return GetLock(root).Validate(version);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+IndexT BasicConcurrentPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Num() const{
+  IndexT num = 0;
+  SumT sum = 0;
+  while (!TryGetTotals(num, sum)){
+  }
+  return num;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+SumT BasicConcurrentPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Sum() const{
+  IndexT num = 0;
+  SumT sum = 0;
+  while (!TryGetTotals(num, sum)){
+  }
+  return sum;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint32_t BasicConcurrentPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::LockRoot(){
+  for (;;){
+    const uint64_t root_version = root_lock_.ReadLock();
+    const uint32_t root = __atomic_load_n(&root_, __ATOMIC_ACQUIRE);
+    GetLock(root).Lock();
+    if (root_lock_.Validate(root_version)) return root;
+    GetLock(root).Unlock();
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicConcurrentPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::GrowRoot(){
+  root_lock_.Lock();
+  const uint32_t root = root_;
+  GetLock(root).Lock();
+  const Node& p = GetNode(root);
+  if (p.IsFull()){
+    IndexT size = 0;
+    SumT sum = 0;
+    for (uint64_t i = 0; i < p.num; ++i){
+      size += p.sizes[i];
+      sum  += p.sums[i];
+    }
+    const uint32_t new_root = NewNode();
+    GetNode(new_root).InsertChild(0, root, size, sum);
+    __atomic_store_n(&root_, new_root, __ATOMIC_RELEASE);
+  }
+  GetLock(root).Unlock();
+  root_lock_.Unlock();
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint32_t BasicConcurrentPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::SplitChild(Node& p, uint64_t i){
+  assert(!p.IsFull());
+  const uint32_t child = p.children[i];
+  uint32_t new_child = 0;
+  IndexT new_size = 0;
+  SumT new_sum = 0;
+  if (Node::IsLeaf(child)){
+    new_child = NewLeaf();
+    Leaf& new_leaf = GetLeaf(new_child);
+    GetLeaf(child).Split(new_leaf);
+    new_size = new_leaf.Num();
+    new_sum  = new_leaf.Sum();
+  } else {
+    new_child = NewNode();
+    Node& new_node = GetNode(new_child);
+    GetNode(child).Split(new_node);
+    for (uint64_t j = 0; j < new_node.num; ++j){
+      new_size += new_node.sizes[j];
+      new_sum  += new_node.sums[j];
+    }
+  }
+  p.sizes[i] -= new_size;
+  p.sums[i]  -= new_sum;
+  p.InsertChild(i+1, new_child, new_size, new_sum);
+  return new_child;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+bool BasicConcurrentPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Insert(IndexT ind, SumT val){
+  uint32_t child = 0;
+  for (;;){
+    child = LockRoot();
+    const Node& root = GetNode(child);
+    IndexT num = 0;
+    for (uint64_t i = 0; i < root.num; ++i){
+      num += root.sizes[i];
+    }
+    if (num >= max_num_){
+      GetLock(child).Unlock();
+      return false;
+    }
+    assert(ind <= num);
+    if (!root.IsFull()) break;
+    GetLock(child).Unlock();
+    GrowRoot();
+  }
+
+  // split full children on the way down so that a parent always has a room,
+  // where a new child is reachable only from the locked parent
+  IndexT offset = ind;
+  for (;;){
+    Node& p = GetNode(child);
+    uint64_t i = p.FindChild(offset);
+    uint32_t next = p.children[i];
+    GetLock(next).Lock();
+    if (IsFullChild(next)){
+      const uint32_t new_child = SplitChild(p, i);
+      if (offset > p.sizes[i]){
+        offset -= p.sizes[i];
+        ++i;
+        GetLock(new_child).Lock();
+        GetLock(next).Unlock();
+        next = new_child;
+      }
+    }
+    p.sizes[i]++;
+    p.sums[i] += val;
+    GetLock(child).Unlock();
+    child = next;
+    if (Node::IsLeaf(child)){
+      GetLeaf(child).Insert(offset, val);
+      GetLock(child).Unlock();
+      return true;
+    }
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicConcurrentPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Increment(IndexT ind, SumT val){
+  Update(INCREMENT, ind, val);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicConcurrentPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Decrement(IndexT ind, SumT val){
+  Update(DECREMENT, ind, val);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicConcurrentPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Update(UpdateType type, IndexT ind, SumT val){
+  uint32_t child = LockRoot();
+  IndexT offset = ind;
+  while (!Node::IsLeaf(child)){
+    Node& p = GetNode(child);
+    const uint64_t i = p.FindChild(offset);
+    const uint32_t next = p.children[i];
+    GetLock(next).Lock();
+    if (type == INCREMENT){
+      p.sums[i] += val;
+    } else {
+      p.sums[i] -= val;
+    }
+    GetLock(child).Unlock();
+    child = next;
+  }
+  Leaf& leaf = GetLeaf(child);
+  assert(offset < leaf.Num());
+  if (type == INCREMENT){
+    leaf.Increment(offset, val);
+  } else {
+    leaf.Decrement(offset, val);
+  }
+  GetLock(child).Unlock();
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicConcurrentPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Set(IndexT ind, SumT val){
+  uint32_t path[MAX_DEPTH];
+  uint64_t slots[MAX_DEPTH];
+  uint64_t depth = 0;
+  uint32_t child = LockRoot();
+  IndexT offset = ind;
+  while (!Node::IsLeaf(child)){
+    assert(depth < MAX_DEPTH);
+    const Node& p = GetNode(child);
+    path[depth] = child;
+    slots[depth] = p.FindChild(offset);
+    child = p.children[slots[depth]];
+    GetLock(child).Lock();
+    ++depth;
+  }
+  Leaf& leaf = GetLeaf(child);
+  assert(offset < leaf.Num());
+  // the difference wraps around when val < old_val
+  const SumT dif = val - leaf.Get(offset);
+  leaf.Set(offset, val);
+  for (uint64_t d = 0; d < depth; ++d){
+    GetNode(path[d]).sums[slots[d]] += dif;
+    GetLock(path[d]).Unlock();
+  }
+  GetLock(child).Unlock();
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicConcurrentPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Reclaim(){
+  arena_.Reclaim();
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint64_t BasicConcurrentPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::GetAllocatedBytes() const{
+  return nodes_.GetAllocatedBytes() + leaves_.GetAllocatedBytes()
+    + arena_.GetAllocatedBytes() + sizeof(*this);
+}
+
+template class BasicConcurrentPrefixSum<uint64_t, uint64_t, 64, 256>;
+template class BasicConcurrentPrefixSum<uint32_t, uint32_t, 32, 256>;
+template class BasicConcurrentPrefixSum<uint64_t, uint64_t, 64, 256, true>;
+
+} // namespace prefixsum
@@ -0,0 +1,219 @@
+/* 
+ *  Copyright (c) 2012 Daisuke Okanohara
+  * 
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ * 
+ *   1. Redistributions of source code must retain the above Copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above Copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the authors nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ */
+
+#ifndef PREFIX_SUM_CONCURRENT_PREFIX_SUM_HPP_
+#define PREFIX_SUM_CONCURRENT_PREFIX_SUM_HPP_
+
+#include <stdint.h>
+#include "PrefixSumNode.hpp"
+#include "PrefixSumLeaf.hpp"
+#include "Arena.hpp"
+#include "Pool.hpp"
+#include "VersionLock.hpp"
+
+namespace prefixsum{
+
+/**
+ * Prefix sum shared by concurrent readers and writers, by optimistic
+ * lock coupling over the B+-tree of PrefixSum.
+ * Every node and leaf has a VersionLock. Get, GetPrefixSum, Find, Num
+ * and Sum take no lock: they validate the version of each node after
+ * reading its child, and restart from the root if a writer has changed
+ * a node on the way. Increment, Decrement and Insert lock the path hand
+ * over hand, so that a writer holds a node only while updating its
+ * sums, and Insert splits full children on the way down. Set keeps the
+ * path locked until it has read the old value, since the ancestors need
+ * the difference.
+ *
+ * Since a reader may still read a node or a leaf changed by a writer,
+ * nodes and leaves never move and are never freed: the pools are
+ * reserved for MaxNum() values at construction, values are never
+ * erased, and the bit arrays replaced by writers are retired and reused
+ * only after Reclaim(). Pending additions (AddRange) are not supported.
+ */
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums = false>
+class BasicConcurrentPrefixSum{
+public:
+  typedef BasicPrefixSumNode<IndexT, SumT> Node;
+  typedef BasicPrefixSumLeaf<MaxWidth, LeafNum, CacheSums> Leaf;
+
+  /**
+   * Constructor for up to max_num values
+   */
+  explicit BasicConcurrentPrefixSum(IndexT max_num);
+
+  /**
+   * Destructor
+   */
+  ~BasicConcurrentPrefixSum();
+
+  /**
+   * Insert val between vs[ind-1] and vs[ind] (ind <= Num()),
+   * or return false if Num() is already MaxNum()
+   */
+  bool Insert(IndexT ind, SumT val);
+
+  /**
+   * vs[ind] <- vs[ind] + val
+   */
+  void Increment(IndexT ind, SumT val);
+
+  /**
+   * vs[ind] <- vs[ind] - val
+   */
+  void Decrement(IndexT ind, SumT val);
+
+  /**
+   * vs[ind] <- val
+   */
+  void Set(IndexT ind, SumT val);
+
+  /**
+   * Return vs[ind]
+   */
+  SumT Get(IndexT ind) const;
+
+  /**
+   * Return vs[0] + ... + vs[ind-1]
+   */
+  SumT GetPrefixSum(IndexT ind) const;
+
+  /**
+   * Return ind s.t. GetPrefixSum(ind) <= val < GetPrefixSum(ind+1)
+   */
+  IndexT Find(SumT val) const;
+
+  IndexT Num() const;
+  SumT Sum() const;
+
+  IndexT MaxNum() const{
+    return max_num_;
+  }
+
+  /**
+   * Reuse the bit arrays retired by writers. No other method may run
+   * concurrently, since their readers may still read the retired arrays.
+   */
+  void Reclaim();
+
+  uint64_t GetAllocatedBytes() const;
+
+private:
+  BasicConcurrentPrefixSum(const BasicConcurrentPrefixSum&);
+  BasicConcurrentPrefixSum& operator=(const BasicConcurrentPrefixSum&);
+
+  // the entries have no pointer into themselves, so that Pool may move them
+  struct NodeEntry{
+    typedef NodeEntry Relocatable;
+
+    VersionLock lock;
+    Node node;
+  };
+
+  struct LeafEntry{
+    typedef LeafEntry Relocatable;
+
+    explicit LeafEntry(Allocator* allocator) : leaf(allocator){
+    }
+
+    VersionLock lock;
+    Leaf leaf;
+  };
+
+  enum QueryType{
+    GET        = 0,
+    PREFIX_SUM = 1,
+    FIND       = 2
+  };
+
+  enum UpdateType{
+    INCREMENT = 0,
+    DECREMENT = 1
+  };
+
+  // return the nodes and the leaves needed for max_num values
+  static uint64_t GetNodeCapacity(uint64_t max_num);
+  static uint64_t GetLeafCapacity(uint64_t max_num);
+
+  // set result to the answer of the query, or return false
+  // if a writer has changed a node or the leaf on the way
+  bool TryQuery(QueryType type, uint64_t key, uint64_t& result) const;
+
+  // set num and sum to the totals of the root, or return false
+  bool TryGetTotals(IndexT& num, SumT& sum) const;
+
+  void Update(UpdateType type, IndexT ind, SumT val);
+
+  // lock the root and return it
+  uint32_t LockRoot();
+
+  // put a new root above the root if the root is full
+  void GrowRoot();
+
+  // split the i-th child of p, where both are locked, and return the new
+  // child, which is the next one of the i-th child
+  uint32_t SplitChild(Node& p, uint64_t i);
+
+  uint32_t NewNode();
+  uint32_t NewLeaf();
+
+  VersionLock& GetLock(uint32_t child){
+    return Node::IsLeaf(child) ? leaves_[Node::GetIndex(child)].lock : nodes_[child].lock;
+  }
+
+  const VersionLock& GetLock(uint32_t child) const{
+    return Node::IsLeaf(child) ? leaves_[Node::GetIndex(child)].lock : nodes_[child].lock;
+  }
+
+  Node& GetNode(uint32_t child){
+    return nodes_[child].node;
+  }
+
+  const Node& GetNode(uint32_t child) const{
+    return nodes_[child].node;
+  }
+
+  Leaf& GetLeaf(uint32_t child){
+    return leaves_[Node::GetIndex(child)].leaf;
+  }
+
+  const Leaf& GetLeaf(uint32_t child) const{
+    return leaves_[Node::GetIndex(child)].leaf;
+  }
+
+  bool IsFullChild(uint32_t child) const{
+    return Node::IsLeaf(child) ? GetLeaf(child).IsFull() : GetNode(child).IsFull();
+  }
+
+  ConcurrentArena arena_;
+  Pool<NodeEntry> nodes_;
+  Pool<LeafEntry> leaves_;
+  VersionLock pool_lock_;  // for allocations from the pools
+  VersionLock root_lock_;  // for root_
+  uint32_t root_;
+  IndexT max_num_;
+};
+
+typedef BasicConcurrentPrefixSum<uint64_t, uint64_t, 64, 256> ConcurrentPrefixSum;
+typedef BasicConcurrentPrefixSum<uint32_t, uint32_t, 32, 256> ConcurrentPrefixSum32;
+typedef BasicConcurrentPrefixSum<uint64_t, uint64_t, 64, 256, true> CachedConcurrentPrefixSum;
+
+} // namespace prefixsum
+
+#endif // PREFIX_SUM_CONCURRENT_PREFIX_SUM_HPP_
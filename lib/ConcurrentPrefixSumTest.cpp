@@ -0,0 +1,156 @@
+/* 
+ *  Copyright (c) 2012 Daisuke Okanohara
+  * 
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ * 
+ *   1. Redistributions of source code must retain the above Copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above Copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the authors nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ */
+
+#include <vector>
+#include <cstdlib>
+#include <gtest/gtest.h>
+#include "ConcurrentPrefixSum.hpp"
+#include "StressTest.hpp"
+
+using namespace std;
+using namespace prefixsum;
+using namespace stress;
+
+namespace {
+
+template <class PrefixSumT, class SumT>
+void CheckSequential(uint64_t max_num){
+  PrefixSumT ps(max_num);
+  vector<SumT> vals;
+  for (uint64_t i = 0; i < max_num * 4; ++i){
+    const uint64_t pos = vals.empty() ? 0 : rand() % vals.size();
+    const uint64_t val = (rand() % 100 == 0) ? 1LLU << 20 : rand() % 100;
+    switch (rand() % 4){
+    case 0:
+      if (vals.size() < max_num){
+        ASSERT_TRUE(ps.Insert(pos, val));
+        vals.insert(vals.begin() + pos, val);
+      }
+      break;
+    case 1:
+      if (!vals.empty()){
+        ps.Increment(pos, val);
+        vals[pos] += val;
+      }
+      break;
+    case 2:
+      if (!vals.empty() && vals[pos] >= val){
+        ps.Decrement(pos, val);
+        vals[pos] -= val;
+      }
+      break;
+    case 3:
+      if (!vals.empty()){
+        ps.Set(pos, val);
+        vals[pos] = val;
+      }
+      break;
+    }
+  }
+  while (vals.size() < max_num){
+    ASSERT_TRUE(ps.Insert(vals.size(), 1));
+    vals.push_back(1);
+  }
+  ASSERT_FALSE(ps.Insert(0, 1));
+  ps.Reclaim();
+
+  ASSERT_EQ(max_num, ps.Num());
+  SumT sum = 0;
+  for (uint64_t i = 0; i < vals.size(); ++i){
+    ASSERT_EQ(vals[i], ps.Get(i)) << " i=" << i;
+    ASSERT_EQ(sum, ps.GetPrefixSum(i)) << " i=" << i;
+    if (vals[i] > 0){
+      ASSERT_EQ(i, ps.Find(sum)) << " i=" << i;
+      ASSERT_EQ(i, ps.Find(sum + vals[i] - 1)) << " i=" << i;
+    }
+    sum += vals[i];
+  }
+  ASSERT_EQ(sum, ps.GetPrefixSum(vals.size()));
+  ASSERT_EQ(sum, ps.Sum());
+  ASSERT_EQ(vals.size(), ps.Find(sum));
+}
+
+// ConcurrentPrefixSum has no Erase, and Insert fails when full
+struct ConcurrentOps{
+  static const bool ERASE = false;
+
+  template <class PrefixSumT>
+  static bool Insert(PrefixSumT& ps, uint64_t pos){
+    return ps.Insert(pos, 0);
+  }
+
+  template <class PrefixSumT>
+  static void Erase(PrefixSumT&, uint64_t){
+  }
+};
+
+template <class PrefixSumT>
+void CheckStress(bool monotone){
+  const uint64_t num = 5000;
+  const uint64_t writer_num = 4;
+  const uint64_t reader_num = 4;
+  PrefixSumT ps(num + writer_num * 100000);
+  StressState<PrefixSumT> state;
+  state.ps = &ps;
+  state.num = num;
+  state.writer_num = writer_num;
+  state.op_num = 100000;
+  state.monotone = monotone;
+  state.expected.resize(num);
+  for (uint64_t i = 0; i < num; ++i){
+    state.expected[i] = i % TAG_MOD;
+    ASSERT_TRUE(ps.Insert(i, i % TAG_MOD));
+  }
+  RunStress<PrefixSumT, ConcurrentOps>(state, reader_num);
+
+  ASSERT_EQ(num + state.inserted, ps.Num());
+  uint64_t sum = 0;
+  for (uint64_t i = 0; i < num; ++i){
+    ASSERT_EQ(state.expected[i], ps.Get(i)) << " i=" << i;
+    ASSERT_EQ(sum, ps.GetPrefixSum(i)) << " i=" << i;
+    sum += state.expected[i];
+  }
+  for (uint64_t i = num; i < ps.Num(); ++i){
+    ASSERT_EQ(0, ps.Get(i)) << " i=" << i;
+  }
+  ASSERT_EQ(sum, ps.GetPrefixSum(ps.Num()));
+  ASSERT_EQ(sum, ps.Sum());
+  ps.Reclaim();
+  ASSERT_EQ(sum, ps.Sum());
+}
+
+}
+
+TEST(ConcurrentPrefixSum, sequential){
+  for (uint64_t max_num = 1; max_num <= 10000; max_num *= 10){
+    CheckSequential<ConcurrentPrefixSum, uint64_t>(max_num);
+    CheckSequential<ConcurrentPrefixSum32, uint32_t>(max_num);
+    CheckSequential<CachedConcurrentPrefixSum, uint64_t>(max_num);
+  }
+}
+
+TEST(ConcurrentPrefixSum, stress_increment){
+  CheckStress<ConcurrentPrefixSum>(true);
+  CheckStress<ConcurrentPrefixSum32>(true);
+}
+
+TEST(ConcurrentPrefixSum, stress_mixed){
+  CheckStress<ConcurrentPrefixSum>(false);
+  CheckStress<CachedConcurrentPrefixSum>(false);
+}
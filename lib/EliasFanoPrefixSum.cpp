@@ -0,0 +1,181 @@
+/* 
+ *  Copyright (c) 2012 Daisuke Okanohara
+  * 
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ * 
+ *   1. Redistributions of source code must retain the above Copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above Copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the authors nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ */
+
+#include <cassert>
+#include "EliasFanoPrefixSum.hpp"
+#include "BitUtil.hpp"
+#include "BitKernel.hpp"
+
+namespace prefixsum{
+
+const uint64_t EliasFanoPrefixSum::SAMPLE;
+
+EliasFanoPrefixSum::EliasFanoPrefixSum() : num_(0), sum_(0), low_width_(0){
+  Clear();
+}
+
+void EliasFanoPrefixSum::Clear(){
+  Init(0, 0);
+  SetPrefixSum(0, 0);
+  BuildSamples();
+}
+
+void EliasFanoPrefixSum::Init(uint64_t num, uint64_t sum){
+  num_ = num;
+  sum_ = sum;
+  // floor(log2(sum / (num+1))) minimizes the bits of the lows and the highs
+  low_width_ = (sum / (num + 1) > 0) ? BitUtil::GetBinaryLen(sum / (num + 1)) - 1 : 0;
+  lows_.assign(((num + 1) * low_width_ + 63) / 64 + 1, 0);
+  highs_.assign((num + 1 + (sum >> low_width_) + 1 + 63) / 64, 0);
+  one_samples_.clear();
+  zero_samples_.clear();
+}
+
+void EliasFanoPrefixSum::SetPrefixSum(uint64_t ind, uint64_t sum){
+  assert(ind <= num_);
+  assert(sum <= sum_);
+  const uint64_t pos = (sum >> low_width_) + ind;
+  highs_[pos / 64] |= 1LLU << (pos % 64);
+  if (low_width_ > 0) BitUtil::SetPacked(&lows_[0], ind, low_width_, sum & ((1LLU << low_width_) - 1));
+}
+
+void EliasFanoPrefixSum::BuildSamples(){
+  // there are num_+1 ones and (sum_ >> low_width_) + 1 zeros up to the last one
+  const uint64_t one_num = num_ + 1;
+  const uint64_t zero_num = (sum_ >> low_width_) + 1;
+  uint64_t ones = 0;
+  uint64_t zeros = 0;
+  for (uint64_t i = 0; i < highs_.size(); ++i){
+    const uint64_t x = highs_[i];
+    const uint64_t count = BitUtil::PopCount(x);
+    // the next sampled one and zero may be in this word
+    const uint64_t next_one = (ones + SAMPLE - 1) / SAMPLE * SAMPLE;
+    if (next_one < one_num && next_one < ones + count){
+      one_samples_.push_back(i * 64 + BitKernel::Select(x, next_one - ones));
+    }
+    const uint64_t next_zero = (zeros + SAMPLE - 1) / SAMPLE * SAMPLE;
+    if (next_zero < zero_num && next_zero < zeros + 64 - count){
+      zero_samples_.push_back(i * 64 + BitKernel::Select(~x, next_zero - zeros));
+    }
+    ones += count;
+    zeros += 64 - count;
+  }
+}
+
+uint64_t EliasFanoPrefixSum::GetLow(uint64_t ind) const{
+  return BitUtil::GetPacked(&lows_[0], ind, low_width_);
+}
+
+uint64_t EliasFanoPrefixSum::SelectOne(uint64_t rank) const{
+  const uint64_t pos = one_samples_[rank / SAMPLE];
+  uint64_t rest = rank % SAMPLE;
+  uint64_t block = pos / 64;
+  uint64_t x = highs_[block] & (~0LLU << (pos % 64));
+  for (;;){
+    const uint64_t count = BitUtil::PopCount(x);
+    if (rest < count) return block * 64 + BitKernel::Select(x, rest);
+    rest -= count;
+    x = highs_[++block];
+  }
+}
+
+uint64_t EliasFanoPrefixSum::SelectZero(uint64_t rank) const{
+  const uint64_t pos = zero_samples_[rank / SAMPLE];
+  uint64_t rest = rank % SAMPLE;
+  uint64_t block = pos / 64;
+  uint64_t x = ~highs_[block] & (~0LLU << (pos % 64));
+  for (;;){
+    const uint64_t count = BitUtil::PopCount(x);
+    if (rest < count) return block * 64 + BitKernel::Select(x, rest);
+    rest -= count;
+    x = ~highs_[++block];
+  }
+}
+
+uint64_t EliasFanoPrefixSum::NextOne(uint64_t pos) const{
+  uint64_t block = pos / 64;
+  uint64_t x = highs_[block] & (~0LLU << (pos % 64));
+  while (x == 0){
+    x = highs_[++block];
+  }
+  return block * 64 + __builtin_ctzll(x);
+}
+
+uint64_t EliasFanoPrefixSum::Get(uint64_t ind) const{
+  assert(ind < num_);
+  const uint64_t pos = SelectOne(ind);
+  const uint64_t next = NextOne(pos + 1);
+  return ((((next - ind - 1) << low_width_) | GetLow(ind + 1)) -
+          (((pos - ind) << low_width_) | GetLow(ind)));
+}
+
+uint64_t EliasFanoPrefixSum::GetPrefixSum(uint64_t ind) const{
+  assert(ind <= num_);
+  return ((SelectOne(ind) - ind) << low_width_) | GetLow(ind);
+}
+
+uint64_t EliasFanoPrefixSum::Find(uint64_t val) const{
+  if (val >= sum_) return num_;
+  // the prefix sums of the bucket high are S[beg...end-1], and the
+  // preceding ones are less than val
+  const uint64_t high = val >> low_width_;
+  const uint64_t low = val & ((1LLU << low_width_) - 1);
+  const uint64_t beg = (high == 0) ? 0 : SelectZero(high - 1) - high + 1;
+  const uint64_t end = SelectZero(high) - high;
+  // count the lows in the bucket at most low
+  uint64_t ind = beg;
+  for (uint64_t step = end - beg; step > 0; ){
+    const uint64_t half = step / 2;
+    if (GetLow(ind + half) <= low){
+      ind += half + 1;
+      step -= half + 1;
+    } else {
+      step = half;
+    }
+  }
+  // S[0] = 0 <= val, so ind > 0
+  return ind - 1;
+}
+
+uint64_t EliasFanoPrefixSum::GetAllocatedBytes() const{
+  return sizeof(*this) + sizeof(uint64_t) *
+    (lows_.capacity() + highs_.capacity() + one_samples_.capacity() + zero_samples_.capacity());
+}
+
+EliasFanoPrefixSum::ValueIterator::ValueIterator(const EliasFanoPrefixSum* ef, uint64_t ind) :
+  ef_(ef), ind_(ind), pos_(0), sum_(0), val_(0){
+  if (ind_ < ef_->num_){
+    pos_ = ef_->SelectOne(ind_);
+    sum_ = ((pos_ - ind_) << ef_->low_width_) | ef_->GetLow(ind_);
+    Decode();
+  }
+}
+
+EliasFanoPrefixSum::ValueIterator& EliasFanoPrefixSum::ValueIterator::operator++(){
+  sum_ += val_;
+  if (++ind_ < ef_->num_) Decode();
+  return *this;
+}
+
+void EliasFanoPrefixSum::ValueIterator::Decode(){
+  pos_ = ef_->NextOne(pos_ + 1);
+  val_ = (((pos_ - ind_ - 1) << ef_->low_width_) | ef_->GetLow(ind_ + 1)) - sum_;
+}
+
+} // namespace prefixsum
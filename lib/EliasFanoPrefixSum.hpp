@@ -0,0 +1,190 @@
+/* 
+ *  Copyright (c) 2012 Daisuke Okanohara
+  * 
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ * 
+ *   1. Redistributions of source code must retain the above Copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above Copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the authors nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ */
+
+#ifndef PREFIX_SUM_ELIAS_FANO_PREFIX_SUM_HPP_
+#define PREFIX_SUM_ELIAS_FANO_PREFIX_SUM_HPP_
+
+#include <cstddef>
+#include <iterator>
+#include <vector>
+#include <stdint.h>
+
+namespace prefixsum{
+
+/**
+ * Static prefix sums of vs[0...num_-1] for read-only phases.
+ * The prefix sums S[i] = vs[0] + ... + vs[i-1] for i <= num_ are stored
+ * as an Elias-Fano sequence: the low low_width_ bits of each S[i] are
+ * packed in lows_, and the rest is the bit (S[i] >> low_width_) + i in
+ * highs_, where low_width_ is about log2(sum / num), so that the whole
+ * takes about 2 + log2(sum / num) bits per value.
+ * The position of every SAMPLE-th one and zero of highs_ is sampled, so
+ * that GetPrefixSum selects the ind-th one by scanning a few words from
+ * a sample, and Find selects the zeros around the bucket of val and
+ * searches the lows in the bucket.
+ * Build from the values or a BasicPrefixSum, and Thaw into a
+ * BasicPrefixSum when the values are updated again.
+ */
+class EliasFanoPrefixSum{
+public:
+  static const uint64_t SAMPLE = 256;
+
+  EliasFanoPrefixSum();
+
+  /**
+   * Set vs <- [first, last), reading the values twice
+   */
+  template <class Iterator>
+  void Build(Iterator first, Iterator last);
+
+  /**
+   * Set vs <- the values of ps (a BasicPrefixSum) in one scan
+   */
+  template <class PrefixSumT>
+  void Build(const PrefixSumT& ps);
+
+  /**
+   * Set ps (a BasicPrefixSum) <- vs by decoding the sequence in order
+   */
+  template <class PrefixSumT>
+  void Thaw(PrefixSumT& ps) const{
+    ps.Build(ValueIterator(this, 0), ValueIterator(this, num_));
+  }
+
+  void Clear();
+
+  /**
+   * Return vs[ind]
+   */
+  uint64_t Get(uint64_t ind) const;
+
+  /**
+   * Return vs[0] + vs[1] + ... + vs[ind-1]
+   */
+  uint64_t GetPrefixSum(uint64_t ind) const;
+
+  /**
+   * Return ind s.t. GetPrefixSum(ind) <= val < GetPrefixSum(ind+1),
+   * or Num() if val >= Sum()
+   */
+  uint64_t Find(uint64_t val) const;
+
+  uint64_t Num() const{
+    return num_;
+  }
+
+  uint64_t Sum() const{
+    return sum_;
+  }
+
+  uint64_t GetAllocatedBytes() const;
+
+private:
+  EliasFanoPrefixSum(const EliasFanoPrefixSum&);
+  EliasFanoPrefixSum& operator=(const EliasFanoPrefixSum&);
+
+  // input iterator over vs decoding the ones of highs_ in order
+  class ValueIterator{
+  public:
+    typedef std::input_iterator_tag iterator_category;
+    typedef uint64_t value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const uint64_t* pointer;
+    typedef const uint64_t& reference;
+
+    ValueIterator(const EliasFanoPrefixSum* ef, uint64_t ind);
+
+    const uint64_t& operator*() const{
+      return val_;
+    }
+
+    ValueIterator& operator++();
+
+    bool operator!=(const ValueIterator& it) const{
+      return ind_ != it.ind_;
+    }
+
+  private:
+    void Decode();
+
+    const EliasFanoPrefixSum* ef_;
+    uint64_t ind_;
+    uint64_t pos_;   // the one of S[ind_+1]
+    uint64_t sum_;   // S[ind_]
+    uint64_t val_;   // vs[ind_]
+  };
+
+  // allocate the sequence of num+1 prefix sums up to sum
+  void Init(uint64_t num, uint64_t sum);
+
+  // set S[ind] <- sum (in increasing order of ind)
+  void SetPrefixSum(uint64_t ind, uint64_t sum);
+  void BuildSamples();
+
+  uint64_t GetLow(uint64_t ind) const;
+
+  // return the position of the rank-th one (or zero) of highs_
+  uint64_t SelectOne(uint64_t rank) const;
+  uint64_t SelectZero(uint64_t rank) const;
+
+  // return the position of the first one of highs_ at pos or later
+  uint64_t NextOne(uint64_t pos) const;
+
+  std::vector<uint64_t> lows_;
+  std::vector<uint64_t> highs_;
+  std::vector<uint64_t> one_samples_;
+  std::vector<uint64_t> zero_samples_;
+  uint64_t num_;
+  uint64_t sum_;
+  uint64_t low_width_;
+};
+
+template <class Iterator>
+void EliasFanoPrefixSum::Build(Iterator first, Iterator last){
+  uint64_t num = 0;
+  uint64_t sum = 0;
+  for (Iterator it = first; it != last; ++it){
+    ++num;
+    sum += *it;
+  }
+  Init(num, sum);
+  sum = 0;
+  uint64_t ind = 0;
+  SetPrefixSum(ind++, 0);
+  for (; first != last; ++first){
+    sum += *first;
+    SetPrefixSum(ind++, sum);
+  }
+  BuildSamples();
+}
+
+template <class PrefixSumT>
+void EliasFanoPrefixSum::Build(const PrefixSumT& ps){
+  Init(ps.Num(), ps.Sum());
+  uint64_t ind = 0;
+  for (typename PrefixSumT::const_iterator it = ps.begin(); it != ps.end(); ++it){
+    SetPrefixSum(ind++, it.PrefixSum());
+  }
+  SetPrefixSum(ind, ps.Sum());
+  BuildSamples();
+}
+
+} // namespace prefixsum
+
+#endif // PREFIX_SUM_ELIAS_FANO_PREFIX_SUM_HPP_
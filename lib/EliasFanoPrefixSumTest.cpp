@@ -0,0 +1,125 @@
+/* 
+ *  Copyright (c) 2012 Daisuke Okanohara
+  * 
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ * 
+ *   1. Redistributions of source code must retain the above Copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above Copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the authors nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ */
+
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <gtest/gtest.h>
+#include "EliasFanoPrefixSum.hpp"
+#include "PrefixSum.hpp"
+
+using namespace std;
+using namespace prefixsum;
+
+namespace {
+
+void CheckEliasFano(const EliasFanoPrefixSum& ef, const vector<uint64_t>& vals){
+  ASSERT_EQ(vals.size(), ef.Num());
+  vector<uint64_t> sums(vals.size() + 1);
+  for (uint64_t i = 0; i < vals.size(); ++i){
+    sums[i + 1] = sums[i] + vals[i];
+  }
+  ASSERT_EQ(sums.back(), ef.Sum());
+  for (uint64_t i = 0; i <= vals.size(); ++i){
+    ASSERT_EQ(sums[i], ef.GetPrefixSum(i)) << " i=" << i;
+    if (i < vals.size()){
+      ASSERT_EQ(vals[i], ef.Get(i)) << " i=" << i;
+    }
+  }
+  for (uint64_t i = 0; i < 2000; ++i){
+    const uint64_t val = (sums.back() == 0) ? i : rand() % (sums.back() + 10);
+    const uint64_t expected = upper_bound(sums.begin(), sums.end(), val) - sums.begin() - 1;
+    ASSERT_EQ(expected, ef.Find(val)) << " val=" << val;
+  }
+}
+
+vector<uint64_t> MakeValues(uint64_t num, uint64_t maxval, uint64_t zero_percent){
+  vector<uint64_t> vals(num);
+  for (uint64_t i = 0; i < num; ++i){
+    vals[i] = (static_cast<uint64_t>(rand()) % 100 < zero_percent) ? 0 :
+      ((static_cast<uint64_t>(rand()) << 31) ^ rand()) % maxval;
+  }
+  return vals;
+}
+
+}
+
+TEST(EliasFanoPrefixSum, empty){
+  EliasFanoPrefixSum ef;
+  ASSERT_EQ(0U, ef.Num());
+  ASSERT_EQ(0U, ef.GetPrefixSum(0));
+  ASSERT_EQ(0U, ef.Find(0));
+  ASSERT_EQ(0U, ef.Find(100));
+}
+
+TEST(EliasFanoPrefixSum, random){
+  const uint64_t maxvals[] = {1, 2, 100, 1LLU << 20, 1LLU << 40};
+  const uint64_t zero_percents[] = {0, 50, 99};
+  for (uint64_t m = 0; m < 5; ++m){
+    for (uint64_t z = 0; z < 3; ++z){
+      vector<uint64_t> vals = MakeValues(3000 + rand() % 100, maxvals[m], zero_percents[z]);
+      EliasFanoPrefixSum ef;
+      ef.Build(vals.begin(), vals.end());
+      CheckEliasFano(ef, vals);
+    }
+  }
+}
+
+TEST(EliasFanoPrefixSum, skewed){
+  // a few large values among small ones make long runs of zeros in the highs
+  vector<uint64_t> vals = MakeValues(5000, 3, 10);
+  for (uint64_t i = 0; i < vals.size(); i += 997){
+    vals[i] = 1LLU << 30;
+  }
+  EliasFanoPrefixSum ef;
+  ef.Build(vals.begin(), vals.end());
+  CheckEliasFano(ef, vals);
+}
+
+TEST(EliasFanoPrefixSum, build_thaw){
+  vector<uint64_t> vals = MakeValues(20000, 1000, 10);
+  PrefixSum ps(vals.begin(), vals.end());
+  ps.AddRange(100, 5000, 7);
+  for (uint64_t i = 100; i < 5000; ++i){
+    vals[i] += 7;
+  }
+  EliasFanoPrefixSum ef;
+  ef.Build(ps);
+  CheckEliasFano(ef, vals);
+  for (uint64_t i = 0; i < 1000; ++i){
+    const uint64_t val = rand() % ps.Sum();
+    ASSERT_EQ(ps.Find(val), ef.Find(val));
+  }
+
+  PrefixSum32 thawed;
+  ef.Thaw(thawed);
+  ASSERT_EQ(vals.size(), thawed.Num());
+  ASSERT_EQ(ef.Sum(), thawed.Sum());
+  for (uint64_t i = 0; i < vals.size(); ++i){
+    ASSERT_EQ(vals[i], thawed.Get(i)) << " i=" << i;
+  }
+  thawed.Insert(0, 5);
+  ASSERT_EQ(ef.Sum() + 5, thawed.Sum());
+
+  ef.Clear();
+  ASSERT_EQ(0U, ef.Num());
+  PrefixSum empty;
+  ef.Thaw(empty);
+  ASSERT_EQ(0U, empty.Num());
+}
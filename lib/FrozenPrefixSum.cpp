@@ -0,0 +1,163 @@
+/* 
+ *  Copyright (c) 2012 Daisuke Okanohara
+  * 
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ * 
+ *   1. Redistributions of source code must retain the above Copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above Copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the authors nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ */
+
+#include <cassert>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "FrozenPrefixSum.hpp"
+#include "PrefixSum.hpp"
+
+namespace prefixsum{
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+const uint64_t BasicFrozenPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::MAGIC;
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+const uint64_t BasicFrozenPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::VERSION;
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+const uint64_t BasicFrozenPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::PAGE_BYTES;
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+BasicFrozenPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::BasicFrozenPrefixSum() :
+  map_(NULL), map_bytes_(0), nodes_(NULL), leaf_offsets_(NULL), num_(0), sum_(0), depth_(0){
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+BasicFrozenPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::~BasicFrozenPrefixSum(){
+  Close();
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint64_t BasicFrozenPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::GetParams(){
+  return MaxWidth | LeafNum << 8 | static_cast<uint64_t>(CacheSums) << 24 |
+    sizeof(IndexT) << 32 | sizeof(SumT) << 40 | static_cast<uint64_t>(sizeof(Node)) << 48;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+bool BasicFrozenPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Open(const char* path){
+  Close();
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < sizeof(Footer)){
+    close(fd);
+    return false;
+  }
+  const uint64_t bytes = st.st_size;
+  void* map = mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+
+  // the nodes are at the beginning, and the leaf table is before the footer
+  const Footer& footer = *reinterpret_cast<const Footer*>(static_cast<const char*>(map) + bytes - sizeof(Footer));
+  if (footer.magic != MAGIC || footer.version != VERSION || footer.params != GetParams() ||
+      footer.node_num == 0 || footer.node_num * sizeof(Node) > footer.leaf_table ||
+      footer.leaf_table % sizeof(uint64_t) != 0 ||
+      footer.leaf_table + footer.leaf_num * sizeof(uint64_t) + sizeof(Footer) != bytes){
+    munmap(map, bytes);
+    return false;
+  }
+  map_ = map;
+  map_bytes_ = bytes;
+  nodes_ = static_cast<const Node*>(map);
+  leaf_offsets_ = reinterpret_cast<const uint64_t*>(static_cast<const char*>(map) + footer.leaf_table);
+  num_ = footer.num;
+  sum_ = footer.sum;
+  depth_ = footer.depth;
+  return true;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicFrozenPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Close(){
+  if (map_ != NULL) munmap(map_, map_bytes_);
+  map_ = NULL;
+  map_bytes_ = 0;
+  nodes_ = NULL;
+  leaf_offsets_ = NULL;
+  num_ = 0;
+  sum_ = 0;
+  depth_ = 0;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+SumT BasicFrozenPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Get(IndexT ind) const{
+  assert(ind < num_);
+  const Node* p = &nodes_[0];
+  IndexT offset = ind;
+  SumT add = 0;
+  for (;;){
+    const uint64_t i = p->FindChild(offset);
+    add += p->adds[i];
+    if (p->LeafChild()){
+      LeafView<Leaf> view(GetLeafImage(p->children[i]));
+      return view.Get().Get(offset) + add;
+    }
+    p = &nodes_[p->children[i]];
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+SumT BasicFrozenPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::GetPrefixSum(IndexT ind) const{
+  assert(ind <= num_);
+  const Node* p = &nodes_[0];
+  IndexT offset = ind;
+  SumT sum = 0;
+  SumT add = 0;
+  for (;;){
+    uint64_t i = 0;
+    for (; i + 1 < p->num && offset >= p->sizes[i]; ++i){
+      offset -= p->sizes[i];
+      sum += p->sums[i] + add * p->sizes[i];
+    }
+    add += p->adds[i];
+    if (p->LeafChild()){
+      LeafView<Leaf> view(GetLeafImage(p->children[i]));
+      return sum + view.Get().GetPrefixSum(offset) + add * offset;
+    }
+    p = &nodes_[p->children[i]];
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+IndexT BasicFrozenPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Find(SumT val) const{
+  const Node* p = &nodes_[0];
+  IndexT offset = 0;
+  SumT remain = val;
+  SumT add = 0;
+  for (;;){
+    uint64_t i = 0;
+    for (; i + 1 < p->num && remain >= p->sums[i] + add * p->sizes[i]; ++i){
+      remain -= p->sums[i] + add * p->sizes[i];
+      offset += p->sizes[i];
+    }
+    add += p->adds[i];
+    if (p->LeafChild()){
+      LeafView<Leaf> view(GetLeafImage(p->children[i]));
+      return offset + BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::FindInLeaf(view.Get(), remain, add);
+    }
+    p = &nodes_[p->children[i]];
+  }
+}
+
+template class BasicFrozenPrefixSum<uint64_t, uint64_t, 64, 256>;
+template class BasicFrozenPrefixSum<uint32_t, uint32_t, 32, 256>;
+template class BasicFrozenPrefixSum<uint64_t, uint64_t, 64, 256, true>;
+
+} // namespace prefixsum
@@ -0,0 +1,145 @@
+/* 
+ *  Copyright (c) 2012 Daisuke Okanohara
+  * 
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ * 
+ *   1. Redistributions of source code must retain the above Copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above Copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the authors nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ */
+
+#ifndef PREFIX_SUM_FROZEN_PREFIX_SUM_HPP_
+#define PREFIX_SUM_FROZEN_PREFIX_SUM_HPP_
+
+#include <cstddef>
+#include <stdint.h>
+#include "PrefixSumNode.hpp"
+#include "PrefixSumLeaf.hpp"
+
+namespace prefixsum{
+
+/**
+ * Read-only prefix sums over an image written by BasicPrefixSum::Freeze,
+ * which is memory-mapped by Open() instead of being read, so that opening
+ * costs O(1) and processes opening the same file share its pages through
+ * the page cache.
+ *
+ * The image has no pointers: the nodes are stored in level order as an
+ * array of Node (from the root at 0), where a child is an index to the
+ * array, or the ordinal of a leaf if LEAF_TAG is set. The leaves follow
+ * from the next page, each as written by PrefixSumLeaf::Save, then the
+ * table of the byte offsets of the leaves, and a Footer at the end.
+ * Queries walk the nodes in the mapping, and run the queries of
+ * PrefixSumLeaf on the attached leaf images, with the same kernels.
+ * The image is in the native byte order and layout of the nodes, and
+ * Open rejects an image of other template parameters.
+ */
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums = false>
+class BasicFrozenPrefixSum{
+public:
+  typedef BasicPrefixSumNode<IndexT, SumT> Node;
+  typedef BasicPrefixSumLeaf<MaxWidth, LeafNum, CacheSums> Leaf;
+
+  static const uint64_t MAGIC = 0x4E455A4F52465350LLU; // "PSFROZEN"
+  static const uint64_t VERSION = 1;
+  static const uint64_t PAGE_BYTES = 4096;
+
+  /**
+   * The last words of the image
+   */
+  struct Footer{
+    uint64_t magic;
+    uint64_t version;
+    uint64_t params;        // GetParams()
+    uint64_t num;
+    uint64_t sum;
+    uint64_t depth;         // levels including the leaves
+    uint64_t node_num;
+    uint64_t leaf_num;
+    uint64_t leaf_table;    // byte offset of the offsets of the leaves
+  };
+
+  BasicFrozenPrefixSum();
+  ~BasicFrozenPrefixSum();
+
+  /**
+   * Map the image at path, and return false if it cannot be mapped or
+   * its footer does not match. The leaves are not validated.
+   */
+  bool Open(const char* path);
+
+  /**
+   * Unmap the image
+   */
+  void Close();
+
+  bool IsOpen() const{
+    return map_ != NULL;
+  }
+
+  /**
+   * Return vs[ind]
+   */
+  SumT Get(IndexT ind) const;
+
+  /**
+   * Return vs[0] + vs[1] + ... + vs[ind-1]
+   */
+  SumT GetPrefixSum(IndexT ind) const;
+
+  /**
+   * Return ind s.t. GetPrefixSum(ind) <= val < GetPrefixSum(ind+1)
+   */
+  IndexT Find(SumT val) const;
+
+  IndexT Num() const{
+    return num_;
+  }
+
+  SumT Sum() const{
+    return sum_;
+  }
+
+  uint64_t Depth() const{
+    return depth_;
+  }
+
+  /**
+   * Return the word identifying the template parameters and the node layout
+   */
+  static uint64_t GetParams();
+
+private:
+  BasicFrozenPrefixSum(const BasicFrozenPrefixSum&);
+  BasicFrozenPrefixSum& operator=(const BasicFrozenPrefixSum&);
+
+  const uint64_t* GetLeafImage(uint32_t child) const{
+    return reinterpret_cast<const uint64_t*>(static_cast<const char*>(map_) +
+                                             leaf_offsets_[Node::GetIndex(child)]);
+  }
+
+  void* map_;
+  uint64_t map_bytes_;
+  const Node* nodes_;
+  const uint64_t* leaf_offsets_;
+  IndexT num_;
+  SumT sum_;
+  uint64_t depth_;
+};
+
+typedef BasicFrozenPrefixSum<uint64_t, uint64_t, 64, 256> FrozenPrefixSum;
+typedef BasicFrozenPrefixSum<uint32_t, uint32_t, 32, 256> FrozenPrefixSum32;
+typedef BasicFrozenPrefixSum<uint64_t, uint64_t, 64, 256, true> CachedFrozenPrefixSum;
+
+} // namespace prefixsum
+
+#endif // PREFIX_SUM_FROZEN_PREFIX_SUM_HPP_
@@ -0,0 +1,140 @@
+/* 
+ *  Copyright (c) 2012 Daisuke Okanohara
+  * 
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ * 
+ *   1. Redistributions of source code must retain the above Copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above Copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the authors nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ */
+
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <gtest/gtest.h>
+#include "PrefixSum.hpp"
+#include "FrozenPrefixSum.hpp"
+
+using namespace std;
+using namespace prefixsum;
+
+namespace {
+
+const char* IMAGE_PATH = "frozen_prefix_sum_test.img";
+
+template <class PrefixSumT, class FrozenT>
+void CheckFrozen(uint64_t num){
+  PrefixSumT ps;
+  vector<uint64_t> vals;
+  for (uint64_t i = 0; i < num; ++i){
+    const uint64_t pos = rand() % (vals.size() + 1);
+    const uint64_t val = (rand() % 100 == 0) ? 1LLU << 20 : rand() % 100;
+    ps.Insert(pos, val);
+    vals.insert(vals.begin() + pos, val);
+  }
+  if (num > 100){
+    ps.AddRange(num / 10, num / 2, 3);
+    for (uint64_t i = num / 10; i < num / 2; ++i){
+      vals[i] += 3;
+    }
+  }
+  ASSERT_TRUE(ps.Freeze(IMAGE_PATH));
+
+  FrozenT frozen;
+  ASSERT_TRUE(frozen.Open(IMAGE_PATH));
+  ASSERT_EQ(ps.Num(), frozen.Num());
+  ASSERT_EQ(ps.Sum(), frozen.Sum());
+  ASSERT_EQ(ps.Depth(), frozen.Depth());
+  uint64_t sum = 0;
+  for (uint64_t i = 0; i < vals.size(); ++i){
+    ASSERT_EQ(vals[i], frozen.Get(i)) << " i=" << i;
+    ASSERT_EQ(sum, frozen.GetPrefixSum(i)) << " i=" << i;
+    sum += vals[i];
+  }
+  ASSERT_EQ(sum, frozen.GetPrefixSum(vals.size()));
+  for (uint64_t i = 0; i < 1000 && sum > 0; ++i){
+    const uint64_t val = rand() % sum;
+    ASSERT_EQ(ps.Find(val), frozen.Find(val)) << " val=" << val;
+  }
+  frozen.Close();
+  ASSERT_FALSE(frozen.IsOpen());
+  remove(IMAGE_PATH);
+}
+
+vector<char> ReadImage(const char* path){
+  ifstream ifs(path, ios::binary);
+  return vector<char>((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+}
+
+}
+
+TEST(FrozenPrefixSum, queries){
+  CheckFrozen<PrefixSum, FrozenPrefixSum>(0);
+  CheckFrozen<PrefixSum, FrozenPrefixSum>(10);
+  CheckFrozen<PrefixSum, FrozenPrefixSum>(50000);
+  CheckFrozen<PrefixSum32, FrozenPrefixSum32>(50000);
+  CheckFrozen<CachedPrefixSum, CachedFrozenPrefixSum>(50000);
+}
+
+TEST(FrozenPrefixSum, invalid){
+  FrozenPrefixSum frozen;
+  ASSERT_FALSE(frozen.Open("no_such_frozen_prefix_sum.img"));
+
+  // an image of other template parameters
+  PrefixSum32 ps32;
+  ps32.Insert(0, 1);
+  ASSERT_TRUE(ps32.Freeze(IMAGE_PATH));
+  ASSERT_FALSE(frozen.Open(IMAGE_PATH));
+
+  // a truncated image
+  PrefixSum ps;
+  for (uint64_t i = 0; i < 1000; ++i){
+    ps.Insert(i, i);
+  }
+  ASSERT_TRUE(ps.Freeze(IMAGE_PATH));
+  ASSERT_TRUE(frozen.Open(IMAGE_PATH));
+  ASSERT_EQ(ps.Sum(), frozen.GetPrefixSum(1000));
+  frozen.Close();
+  ifstream ifs(IMAGE_PATH, ios::binary);
+  vector<char> image((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+  ifs.close();
+  ofstream ofs(IMAGE_PATH, ios::binary | ios::trunc);
+  ofs.write(&image[0], image.size() - 8);
+  ofs.close();
+  ASSERT_FALSE(frozen.Open(IMAGE_PATH));
+  ASSERT_FALSE(frozen.IsOpen());
+  remove(IMAGE_PATH);
+}
+
+TEST(FrozenPrefixSum, deterministic){
+  // the erasures leave stale slots in the nodes, which the loaded copy
+  // of the same tree does not have
+  PrefixSum ps;
+  for (uint64_t i = 0; i < 20000; ++i){
+    ps.Insert(rand() % (ps.Num() + 1), rand() % 100);
+  }
+  for (uint64_t i = 0; i < 10000; ++i){
+    ps.Erase(rand() % ps.Num());
+  }
+  stringstream ss;
+  ASSERT_TRUE(ps.Save(ss));
+  PrefixSum loaded;
+  ASSERT_TRUE(loaded.Load(ss));
+
+  ASSERT_TRUE(ps.Freeze(IMAGE_PATH));
+  const vector<char> image = ReadImage(IMAGE_PATH);
+  ASSERT_TRUE(loaded.Freeze(IMAGE_PATH));
+  ASSERT_TRUE(image == ReadImage(IMAGE_PATH));
+  remove(IMAGE_PATH);
+}
@@ -0,0 +1,212 @@
+/* 
+ *  Copyright (c) 2012 Daisuke Okanohara
+  * 
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ * 
+ *   1. Redistributions of source code must retain the above Copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above Copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the authors nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ */
+
+#ifndef PREFIX_SUM_POOL_HPP_
+#define PREFIX_SUM_POOL_HPP_
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+#include <stdint.h>
+
+namespace prefixsum{
+
+/**
+ * value is true if T may be moved by memcpy: T is trivially copyable, or
+ * declares "typedef T Relocatable" to state that it has no pointer into
+ * itself nor is pointed to by its members
+ */
+template <class T>
+class IsRelocatable{
+  template <class U>
+  static char Check(typename U::Relocatable*);
+
+  template <class U>
+  static long Check(...);
+
+public:
+  static const bool value = __has_trivial_copy(T) || sizeof(Check<T>(0)) == 1;
+};
+
+/**
+ * Contiguous array of T addressed by 32-bit indices.
+ * Freed slots are reused by later allocations.
+ * The array is moved by realloc when it grows, so T must be relocatable
+ * by memcpy (see IsRelocatable), and references to elements are
+ * invalidated by Allocate() unless Reserve() is called beforehand.
+ * While retiring, a replaced array is kept with an epoch until Reclaim()
+ * instead of being freed, so that a reader of an array returned by
+ * Data() may keep reading the elements it has seen there.
+ * Elements alive at Clear() or at destruction are discarded without
+ * calling their destructors (their resources are released in bulk).
+ */
+template <class T>
+class Pool{
+public:
+  static const uint64_t MAX_NUM = 0x80000000LLU;
+
+  Pool() : data_(NULL), num_(0), capacity_(0), retire_(false), retire_epoch_(0){
+  }
+
+  ~Pool(){
+    free(data_);
+    Reclaim(~0LLU);
+  }
+
+  uint32_t Allocate(){
+    uint32_t ind = NewIndex();
+    new (&data_[ind]) T;
+    return ind;
+  }
+
+  template <class Arg>
+  uint32_t Allocate(Arg arg){
+    uint32_t ind = NewIndex();
+    new (&data_[ind]) T(arg);
+    return ind;
+  }
+
+  void Free(uint32_t ind){
+    assert(ind < num_);
+    data_[ind].~T();
+    free_list_.push_back(ind);
+  }
+
+  /**
+   * Make the next n allocations not to move the array
+   */
+  void Reserve(uint64_t n){
+    if (free_list_.size() + capacity_ - num_ >= n) return;
+    uint64_t capacity = capacity_ * 2;
+    if (capacity < num_ + n) capacity = num_ + n;
+    if (capacity > MAX_NUM) capacity = MAX_NUM;
+    assert(num_ + n <= capacity);
+    T* data = NULL;
+    if (retire_ && data_ != NULL){
+      data = static_cast<T*>(malloc(sizeof(T) * capacity));
+      if (data == NULL) throw std::bad_alloc();
+      memcpy(static_cast<void*>(data), static_cast<const void*>(data_), sizeof(T) * num_);
+      RetiredArray retired = {data_, capacity_, retire_epoch_};
+      retired_.push_back(retired);
+    } else {
+      data = static_cast<T*>(realloc(static_cast<void*>(data_), sizeof(T) * capacity));
+      if (data == NULL) throw std::bad_alloc();
+    }
+    data_ = data;
+    capacity_ = capacity;
+  }
+
+  /**
+   * Retire the arrays replaced from now on with epoch if retire is true,
+   * or free them at once otherwise
+   */
+  void SetRetire(bool retire, uint64_t epoch){
+    retire_ = retire;
+    retire_epoch_ = epoch;
+  }
+
+  /**
+   * Free the arrays retired with an epoch at or before epoch
+   */
+  void Reclaim(uint64_t epoch){
+    uint64_t i = 0;
+    for (; i < retired_.size() && retired_[i].epoch <= epoch; ++i){
+      free(retired_[i].data);
+    }
+    retired_.erase(retired_.begin(), retired_.begin() + i);
+  }
+
+  void Clear(){
+    num_ = 0;
+    free_list_.clear();
+    Reclaim(~0LLU);
+  }
+
+  /**
+   * Return the array of the elements, which moves when the pool grows
+   */
+  const T* Data() const{
+    return data_;
+  }
+
+  T& operator[](uint32_t ind){
+    assert(ind < num_);
+    return data_[ind];
+  }
+
+  const T& operator[](uint32_t ind) const{
+    assert(ind < num_);
+    return data_[ind];
+  }
+
+  /**
+   * Return the number of elements alive
+   */
+  uint64_t Num() const{
+    return num_ - free_list_.size();
+  }
+
+  uint64_t GetAllocatedBytes() const{
+    uint64_t bytes = sizeof(T) * capacity_ + sizeof(uint32_t) * free_list_.capacity();
+    for (uint64_t i = 0; i < retired_.size(); ++i){
+      bytes += sizeof(T) * retired_[i].capacity;
+    }
+    return bytes;
+  }
+
+private:
+  Pool(const Pool&);
+  Pool& operator=(const Pool&);
+
+  struct RetiredArray{
+    T* data;
+    uint64_t capacity;
+    uint64_t epoch;
+  };
+
+  // fails to compile if T may not be moved by realloc
+  typedef char CheckRelocatable[IsRelocatable<T>::value ? 1 : -1];
+
+  uint32_t NewIndex(){
+    if (!free_list_.empty()){
+      uint32_t ind = free_list_.back();
+      free_list_.pop_back();
+      return ind;
+    }
+    Reserve(1);
+    return num_++;
+  }
+
+  T* data_;
+  uint64_t num_;
+  uint64_t capacity_;
+  std::vector<uint32_t> free_list_;
+  bool retire_;
+  uint64_t retire_epoch_;
+  std::vector<RetiredArray> retired_;  // in the order of their epochs
+};
+
+template <class T>
+const uint64_t Pool<T>::MAX_NUM;
+
+} // namespace prefixsum
+
+#endif // PREFIX_SUM_POOL_HPP_
@@ -18,176 +18,1337 @@
  */
 
 #include <cassert>
+#include <algorithm>
+#include <fstream>
 #include "PrefixSum.hpp"
+#include "FrozenPrefixSum.hpp"
 
 namespace prefixsum{
 
 namespace {
 
-void Split(PrefixSumNode* p){
-  assert(p != NULL);
-  PrefixSumLeaf* leaf = p->leaf;
-  assert(leaf != NULL);
-  PrefixSumLeaf* new_leaf = new PrefixSumLeaf;
-  leaf->Split(*new_leaf);
-  p->children = new PrefixSumNode* [2];
-  p->children[0] = new PrefixSumNode;
-  p->children[1] = new PrefixSumNode;
-  p->children[0]->leaf = leaf;
-  p->children[1]->leaf = new_leaf;
-  p->leaf = NULL;
-  p->left_size = leaf->Num();
-  p->left_sum = leaf->Sum();
+template <class Node>
+struct PathEntry{
+  Node* node;
+  uint64_t child;
+};
+
+static const uint64_t MAX_DEPTH = 64;
+
+// prefetch all cache lines of *p
+template <class T>
+void PrefetchObject(const T* p){
+  const char* bytes = reinterpret_cast<const char*>(p);
+  for (uint64_t offset = 0; offset < sizeof(T); offset += 64){
+    __builtin_prefetch(bytes + offset);
+  }
+}
+
+// deeper trees than the number of nodes in a pool allows are rejected by Load
+const uint64_t MAX_LOAD_DEPTH = 16;
+
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+const uint64_t BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::BATCH_NUM;
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+const uint64_t BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::MAGIC;
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+const uint64_t BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::VERSION;
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+const uint64_t BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::LEAF_CHILD_FLAG;
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::BasicPrefixSum() : allocator_(new Arena), root_(0), num_(0), sum_(0), compact_pos_(0),
+  epoch_(0), shared_epoch_(0), released_(false){
+  InitRoot();
 }
 
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::BasicPrefixSum(Allocator* allocator) : allocator_(allocator), root_(0), num_(0), sum_(0), compact_pos_(0),
+  epoch_(0), shared_epoch_(0), released_(false){
+  assert(allocator_ != NULL);
+  InitRoot();
 }
 
-PrefixSum::PrefixSum() : num_(0), sum_(0){
-  root_.leaf = new PrefixSumLeaf;
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::~BasicPrefixSum(){
+  Release();
+  delete allocator_;
 }
 
-PrefixSum::~PrefixSum(){
-  root_.Clear();
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Clear(){
+  Release();
+  InitRoot();
 }
 
-void PrefixSum::Clear(){
-  root_.Clear();
-  root_.leaf = new PrefixSumLeaf;
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Release(){
+  assert(snapshots_.empty());
+  nodes_.Clear();
+  leaves_.Clear();
+  node_births_.clear();
+  leaf_births_.clear();
+  retired_.clear();
+  released_ = false;
+  nodes_.SetRetire(false, epoch_);
+  leaves_.SetRetire(false, epoch_);
+  allocator_->Clear();
+  root_ = 0;
   num_ = 0;
   sum_ = 0;
+  compact_pos_ = 0;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::InitRoot(){
+  uint32_t leaf = NewLeaf();
+  root_ = NewNode();
+  nodes_[root_].InsertChild(0, leaf, 0, 0);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint32_t BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::NewNode(){
+  const uint32_t node = nodes_.Allocate();
+  if (node >= node_births_.size()) node_births_.resize(node + 1);
+  node_births_[node] = epoch_;
+  return node;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint32_t BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::NewLeaf(){
+  const uint32_t leaf = leaves_.Allocate(allocator_);
+  if (leaf >= leaf_births_.size()) leaf_births_.resize(leaf + 1);
+  leaf_births_[leaf] = epoch_;
+  return leaf | Node::LEAF_TAG;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::DeleteChild(uint32_t child){
+  if (IsShared(child)){
+    const std::vector<uint64_t>& births = Node::IsLeaf(child) ? leaf_births_ : node_births_;
+    RetiredChild retired = {child, births[Node::GetIndex(child)], epoch_};
+    retired_.push_back(retired);
+  } else {
+    FreeChild(child);
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::FreeChild(uint32_t child){
+  if (Node::IsLeaf(child)){
+    leaves_.Free(Node::GetIndex(child));
+  } else {
+    nodes_.Free(child);
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::ReserveCopies(uint64_t node_num, uint64_t leaf_num){
+  if (__atomic_load_n(&shared_epoch_, __ATOMIC_ACQUIRE) == 0) return;
+  nodes_.Reserve(node_num);
+  leaves_.Reserve(leaf_num);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint32_t BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::CopyChild(uint32_t child){
+  uint32_t copy = 0;
+  if (Node::IsLeaf(child)){
+    copy = NewLeaf();
+    GetLeaf(copy).Assign(GetLeaf(child));
+  } else {
+    copy = NewNode();
+    nodes_[copy] = nodes_[child];
+  }
+  DeleteChild(child);
+  return copy;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::UnshareRoot(){
+  ReclaimSnapshots();
+  if (IsShared(root_)) root_ = CopyChild(root_);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::UnshareChild(Node& p, uint64_t i){
+  assert(i < p.num);
+  if (!IsShared(p.children[i])) return;
+  // the copy may not move p, since the caller has reserved the pools
+  const uint32_t copy = CopyChild(p.children[i]);
+  p.children[i] = copy;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::AcquireSnapshot(uint64_t epoch){
+  snapshot_lock_.Lock();
+  ++snapshots_[epoch];
+  if (epoch + 1 > shared_epoch_){
+    __atomic_store_n(&shared_epoch_, epoch + 1, __ATOMIC_RELEASE);
+  }
+  snapshot_lock_.Unlock();
+}
+
+// the reads of the snapshot happen before the release, so that the
+// writer seeing the new shared_epoch_ or released_ may modify or free
+// what it has read
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::ReleaseSnapshot(uint64_t epoch){
+  snapshot_lock_.Lock();
+  typename std::map<uint64_t, uint64_t>::iterator it = snapshots_.find(epoch);
+  assert(it != snapshots_.end());
+  if (--it->second == 0){
+    snapshots_.erase(it);
+    __atomic_store_n(&shared_epoch_, snapshots_.empty() ? 0 : snapshots_.rbegin()->first + 1,
+                     __ATOMIC_RELEASE);
+    __atomic_store_n(&released_, true, __ATOMIC_RELEASE);
+  }
+  snapshot_lock_.Unlock();
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::ReclaimSnapshots(){
+  if (!__atomic_load_n(&released_, __ATOMIC_ACQUIRE)) return;
+  snapshot_lock_.Lock();
+  __atomic_store_n(&released_, false, __ATOMIC_RELAXED);
+
+  // free the retired children which no remaining snapshot sees
+  uint64_t kept = 0;
+  for (uint64_t i = 0; i < retired_.size(); ++i){
+    const RetiredChild& retired = retired_[i];
+    typename std::map<uint64_t, uint64_t>::const_iterator s = snapshots_.lower_bound(retired.birth);
+    if (s != snapshots_.end() && s->first < retired.death){
+      retired_[kept++] = retired;
+    } else {
+      FreeChild(retired.child);
+    }
+  }
+  retired_.resize(kept);
+
+  // an array retired in epoch_ is seen by the snapshots before epoch_
+  const uint64_t oldest = snapshots_.empty() ? epoch_ : snapshots_.begin()->first;
+  nodes_.Reclaim(oldest);
+  leaves_.Reclaim(oldest);
+  nodes_.SetRetire(!snapshots_.empty(), epoch_);
+  leaves_.SetRetire(!snapshots_.empty(), epoch_);
+  snapshot_lock_.Unlock();
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Snapshot::Snapshot(BasicPrefixSum* ps) :
+  ps_(ps), epoch_(ps->epoch_++), nodes_(ps->nodes_.Data()), leaves_(ps->leaves_.Data()),
+  root_(ps->root_), num_(ps->num_), sum_(ps->sum_){
+  ps_->AcquireSnapshot(epoch_);
+  ps_->nodes_.SetRetire(true, ps_->epoch_);
+  ps_->leaves_.SetRetire(true, ps_->epoch_);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Snapshot::Snapshot(const Snapshot& snapshot) :
+  ps_(snapshot.ps_), epoch_(snapshot.epoch_), nodes_(snapshot.nodes_), leaves_(snapshot.leaves_),
+  root_(snapshot.root_), num_(snapshot.num_), sum_(snapshot.sum_){
+  ps_->AcquireSnapshot(epoch_);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+typename BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Snapshot&
+BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Snapshot::operator=(const Snapshot& snapshot){
+  snapshot.ps_->AcquireSnapshot(snapshot.epoch_);
+  ps_->ReleaseSnapshot(epoch_);
+  ps_ = snapshot.ps_;
+  epoch_ = snapshot.epoch_;
+  nodes_ = snapshot.nodes_;
+  leaves_ = snapshot.leaves_;
+  root_ = snapshot.root_;
+  num_ = snapshot.num_;
+  sum_ = snapshot.sum_;
+  return *this;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Snapshot::~Snapshot(){
+  ps_->ReleaseSnapshot(epoch_);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+bool BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::IsFullChild(uint32_t child) const{
+  if (Node::IsLeaf(child)){
+    return GetLeaf(child).IsFull();
+  } else {
+    return nodes_[child].IsFull();
+  }
+}
+
+// assume that pools have a room for a new node and a new leaf
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::SplitChild(Node& p, uint64_t i){
+  assert(!p.IsFull());
+  PushDown(p, i);
+  const uint32_t child = p.children[i];
+  uint32_t new_child = 0;
+  IndexT new_size = 0;
+  SumT new_sum = 0;
+  if (Node::IsLeaf(child)){
+    new_child = NewLeaf();
+    Leaf& new_leaf = GetLeaf(new_child);
+    GetLeaf(child).Split(new_leaf);
+    new_size = new_leaf.Num();
+    new_sum  = new_leaf.Sum();
+  } else {
+    new_child = NewNode();
+    Node& new_node = nodes_[new_child];
+    nodes_[child].Split(new_node);
+    for (uint64_t j = 0; j < new_node.num; ++j){
+      new_size += new_node.sizes[j];
+      new_sum  += new_node.sums[j];
+    }
+  }
+  p.sizes[i] -= new_size;
+  p.sums[i]  -= new_sum;
+  p.InsertChild(i+1, new_child, new_size, new_sum);
+}
+
+// remove the i-th leaf of p if empty, or merge it to its sibling if underfull
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::FixLeaf(Node& p, uint64_t i){
+  assert(p.LeafChild());
+  Leaf& leaf = GetLeaf(p.children[i]);
+  if (!leaf.IsUnderfull() || p.num == 1) return;
+  if (leaf.Num() == 0){
+    DeleteChild(p.children[i]);
+    p.RemoveChild(i);
+    return;
+  }
+  uint64_t left = 0;
+  if (i > 0 && GetLeaf(p.children[i-1]).CanMerge(leaf)){
+    left = i-1;
+  } else if (i+1 < p.num && leaf.CanMerge(GetLeaf(p.children[i+1]))){
+    left = i;
+  } else {
+    return;
+  }
+  UnshareChild(p, left);
+  UnshareChild(p, left+1);
+  PushDown(p, left);
+  PushDown(p, left+1);
+  GetLeaf(p.children[left]).Merge(GetLeaf(p.children[left+1]));
+  DeleteChild(p.children[left+1]);
+  p.sizes[left] += p.sizes[left+1];
+  p.sums[left]  += p.sums[left+1];
+  p.RemoveChild(left+1);
+}
+
+// merge the i-th node of p to its sibling, or move a child from the sibling
+// if it has less than MIN_CHILD children
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::FixNode(Node& p, uint64_t i){
+  assert(!p.LeafChild());
+  if (nodes_[p.children[i]].num >= Node::MIN_CHILD || p.num == 1) return;
+  uint64_t left = (i > 0) ? i-1 : i;
+  UnshareChild(p, left);
+  UnshareChild(p, left+1);
+  PushDown(p, left);
+  PushDown(p, left+1);
+  Node& l = nodes_[p.children[left]];
+  Node& r = nodes_[p.children[left+1]];
+  if (l.num + r.num <= Node::MAX_CHILD){
+    l.Merge(r);
+    DeleteChild(p.children[left+1]);
+    p.sizes[left] += p.sizes[left+1];
+    p.sums[left]  += p.sums[left+1];
+    p.RemoveChild(left+1);
+    return;
+  }
+  IndexT size = 0;
+  SumT sum = 0;
+  if (left == i){
+    // move the first child of r to the end of l
+    size = r.sizes[0];
+    sum  = r.sums[0];
+    l.InsertChild(l.num, r.children[0], size, sum);
+    l.adds[l.num-1] = r.adds[0];
+    r.RemoveChild(0);
+    p.sizes[left]   += size;
+    p.sums[left]    += sum;
+    p.sizes[left+1] -= size;
+    p.sums[left+1]  -= sum;
+  } else {
+    // move the last child of l to the beginning of r
+    size = l.sizes[l.num-1];
+    sum  = l.sums[l.num-1];
+    r.InsertChild(0, l.children[l.num-1], size, sum);
+    r.adds[0] = l.adds[l.num-1];
+    l.RemoveChild(l.num-1);
+    p.sizes[left]   -= size;
+    p.sums[left]    -= sum;
+    p.sizes[left+1] += size;
+    p.sums[left+1]  += sum;
+  }
 }
 
-void PrefixSum::Insert(uint64_t ind, uint64_t val){
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Insert(IndexT ind, SumT val){
   assert(ind <= num_);
-  PrefixSumNode* p = &root_;
-  uint64_t offset = ind;
+  // references to nodes and leaves are kept valid during the insertion
+  nodes_.Reserve(MAX_DEPTH);
+  leaves_.Reserve(1);
+  ReserveCopies(MAX_DEPTH * 2, 2);
+  if (nodes_[root_].IsFull()){
+    uint32_t new_root = NewNode();
+    nodes_[new_root].InsertChild(0, root_, num_, sum_);
+    root_ = new_root;
+  }
+
+  // split full nodes on the way down so that a parent always has a room
+  UnshareRoot();
+  Node* p = &nodes_[root_];
+  IndexT offset = ind;
   for (;;){
-    if (p->IsLeaf()){
-      if (!p->leaf->IsFull()){
-        break;
-      } else {
-        Split(p);
+    uint64_t i = p->FindChild(offset);
+    UnshareChild(*p, i);
+    PushDown(*p, i);
+    if (IsFullChild(p->children[i])){
+      SplitChild(*p, i);
+      if (offset > p->sizes[i]){
+        offset -= p->sizes[i];
+        ++i;
       }
     }
-    if (offset < p->left_size){
-      p->left_size++;
-      p->left_sum += val;
-      p = p->children[0];
-    } else {
-      offset -= p->left_size;
-      p = p->children[1];
+    p->sizes[i]++;
+    p->sums[i] += val;
+    const uint32_t child = p->children[i];
+    if (Node::IsLeaf(child)){
+      GetLeaf(child).Insert(offset, val);
+      break;
     }
+    p = &nodes_[child];
   }
-  p->leaf->Insert(offset, val);
   ++num_;
   sum_ += val;
 }
 
-void PrefixSum::Increment(uint64_t ind, uint64_t val){
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Erase(IndexT ind){
   assert(ind < num_);
-  PrefixSumNode* p = &root_;
-  uint64_t offset = ind;
-  while (!p->IsLeaf()){
-    if (offset < p->left_size){
-      p->left_sum += val;
-      p = p->children[0];
-    } else {
-      offset -= p->left_size;
-      p = p->children[1];
+  EraseRange(ind, ind+1);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::EraseRange(IndexT beg, IndexT end){
+  assert(beg <= end);
+  assert(end <= num_);
+  while (beg < end){
+    end -= EraseInLeaf(beg, end - beg);
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+IndexT BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::EraseInLeaf(IndexT ind, IndexT len){
+  // the path, the siblings merged on the way up and the root collapsed
+  ReserveCopies(MAX_DEPTH * 3, 3);
+  UnshareRoot();
+  PathEntry<Node> path[MAX_DEPTH];
+  uint64_t depth = 0;
+  Node* p = &nodes_[root_];
+  IndexT offset = ind;
+  for (;;){
+    assert(depth < MAX_DEPTH);
+    uint64_t i = p->FindChild(offset);
+    UnshareChild(*p, i);
+    PushDown(*p, i);
+    path[depth].node  = p;
+    path[depth].child = i;
+    ++depth;
+    if (p->LeafChild()) break;
+    p = &nodes_[p->children[i]];
+  }
+
+  Leaf& leaf = GetLeaf(p->children[path[depth-1].child]);
+  const IndexT end = std::min(offset + len, static_cast<IndexT>(leaf.Num()));
+  const IndexT num = end - offset;
+  const SumT sum = leaf.GetPrefixSum(end) - leaf.GetPrefixSum(offset);
+  leaf.EraseRange(offset, end);
+  for (uint64_t d = 0; d < depth; ++d){
+    path[d].node->sizes[path[d].child] -= num;
+    path[d].node->sums[path[d].child]  -= sum;
+  }
+  num_ -= num;
+  sum_ -= sum;
+
+  // rebalance bottom-up, and collapse the root with a single child
+  FixLeaf(*path[depth-1].node, path[depth-1].child);
+  for (uint64_t d = depth-1; d > 0; --d){
+    FixNode(*path[d-1].node, path[d-1].child);
+  }
+  while (!nodes_[root_].LeafChild() && nodes_[root_].num == 1){
+    UnshareChild(nodes_[root_], 0);
+    PushDown(nodes_[root_], 0);
+    uint32_t child = nodes_[root_].children[0];
+    DeleteChild(root_);
+    root_ = child;
+  }
+  return num;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Increment(IndexT ind, SumT val){
+  assert(ind < num_);
+  // an increment commutes with the pending additions on the path
+  ReserveCopies(MAX_DEPTH, 1);
+  UnshareRoot();
+  Node* p = &nodes_[root_];
+  IndexT offset = ind;
+  for (;;){
+    uint64_t i = p->FindChild(offset);
+    UnshareChild(*p, i);
+    p->sums[i] += val;
+    if (p->LeafChild()){
+      GetLeaf(p->children[i]).Increment(offset, val);
+      break;
     }
+    p = &nodes_[p->children[i]];
   }
-  p->leaf->Increment(offset, val);
   sum_ += val;
 }
 
-void PrefixSum::Decrement(uint64_t ind, uint64_t val){
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Decrement(IndexT ind, SumT val){
   assert(ind < num_);
-  PrefixSumNode* p = &root_;
-  uint64_t offset = ind;
-  while (!p->IsLeaf()){
-    if (offset < p->left_size){
-      p->left_sum -= val;
-      p = p->children[0];
-    } else {
-      offset -= p->left_size;
-      p = p->children[1];
+  ReserveCopies(MAX_DEPTH, 1);
+  UnshareRoot();
+  Node* p = &nodes_[root_];
+  IndexT offset = ind;
+  for (;;){
+    uint64_t i = p->FindChild(offset);
+    UnshareChild(*p, i);
+    PushDown(*p, i);
+    p->sums[i] -= val;
+    if (p->LeafChild()){
+      GetLeaf(p->children[i]).Decrement(offset, val);
+      break;
     }
+    p = &nodes_[p->children[i]];
   }
-  p->leaf->Decrement(offset, val);
   sum_ -= val;
 }
 
-void PrefixSum::Set(uint64_t ind, uint64_t val){
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Set(IndexT ind, SumT val){
   assert(ind < num_);
-  uint64_t old_val = Get(ind);
-  int64_t dif = val - old_val;
-  PrefixSumNode* p = &root_;
-  uint64_t offset = ind;
-  while (!p->IsLeaf()){
-    if (offset < p->left_size){
-      p->left_sum += dif;
-      p = p->children[0];
-    } else {
-      offset -= p->left_size;
-      p = p->children[1];
+  // the difference wraps around when val < old_val
+  SumT old_val = Get(ind);
+  SumT dif = val - old_val;
+  ReserveCopies(MAX_DEPTH, 1);
+  UnshareRoot();
+  Node* p = &nodes_[root_];
+  IndexT offset = ind;
+  for (;;){
+    uint64_t i = p->FindChild(offset);
+    UnshareChild(*p, i);
+    PushDown(*p, i);
+    p->sums[i] += dif;
+    if (p->LeafChild()){
+      GetLeaf(p->children[i]).Set(offset, val);
+      break;
     }
+    p = &nodes_[p->children[i]];
   }
-  p->leaf->Set(offset, val);
   sum_ += dif;
 }
 
-uint64_t PrefixSum::Get(uint64_t ind) const{
-  assert(ind < num_);
-  const PrefixSumNode* p = &root_;
-  uint64_t offset = ind;
-  while (!p->IsLeaf()){
-    if (offset < p->left_size){
-      p = p->children[0];
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::AddRange(IndexT beg, IndexT end, SumT val){
+  assert(beg <= end);
+  assert(end <= num_);
+  if (beg == end || val == 0) return;
+  // the paths to beg and end-1
+  ReserveCopies(MAX_DEPTH * 2, 2);
+  UnshareRoot();
+  AddRangeUnder(nodes_[root_], beg, end, val);
+  sum_ += val * (end - beg);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::AddRangeUnder(Node& p, IndexT beg, IndexT end, SumT val){
+  IndexT child_beg = 0;
+  for (uint64_t i = 0; i < p.num && child_beg < end; child_beg += p.sizes[i++]){
+    const IndexT child_end = child_beg + p.sizes[i];
+    if (child_end <= beg) continue;
+    // [b, e) of the child is in the range
+    const IndexT b = std::max(beg, child_beg) - child_beg;
+    const IndexT e = std::min(end, child_end) - child_beg;
+    p.sums[i] += val * (e - b);
+    if (b == 0 && e == p.sizes[i]){
+      p.adds[i] += val;
+      continue;
+    }
+    UnshareChild(p, i);
+    const uint32_t child = p.children[i];
+    if (Node::IsLeaf(child)){
+      GetLeaf(child).AddRange(b, e, val);
     } else {
-      offset -= p->left_size;
-      p = p->children[1];
+      AddRangeUnder(nodes_[child], b, e, val);
     }
   }
-  assert(offset < p->leaf->Num());
-  return p->leaf->Get(offset);
 }
 
-uint64_t PrefixSum::GetPrefixSum(uint64_t ind) const{
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::PushDown(Node& p, uint64_t i){
+  const SumT add = p.adds[i];
+  if (add == 0) return;
+  assert(!IsShared(p.children[i]));
+  p.adds[i] = 0;
+  const uint32_t child = p.children[i];
+  if (Node::IsLeaf(child)){
+    Leaf& leaf = GetLeaf(child);
+    leaf.AddRange(0, leaf.Num(), add);
+  } else {
+    Node& c = nodes_[child];
+    for (uint64_t j = 0; j < c.num; ++j){
+      c.sums[j] += add * c.sizes[j];
+      c.adds[j] += add;
+    }
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::ApplyBatch(const Update* updates, uint64_t num){
+  if (num == 0) return;
+  // the updates of the same index keep their order
+  std::vector<std::pair<IndexT, uint64_t> > order(num);
+  for (uint64_t i = 0; i < num; ++i){
+    assert(updates[i].ind < num_);
+    order[i] = std::make_pair(updates[i].ind, i);
+  }
+  std::sort(order.begin(), order.end());
+  std::vector<Update> sorted(num);
+  for (uint64_t i = 0; i < num; ++i){
+    sorted[i] = updates[order[i].second];
+  }
+  UnshareRoot();
+  sum_ += ApplySorted(root_, &sorted[0], num, 0);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+SumT BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::ApplySorted(uint32_t child, const Update* updates, uint64_t num, uint64_t base){
+  SumT dif = 0;
+  if (Node::IsLeaf(child)){
+    Leaf& leaf = GetLeaf(child);
+    for (uint64_t j = 0; j < num; ){
+      // fold the updates of vs[offset] into one
+      const uint64_t offset = updates[j].ind - base;
+      bool set = false;
+      SumT set_val = 0;
+      SumT inc = 0;
+      SumT dec = 0;
+      for (; j < num && updates[j].ind - base == offset; ++j){
+        const Update& update = updates[j];
+        if (update.type == INCREMENT){
+          inc += update.val;
+        } else if (update.type == DECREMENT){
+          dec += update.val;
+        } else {
+          set = true;
+          set_val = update.val;
+          inc = dec = 0;
+        }
+      }
+      if (set){
+        const SumT old_val = leaf.Get(offset);
+        const SumT val = set_val + inc - dec;
+        leaf.Set(offset, val);
+        dif += val - old_val;
+      } else if (inc >= dec){
+        if (inc > dec) leaf.Increment(offset, inc - dec);
+        dif += inc - dec;
+      } else {
+        leaf.Decrement(offset, dec - inc);
+        dif -= dec - inc;
+      }
+    }
+    return dif;
+  }
+
+  // updates [ends[i-1], ends[i]) go to the i-th child
+  Node& p = nodes_[child];
+  uint64_t ends[Node::MAX_CHILD];
+  for (uint64_t i = 0, beg = 0, lo = base; i < p.num; ++i){
+    uint64_t end = beg;
+    if (i + 1 == p.num){
+      end = num;
+    } else {
+      while (end < num && updates[end].ind - lo < p.sizes[i]) ++end;
+    }
+    ends[i] = end;
+    if (end > beg) PrefetchChild(p.children[i]);
+    lo += p.sizes[i];
+    beg = end;
+  }
+  if (p.LeafChild()){
+    for (uint64_t i = 0, beg = 0; i < p.num; beg = ends[i++]){
+      if (ends[i] > beg) GetLeaf(p.children[i]).Prefetch();
+    }
+  }
+  // copies of shared children move the pool, so p is looked up again
+  const uint64_t p_num = p.num;
+  for (uint64_t i = 0, beg = 0, lo = base; i < p_num; lo += nodes_[child].sizes[i], beg = ends[i++]){
+    if (ends[i] > beg){
+      ReserveCopies(1, 1);
+      UnshareChild(nodes_[child], i);
+      PushDown(nodes_[child], i);
+      const SumT child_dif = ApplySorted(nodes_[child].children[i], updates + beg, ends[i] - beg, lo);
+      nodes_[child].sums[i] += child_dif;
+      dif += child_dif;
+    }
+  }
+  return dif;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+SumT BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Get(IndexT ind) const{
+  assert(ind < num_);
+  return GetUnder(nodes_.Data(), leaves_.Data(), root_, ind);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+SumT BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::GetUnder(const Node* nodes, const Leaf* leaves,
+                                                                          uint32_t child, IndexT offset){
+  const Node* p = &nodes[child];
+  SumT add = 0;
+  for (;;){
+    uint64_t i = p->FindChild(offset);
+    add += p->adds[i];
+    if (p->LeafChild()){
+      const Leaf& leaf = leaves[Node::GetIndex(p->children[i])];
+      assert(offset < leaf.Num());
+      return leaf.Get(offset) + add;
+    }
+    p = &nodes[p->children[i]];
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+SumT BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::GetPrefixSum(IndexT ind) const{
   assert(ind <= num_);
-  const PrefixSumNode* p = &root_;
-  uint64_t offset = ind;
-  uint64_t sum = 0;
-  while (!p->IsLeaf()){
-    if (offset < p->left_size){
-      p = p->children[0];
+  return GetPrefixSumUnder(nodes_.Data(), leaves_.Data(), root_, ind, 0);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+SumT BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::GetPrefixSumUnder(const Node* nodes, const Leaf* leaves,
+                                                                                   uint32_t child, IndexT offset, SumT add){
+  SumT sum = 0;
+  while (!Node::IsLeaf(child)){
+    const Node& p = nodes[child];
+    uint64_t i = 0;
+    for (; i + 1 < p.num && offset >= p.sizes[i]; ++i){
+      offset -= p.sizes[i];
+      sum += p.sums[i] + add * p.sizes[i];
+    }
+    add += p.adds[i];
+    child = p.children[i];
+  }
+  const Leaf& leaf = leaves[Node::GetIndex(child)];
+  assert(offset <= leaf.Num());
+  return sum + leaf.GetPrefixSum(offset) + add * offset;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+IndexT BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Find(SumT val) const{
+  return FindUnder(nodes_.Data(), leaves_.Data(), root_, val);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+IndexT BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::FindUnder(const Node* nodes, const Leaf* leaves,
+                                                                            uint32_t child, SumT val){
+  const Node* p = &nodes[child];
+  IndexT offset = 0;
+  SumT remain = val;
+  SumT add = 0;
+  for (;;){
+    uint64_t i = 0;
+    for (; i + 1 < p->num && remain >= p->sums[i] + add * p->sizes[i]; ++i){
+      remain -= p->sums[i] + add * p->sizes[i];
+      offset += p->sizes[i];
+    }
+    add += p->adds[i];
+    if (p->LeafChild()){
+      return offset + FindInLeaf(leaves[Node::GetIndex(p->children[i])], remain, add);
+    }
+    p = &nodes[p->children[i]];
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint64_t BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::FindInLeaf(const Leaf& leaf, uint64_t val, uint64_t add){
+  if (add == 0) return leaf.Find(val);
+  // the last ind s.t. GetPrefixSum(ind) + add * ind <= val, since every value is positive
+  uint64_t ind = 0;
+  for (uint64_t step = Leaf::MAX_NUM; step > 0; step >>= 1){
+    const uint64_t next = ind + step;
+    if (next <= leaf.Num() && leaf.GetPrefixSum(next) + add * next <= val){
+      ind = next;
+    }
+  }
+  return ind;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+SumT BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::RangeSum(IndexT beg, IndexT end) const{
+  assert(beg <= end);
+  assert(end <= num_);
+  if (beg == end) return 0;
+  // descend while vs[beg] and vs[end-1] are under the same child
+  uint32_t child = root_;
+  SumT add = 0;
+  IndexT last = end - 1;
+  while (!Node::IsLeaf(child)){
+    const Node& p = nodes_[child];
+    IndexT beg_offset = beg;
+    const uint64_t i = p.FindChild(beg_offset);
+    const uint64_t j = p.FindChild(last);
+    if (i == j){
+      beg = beg_offset;
+      add += p.adds[i];
+      child = p.children[i];
+      continue;
+    }
+    // the rest of the i-th child, the children between, and the head of the j-th child
+    SumT sum = p.sums[i] + add * p.sizes[i] -
+      GetPrefixSumUnder(nodes_.Data(), leaves_.Data(), p.children[i], beg_offset, add + p.adds[i]);
+    for (uint64_t k = i + 1; k < j; ++k){
+      sum += p.sums[k] + add * p.sizes[k];
+    }
+    return sum + GetPrefixSumUnder(nodes_.Data(), leaves_.Data(), p.children[j], last + 1, add + p.adds[j]);
+  }
+  const Leaf& leaf = GetLeaf(child);
+  return leaf.GetPrefixSum(last + 1) - leaf.GetPrefixSum(beg) + add * (last + 1 - beg);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::DecodeTo(SumT* out, IndexT beg, IndexT end) const{
+  assert(beg <= end);
+  assert(end <= num_);
+  if (beg == end) return;
+  DecodeUnder(root_, beg, end, 0, out, NULL);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::PrefixSumsTo(SumT* out, IndexT beg, IndexT end) const{
+  assert(beg <= end);
+  assert(end <= num_);
+  if (beg == end) return;
+  SumT sum = GetPrefixSum(beg);
+  DecodeUnder(root_, beg, end, 0, out, &sum);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::DecodeUnder(uint32_t child, IndexT beg, IndexT end, SumT add,
+                                                                              SumT* out, SumT* sum) const{
+  if (Node::IsLeaf(child)){
+    uint64_t vals[Leaf::MAX_NUM];
+    GetLeaf(child).Decode(vals);
+    if (sum == NULL){
+      for (IndexT i = beg; i < end; ++i){
+        *out++ = vals[i] + add;
+      }
     } else {
-      sum += p->left_sum;
-      offset -= p->left_size;
-      p = p->children[1];
+      for (IndexT i = beg; i < end; ++i){
+        *out++ = *sum;
+        *sum += vals[i] + add;
+      }
     }
+    return;
   }
-  assert(offset <= p->leaf->Num());
-  return sum + p->leaf->GetPrefixSum(offset);
+  const Node& p = nodes_[child];
+  IndexT offset = 0;
+  for (uint64_t i = 0; i < p.num && offset < end; ++i){
+    const IndexT next = offset + p.sizes[i];
+    if (next > beg){
+      // the next leaf is fetched while this one is decoded
+      if (p.LeafChild() && i + 1 < p.num && next < end) PrefetchChild(p.children[i + 1]);
+      const IndexT b = std::max(beg, offset);
+      const IndexT e = std::min(end, next);
+      DecodeUnder(p.children[i], b - offset, e - offset, add + p.adds[i], out, sum);
+      out += e - b;
+    }
+    offset = next;
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::SplitByLeaf(IndexT beg, IndexT end, uint64_t part_num,
+                                                                              std::vector<IndexT>& bounds) const{
+  assert(beg <= end);
+  assert(end <= num_);
+  assert(part_num > 0);
+  bounds.clear();
+  bounds.push_back(beg);
+  for (uint64_t k = 1; k < part_num; ++k){
+    const IndexT ind = beg + static_cast<uint64_t>(end - beg) * k / part_num;
+    if (ind >= end) break;
+    const IndexT leaf_beg = GetLeafBegin(ind);
+    if (leaf_beg > bounds.back()) bounds.push_back(leaf_beg);
+  }
+  if (end > beg) bounds.push_back(end);
 }
 
-uint64_t PrefixSum::Find(uint64_t val) const{
-  const PrefixSumNode* p = &root_;
-  uint64_t offset = 0;
-  uint64_t remain = val;
-  while (!p->IsLeaf()){
-    if (remain < p->left_sum){
-      p = p->children[0];
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+IndexT BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::GetLeafBegin(IndexT ind) const{
+  assert(ind < num_);
+  uint32_t child = root_;
+  IndexT offset = ind;
+  while (!Node::IsLeaf(child)){
+    const Node& p = nodes_[child];
+    child = p.children[p.FindChild(offset)];
+  }
+  return ind - offset;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::GetBatch(const IndexT* inds, uint64_t num, SumT* vals) const{
+  QueryBatch(GET, inds, num, vals);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::GetPrefixSumBatch(const IndexT* inds, uint64_t num, SumT* sums) const{
+  QueryBatch(PREFIX_SUM, inds, num, sums);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::FindBatch(const SumT* vals, uint64_t num, IndexT* inds) const{
+  QueryBatch(FIND, vals, num, inds);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+template <class KeyT, class ResultT>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::QueryBatch(QueryType type, const KeyT* keys, uint64_t num, ResultT* results) const{
+  uint64_t sorted_num = 1;
+  while (sorted_num < num && keys[sorted_num - 1] <= keys[sorted_num]) ++sorted_num;
+  if (num == 0) return;
+  if (sorted_num == num){
+    QuerySorted(type, root_, keys, num, results, 0, 0, 0);
+    return;
+  }
+
+  // every leaf is at the same depth, under Depth() - 1 nodes
+  const uint64_t node_depth = Depth() - 1;
+  for (uint64_t beg = 0; beg < num; beg += BATCH_NUM){
+    const uint64_t batch_num = std::min(BATCH_NUM, num - beg);
+    uint32_t children[BATCH_NUM];
+    uint64_t ks[BATCH_NUM];
+    uint64_t accs[BATCH_NUM];
+    uint64_t adds[BATCH_NUM];
+    for (uint64_t j = 0; j < batch_num; ++j){
+      children[j] = root_;
+      ks[j] = keys[beg + j];
+      accs[j] = 0;
+      adds[j] = 0;
+    }
+    for (uint64_t d = 0; d < node_depth; ++d){
+      for (uint64_t j = 0; j < batch_num; ++j){
+        children[j] = StepQuery(type, nodes_[children[j]], ks[j], accs[j], adds[j]);
+        PrefetchChild(children[j]);
+      }
+    }
+    for (uint64_t j = 0; j < batch_num; ++j){
+      GetLeaf(children[j]).Prefetch();
+    }
+    for (uint64_t j = 0; j < batch_num; ++j){
+      results[beg + j] = QueryLeaf(type, GetLeaf(children[j]), ks[j], accs[j], adds[j]);
+    }
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+template <class KeyT, class ResultT>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::QuerySorted(QueryType type, uint32_t child, const KeyT* keys, uint64_t num,
+                                                                              ResultT* results, uint64_t base, uint64_t acc, uint64_t add) const{
+  if (Node::IsLeaf(child)){
+    const Leaf& leaf = GetLeaf(child);
+    for (uint64_t j = 0; j < num; ++j){
+      results[j] = QueryLeaf(type, leaf, keys[j] - base, acc, add);
+    }
+    return;
+  }
+
+  // queries [ends[i-1], ends[i]) go to the i-th child
+  const Node& p = nodes_[child];
+  uint64_t ends[Node::MAX_CHILD];
+  uint64_t bases[Node::MAX_CHILD];
+  uint64_t accs[Node::MAX_CHILD];
+  for (uint64_t i = 0, beg = 0; i < p.num; ++i){
+    const uint64_t sum = p.sums[i] + add * p.sizes[i];
+    const uint64_t len = (type == FIND) ? sum : p.sizes[i];
+    uint64_t end = beg;
+    if (i + 1 == p.num){
+      end = num;
     } else {
-      remain -= p->left_sum;
-      offset += p->left_size;
-      p = p->children[1];
+      while (end < num && keys[end] - base < len) ++end;
+    }
+    ends[i] = end;
+    bases[i] = base;
+    accs[i] = acc;
+    if (end > beg) PrefetchChild(p.children[i]);
+    base += len;
+    acc += (type == FIND) ? p.sizes[i] : sum;
+    beg = end;
+  }
+  if (p.LeafChild()){
+    for (uint64_t i = 0, beg = 0; i < p.num; beg = ends[i++]){
+      if (ends[i] > beg) GetLeaf(p.children[i]).Prefetch();
+    }
+  }
+  for (uint64_t i = 0, beg = 0; i < p.num; beg = ends[i++]){
+    if (ends[i] > beg){
+      QuerySorted(type, p.children[i], keys + beg, ends[i] - beg, results + beg, bases[i], accs[i],
+                  add + p.adds[i]);
+    }
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::PrefetchChild(uint32_t child) const{
+  if (Node::IsLeaf(child)){
+    PrefetchObject(&GetLeaf(child));
+  } else {
+    PrefetchObject(&nodes_[child]);
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint32_t BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::StepQuery(QueryType type, const Node& p, uint64_t& key, uint64_t& acc, uint64_t& add){
+  uint64_t i = 0;
+  if (type == FIND){
+    for (; i + 1 < p.num && key >= p.sums[i] + add * p.sizes[i]; ++i){
+      key -= p.sums[i] + add * p.sizes[i];
+      acc += p.sizes[i];
+    }
+  } else {
+    for (; i + 1 < p.num && key >= p.sizes[i]; ++i){
+      key -= p.sizes[i];
+      acc += p.sums[i] + add * p.sizes[i];
     }
   }
-  return offset + p->leaf->Find(remain);
+  add += p.adds[i];
+  return p.children[i];
 }
 
-uint64_t PrefixSum::GetAllocatedBytes() const{
-  return sizeof(num_) + sizeof(sum_) + root_.GetAllocatedBytes();
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint64_t BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::QueryLeaf(QueryType type, const Leaf& leaf, uint64_t key, uint64_t acc, uint64_t add){
+  switch (type){
+  case GET:
+    assert(key < leaf.Num());
+    return leaf.Get(key) + add;
+  case PREFIX_SUM:
+    assert(key <= leaf.Num());
+    return acc + leaf.GetPrefixSum(key) + add * key;
+  default:
+    return acc + FindInLeaf(leaf, key, add);
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint32_t BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::BuildLeaf(const uint64_t* vals, uint64_t num){
+  uint32_t leaf = NewLeaf();
+  GetLeaf(leaf).Build(vals, num);
+  return leaf;
 }
 
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::BuildTree(const std::vector<uint32_t>& leaves){
+  assert(!leaves.empty());
+  assert(nodes_.Num() == 0);
+
+  std::vector<uint32_t> children(leaves);
+  std::vector<IndexT> sizes(leaves.size());
+  std::vector<SumT> sums(leaves.size());
+  for (uint64_t i = 0; i < leaves.size(); ++i){
+    const Leaf& leaf = GetLeaf(leaves[i]);
+    sizes[i] = leaf.Num();
+    sums[i]  = leaf.Sum();
+    num_ += sizes[i];
+    sum_ += sums[i];
+  }
+
+  // distribute children evenly so that every node has at least MIN_CHILD
+  for (;;){
+    const uint64_t child_num = children.size();
+    const uint64_t node_num = (child_num + Node::MAX_CHILD - 1) / Node::MAX_CHILD;
+    uint64_t pos = 0;
+    for (uint64_t i = 0; i < node_num; ++i){
+      const uint64_t num = child_num / node_num + (i < child_num % node_num ? 1 : 0);
+      const uint32_t ind = NewNode();
+      Node& node = nodes_[ind];
+      IndexT size = 0;
+      SumT sum = 0;
+      for (uint64_t j = 0; j < num; ++j, ++pos){
+        node.InsertChild(j, children[pos], sizes[pos], sums[pos]);
+        size += sizes[pos];
+        sum  += sums[pos];
+      }
+      children[i] = ind;
+      sizes[i] = size;
+      sums[i] = sum;
+    }
+    children.resize(node_num);
+    sizes.resize(node_num);
+    sums.resize(node_num);
+    if (node_num == 1) break;
+  }
+  root_ = children[0];
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint64_t BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Depth() const{
+  uint64_t depth = 1;
+  for (uint32_t child = root_; !Node::IsLeaf(child); child = nodes_[child].children[0]){
+    ++depth;
+  }
+  return depth;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint64_t BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Compact(uint64_t leaf_num){
+  ReclaimSnapshots();
+  uint64_t bytes = 0;
+  for (uint64_t i = 0; i < leaf_num; ++i){
+    // the cursor may be out of date after insertions and erasures
+    if (compact_pos_ >= num_){
+      compact_pos_ = 0;
+    }
+    Node* p = &nodes_[root_];
+    IndexT offset = compact_pos_;
+    uint64_t j = p->FindChild(offset);
+    while (!p->LeafChild()){
+      p = &nodes_[p->children[j]];
+      j = p->FindChild(offset);
+    }
+    Leaf& leaf = GetLeaf(p->children[j]);
+    // a snapshot may be reading a shared leaf, and copying it frees nothing
+    if (!IsShared(p->children[j])) bytes += leaf.Compact();
+    compact_pos_ += leaf.Num() - offset;
+    if (compact_pos_ >= num_){
+      compact_pos_ = 0;
+      break;
+    }
+  }
+  return bytes;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint64_t BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Compact(){
+  compact_pos_ = 0;
+  return Compact(nodes_.Num() * Node::MAX_CHILD);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint64_t BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::GetAllocatedBytes() const{
+  return sizeof(*this) + allocator_->GetAllocatedBytes() + 
+    nodes_.GetAllocatedBytes() + leaves_.GetAllocatedBytes();
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint64_t BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::GetParams(){
+  return MaxWidth | LeafNum << 8 | static_cast<uint64_t>(CacheSums) << 24 |
+    sizeof(IndexT) << 32 | sizeof(SumT) << 40;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+bool BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Save(std::ostream& os) const{
+  Writer writer(os);
+  const uint64_t header[] = {MAGIC, VERSION, GetParams(), num_, sum_};
+  writer.Write(header, sizeof(header) / sizeof(header[0]));
+  SaveChild(writer, root_);
+  writer.Write(writer.Checksum());
+  return writer.Good();
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::SaveChild(Writer& writer, uint32_t child) const{
+  if (Node::IsLeaf(child)){
+    GetLeaf(child).Save(writer);
+    return;
+  }
+  const Node& p = nodes_[child];
+  writer.Write(p.num | (p.LeafChild() ? LEAF_CHILD_FLAG : 0));
+  for (uint64_t i = 0; i < p.num; ++i){
+    writer.Write(p.adds[i]);
+  }
+  for (uint64_t i = 0; i < p.num; ++i){
+    SaveChild(writer, p.children[i]);
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+bool BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Load(std::istream& is){
+  Release();
+  Reader reader(is);
+  uint64_t header[5];
+  IndexT size = 0;
+  SumT sum = 0;
+  bool ok = reader.Read(header, sizeof(header) / sizeof(header[0])) &&
+    header[0] == MAGIC && header[1] == VERSION && header[2] == GetParams() &&
+    LoadChild(reader, false, 0, root_, size, sum) &&
+    size == header[3] && sum == header[4];
+  if (ok){
+    const uint64_t expected = reader.Checksum();
+    uint64_t checksum = 0;
+    ok = reader.Read(checksum) && checksum == expected;
+  }
+  if (!ok){
+    Clear();
+    return false;
+  }
+  num_ = size;
+  sum_ = sum;
+  return true;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+bool BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::LoadChild(Reader& reader, bool is_leaf, uint64_t depth,
+                                                                            uint32_t& child, IndexT& size, SumT& sum){
+  if (is_leaf){
+    child = NewLeaf();
+    Leaf& leaf = GetLeaf(child);
+    if (!leaf.Load(reader)) return false;
+    size = leaf.Num();
+    sum = leaf.Sum();
+    return true;
+  }
+  uint64_t word = 0;
+  if (depth >= MAX_LOAD_DEPTH || !reader.Read(word)) return false;
+  const uint64_t num = word & ~LEAF_CHILD_FLAG;
+  if (num == 0 || num > Node::MAX_CHILD || (word & ~(LEAF_CHILD_FLAG | 0xFF)) != 0) return false;
+  uint64_t adds[Node::MAX_CHILD];
+  if (!reader.Read(adds, num)) return false;
+
+  // the children are loaded before the node, since allocations move the pool
+  uint32_t children[Node::MAX_CHILD];
+  IndexT sizes[Node::MAX_CHILD];
+  SumT sums[Node::MAX_CHILD];
+  for (uint64_t i = 0; i < num; ++i){
+    if (!LoadChild(reader, (word & LEAF_CHILD_FLAG) != 0, depth + 1, children[i], sizes[i], sums[i])) return false;
+  }
+  child = NewNode();
+  Node& p = nodes_[child];
+  size = 0;
+  sum = 0;
+  for (uint64_t i = 0; i < num; ++i){
+    p.InsertChild(i, children[i], sizes[i], sums[i] + adds[i] * sizes[i]);
+    p.adds[i] = adds[i];
+    size += p.sizes[i];
+    sum += p.sums[i];
+  }
+  return true;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+bool BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Freeze(const char* path) const{
+  typedef BasicFrozenPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums> Frozen;
+  std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+  if (!ofs) return false;
+
+  // renumber the nodes in level order, where the children of a node
+  // get the next indices, and the leaves get their ordinals
+  std::vector<uint32_t> order(1, root_);
+  std::vector<uint32_t> leaves;
+  std::vector<Node> nodes;
+  for (uint64_t k = 0; k < order.size(); ++k){
+    Node node = nodes_[order[k]];
+    for (uint64_t i = 0; i < node.num; ++i){
+      if (Node::IsLeaf(node.children[i])){
+        leaves.push_back(node.children[i]);
+        node.children[i] = (leaves.size() - 1) | Node::LEAF_TAG;
+      } else {
+        order.push_back(node.children[i]);
+        node.children[i] = order.size() - 1;
+      }
+    }
+    nodes.push_back(node);
+  }
+
+  Writer writer(ofs);
+  const uint64_t page_words = Frozen::PAGE_BYTES / sizeof(uint64_t);
+  std::vector<uint64_t> words((sizeof(Node) * nodes.size() + page_words * sizeof(uint64_t) - 1) /
+                              (page_words * sizeof(uint64_t)) * page_words);
+  // copy only the live fields into the zeroed words, since the padding
+  // and the unused slots of a pool node are uninitialized or stale, and
+  // the image has to be a function of the tree alone
+  Node* frozen_nodes = reinterpret_cast<Node*>(&words[0]);
+  for (uint64_t k = 0; k < nodes.size(); ++k){
+    const Node& node = nodes[k];
+    Node& frozen = frozen_nodes[k];
+    for (uint64_t i = 0; i < node.num; ++i){
+      frozen.sizes[i]    = node.sizes[i];
+      frozen.sums[i]     = node.sums[i];
+      frozen.adds[i]     = node.adds[i];
+      frozen.children[i] = node.children[i];
+    }
+    frozen.num = node.num;
+  }
+  writer.Write(&words[0], words.size());
+  std::vector<uint64_t> leaf_offsets(leaves.size());
+  for (uint64_t i = 0; i < leaves.size(); ++i){
+    leaf_offsets[i] = writer.Num() * sizeof(uint64_t);
+    GetLeaf(leaves[i]).Save(writer);
+  }
+  typename Frozen::Footer footer;
+  footer.magic      = Frozen::MAGIC;
+  footer.version    = Frozen::VERSION;
+  footer.params     = Frozen::GetParams();
+  footer.num        = num_;
+  footer.sum        = sum_;
+  footer.depth      = Depth();
+  footer.node_num   = nodes.size();
+  footer.leaf_num   = leaves.size();
+  footer.leaf_table = writer.Num() * sizeof(uint64_t);
+  writer.Write(&leaf_offsets[0], leaf_offsets.size());
+  writer.Write(reinterpret_cast<const uint64_t*>(&footer), sizeof(footer) / sizeof(uint64_t));
+  ofs.close();
+  return !ofs.fail();
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::ConstIterator::ConstIterator(const BasicPrefixSum* ps, IndexT ind) :
+  ps_(ps), ind_(ind), sum_(0), leaf_beg_(ind), leaf_end_(ind){
+  assert(ind <= ps_->num_);
+  // end() decodes the last leaf only when it is decremented
+  if (ind < ps_->num_){
+    Load(ind);
+    sum_ = ps_->GetPrefixSum(ind);
+  } else {
+    sum_ = ps_->sum_;
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::ConstIterator::Load(IndexT ind){
+  assert(ind < ps_->num_);
+  const Node* p = &ps_->nodes_[ps_->root_];
+  IndexT offset = ind;
+  SumT add = 0;
+  for (;;){
+    const uint64_t i = p->FindChild(offset);
+    add += p->adds[i];
+    if (p->LeafChild()){
+      const Leaf& leaf = ps_->GetLeaf(p->children[i]);
+      uint64_t vals[Leaf::MAX_NUM];
+      leaf.Decode(vals);
+      vals_.resize(leaf.Num());
+      for (uint64_t j = 0; j < leaf.Num(); ++j){
+        vals_[j] = vals[j] + add;
+      }
+      leaf_beg_ = ind - offset;
+      leaf_end_ = leaf_beg_ + leaf.Num();
+      return;
+    }
+    p = &ps_->nodes_[p->children[i]];
+  }
+}
+
+template class BasicPrefixSum<uint64_t, uint64_t, 64, 256>;
+template class BasicPrefixSum<uint32_t, uint32_t, 32, 256>;
+template class BasicPrefixSum<uint64_t, uint64_t, 64, 256, true>;
+
 } // namespace prefixsum
@@ -20,99 +20,640 @@
 #ifndef PREFIX_SUM_PREFIX_SUM_HPP_
 #define PREFIX_SUM_PREFIX_SUM_HPP_
 
+#include <cassert>
+#include <cstddef>
+#include <iostream>
+#include <iterator>
+#include <map>
 #include <vector>
 #include <stdint.h>
 #include "PrefixSumNode.hpp"
+#include "PrefixSumLeaf.hpp"
+#include "Arena.hpp"
+#include "Pool.hpp"
+#include "Serializer.hpp"
+#include "VersionLock.hpp"
 
 namespace prefixsum{
 
 /**
  * Dynamic Succinct Prefix Sum Data Structure
- * Store integer arrrays vs[0...num_-1] compactly and support
+ * Store integer arrrays vs[0...num_-1] compactly in a B+-tree whose
+ * leaves are PrefixSumLeafs, and support
  *   prefixsum(k)    : return \sum_{i=0}^{k} vs[i]
  *   find(i)         : return i s.t. prefixum(k) <= i < prefixsum(k+1)
  *   insert(i, x)    : vs <- vs[0...i-1] x vs[i ... num_-1]
+ *   erase(i)        : vs <- vs[0...i-1] vs[i+1 ... num_-1]
  *   set(i, x)       : vs[i] <- x
  *   increment(i, x) : vs[i] <- vs[i] + 1
  *   decrement(i, x) : vs[i] <- vs[i] - 1
+ *   addrange(i, j, x) : vs[k] <- vs[k] + x for i <= k < j
+ *
+ * IndexT and SumT are the types of indices and sums, each value has
+ * at most MaxWidth bits, and a leaf stores up to LeafNum values.
+ * Use PrefixSum for 64-bit indices and sums, and PrefixSum32 when
+ * both the number and the sum of values are less than 2^32.
+ *
+ * If CacheSums is true, each leaf also keeps the cumulative sums of its
+ * 64-value blocks, so that prefix sums and finds in a leaf read one
+ * cached sum instead of summing the preceding blocks, while every update
+ * pays for maintaining it. CachedPrefixSum is PrefixSum with the cache.
  */
-class PrefixSum{
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums = false>
+class BasicPrefixSum{
 public:
+  typedef BasicPrefixSumNode<IndexT, SumT> Node;
+  typedef BasicPrefixSumLeaf<MaxWidth, LeafNum, CacheSums> Leaf;
+
+  enum UpdateType{
+    INCREMENT = 0,
+    DECREMENT = 1,
+    SET       = 2
+  };
+
+  /**
+   * An update of ApplyBatch
+   */
+  struct Update{
+    UpdateType type;
+    IndexT ind;
+    SumT val;
+  };
+
   /**
    * Constructor
    */ 
-  PrefixSum();
+  BasicPrefixSum();
+
+  /**
+   * Constructor with an allocator for nodes, leaves and bit arrays.
+   * The allocator is owned and deleted by BasicPrefixSum.
+   */ 
+  explicit BasicPrefixSum(Allocator* allocator);
+
+  /**
+   * Constructor with values [first, last)
+   */
+  template <class Iterator>
+  BasicPrefixSum(Iterator first, Iterator last);
   
   /**
    * Destructor
    */ 
-  ~PrefixSum();
+  ~BasicPrefixSum();
 
   /**
    * Clear the internal state
    */
   void Clear();
 
+  /**
+   * Set vs <- [first, last) in O(n).
+   * Leaves are packed to full, and nodes are built bottom-up.
+   */
+  template <class Iterator>
+  void Build(Iterator first, Iterator last);
+
   /**
    * Insert val between vs[ind-1] and vs[ind]
    */
-  void Insert(uint64_t ind, uint64_t val);
+  void Insert(IndexT ind, SumT val);
+
+  /**
+   * Remove vs[ind]
+   */
+  void Erase(IndexT ind);
+
+  /**
+   * Remove vs[beg...end-1]
+   */
+  void EraseRange(IndexT beg, IndexT end);
 
   /**
    * Increment current value vs[ind] <- vs[ind] + 1
    */
-  void Increment(uint64_t ind, uint64_t val);
+  void Increment(IndexT ind, SumT val);
 
   /**
    * Decrement current value vs[ind] <- vs[ind] - 1
    */
-  void Decrement(uint64_t ind, uint64_t val);
+  void Decrement(IndexT ind, SumT val);
 
   /**
    * Set vs[ind] <- val
    */
-  void Set(uint64_t ind, uint64_t val);
+  void Set(IndexT ind, SumT val);
+
+  /**
+   * vs[i] <- vs[i] + val for beg <= i < end in O(log n).
+   * A child entirely in the range gets a pending addition in its parent,
+   * which is pushed down to the child when an update descends into it,
+   * and only the leaves at the ends of the range are rebuilt.
+   */
+  void AddRange(IndexT beg, IndexT end, SumT val);
+
+  /**
+   * Return vs[beg] + vs[beg+1] + ... + vs[end-1]
+   * with one descent to the node where the paths to beg and end-1 split
+   */
+  SumT RangeSum(IndexT beg, IndexT end) const;
+
+  /**
+   * Apply updates[0...num-1] in this order.
+   * The updates are sorted by their indices (keeping the order of the
+   * updates of the same index) and applied in one walk of the tree, so
+   * that each affected leaf is visited once (with the updates of the same
+   * index folded into one), and each node on the way adds the sum of the
+   * differences of its children at once.
+   */
+  void ApplyBatch(const Update* updates, uint64_t num);
 
   /**
    * Return vs[ind]
    */
-  uint64_t Get(uint64_t ind) const;
+  SumT Get(IndexT ind) const;
 
   /**
    * Return vs[0] + vs[1] + ... + vs[ind-1]
    */
-  uint64_t GetPrefixSum(uint64_t ind) const;
+  SumT GetPrefixSum(IndexT ind) const;
 
   /**
    * Return ind s.t. GetPrefixSum(ind) <= ind < GetPrefixSum(ind+1)
    */
-  uint64_t Find(uint64_t val) const;
+  IndexT Find(SumT val) const;
+
+  /**
+   * Return Find(val) in leaf whose values have the pending addition add,
+   * which is also used for the leaves of a FrozenPrefixSum
+   */
+  static uint64_t FindInLeaf(const Leaf& leaf, uint64_t val, uint64_t add);
+
+  /**
+   * vals[i] <- Get(inds[i]) for i < num.
+   * The batch queries descend the tree for BATCH_NUM queries together,
+   * prefetching the next node or leaf of every query before reading any
+   * of them, so that their cache misses overlap. If the queries are
+   * sorted, they are instead partitioned among the children of each node,
+   * so that the shared part of their paths is read only once.
+   */
+  void GetBatch(const IndexT* inds, uint64_t num, SumT* vals) const;
+
+  /**
+   * sums[i] <- GetPrefixSum(inds[i]) for i < num
+   */
+  void GetPrefixSumBatch(const IndexT* inds, uint64_t num, SumT* sums) const;
+
+  /**
+   * inds[i] <- Find(vals[i]) for i < num
+   */
+  void FindBatch(const SumT* vals, uint64_t num, IndexT* inds) const;
+
+  /**
+   * out[i] <- vs[beg+i] for i < end-beg.
+   * The leaves in the range are walked in order, and each is decoded at
+   * once by transposing the bit planes of its blocks, instead of one
+   * descent per value.
+   */
+  void DecodeTo(SumT* out, IndexT beg, IndexT end) const;
+
+  /**
+   * out[i] <- GetPrefixSum(beg+i) for i < end-beg in one walk of the leaves
+   */
+  void PrefixSumsTo(SumT* out, IndexT beg, IndexT end) const;
+
+  /**
+   * Split [beg, end) into at most part_num parts of about the same length
+   * whose boundaries are at the beginnings of leaves, and set bounds so
+   * that the k-th part is [bounds[k], bounds[k+1]). Since the queries do
+   * not modify the tree, DecodeTo and PrefixSumsTo of the parts can run
+   * in parallel threads without sharing a leaf.
+   */
+  void SplitByLeaf(IndexT beg, IndexT end, uint64_t part_num, std::vector<IndexT>& bounds) const;
 
   /**
    * Return the number of interger nums
    */
-  uint64_t Num() const{
+  IndexT Num() const{
     return num_;
   }
 
   /**
    * Return the sum of integers
    */
-  uint64_t Sum() const {
+  SumT Sum() const {
     return sum_;
   }
 
   /**
-   * Return the allocated bytes
+   * Return the number of levels from the root to a leaf (including the leaf)
+   */
+  uint64_t Depth() const;
+
+  /**
+   * Shrink the bit planes of up to leaf_num leaves, continuing from where
+   * the previous call stopped, and return the number of freed bytes.
+   * A pass stops at the last leaf, and the next call starts a new pass,
+   * so that a long-running caller can spread the work over time.
+   * The leaves shared with snapshots are skipped.
+   */
+  uint64_t Compact(uint64_t leaf_num);
+
+  /**
+   * Shrink the bit planes of all leaves, and return the number of freed bytes
+   */
+  uint64_t Compact();
+
+  /**
+   * Return the allocated bytes (including the unused memory in the allocator)
    */
   uint64_t GetAllocatedBytes() const;
 
+  /**
+   * Write the tree to os in a binary format of 64-bit words (in the
+   * native byte order): a header with the version and the template
+   * parameters, the nodes in preorder (the number of children and their
+   * pending additions), each leaf verbatim in place of a child, and a
+   * checksum. Return false if writing fails.
+   */
+  bool Save(std::ostream& os) const;
+
+  /**
+   * Replace vs by the tree written by Save. The leaves are read into their
+   * allocations as they are, without decoding or encoding any value, and
+   * the sizes and sums of the nodes are recomputed from their children.
+   * Return false (and leave vs empty) if the stream ends, the version or
+   * the template parameters differ, or the checksum does not match.
+   */
+  bool Load(std::istream& is);
+
+  /**
+   * Write the image of the tree to path for BasicFrozenPrefixSum::Open,
+   * where the nodes are renumbered in level order and the leaves are
+   * written as by Save. Return false if writing fails.
+   */
+  bool Freeze(const char* path) const;
+
+  /**
+   * Bidirectional iterator over vs, which also keeps the prefix sum of
+   * the current position. Entering a leaf descends from the root once and
+   * decodes all values of the leaf (transposing the bit planes of each
+   * block), so that a scan costs O(1) amortized per value.
+   * An iterator is invalidated by any update of the BasicPrefixSum.
+   */
+  class ConstIterator{
+  public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef SumT value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const SumT* pointer;
+    typedef const SumT& reference;
+
+    ConstIterator() : ps_(NULL), ind_(0), sum_(0), leaf_beg_(0), leaf_end_(0){
+    }
+
+    const SumT& operator*() const{
+      return vals_[ind_ - leaf_beg_];
+    }
+
+    ConstIterator& operator++(){
+      sum_ += vals_[ind_ - leaf_beg_];
+      if (++ind_ == leaf_end_ && ind_ < ps_->num_) Load(ind_);
+      return *this;
+    }
+
+    ConstIterator operator++(int){
+      ConstIterator it(*this);
+      ++*this;
+      return it;
+    }
+
+    ConstIterator& operator--(){
+      if (ind_ == leaf_beg_) Load(ind_ - 1);
+      sum_ -= vals_[--ind_ - leaf_beg_];
+      return *this;
+    }
+
+    ConstIterator operator--(int){
+      ConstIterator it(*this);
+      --*this;
+      return it;
+    }
+
+    bool operator==(const ConstIterator& it) const{
+      return ind_ == it.ind_ && ps_ == it.ps_;
+    }
+
+    bool operator!=(const ConstIterator& it) const{
+      return !(*this == it);
+    }
+
+    /**
+     * Return the current position
+     */
+    IndexT Index() const{
+      return ind_;
+    }
+
+    /**
+     * Return vs[0] + ... + vs[Index()-1]
+     */
+    SumT PrefixSum() const{
+      return sum_;
+    }
+
+  private:
+    friend class BasicPrefixSum;
+    ConstIterator(const BasicPrefixSum* ps, IndexT ind);
+
+    // decode the leaf containing vs[ind]
+    void Load(IndexT ind);
+
+    const BasicPrefixSum* ps_;
+    IndexT ind_;
+    SumT sum_;
+    IndexT leaf_beg_;  // vals_ is vs[leaf_beg_...leaf_end_-1]
+    IndexT leaf_end_;
+    std::vector<SumT> vals_;
+  };
+
+  typedef ConstIterator const_iterator;
+
+  /**
+   * Return the iterator at vs[ind] (ind <= Num())
+   */
+  ConstIterator GetIterator(IndexT ind) const{
+    return ConstIterator(this, ind);
+  }
+
+  // begin() and end() for range-based for and STL algorithms
+  ConstIterator begin() const{
+    return GetIterator(0);
+  }
+
+  ConstIterator end() const{
+    return GetIterator(num_);
+  }
+
+  /**
+   * Immutable view of vs at the time of GetSnapshot(), which answers
+   * queries while the BasicPrefixSum keeps being updated. A snapshot
+   * shares the nodes and the leaves of the tree, and an update copies
+   * the nodes and the leaves it modifies if a snapshot still shares
+   * them, so that the memory kept by snapshots is proportional to the
+   * modified leaves. Copies of a snapshot share it.
+   *
+   * A snapshot may be read, copied and destroyed by any thread while the
+   * BasicPrefixSum is updated: it reads the arrays of nodes and leaves of
+   * its time, which are retired rather than freed when the pools grow,
+   * and the nodes and the leaves it sees are never modified. The copies
+   * and the arrays no snapshot sees are freed by the next update after
+   * the release of the snapshots seeing them, so that only the updating
+   * thread changes the pools. A snapshot must not outlive the
+   * BasicPrefixSum.
+   */
+  class Snapshot{
+  public:
+    Snapshot(const Snapshot& snapshot);
+    Snapshot& operator=(const Snapshot& snapshot);
+    ~Snapshot();
+
+    SumT Get(IndexT ind) const{
+      assert(ind < num_);
+      return GetUnder(nodes_, leaves_, root_, ind);
+    }
+
+    SumT GetPrefixSum(IndexT ind) const{
+      assert(ind <= num_);
+      return GetPrefixSumUnder(nodes_, leaves_, root_, ind, 0);
+    }
+
+    IndexT Find(SumT val) const{
+      return FindUnder(nodes_, leaves_, root_, val);
+    }
+
+    IndexT Num() const{
+      return num_;
+    }
+
+    SumT Sum() const{
+      return sum_;
+    }
+
+  private:
+    friend class BasicPrefixSum;
+    explicit Snapshot(BasicPrefixSum* ps);
+
+    BasicPrefixSum* ps_;
+    uint64_t epoch_;
+    const Node* nodes_;
+    const Leaf* leaves_;
+    uint32_t root_;
+    IndexT num_;
+    SumT sum_;
+  };
+
+  /**
+   * Return a snapshot of vs in O(1), which must be called by the updating
+   * thread. Clear, Build and Load must not be called while a snapshot
+   * is alive.
+   */
+  Snapshot GetSnapshot(){
+    return Snapshot(this);
+  }
+
 private:
-  PrefixSumNode root_;
-  uint64_t num_;
-  uint64_t sum_;
+  BasicPrefixSum(const BasicPrefixSum&);
+  BasicPrefixSum& operator=(const BasicPrefixSum&);
+
+  // erase vs[ind...] in the leaf containing vs[ind] up to len values,
+  // and return the number of erased values
+  IndexT EraseInLeaf(IndexT ind, IndexT len);
+
+  enum QueryType{
+    GET        = 0,
+    PREFIX_SUM = 1,
+    FIND       = 2
+  };
+
+  // queries descending the tree together in a batch
+  static const uint64_t BATCH_NUM = 32;
+
+  template <class KeyT, class ResultT>
+  void QueryBatch(QueryType type, const KeyT* keys, uint64_t num, ResultT* results) const;
+
+  // answer the sorted queries under child, where base is subtracted from
+  // the keys, acc is added to the results, and add is the pending
+  // addition to the values under child
+  template <class KeyT, class ResultT>
+  void QuerySorted(QueryType type, uint32_t child, const KeyT* keys, uint64_t num,
+                   ResultT* results, uint64_t base, uint64_t acc, uint64_t add) const;
+
+  // apply the sorted updates under child, where base is subtracted from
+  // the indices, and return the difference of the sum under child
+  SumT ApplySorted(uint32_t child, const Update* updates, uint64_t num, uint64_t base);
+
+  // prefetch the node, or the leaf object, of child
+  void PrefetchChild(uint32_t child) const;
+
+  // move a query from p to its child and return the child
+  static uint32_t StepQuery(QueryType type, const Node& p, uint64_t& key, uint64_t& acc, uint64_t& add);
+  static uint64_t QueryLeaf(QueryType type, const Leaf& leaf, uint64_t key, uint64_t acc, uint64_t add);
+
+  // return the offset-th value under child in the arrays of nodes and leaves
+  static SumT GetUnder(const Node* nodes, const Leaf* leaves, uint32_t child, IndexT offset);
+
+  // return the sum of the first offset values under child,
+  // where add is the pending addition to the values under child
+  static SumT GetPrefixSumUnder(const Node* nodes, const Leaf* leaves, uint32_t child,
+                                IndexT offset, SumT add);
+
+  // return Find(val) in the values under child
+  static IndexT FindUnder(const Node* nodes, const Leaf* leaves, uint32_t child, SumT val);
+
+  // out[i] <- vs[beg+i] under child for i < end-beg, where add is the
+  // pending addition to the values under child, or out[i] <- *sum
+  // followed by *sum += vs[beg+i] if sum is not NULL
+  void DecodeUnder(uint32_t child, IndexT beg, IndexT end, SumT add, SumT* out, SumT* sum) const;
+
+  // return the index of the first value in the leaf containing vs[ind]
+  IndexT GetLeafBegin(IndexT ind) const;
+
+  // the first word of the format of Save, and its version
+  static const uint64_t MAGIC = 0x4D55535846455250LLU; // "PREFXSUM"
+  static const uint64_t VERSION = 2;  // 2: xxHash64 rounds for the checksum
+
+  // the bit in the first word of a node whose children are leaves
+  static const uint64_t LEAF_CHILD_FLAG = 0x100;
+
+  // return the word identifying the template parameters
+  static uint64_t GetParams();
+
+  void SaveChild(Writer& writer, uint32_t child) const;
+
+  // read a child written by SaveChild, where depth is the number of nodes
+  // above it, and set its size and the sum of its values
+  bool LoadChild(Reader& reader, bool is_leaf, uint64_t depth,
+                 uint32_t& child, IndexT& size, SumT& sum);
+
+  // move the pending addition of the i-th child of p to the child
+  void PushDown(Node& p, uint64_t i);
+
+  // add val to vs[beg...end-1] under the node p
+  void AddRangeUnder(Node& p, IndexT beg, IndexT end, SumT val);
+
+  // release all nodes and leaves at once
+  void Release();
+  void InitRoot();
+
+  Leaf& GetLeaf(uint32_t child){
+    return leaves_[Node::GetIndex(child)];
+  }
+  const Leaf& GetLeaf(uint32_t child) const{
+    return leaves_[Node::GetIndex(child)];
+  }
+
+  // a node or a leaf copied for the snapshots in [birth, death) of epoch_
+  struct RetiredChild{
+    uint32_t child;
+    uint64_t birth;
+    uint64_t death;
+  };
+
+  // count a snapshot of epoch, or release it, in any thread
+  void AcquireSnapshot(uint64_t epoch);
+  void ReleaseSnapshot(uint64_t epoch);
+
+  // free the retired children and arrays which no snapshot sees
+  // if a snapshot has been released, at the beginning of an update
+  void ReclaimSnapshots();
+
+  // return true if a snapshot sees child
+  bool IsShared(uint32_t child) const{
+    const std::vector<uint64_t>& births = Node::IsLeaf(child) ? leaf_births_ : node_births_;
+    return births[Node::GetIndex(child)] < __atomic_load_n(&shared_epoch_, __ATOMIC_ACQUIRE);
+  }
+
+  // copy the root or the i-th child of p if shared, before modifying it,
+  // where p is not shared. UnshareRoot() begins every update
+  void UnshareRoot();
+  void UnshareChild(Node& p, uint64_t i);
+  uint32_t CopyChild(uint32_t child);
+
+  // make the pools keep references valid while the nodes and leaves
+  // of an update are copied
+  void ReserveCopies(uint64_t node_num, uint64_t leaf_num);
+
+  uint32_t NewNode();
+  uint32_t NewLeaf();
+
+  // free child, or retire it if shared
+  void DeleteChild(uint32_t child);
+  void FreeChild(uint32_t child);
+  bool IsFullChild(uint32_t child) const;
+  void SplitChild(Node& p, uint64_t i);
+  void FixLeaf(Node& p, uint64_t i);
+  void FixNode(Node& p, uint64_t i);
+
+  uint32_t BuildLeaf(const uint64_t* vals, uint64_t num);
+  void BuildTree(const std::vector<uint32_t>& leaves);
+
+  Allocator* allocator_;
+  Pool<Node> nodes_;
+  Pool<Leaf> leaves_;
+  uint32_t root_;
+  IndexT num_;
+  SumT sum_;
+  IndexT compact_pos_;  // the beginning of the next leaf to compact
+
+  // a child is born in the epoch_ of its allocation, and GetSnapshot()
+  // takes the epoch_ and advances it, so that a snapshot of epoch sees the
+  // children born at or before epoch. The epochs are 64-bit so that they
+  // never wrap around however many snapshots are taken
+  uint64_t epoch_;
+  std::vector<uint64_t> node_births_;
+  std::vector<uint64_t> leaf_births_;
+  std::vector<RetiredChild> retired_;
+
+  // the snapshots, which may be copied and destroyed in other threads,
+  // under snapshot_lock_
+  uint64_t shared_epoch_;  // 1 + the latest epoch of the snapshots, or 0
+  bool released_;          // a snapshot has been released since ReclaimSnapshots()
+  std::map<uint64_t, uint64_t> snapshots_;  // epoch -> count
+  VersionLock snapshot_lock_;
 };
 
+typedef BasicPrefixSum<uint64_t, uint64_t, 64, 256> PrefixSum;
+typedef BasicPrefixSum<uint32_t, uint32_t, 32, 256> PrefixSum32;
+typedef BasicPrefixSum<uint64_t, uint64_t, 64, 256, true> CachedPrefixSum;
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+template <class Iterator>
+BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::BasicPrefixSum(Iterator first, Iterator last) : 
+  allocator_(new Arena), root_(0), num_(0), sum_(0), compact_pos_(0),
+  epoch_(0), shared_epoch_(0), released_(false){
+  Build(first, last);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+template <class Iterator>
+void BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Build(Iterator first, Iterator last){
+  Release();
+  std::vector<uint32_t> leaves;
+  uint64_t vals[Leaf::MAX_NUM];
+  uint64_t num = 0;
+  for (; first != last; ++first){
+    vals[num++] = *first;
+    if (num == Leaf::MAX_NUM){
+      leaves.push_back(BuildLeaf(vals, num));
+      num = 0;
+    }
+  }
+  if (num > 0 || leaves.empty()){
+    leaves.push_back(BuildLeaf(vals, num));
+  }
+  BuildTree(leaves);
+}
 
 } // namespace prefixsum
 
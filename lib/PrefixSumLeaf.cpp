@@ -18,91 +18,715 @@
  */
 
 #include <cassert>
+#include <cstring>
+#include <algorithm>
 #include "PrefixSumLeaf.hpp"
 #include "BitUtil.hpp"
+#include "BitKernel.hpp"
 
 using namespace std;
 
 namespace prefixsum{
 
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+const uint64_t BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::MAX_WIDTH;
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+const uint64_t BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::MAX_NUM;
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+const uint64_t BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::BLOCK_NUM;
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+const uint64_t BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::MAX_EXCEPTION;
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+const uint64_t BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::PREFETCH_BYTES;
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+const uint64_t BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::ADD_RANGE_INCREMENTS;
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+typename BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Header BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::empty_header_ = {0, 0, 0, 0, 0, 0};
+
 namespace {
-static const uint64_t MAX_NUM = 256; // 128, 256, 512, 1024...
-static const uint64_t BLOCK_NUM = MAX_NUM / 64;
+
+const uint64_t BYTE_ONES = 0x0101010101010101LLU;
+
+uint64_t GetLeafWidth(uint64_t beg, uint64_t end, uint64_t width, uint64_t capacity,
+                       const uint64_t* bit_arrays){
+  uint64_t max_w = 0;
+  for (uint64_t block = beg; block < end; ++block){
+    for (uint64_t w = 0; w < width; ++w){
+      if (bit_arrays[block * capacity + w] > 0) max_w = max(max_w, w+1);
+    }
+  }
+  return max_w;
 }
 
-PrefixSumLeaf::PrefixSumLeaf() : num_(0), width_(0){
+// return 64 bits of the shift-th bit array beginning at pos
+uint64_t ReadBits(const uint64_t* bit_arrays, uint64_t block_num, uint64_t capacity,
+                  uint64_t shift, uint64_t pos){
+  uint64_t block = pos / 64;
+  uint64_t offset = pos % 64;
+  uint64_t ret = 0;
+  if (block < block_num){
+    ret = bit_arrays[block * capacity + shift] >> offset;
+  }
+  if (offset > 0 && block + 1 < block_num){
+    ret |= bit_arrays[(block + 1) * capacity + shift] << (64 - offset);
+  }
+  return ret;
+}
 }
 
-PrefixSumLeaf::~PrefixSumLeaf() {
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::BasicPrefixSumLeaf(Allocator* allocator) : 
+  header_(&empty_header_), allocator_(allocator){
 }
 
-void PrefixSumLeaf::Init(uint64_t num){
-  num_ = num;
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::~BasicPrefixSumLeaf() {
+  FreeHeader();
 }
 
-void PrefixSumLeaf::Clear(){
-  bit_arrays_.clear();
-  num_ = 0;
-  width_ = 0;
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+uint64_t BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::GetGrownCapacity(uint64_t width){
+  return min(width + width / 4 + 1, MAX_WIDTH);
 }
 
-bool PrefixSumLeaf::IsFull() const{
-  return num_ == MAX_NUM;
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+uint64_t BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::GetWordNum(Encoding encoding, uint64_t num, uint64_t width,
+                                                     uint64_t capacity, uint64_t count){
+  switch (encoding){
+  case PACKED:
+    return SUM_WORDS + (num * width + 63) / 64;
+  case SPARSE:
+  case RUN_LENGTH:
+    return SUM_WORDS + (count + 3) / 4 + (count * width + 63) / 64;
+  default:
+    return SUM_WORDS + capacity * BLOCK_NUM + (count + 3) / 4 + count;
+  }
+}
+
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+typename BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Header* BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::NewHeader(uint64_t words){
+  uint64_t* data = NULL;
+  if (allocator_ == NULL){
+    data = new uint64_t[words];
+  } else {
+    data = static_cast<uint64_t*>(allocator_->Allocate(sizeof(uint64_t) * words));
+  }
+  fill(data, data + words, 0);
+  return reinterpret_cast<Header*>(data);
 }
 
-void PrefixSumLeaf::Rewidth(uint64_t width){
-  vector<uint64_t> new_bit_arrays(width * BLOCK_NUM);
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Allocate(Encoding encoding, uint64_t num, uint64_t width,
+                                                uint64_t capacity, uint64_t count){
+  FreeHeader();
+  header_ = NewHeader(1 + GetWordNum(encoding, num, width, capacity, count));
+  header_->num      = num;
+  header_->width    = width;
+  header_->capacity = capacity;
+  header_->encoding = encoding;
+  header_->count    = count;
+}
+
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Reallocate(uint64_t capacity, uint64_t exception_capacity){
+  assert(header_->encoding == BIT_SLICED);
+  assert(header_->exception_num <= exception_capacity);
+  Header* header = NewHeader(1 + GetWordNum(BIT_SLICED, 0, 0, capacity, exception_capacity));
+  const uint64_t width = min(static_cast<uint64_t>(header_->width), capacity);
+  header->num           = header_->num;
+  header->width         = width;
+  header->capacity      = capacity;
+  header->exception_num = header_->exception_num;
+  header->count         = exception_capacity;
+  uint64_t* new_sums = reinterpret_cast<uint64_t*>(header + 1);
+  uint64_t* new_bit_arrays = new_sums + SUM_WORDS;
+  const uint64_t* bit_arrays = BitArrays();
   for (uint64_t i = 0; i < BLOCK_NUM; ++i){
-    for (uint64_t j = 0; j < width_; ++j){
-      new_bit_arrays[i * width + j] = bit_arrays_[i * width_ + j];
+    for (uint64_t j = 0; j < width; ++j){
+      new_bit_arrays[i * capacity + j] = bit_arrays[i * header_->capacity + j];
+    }
+  }
+  uint16_t* new_keys = reinterpret_cast<uint16_t*>(new_bit_arrays + capacity * BLOCK_NUM);
+  uint64_t* new_values = new_bit_arrays + capacity * BLOCK_NUM + (exception_capacity + 3) / 4;
+  copy(ExceptionKeys(), ExceptionKeys() + header_->exception_num, new_keys);
+  copy(ExceptionValues(), ExceptionValues() + header_->exception_num, new_values);
+  if (CacheSums && header_ != &empty_header_){
+    copy(BlockSums(), BlockSums() + BLOCK_NUM, new_sums);
+  }
+  FreeHeader();
+  header_ = header;
+}
+
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::FreeHeader(){
+  if (header_ == &empty_header_) return;
+  uint64_t* data = reinterpret_cast<uint64_t*>(header_);
+  if (allocator_ == NULL){
+    delete[] data;
+  } else {
+    const uint64_t words = 1 + GetWordNum(GetEncoding(), header_->num, header_->width,
+                                          header_->capacity, header_->count);
+    allocator_->Free(data, sizeof(uint64_t) * words);
+  }
+  header_ = &empty_header_;
+}
+
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Init(uint64_t num){
+  ToBitSliced();
+  if (header_ == &empty_header_){
+    Reallocate(0, 0);
+  }
+  header_->num = num;
+}
+
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+typename BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Encoding BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::ChooseEncoding(const uint64_t* vals, uint64_t num){
+  uint64_t all = 0;
+  uint64_t nonzero_num = 0;
+  uint64_t run_num = 0;
+  for (uint64_t i = 0; i < num; ++i){
+    all |= vals[i];
+    if (vals[i] != 0) ++nonzero_num;
+    if (i == 0 || vals[i] != vals[i-1]) ++run_num;
+  }
+  const uint64_t width = BitUtil::GetBinaryLen(all);
+  uint64_t exception_num = 0;
+  const uint64_t base_width = ChooseBaseWidth(vals, num, exception_num);
+  uint64_t words[4];
+  words[BIT_SLICED] = GetWordNum(BIT_SLICED, num, base_width, base_width, exception_num);
+  words[PACKED]     = GetWordNum(PACKED, num, width, 0, 0);
+  words[SPARSE]     = GetWordNum(SPARSE, num, width, 0, nonzero_num);
+  words[RUN_LENGTH] = GetWordNum(RUN_LENGTH, num, width, 0, run_num);
+  uint64_t best = PACKED;
+  for (uint64_t i = SPARSE; i <= RUN_LENGTH; ++i){
+    if (words[i] < words[best]) best = i;
+  }
+  // the others are slower to query and to update, so they must save half
+  if (words[best] * 2 >= words[BIT_SLICED]){
+    best = BIT_SLICED;
+  }
+  return static_cast<Encoding>(best);
+}
+
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Build(const uint64_t* vals, uint64_t num){
+  Build(vals, num, ChooseEncoding(vals, num));
+}
+
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Build(const uint64_t* vals, uint64_t num, Encoding encoding){
+  assert(num <= MAX_NUM);
+  if (encoding == SPARSE || encoding == RUN_LENGTH){
+    BuildEntries(vals, num, encoding);
+    return;
+  }
+  uint64_t all = 0;
+  for (uint64_t i = 0; i < num; ++i){
+    all |= vals[i];
+  }
+  const uint64_t width = BitUtil::GetBinaryLen(all);
+  assert(width <= MAX_WIDTH);
+  if (encoding == PACKED){
+    Allocate(PACKED, num, width, 0, 0);
+    uint64_t* words = BitArrays();
+    for (uint64_t i = 0; i < num; ++i){
+      BitUtil::SetPacked(words, i, width, vals[i]);
     }
+    return;
+  }
+  uint64_t exception_num = 0;
+  const uint64_t base_width = ChooseBaseWidth(vals, num, exception_num);
+  Allocate(BIT_SLICED, num, base_width, base_width, exception_num);
+  const uint64_t mask = GetLowMask(base_width);
+  for (uint64_t i = 0; i < num; ++i){
+    if (vals[i] > mask){
+      AddException(i, vals[i] & ~mask);
+    }
+  }
+  assert(header_->exception_num == exception_num);
+  uint64_t* bit_arrays = BitArrays();
+  uint64_t planes[64];
+  for (uint64_t block = 0; block * 64 < num; ++block){
+    const uint64_t block_num = min(num - block * 64, static_cast<uint64_t>(64));
+    for (uint64_t i = 0; i < block_num; ++i){
+      planes[i] = vals[block * 64 + i] & mask;
+    }
+    for (uint64_t i = block_num; i < 64; ++i){
+      planes[i] = 0;
+    }
+    BitUtil::Transpose64(planes);
+    for (uint64_t shift = 0; shift < base_width; ++shift){
+      bit_arrays[block * base_width + shift] = planes[shift];
+    }
+  }
+  UpdateBlockSums(0);
+}
+
+// choose the width of planes minimizing the words of planes and exceptions,
+// where the exceptions are the outliers of UseException for the width
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+uint64_t BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::ChooseBaseWidth(const uint64_t* vals, uint64_t num, uint64_t& exception_num){
+  uint64_t blen_nums[65];
+  fill(blen_nums, blen_nums + 65, 0);
+  uint64_t width = 0;
+  for (uint64_t i = 0; i < num; ++i){
+    const uint64_t blen = BitUtil::GetBinaryLen(vals[i]);
+    ++blen_nums[blen];
+    width = max(width, blen);
+  }
+  uint64_t best_width = width;
+  uint64_t best_words = GetWordNum(BIT_SLICED, num, width, width, 0);
+  exception_num = 0;
+  if (num < 64) return best_width;
+  // exceptions and near are the values longer than w bits,
+  // and those shorter than w + EXCEPTION_BITS among them
+  uint64_t exceptions = 0;
+  uint64_t near = 0;
+  for (uint64_t w = width; w > 0; --w){
+    exceptions += blen_nums[w];
+    if (exceptions > MAX_EXCEPTION) break;
+    near += blen_nums[w];
+    if (w - 1 + EXCEPTION_BITS <= 64) near -= blen_nums[w - 1 + EXCEPTION_BITS];
+    if (near > 0) continue;
+    const uint64_t words = GetWordNum(BIT_SLICED, num, w - 1, w - 1, exceptions);
+    if (words < best_words){
+      best_width = w - 1;
+      best_words = words;
+      exception_num = exceptions;
+    }
+  }
+  return best_width;
+}
+
+// keys are the positions of non-zero values (SPARSE), or the ends of runs (RUN_LENGTH)
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::BuildEntries(const uint64_t* vals, uint64_t num, Encoding encoding){
+  uint64_t all = 0;
+  uint64_t count = 0;
+  for (uint64_t i = 0; i < num; ++i){
+    all |= vals[i];
+    if (encoding == SPARSE ? vals[i] != 0 : (i + 1 == num || vals[i] != vals[i+1])) ++count;
+  }
+  const uint64_t width = BitUtil::GetBinaryLen(all);
+  assert(width <= MAX_WIDTH);
+  Allocate(encoding, num, width, 0, count);
+  uint16_t* keys = reinterpret_cast<uint16_t*>(BitArrays());
+  uint64_t* values = BitArrays() + (count + 3) / 4;
+  uint64_t j = 0;
+  for (uint64_t i = 0; i < num; ++i){
+    if (encoding == SPARSE ? vals[i] == 0 : (i + 1 < num && vals[i] == vals[i+1])) continue;
+    keys[j] = (encoding == SPARSE) ? i : i + 1;
+    BitUtil::SetPacked(values, j, width, vals[i]);
+    ++j;
+  }
+  assert(j == count);
+}
+
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Decode(uint64_t* vals) const{
+  const uint64_t num = header_->num;
+  const uint64_t width = header_->width;
+  switch (header_->encoding){
+  case PACKED:
+    for (uint64_t i = 0; i < num; ++i){
+      vals[i] = BitUtil::GetPacked(BitArrays(), i, width);
+    }
+    return;
+  case SPARSE:
+    fill(vals, vals + num, 0);
+    for (uint64_t j = 0; j < header_->count; ++j){
+      vals[Keys()[j]] = BitUtil::GetPacked(EntryValues(), j, width);
+    }
+    return;
+  case RUN_LENGTH:
+    for (uint64_t j = 0, i = 0; j < header_->count; ++j){
+      const uint64_t val = BitUtil::GetPacked(EntryValues(), j, width);
+      for (; i < Keys()[j]; ++i){
+        vals[i] = val;
+      }
+    }
+    return;
+  }
+  const uint64_t capacity = header_->capacity;
+  const uint64_t* bit_arrays = BitArrays();
+  // a partial last block is decoded into block_vals
+  uint64_t block_vals[64];
+  for (uint64_t block = 0; block * 64 < num; ++block){
+    const uint64_t block_num = min(num - block * 64, static_cast<uint64_t>(64));
+    if (block_num == 64){
+      BitKernel::DecodeBlock(bit_arrays + block * capacity, width, vals + block * 64);
+      continue;
+    }
+    BitKernel::DecodeBlock(bit_arrays + block * capacity, width, block_vals);
+    copy(block_vals, block_vals + block_num, vals + block * 64);
+  }
+  for (uint64_t j = 0; j < header_->exception_num; ++j){
+    vals[ExceptionKeys()[j]] += ExceptionValues()[j];
+  }
+}
+
+// updates are done in BIT_SLICED
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::ToBitSliced(){
+  if (header_->encoding == BIT_SLICED) return;
+  uint64_t vals[MAX_NUM];
+  Decode(vals);
+  Build(vals, header_->num, BIT_SLICED);
+}
+
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Clear(){
+  FreeHeader();
+}
+
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+bool BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::IsFull() const{
+  return header_->num == MAX_NUM;
+}
+
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+bool BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::IsUnderfull() const{
+  return header_->num < MAX_NUM / 4;
+}
+
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+bool BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::CanMerge(const BasicPrefixSumLeaf& ps) const{
+  return header_->num + ps.header_->num <= MAX_NUM;
+}
+
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Rewidth(uint64_t width){
+  if (width > header_->capacity){
+    Reallocate(GetGrownCapacity(width), header_->count);
+  }
+  const uint64_t capacity = header_->capacity;
+  uint64_t* bit_arrays = BitArrays();
+  for (uint64_t i = 0; i < BLOCK_NUM; ++i){
+    for (uint64_t j = width; j < header_->width; ++j){
+      bit_arrays[i * capacity + j] = 0;
+    }
+  }
+  header_->width = width;
+}
+
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::ShrinkWidth(){
+  const uint64_t width = GetLeafWidth(0, BLOCK_NUM, header_->width, header_->capacity, BitArrays());
+  if (width < header_->width){
+    Rewidth(width);
+  }
+  if (header_ != &empty_header_ && GetGrownCapacity(width) < header_->capacity){
+    Reallocate(width, header_->count);
+  }
+}
+
+// shrink the width when the top plane has just been cleared in block
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::ShrinkWidthIfCleared(uint64_t block){
+  const uint64_t width = header_->width;
+  if (width == 0) return;
+  const uint64_t capacity = header_->capacity;
+  const uint64_t* bit_arrays = BitArrays();
+  if (bit_arrays[block * capacity + width - 1] != 0) return;
+  for (uint64_t i = 0; i < BLOCK_NUM; ++i){
+    if (bit_arrays[i * capacity + width - 1] != 0) return;
+  }
+  ShrinkWidth();
+}
+
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+uint64_t BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::GetLowMask(uint64_t width){
+  return (width == 64) ? 0xFFFFFFFFFFFFFFFFLLU : (1LLU << width) - 1;
+}
+
+// a value becomes an exception rather than widening the planes
+// if it is an outlier in a leaf with enough values to be typical
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+bool BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::UseException(uint64_t blen) const{
+  return header_->num >= 64 && header_->exception_num < MAX_EXCEPTION &&
+    blen >= header_->width + EXCEPTION_BITS;
+}
+
+// return the index of the exception at pos, or exception_num if not found
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+uint64_t BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::FindException(uint64_t pos) const{
+  const uint16_t* keys = ExceptionKeys();
+  const uint64_t exception_num = header_->exception_num;
+  uint64_t j = 0;
+  while (j < exception_num && keys[j] < pos) ++j;
+  return (j < exception_num && keys[j] == pos) ? j : exception_num;
+}
+
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::AddException(uint64_t pos, uint64_t excess){
+  uint64_t j = FindException(pos);
+  if (j < header_->exception_num){
+    ExceptionValues()[j] += excess;
+    return;
+  }
+  if (header_->exception_num == header_->count){
+    Reallocate(header_->capacity, min(header_->count + static_cast<uint64_t>(4), MAX_EXCEPTION));
+  }
+  uint16_t* keys = ExceptionKeys();
+  uint64_t* values = ExceptionValues();
+  for (j = header_->exception_num; j > 0 && keys[j-1] > pos; --j){
+    keys[j]   = keys[j-1];
+    values[j] = values[j-1];
+  }
+  keys[j]   = pos;
+  values[j] = excess;
+  ++header_->exception_num;
+}
+
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::RemoveException(uint64_t j){
+  uint16_t* keys = ExceptionKeys();
+  uint64_t* values = ExceptionValues();
+  for (; j + 1 < header_->exception_num; ++j){
+    keys[j]   = keys[j+1];
+    values[j] = values[j+1];
+  }
+  --header_->exception_num;
+  if (header_->exception_num == 0){
+    Reallocate(header_->capacity, 0);
+  }
+}
+
+// remove the exceptions in [beg, end), and move the following ones by len
+// to the left (or to the right if insert is true)
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::MoveExceptions(uint64_t beg, uint64_t end, uint64_t len, bool insert){
+  uint16_t* keys = ExceptionKeys();
+  uint64_t* values = ExceptionValues();
+  uint64_t k = 0;
+  for (uint64_t j = 0; j < header_->exception_num; ++j){
+    if (beg <= keys[j] && keys[j] < end) continue;
+    keys[k]   = (keys[j] < beg) ? keys[j] : (insert ? keys[j] + len : keys[j] - len);
+    values[k] = values[j];
+    ++k;
+  }
+  header_->exception_num = k;
+  if (header_->exception_num == 0){
+    Reallocate(header_->capacity, 0);
   }
-  width_ = width;
-  bit_arrays_.swap(new_bit_arrays);
 }
 
-void PrefixSumLeaf::Insert(uint64_t ind, uint64_t val){
+// return the sum of exceptions in [beg, end)
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+uint64_t BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::GetExceptionSum(uint64_t beg, uint64_t end) const{
+  const uint16_t* keys = ExceptionKeys();
+  const uint64_t* values = ExceptionValues();
+  uint64_t sum = 0;
+  for (uint64_t j = 0; j < header_->exception_num && keys[j] < end; ++j){
+    if (keys[j] >= beg) sum += values[j];
+  }
+  return sum;
+}
+
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::GetExceptionSums(uint64_t beg, uint64_t len,
+                                                                        uint64_t* sums) const{
+  for (uint64_t i = 0; i < 8; ++i){
+    sums[i] = 0;
+  }
+  const uint16_t* keys = ExceptionKeys();
+  const uint64_t* values = ExceptionValues();
+  for (uint64_t j = 0; j < header_->exception_num && keys[j] < beg + len * 8; ++j){
+    if (keys[j] < beg) continue;
+    for (uint64_t i = (keys[j] - beg) / len; i < 8; ++i){
+      sums[i] += values[j];
+    }
+  }
+}
+
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+uint64_t BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Compact(){
+  const uint64_t bytes = GetAllocatedBytes();
+  if (header_->num == 0){
+    FreeHeader();
+  } else {
+    // keep the leaf if the rebuilt one is not smaller,
+    // e.g. if updates have made exceptions of values shorter than Build does
+    uint64_t vals[MAX_NUM];
+    Decode(vals);
+    BasicPrefixSumLeaf leaf(allocator_);
+    leaf.Build(vals, header_->num);
+    if (leaf.GetAllocatedBytes() < bytes){
+      swap(header_, leaf.header_);
+    }
+  }
+  return bytes - GetAllocatedBytes();
+}
+
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Insert(uint64_t ind, uint64_t val){
   assert(ind < MAX_NUM);
-  assert(num_ < MAX_NUM);
+  assert(header_->num < MAX_NUM);
+  ToBitSliced();
   uint64_t blen = BitUtil::GetBinaryLen(val);
-  if (width_ < blen){
+  assert(blen <= MAX_WIDTH);
+  uint64_t excess = 0;
+  if (blen > header_->width && UseException(blen)){
+    excess = val & ~GetLowMask(header_->width);
+    val &= GetLowMask(header_->width);
+    blen = BitUtil::GetBinaryLen(val);
+  }
+  if (header_ == &empty_header_){
+    Reallocate(GetGrownCapacity(blen), 0);
+  }
+  if (header_->width < blen){
     Rewidth(blen);
   }
 
+  const uint64_t width = header_->width;
+  const uint64_t capacity = header_->capacity;
+  uint64_t* bit_arrays = BitArrays();
   uint64_t block = ind / 64;
   uint64_t offset = ind % 64;
-  uint64_t mask = (1LLU << offset) - 1;
-  uint64_t not_mask = ~mask;
-  ++num_;
-  const uint64_t block_num = (num_ + 64 - 1) / 64;
-  for (uint64_t shift = 0; shift < width_; ++shift){
-    uint64_t& bits = bit_arrays_[block * width_ + shift];
-    uint64_t carry = bits >> (64 - 1);
-    bits = (bits & mask) | ((bits & not_mask) << 1) | BitUtil::GetBit(val, shift) << offset;
-    for (uint64_t i = block+1; i < block_num; ++i){
-      uint64_t& next_bits = bit_arrays_[i * width_ + shift];
-      uint64_t next_carry = next_bits >> (64-1);
-      next_bits = (next_bits << 1) | carry;
-      carry = next_carry;
+  ++header_->num;
+  const uint64_t block_num = (header_->num + 64 - 1) / 64;
+  uint64_t outs[BLOCK_NUM]; // the values shifted out of each block
+  fill(outs, outs + BLOCK_NUM, 0);
+  BitKernel::InsertShift(bit_arrays + block * capacity, capacity, block_num - block, width,
+                         offset, val, CacheSums ? outs + block : NULL);
+  if (header_->exception_num > 0 || excess > 0){
+    // exceptions may move across blocks
+    if (header_->exception_num > 0){
+      MoveExceptions(ind, ind, 1, true);
+    }
+    if (excess > 0){
+      AddException(ind, excess);
+    }
+    UpdateBlockSums(block);
+  } else if (CacheSums){
+    uint64_t* sums = BlockSums();
+    for (uint64_t i = block; i < BLOCK_NUM; ++i){
+      sums[i] += val - outs[i];
     }
   }
+}
 
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+uint64_t BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Erase(uint64_t ind){
+  assert(ind < header_->num);
+  uint64_t val = Get(ind);
+  EraseRange(ind, ind+1);
+  return val;
 }
 
-void PrefixSumLeaf::Increment(uint64_t ind, uint64_t val){
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::EraseRange(uint64_t beg, uint64_t end){
+  assert(beg <= end);
+  assert(end <= header_->num);
+  if (beg == end) return;
+  ToBitSliced();
+  const uint64_t width = header_->width;
+  const uint64_t capacity = header_->capacity;
+  uint64_t* bit_arrays = BitArrays();
+  const uint64_t len = end - beg;
+  const uint64_t block_num = (header_->num + 64 - 1) / 64;
+  // for a single value, the cached sums lose it and gain the values
+  // shifted into each block, unless exceptions move across blocks
+  const bool shift_sums = CacheSums && len == 1 && header_->exception_num == 0;
+  const uint64_t removed = shift_sums ? Get(beg) : 0;
+  uint64_t ins[BLOCK_NUM];
+  fill(ins, ins + BLOCK_NUM, 0);
+  if (len == 1){
+    BitKernel::EraseShift(bit_arrays + beg / 64 * capacity, capacity, block_num - beg / 64, width,
+                          beg % 64, shift_sums ? ins + beg / 64 : NULL);
+  } else {
+    for (uint64_t shift = 0; shift < width; ++shift){
+      for (uint64_t block = beg / 64; block < block_num; ++block){
+        uint64_t mask = (block * 64 < beg) ? ((1LLU << (beg - block * 64)) - 1) : 0;
+        uint64_t& bits = bit_arrays[block * capacity + shift];
+        bits = (bits & mask) | (ReadBits(bit_arrays, BLOCK_NUM, capacity, shift, block * 64 + len) & ~mask);
+      }
+    }
+  }
+  if (header_->exception_num > 0){
+    MoveExceptions(beg, end, len, false);
+  }
+  header_->num -= len;
+  ShrinkWidth();
+  if (shift_sums){
+    uint64_t* sums = BlockSums();
+    for (uint64_t i = beg / 64; i < BLOCK_NUM; ++i){
+      sums[i] += ins[i] - removed;
+    }
+  } else {
+    UpdateBlockSums(beg / 64);
+  }
+}
+
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Merge(BasicPrefixSumLeaf& ps){
+  assert(CanMerge(ps));
+  if (ps.header_->num == 0){
+    ps.Clear();
+    return;
+  }
+  if (header_->encoding != BIT_SLICED || ps.header_->encoding != BIT_SLICED ||
+      header_->exception_num > 0 || ps.header_->exception_num > 0){
+    uint64_t vals[MAX_NUM];
+    Decode(vals);
+    ps.Decode(vals + header_->num);
+    Build(vals, header_->num + ps.header_->num);
+    ps.Clear();
+    return;
+  }
+  if (header_ == &empty_header_){
+    Reallocate(ps.header_->width, 0);
+  }
+  if (header_->width < ps.header_->width){
+    Rewidth(ps.header_->width);
+  }
+  const uint64_t num = header_->num;
+  const uint64_t capacity = header_->capacity;
+  uint64_t* bit_arrays = BitArrays();
+  const uint64_t ps_capacity = ps.header_->capacity;
+  const uint64_t* ps_bit_arrays = ps.BitArrays();
+  const uint64_t block_num = (ps.header_->num + 64 - 1) / 64;
+  const uint64_t offset = num % 64;
+  for (uint64_t shift = 0; shift < ps.header_->width; ++shift){
+    for (uint64_t i = 0; i < block_num; ++i){
+      uint64_t bits = ps_bit_arrays[i * ps_capacity + shift];
+      uint64_t block = num / 64 + i;
+      bit_arrays[block * capacity + shift] |= bits << offset;
+      if (offset > 0 && block + 1 < BLOCK_NUM){
+        bit_arrays[(block + 1) * capacity + shift] |= bits >> (64 - offset);
+      }
+    }
+  }
+  header_->num += ps.header_->num;
+  UpdateBlockSums(num / 64);
+  ps.Clear();
+}
+
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Increment(uint64_t ind, uint64_t val){
+  ToBitSliced();
   uint64_t block = ind / 64;
   uint64_t offset = ind % 64;
   const uint64_t set_bit = (1LLU << offset);
   uint64_t carry_bit = 0;
+  AddBlockSums(block, val);
   for (uint64_t shift = 0;; ++shift){
     if ((val >> shift) == 0 && carry_bit == 0){
       return;
     }
-    if (shift == width_){
+    if (shift == header_->width){
+      // the rest overflows the planes
+      const uint64_t excess = ((val >> shift) + carry_bit) << shift;
+      if (UseException(BitUtil::GetBinaryLen(Get(ind) + excess))){
+        AddException(ind, excess);
+        return;
+      }
+      assert(shift < MAX_WIDTH);
       Rewidth(shift+1);
     }
     uint64_t val_bit = (val >> shift) & 1LLU;
-    uint64_t& bits = bit_arrays_[block * width_ + shift];
+    uint64_t& bits = BitArrays()[block * header_->capacity + shift];
     uint64_t cur_bit = BitUtil::GetBit(bits, offset);
     uint64_t sum = cur_bit + carry_bit + val_bit;
     
@@ -116,15 +740,25 @@ void PrefixSumLeaf::Increment(uint64_t ind, uint64_t val){
   assert(false); // should not come here
 }
 
-void PrefixSumLeaf::Decrement(uint64_t ind, uint64_t val){
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Decrement(uint64_t ind, uint64_t val){
+  ToBitSliced();
+  if (header_->exception_num > 0 && FindException(ind) < header_->exception_num){
+    Set(ind, Get(ind) - val);
+    return;
+  }
+  const uint64_t width = header_->width;
+  const uint64_t capacity = header_->capacity;
+  uint64_t* bit_arrays = BitArrays();
   uint64_t block = ind / 64;
   uint64_t offset = ind % 64;
   const uint64_t set_bit = (1LLU << offset);
   uint64_t carry_bit = 0;
   val = ~val + 1;
-  for (uint64_t shift = 0; shift < width_; ++shift){
+  AddBlockSums(block, val);
+  for (uint64_t shift = 0; shift < width; ++shift){
     uint64_t val_bit = (val >> shift) & 1LLU;
-    uint64_t& bits = bit_arrays_[block * width_ + shift];
+    uint64_t& bits = bit_arrays[block * capacity + shift];
     uint64_t cur_bit = BitUtil::GetBit(bits, offset);
     uint64_t sum = cur_bit + carry_bit + val_bit;
     
@@ -135,156 +769,398 @@ void PrefixSumLeaf::Decrement(uint64_t ind, uint64_t val){
     }
     carry_bit = sum >> 1;
   }
+  ShrinkWidthIfCleared(block);
 }
 
-void PrefixSumLeaf::Set(uint64_t ind, uint64_t val){
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Set(uint64_t ind, uint64_t val){
+  ToBitSliced();
   uint64_t block = ind / 64;
   uint64_t offset = ind % 64;
   const uint64_t unset_bit = ~(1LLU << offset);
-  for (uint64_t shift = 0; shift < width_; ++shift){
-    bit_arrays_[block * width_ + shift] &= unset_bit;
+  uint64_t old_val = 0;
+  for (uint64_t shift = 0; shift < header_->width; ++shift){
+    uint64_t& bits = BitArrays()[block * header_->capacity + shift];
+    old_val |= BitUtil::GetBit(bits, offset) << shift;
+    bits &= unset_bit;
   }
+  if (header_->exception_num > 0){
+    const uint64_t j = FindException(ind);
+    if (j < header_->exception_num){
+      old_val += ExceptionValues()[j];
+      RemoveException(j);
+    }
+  }
+  AddBlockSums(block, val - old_val);
   uint64_t blen = BitUtil::GetBinaryLen(val);
-  if (width_ < blen){
+  assert(blen <= MAX_WIDTH);
+  if (blen > header_->width && UseException(blen)){
+    AddException(ind, val & ~GetLowMask(header_->width));
+    val &= GetLowMask(header_->width);
+    blen = BitUtil::GetBinaryLen(val);
+  }
+  if (header_->width < blen){
     Rewidth(blen);
   }
+  const uint64_t capacity = header_->capacity;
+  uint64_t* bit_arrays = BitArrays();
   for (uint64_t shift = 0; shift < blen; ++shift){
-    bit_arrays_[block * width_ + shift] |= (BitUtil::GetBit(val, shift) << offset);
+    bit_arrays[block * capacity + shift] |= (BitUtil::GetBit(val, shift) << offset);
+  }
+  if (blen < header_->width){
+    ShrinkWidthIfCleared(block);
   }
 }
 
-uint64_t PrefixSumLeaf::Get(uint64_t ind) const{
-  uint64_t ret = 0;
-  uint64_t block = ind / 64;
-  uint64_t offset = ind % 64;
-  for (uint64_t shift = 0; shift < width_; ++shift){
-    ret += BitUtil::GetBit(bit_arrays_[block * width_ + shift], offset) << shift;
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::AddRange(uint64_t beg, uint64_t end, uint64_t val){
+  assert(beg <= end);
+  assert(end <= header_->num);
+  if (beg == end || val == 0) return;
+  if (end - beg <= ADD_RANGE_INCREMENTS){
+    for (uint64_t i = beg; i < end; ++i){
+      Increment(i, val);
+    }
+    return;
   }
-  return ret;
+  uint64_t vals[MAX_NUM];
+  Decode(vals);
+  for (uint64_t i = beg; i < end; ++i){
+    vals[i] += val;
+  }
+  // keep BIT_SLICED for the following updates
+  const uint64_t num = header_->num;
+  Build(vals, num, (header_->encoding == BIT_SLICED) ? BIT_SLICED : ChooseEncoding(vals, num));
 }
 
-uint64_t PrefixSumLeaf::GetBlockSum(uint64_t block, uint64_t offset) const {
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+uint64_t BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Get(uint64_t ind) const{
+  switch (header_->encoding){
+  case PACKED:
+    return BitUtil::GetPacked(BitArrays(), ind, header_->width);
+  case SPARSE: {
+    const uint16_t* keys = Keys();
+    const uint64_t j = lower_bound(keys, keys + header_->count, ind) - keys;
+    if (j == header_->count || keys[j] != ind) return 0;
+    return BitUtil::GetPacked(EntryValues(), j, header_->width);
+  }
+  case RUN_LENGTH: {
+    const uint16_t* keys = Keys();
+    const uint64_t j = upper_bound(keys, keys + header_->count, ind) - keys;
+    return BitUtil::GetPacked(EntryValues(), j, header_->width);
+  }
+  }
+  const uint64_t width = header_->width;
+  const uint64_t capacity = header_->capacity;
+  const uint64_t* bit_arrays = BitArrays();
   uint64_t ret = 0;
-  uint64_t mask = (offset == 64) ? 0xFFFFFFFFFFFFFFFFLLU : ((1LLU << offset) - 1);
-  for (uint64_t shift = 0; shift < width_; ++shift){
-    ret += BitUtil::PopCount(bit_arrays_[block * width_ + shift] & mask) << shift;
+  uint64_t block = ind / 64;
+  uint64_t offset = ind % 64;
+  for (uint64_t shift = 0; shift < width; ++shift){
+    ret += BitUtil::GetBit(bit_arrays[block * capacity + shift], offset) << shift;
+  }
+  if (header_->exception_num > 0){
+    const uint64_t j = FindException(ind);
+    if (j < header_->exception_num) ret += ExceptionValues()[j];
   }
   return ret;
 }
 
-uint64_t PrefixSumLeaf::GetPrefixSum(uint64_t ind) const{
-  uint64_t block = ind / 64;
-  uint64_t offset = ind % 64;
-  uint64_t ret = 0;
-  for (uint64_t i = 0; i < block; ++i){
-    ret += GetBlockSum(i, 64);
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+uint64_t BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::GetBlockSum(uint64_t block, uint64_t offset) const {
+  const uint64_t mask = (offset == 64) ? 0xFFFFFFFFFFFFFFFFLLU : ((1LLU << offset) - 1);
+  uint64_t ret = BitKernel::PlaneSum(BitArrays() + block * header_->capacity, header_->width, mask);
+  if (header_->exception_num > 0){
+    ret += GetExceptionSum(block * 64, block * 64 + offset);
   }
-  ret += GetBlockSum(block, offset);
   return ret;
 }
 
-namespace {
-  static uint64_t masks[5] = 
-    {0x5555555555555555LLU,
-     0x3333333333333333LLU,
-     0x0f0f0f0f0f0f0f0fLLU,
-     0x00ff00ff00ff00ffLLU,
-     0x0000ffff0000ffffLLU};
+// add delta (modulo 2^64) to the cumulative sums of block and the following blocks
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::AddBlockSums(uint64_t block, uint64_t delta){
+  if (!CacheSums) return;
+  uint64_t* sums = BlockSums();
+  for (uint64_t i = block; i < BLOCK_NUM; ++i){
+    sums[i] += delta;
+  }
 }
 
-uint64_t PrefixSumLeaf::Find(uint64_t val) const{
-  if (bit_arrays_.size() == 0) return 0;
-  uint64_t block = 0;
-  for ( ;num_ / 64 ; ++block){
-    uint64_t sum = GetBlockSum(block, 64);
-    if (val < sum) break;
-    val -= sum;
+// recompute the cumulative sums of block and the following blocks
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::UpdateBlockSums(uint64_t block){
+  if (!CacheSums || header_ == &empty_header_) return;
+  uint64_t* sums = BlockSums();
+  uint64_t sum = (block > 0) ? sums[block - 1] : 0;
+  const uint64_t block_num = (header_->num + 64 - 1) / 64;
+  for (; block < block_num; ++block){
+    sum += GetBlockSum(block, 64);
+    sums[block] = sum;
   }
-  assert(block * width_ < bit_arrays_.size());
-
-  uint64_t cums[64][6];
-  for (uint64_t shift = 0; shift < width_; ++shift){
-    cums[shift][0] = bit_arrays_[block * width_ + shift];
+  for (; block < BLOCK_NUM; ++block){
+    sums[block] = sum;
   }
+}
 
-  for (uint64_t shift = 0; shift < width_; ++shift){
-    uint64_t* cs = cums[shift];
-    for (uint64_t i = 0, offset =1; i < 5; ++i, offset <<= 1){
-      cs[i+1] = (cs[i] & masks[i]) + ((cs[i] >> offset) & masks[i]);
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+uint64_t BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::GetPrefixSum(uint64_t ind) const{
+  switch (header_->encoding){
+  case PACKED: {
+    uint64_t ret = 0;
+    for (uint64_t i = 0; i < ind; ++i){
+      ret += BitUtil::GetPacked(BitArrays(), i, header_->width);
     }
+    return ret;
   }
-  
-  uint64_t ind = 0;
-  uint64_t sum = 0;
-  for (uint64_t sums = 6; sums > 0; ){
-    --sums;
-    uint64_t psum = 0;
-    for (uint64_t shift = 0; shift < width_; ++shift){
-      psum += BitUtil::GetBits(cums[shift][sums], ind, 1LLU << sums) << shift;
+  case SPARSE:
+  case RUN_LENGTH:
+    return GetPrefixSumEntries(ind);
+  }
+  uint64_t block = ind / 64;
+  uint64_t offset = ind % 64;
+  uint64_t ret = 0;
+  if (CacheSums){
+    if (block > 0) ret = BlockSums()[block - 1];
+  } else {
+    for (uint64_t i = 0; i < block; ++i){
+      ret += GetBlockSum(i, 64);
     }
-    if (sum + psum < val){
-      sum += psum;
-      ind += (1LLU << sums);
+  }
+  if (offset > 0){
+    ret += GetBlockSum(block, offset);
+  }
+  return ret;
+}
+
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+uint64_t BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::GetPrefixSumEntries(uint64_t ind) const{
+  const uint16_t* keys = Keys();
+  const uint64_t* values = EntryValues();
+  const uint64_t width = header_->width;
+  uint64_t ret = 0;
+  if (header_->encoding == SPARSE){
+    for (uint64_t j = 0; j < header_->count && keys[j] < ind; ++j){
+      ret += BitUtil::GetPacked(values, j, width);
     }
+    return ret;
   }
-  if (sum + Get(ind) <= val){
-    ++ind;
+  for (uint64_t j = 0, beg = 0; beg < ind; beg = keys[j++]){
+    ret += (min(static_cast<uint64_t>(keys[j]), ind) - beg) * BitUtil::GetPacked(values, j, width);
   }
-  return block * 64 + ind;
+  return ret;
 }
 
-void PrefixSumLeaf::Print() const{
-  uint64_t block_num = (num_ + 64 - 1) / 64;
-  for (uint64_t block = 0; block < block_num; ++block){
-    for (uint64_t w = 0; w < width_; ++w){
-      BitUtil::PrintBit(bit_arrays_[block * width_ + w]);
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+uint64_t BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::FindEntries(uint64_t val) const{
+  const uint16_t* keys = Keys();
+  const uint64_t* values = EntryValues();
+  const uint64_t width = header_->width;
+  uint64_t sum = 0;
+  for (uint64_t j = 0; j < header_->count; ++j){
+    const uint64_t v = BitUtil::GetPacked(values, j, width);
+    if (header_->encoding == SPARSE){
+      if (sum + v > val) return keys[j];
+      sum += v;
+    } else {
+      const uint64_t beg = (j == 0) ? 0 : keys[j-1];
+      const uint64_t run_sum = (keys[j] - beg) * v;
+      if (sum + run_sum > val) return beg + (val - sum) / v;
+      sum += run_sum;
     }
   }
+  return header_->num;
 }
 
 namespace {
-uint64_t GetLeafWidth(uint64_t beg, uint64_t end, uint64_t width,
-                       const vector<uint64_t>& bit_arrays){
-  uint64_t max_w = 0;
-  for (uint64_t block = beg; block < end; ++block){
-    for (uint64_t w = 0; w < width; ++w){
-      if (bit_arrays[block * width + w] > 0) max_w = w+1;
+
+// the i-th byte of the result is the number of ones in bits 0...i of the byte x
+uint64_t CumulativeBitCounts(uint64_t x){
+  return BitUtil::SpreadBits(x) * BYTE_ONES;
+}
+
+// counts[shift] holds 8 non-decreasing byte counts of the plane of weight 2^shift,
+// and extras[i] is added to the weighted sum of the i-th bytes.
+// Return the first i such that the weighted sum of the i-th bytes exceeds val
+// (7 if none) and set sum to the weighted sum of the preceding bytes.
+uint64_t SelectByte(const uint64_t* counts, uint64_t width, const uint64_t* extras,
+                    uint64_t val, uint64_t& sum){
+  uint64_t ind = 0;
+  sum = 0;
+  for (uint64_t step = 4; step > 0; step >>= 1){
+    const uint64_t last = ind + step - 1;
+    uint64_t s = extras[last];
+    for (uint64_t shift = 0; shift < width; ++shift){
+      s += ((counts[shift] >> (last * 8)) & 0xFFLLU) << shift;
+    }
+    if (s <= val){
+      sum = s;
+      ind += step;
     }
   }
-  return max_w;
+  return ind;
 }
+
 }
 
-void PrefixSumLeaf::Split(PrefixSumLeaf& ps){
-  // assume num_ = MAX_NUM
-  uint64_t first_leaf_width = GetLeafWidth(0, BLOCK_NUM/2, width_, bit_arrays_);
-  uint64_t second_leaf_width = GetLeafWidth(BLOCK_NUM/2, BLOCK_NUM, width_, bit_arrays_);
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+uint64_t BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Find(uint64_t val) const{
+  switch (header_->encoding){
+  case PACKED: {
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < header_->num; ++i){
+      sum += BitUtil::GetPacked(BitArrays(), i, header_->width);
+      if (sum > val) return i;
+    }
+    return header_->num;
+  }
+  case SPARSE:
+  case RUN_LENGTH:
+    return FindEntries(val);
+  }
+  const uint64_t num = header_->num;
+  const uint64_t width = header_->width;
+  const uint64_t capacity = header_->capacity;
+  const uint64_t* bit_arrays = BitArrays();
+  if (width == 0 && header_->exception_num == 0) return num;
+  uint64_t block = 0;
+  if (CacheSums){
+    const uint64_t* sums = BlockSums();
+    while (block < num / 64 && sums[block] <= val) ++block;
+    if (block > 0) val -= sums[block - 1];
+  } else {
+    for ( ; block < num / 64; ++block){
+      uint64_t sum = GetBlockSum(block, 64);
+      if (val < sum) break;
+      val -= sum;
+    }
+  }
+  if (block * 64 == num) return num;
+  assert(block < BLOCK_NUM);
+  if (width == 1 && header_->exception_num == 0){
+    // the val-th one of the plane
+    const uint64_t bits = bit_arrays[block * capacity];
+    if (val >= BitUtil::PopCount(bits)) return std::min(block * 64 + 64, num);
+    return std::min(block * 64 + BitKernel::Select(bits, val), num);
+  }
 
-  vector<uint64_t> first_bit_arrays(first_leaf_width * BLOCK_NUM);
-  vector<uint64_t> second_bit_arrays(second_leaf_width * BLOCK_NUM);
+  // select the byte by the cumulative popcounts of the bytes of the planes,
+  // and then the bit in the byte by the cumulative popcounts of its bits
+  const uint64_t* planes = bit_arrays + block * capacity;
+  uint64_t counts[MAX_WIDTH];
+  uint64_t extras[8];
+  for (uint64_t shift = 0; shift < width; ++shift){
+    counts[shift] = BitUtil::ByteCounts(planes[shift]) * BYTE_ONES;
+  }
+  GetExceptionSums(block * 64, 8, extras);
+  uint64_t sum = 0;
+  // if val is not less than the block sum, the block is the last one
+  // and the last bit of the byte 7 is at num or later
+  const uint64_t byte = SelectByte(counts, width, extras, val, sum);
+  val -= sum;
+  for (uint64_t shift = 0; shift < width; ++shift){
+    counts[shift] = CumulativeBitCounts((planes[shift] >> (byte * 8)) & 0xFFLLU);
+  }
+  GetExceptionSums(block * 64 + byte * 8, 1, extras);
+  const uint64_t bit = SelectByte(counts, width, extras, val, sum);
+  return std::min(block * 64 + byte * 8 + bit, num);
+}
 
-  for (uint64_t i = 0; i < BLOCK_NUM/2; ++i){
-    for (uint64_t j = 0; j < first_leaf_width; ++j){
-      first_bit_arrays[i * first_leaf_width + j] = bit_arrays_[i * width_ + j];
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Print() const{
+  if (header_->encoding != BIT_SLICED){
+    uint64_t vals[MAX_NUM];
+    Decode(vals);
+    for (uint64_t i = 0; i < header_->num; ++i){
+      std::cout << vals[i] << " ";
     }
+    std::cout << std::endl;
+    return;
   }
-  for (uint64_t i = 0; i < BLOCK_NUM/2; ++i){
-    for (uint64_t j = 0; j < second_leaf_width; ++j){
-      second_bit_arrays[i * second_leaf_width + j] = bit_arrays_[(i + BLOCK_NUM/2) * width_ + j];
+  const uint64_t* bit_arrays = BitArrays();
+  uint64_t block_num = (header_->num + 64 - 1) / 64;
+  for (uint64_t block = 0; block < block_num; ++block){
+    for (uint64_t w = 0; w < header_->width; ++w){
+      BitUtil::PrintBit(bit_arrays[block * header_->capacity + w]);
     }
   }
+}
 
-  num_ = num_ / 2;
-  width_ = first_leaf_width;
-  bit_arrays_.swap(first_bit_arrays);
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Split(BasicPrefixSumLeaf& ps){
+  // the encodings of both halves are chosen again
+  uint64_t vals[MAX_NUM];
+  Decode(vals);
+  const uint64_t num = header_->num;
+  ps.Build(vals + num / 2, num - num / 2);
+  Build(vals, num / 2);
+}
 
-  ps.num_ = MAX_NUM / 2;
-  ps.width_ = second_leaf_width;
-  ps.bit_arrays_.swap(second_bit_arrays);
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Assign(const BasicPrefixSumLeaf& ps){
+  if (&ps == this) return;
+  Clear();
+  if (ps.header_ == &empty_header_) return;
+  const uint64_t words = 1 + GetWordNum(ps.GetEncoding(), ps.header_->num, ps.header_->width,
+                                        ps.header_->capacity, ps.header_->count);
+  Header* header = NewHeader(words);
+  const uint64_t* data = reinterpret_cast<const uint64_t*>(ps.header_);
+  copy(data, data + words, reinterpret_cast<uint64_t*>(header));
+  header_ = header;
 }
 
-uint64_t PrefixSumLeaf::GetAllocatedBytes() const{
-  return sizeof(bit_arrays_[0]) * bit_arrays_.size() + sizeof(num_) + sizeof(width_);
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+void BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Save(Writer& writer) const{
+  writer.Write(reinterpret_cast<const uint64_t*>(header_), 1);
+  const uint64_t words = GetWordNum(GetEncoding(), header_->num, header_->width,
+                                    header_->capacity, header_->count);
+  if (header_ == &empty_header_){
+    // the empty header has no data words
+    for (uint64_t i = 0; i < words; ++i){
+      writer.Write(0);
+    }
+    return;
+  }
+  writer.Write(reinterpret_cast<const uint64_t*>(header_ + 1), words);
 }
 
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+bool BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::Load(Reader& reader){
+  Clear();
+  Header header;
+  uint64_t word = 0;
+  if (!reader.Read(word)) return false;
+  memcpy(&header, &word, sizeof(header));
+  if (header.num > MAX_NUM || header.width > MAX_WIDTH || header.encoding > RUN_LENGTH ||
+      header.exception_num > header.count) return false;
+  if (header.encoding == BIT_SLICED){
+    if (header.width > header.capacity || header.capacity > MAX_WIDTH ||
+        header.count > MAX_EXCEPTION) return false;
+  } else if (header.capacity != 0 || header.exception_num != 0 ||
+             header.count > header.num){
+    return false;
+  }
+  Allocate(static_cast<Encoding>(header.encoding), header.num, header.width,
+           header.capacity, header.count);
+  *header_ = header;
+  const uint64_t words = GetWordNum(GetEncoding(), header.num, header.width,
+                                    header.capacity, header.count);
+  if (!reader.Read(reinterpret_cast<uint64_t*>(header_ + 1), words)){
+    Clear();
+    return false;
+  }
+  if (header.num == 0) Clear();
+  return true;
+}
+
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums>
+uint64_t BasicPrefixSumLeaf<MaxWidth, MaxNum, CacheSums>::GetAllocatedBytes() const{
+  if (header_ == &empty_header_) return sizeof(*this);
+  return sizeof(*this) + sizeof(uint64_t) *
+    (1 + GetWordNum(GetEncoding(), header_->num, header_->width, header_->capacity, header_->count));
+}
+
+template class BasicPrefixSumLeaf<64, 256>;
+template class BasicPrefixSumLeaf<32, 256>;
+template class BasicPrefixSumLeaf<64, 256, true>;
+
 } // namespace prefixsum
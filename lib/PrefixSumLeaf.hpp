@@ -20,20 +20,97 @@
 #ifndef PREFIX_SUM_PREFIX_SUM_LEAF_HPP_
 #define PREFIX_SUM_PREFIX_SUM_LEAF_HPP_
 
-#include <vector>
+#include <cstddef>
+#include <stdint.h>
+#include "Arena.hpp"
+#include "Serializer.hpp"
 
 namespace prefixsum{
 
-class PrefixSumLeaf{
+/**
+ * Leaf of the B+-tree storing up to MAX_NUM values in bit planes.
+ * A leaf is a single allocation of a header (num, width, capacity)
+ * followed by capacity * MAX_NUM / 64 words, where the shift-th bit of
+ * vs[block * 64 + i] is the i-th bit of bit_arrays[block * capacity + shift].
+ * The planes in [width, capacity) are zero, and capacity grows
+ * geometrically so that a width increment rarely reallocates.
+ * The width shrinks when Erase, Decrement or Set clears the top plane,
+ * and the slack planes are released when the capacity exceeds the
+ * grown capacity of the width, or by Compact().
+ *
+ * Build, Split and Compact may instead choose a read-optimized encoding
+ * when it is much smaller: PACKED stores num values of width bits
+ * horizontally, and SPARSE and RUN_LENGTH store count 16-bit keys
+ * (the position of a non-zero value, or the end of a run) followed by
+ * count packed values. An update converts the leaf back to BIT_SLICED.
+ *
+ * In BIT_SLICED, an outlier does not widen the planes: the planes keep
+ * its low width bits, and the rest is stored as an exception (a 16-bit
+ * position and a 64-bit excess) after the planes, so that
+ * vs[i] = planes[i] + excess[i]. Up to MAX_EXCEPTION exceptions are
+ * kept sorted by position in count allocated slots.
+ *
+ * If CacheSums is true, BLOCK_NUM words between the header and the
+ * data (reserved in every encoding) keep the inclusive cumulative sums
+ * of the blocks of BIT_SLICED in the cache line of the header, so that
+ * GetPrefixSum and Find skip the preceding blocks with one lookup.
+ * Increment, Decrement and Set add their delta to the following sums,
+ * Insert and Erase of a value also account for the values shifted
+ * across blocks, and the other updates recompute the sums from the
+ * first changed block.
+ * Values are at most MaxWidth bits, and MaxNum is a multiple of 64.
+ */
+template <uint64_t MaxWidth, uint64_t MaxNum, bool CacheSums = false>
+class BasicPrefixSumLeaf{
 public:
-  PrefixSumLeaf();
-  ~PrefixSumLeaf();
+  static const uint64_t MAX_WIDTH = MaxWidth; // 1...64
+  static const uint64_t MAX_NUM = MaxNum;     // 128, 256, 512, 1024...
+  static const uint64_t BLOCK_NUM = MaxNum / 64;
+  static const uint64_t MAX_EXCEPTION = 16;
+  static const uint64_t PREFETCH_BYTES = 512;
+
+  // a leaf points only to its allocation, empty_header_ and the
+  // allocator, so that Pool may move it by realloc
+  typedef BasicPrefixSumLeaf Relocatable;
+
+  enum Encoding{
+    BIT_SLICED = 0,
+    PACKED     = 1,
+    SPARSE     = 2,
+    RUN_LENGTH = 3
+  };
+
+  // the leaf is allocated from allocator (or new[] if NULL)
+  explicit BasicPrefixSumLeaf(Allocator* allocator = NULL);
+  ~BasicPrefixSumLeaf();
   void Clear();
   void Init(uint64_t num);
+
+  // set vs <- vals[0...num-1] (num <= MAX_NUM) in the smallest encoding
+  void Build(const uint64_t* vals, uint64_t num);
+
+  // set vs <- vals[0...num-1] in the given encoding
+  void Build(const uint64_t* vals, uint64_t num, Encoding encoding);
+
+  // set the leaf to a copy of the words of ps
+  void Assign(const BasicPrefixSumLeaf& ps);
+
+  // vals[0...num-1] <- vs
+  void Decode(uint64_t* vals) const;
   void Insert(uint64_t ind, uint64_t val);
+
+  // remove vs[ind] and return its value
+  uint64_t Erase(uint64_t ind);
+
+  // remove vs[beg...end-1]
+  void EraseRange(uint64_t beg, uint64_t end);
   void Increment(uint64_t ind, uint64_t val);
   void Decrement(uint64_t ind, uint64_t val);
   void Set(uint64_t ind, uint64_t val);
+
+  // vs[beg...end-1] <- vs[beg...end-1] + val, by increments for a short
+  // range and by rebuilding the leaf otherwise
+  void AddRange(uint64_t beg, uint64_t end, uint64_t val);
   uint64_t Get(uint64_t ind) const;
   uint64_t GetPrefixSum(uint64_t ind) const;
 
@@ -41,33 +118,209 @@ public:
   uint64_t Find(uint64_t val) const;
 
   uint16_t Num() const{
-    return num_;
+    return header_->num;
   }
 
   uint8_t Width() const{
-    return width_;
+    return header_->width;
+  }
+
+  Encoding GetEncoding() const{
+    return static_cast<Encoding>(header_->encoding);
+  }
+
+  // return the number of allocated bit planes
+  uint8_t Capacity() const{
+    return header_->capacity;
   }
 
   uint64_t Sum() const {
-    return GetPrefixSum(num_);
+    return GetPrefixSum(header_->num);
+  }
+
+  // prefetch the header and the first planes for a following query
+  void Prefetch() const{
+    const char* p = reinterpret_cast<const char*>(header_);
+    for (uint64_t offset = 0; offset < PREFETCH_BYTES; offset += 64){
+      __builtin_prefetch(p + offset);
+    }
   }
 
   bool IsFull() const;
+  bool IsUnderfull() const;
+  bool CanMerge(const BasicPrefixSumLeaf& ps) const;
   void Print() const;
-  void Split(PrefixSumLeaf& ps);
+  void Split(BasicPrefixSumLeaf& ps);
+
+  // append all values of ps to the end and clear ps
+  void Merge(BasicPrefixSumLeaf& ps);
+
+  // drop the empty high planes and the slack planes,
+  // and return the number of freed bytes (never growing the leaf)
+  uint64_t Compact();
   uint64_t GetAllocatedBytes() const;
 
+  // write the header and the data words verbatim
+  void Save(Writer& writer) const;
+
+  // read a leaf written by Save, and return false (and clear the leaf)
+  // if the stream ends or the header is invalid
+  bool Load(Reader& reader);
+
+  /**
+   * Use the words written by Save at image as the leaf without copying
+   * them, e.g. in a mapped file. Only the const methods may be called
+   * until Detach(), which must be called before the leaf is destroyed.
+   */
+  void Attach(const uint64_t* image){
+    Clear();
+    header_ = reinterpret_cast<Header*>(const_cast<uint64_t*>(image));
+  }
+
+  void Detach(){
+    header_ = &empty_header_;
+  }
+
+  // return the words of the leaf, which another leaf may Attach
+  const uint64_t* Image() const{
+    return reinterpret_cast<const uint64_t*>(header_);
+  }
+
 private:
+  BasicPrefixSumLeaf(const BasicPrefixSumLeaf&);
+  BasicPrefixSumLeaf& operator=(const BasicPrefixSumLeaf&);
+
+  // fails to compile if the parameters do not fit in the header
+  typedef char CheckParams[(MaxWidth >= 1 && MaxWidth <= 64 &&
+                            MaxNum >= 64 && MaxNum % 64 == 0 && MaxNum <= 0x8000) ? 1 : -1];
+
+  struct Header{
+    uint16_t num;
+    uint8_t width;
+    uint8_t capacity;   // bit planes of BIT_SLICED
+    uint8_t encoding;
+    uint8_t exception_num;
+    uint16_t count;     // entries of SPARSE and RUN_LENGTH,
+                        // or allocated exceptions of BIT_SLICED
+  };
+
+  // an outlier of EXCEPTION_BITS more bits than width becomes an exception,
+  // both by the updates and by Build
+  static const uint64_t EXCEPTION_BITS = 8;
+
+  // the longest range of AddRange applied by increments
+  static const uint64_t ADD_RANGE_INCREMENTS = 32;
+
+  // words of the cached block sums before the data
+  static const uint64_t SUM_WORDS = CacheSums ? BLOCK_NUM : 0;
+
+  uint64_t* BlockSums(){
+    return reinterpret_cast<uint64_t*>(header_ + 1);
+  }
+
+  const uint64_t* BlockSums() const{
+    return reinterpret_cast<const uint64_t*>(header_ + 1);
+  }
+
+  uint64_t* BitArrays(){
+    return BlockSums() + SUM_WORDS;
+  }
+
+  const uint64_t* BitArrays() const{
+    return BlockSums() + SUM_WORDS;
+  }
+
+  const uint16_t* Keys() const{
+    return reinterpret_cast<const uint16_t*>(BitArrays());
+  }
+
+  const uint64_t* EntryValues() const{
+    return BitArrays() + (header_->count + 3) / 4;
+  }
+
+  uint16_t* ExceptionKeys(){
+    return reinterpret_cast<uint16_t*>(BitArrays() + header_->capacity * BLOCK_NUM);
+  }
+
+  const uint16_t* ExceptionKeys() const{
+    return reinterpret_cast<const uint16_t*>(BitArrays() + header_->capacity * BLOCK_NUM);
+  }
+
+  uint64_t* ExceptionValues(){
+    return BitArrays() + header_->capacity * BLOCK_NUM + (header_->count + 3) / 4;
+  }
+
+  const uint64_t* ExceptionValues() const{
+    return BitArrays() + header_->capacity * BLOCK_NUM + (header_->count + 3) / 4;
+  }
+
+  static Encoding ChooseEncoding(const uint64_t* vals, uint64_t num);
+  static uint64_t ChooseBaseWidth(const uint64_t* vals, uint64_t num, uint64_t& exception_num);
+  static uint64_t GetLowMask(uint64_t width);
+  bool UseException(uint64_t blen) const;
+  uint64_t FindException(uint64_t pos) const;
+  void AddException(uint64_t pos, uint64_t excess);
+  void RemoveException(uint64_t j);
+  void MoveExceptions(uint64_t beg, uint64_t end, uint64_t len, bool insert);
+  uint64_t GetExceptionSum(uint64_t beg, uint64_t end) const;
+
+  // sums[i] <- the sum of the exceptions in [beg, beg + len * (i+1)) for i < 8
+  void GetExceptionSums(uint64_t beg, uint64_t len, uint64_t* sums) const;
+  static uint64_t GetWordNum(Encoding encoding, uint64_t num, uint64_t width,
+                             uint64_t capacity, uint64_t count);
+  Header* NewHeader(uint64_t words);
+  void Allocate(Encoding encoding, uint64_t num, uint64_t width,
+                uint64_t capacity, uint64_t count);
+  void ToBitSliced();
+  void BuildEntries(const uint64_t* vals, uint64_t num, Encoding encoding);
+  uint64_t GetPrefixSumEntries(uint64_t ind) const;
+  uint64_t FindEntries(uint64_t val) const;
+
+  static uint64_t GetGrownCapacity(uint64_t width);
+  void Reallocate(uint64_t capacity, uint64_t exception_capacity);
+  void FreeHeader();
   void Rewidth(uint64_t width);
+  void ShrinkWidth();
+  void ShrinkWidthIfCleared(uint64_t block);
   uint64_t GetBlockSum(uint64_t block, uint64_t offset) const;
-  uint64_t GetWidth() const;
-  void IncrementInternal(uint64_t ind, uint64_t val, bool plus);
-  static uint64_t GetBinaryLen(uint64_t x);
-  std::vector<uint64_t> bit_arrays_;
-  uint16_t num_;
-  uint8_t width_;
+  void AddBlockSums(uint64_t block, uint64_t delta);
+  void UpdateBlockSums(uint64_t block);
+
+  // header of empty leaves, which is never modified
+  static Header empty_header_;
+
+  Header* header_;
+  Allocator* allocator_;
+};
+
+/**
+ * Leaf attached to the words of another leaf or of an image for the
+ * queries of a scope, and detached at its end. A reader of a leaf which
+ * a writer may replace reads the words of one allocation this way.
+ */
+template <class Leaf>
+class LeafView{
+public:
+  explicit LeafView(const uint64_t* image){
+    leaf_.Attach(image);
+  }
+
+  ~LeafView(){
+    leaf_.Detach();
+  }
+
+  const Leaf& Get() const{
+    return leaf_;
+  }
+
+private:
+  LeafView(const LeafView&);
+  LeafView& operator=(const LeafView&);
+
+  Leaf leaf_;
 };
 
+typedef BasicPrefixSumLeaf<64, 256> PrefixSumLeaf;
 
 } // namespace prefixsum
 
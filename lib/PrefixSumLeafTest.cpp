@@ -18,6 +18,7 @@
  */
 
 #include <iostream>
+#include <sstream>
 #include <gtest/gtest.h>
 #include "PrefixSumLeaf.hpp"
 
@@ -244,3 +245,517 @@ TEST(PrefixSumLeaf, random){
     ASSERT_LT(v, cums[ind+1]) << " ind=" << ind;
   }
 }
+
+TEST(PrefixSumLeaf, find_zeros){
+  PrefixSumLeaf ps;
+  uint64_t vals[] = {5, 0, 0, 7, 0};
+  for (uint64_t i = 0; i < 5; ++i){
+    ps.Insert(i, vals[i]);
+  }
+  ASSERT_EQ(0, ps.Find(0));
+  ASSERT_EQ(0, ps.Find(4));
+  ASSERT_EQ(3, ps.Find(5));
+  ASSERT_EQ(3, ps.Find(11));
+  ASSERT_EQ(5, ps.Find(12));
+}
+
+TEST(PrefixSumLeaf, find_full){
+  PrefixSumLeaf ps;
+  vector<uint64_t> cums(1, 0);
+  for (uint64_t i = 0; i < 256; ++i){
+    uint64_t val = rand() % 3;
+    ps.Insert(i, val);
+    cums.push_back(cums.back() + val);
+  }
+  for (uint64_t v = 0; v <= cums.back(); ++v){
+    uint64_t ind = ps.Find(v);
+    ASSERT_LE(cums[ind], v) << " ind=" << ind;
+    ASSERT_TRUE(ind == 256 || v < cums[ind+1]) << " ind=" << ind;
+  }
+  ASSERT_EQ(256, ps.Find(cums.back()));
+}
+
+TEST(PrefixSumLeaf, erase){
+  PrefixSumLeaf ps;
+  vector<uint64_t> vals;
+  for (uint64_t i = 0; i < 256; ++i){
+    uint64_t val = rand() % 1000;
+    ps.Insert(i, val);
+    vals.push_back(val);
+  }
+  while (!vals.empty()){
+    uint64_t pos = rand() % vals.size();
+    ASSERT_EQ(vals[pos], ps.Erase(pos));
+    vals.erase(vals.begin() + pos);
+    ASSERT_EQ(vals.size(), ps.Num());
+    uint64_t cum = 0;
+    for (uint64_t i = 0; i < vals.size(); ++i){
+      ASSERT_EQ(vals[i], ps.Get(i)) << " i=" << i;
+      ASSERT_EQ(cum, ps.GetPrefixSum(i)) << " i=" << i;
+      cum += vals[i];
+    }
+    ASSERT_EQ(cum, ps.Sum());
+  }
+  ASSERT_EQ(0, ps.Width());
+}
+
+TEST(PrefixSumLeaf, erase_range){
+  for (uint64_t iter = 0; iter < 100; ++iter){
+    PrefixSumLeaf ps;
+    vector<uint64_t> vals;
+    for (uint64_t i = 0; i < 256; ++i){
+      uint64_t val = rand() % 100;
+      ps.Insert(i, val);
+      vals.push_back(val);
+    }
+    uint64_t beg = rand() % 257;
+    uint64_t end = beg + rand() % (257 - beg);
+    ps.EraseRange(beg, end);
+    vals.erase(vals.begin() + beg, vals.begin() + end);
+    ASSERT_EQ(vals.size(), ps.Num());
+    for (uint64_t i = 0; i < vals.size(); ++i){
+      ASSERT_EQ(vals[i], ps.Get(i)) << " i=" << i << " beg=" << beg << " end=" << end;
+    }
+  }
+}
+
+TEST(PrefixSumLeaf, erase_shrink_width){
+  PrefixSumLeaf ps;
+  ps.Insert(0, 3);
+  ps.Insert(1, 1LLU << 40);
+  ps.Insert(2, 5);
+  ASSERT_EQ(41, ps.Width());
+  ASSERT_EQ(1LLU << 40, ps.Erase(1));
+  ASSERT_EQ(3, ps.Width());
+  ASSERT_EQ(3, ps.Get(0));
+  ASSERT_EQ(5, ps.Get(1));
+}
+
+TEST(PrefixSumLeaf, decrement_shrink_width){
+  // too few values to make exceptions
+  PrefixSumLeaf ps;
+  for (uint64_t i = 0; i < 60; ++i){
+    ps.Insert(i, i % 8);
+  }
+  ASSERT_EQ(3, ps.Width());
+  ps.Increment(10, 1LLU << 40);
+  ps.Set(50, 1LLU << 30);
+  ASSERT_EQ(41, ps.Width());
+  uint64_t bytes = ps.GetAllocatedBytes();
+  ps.Decrement(10, 1LLU << 40);
+  ASSERT_EQ(31, ps.Width());
+  ps.Set(50, 50 % 8);
+  ASSERT_EQ(3, ps.Width());
+  ASSERT_LT(ps.GetAllocatedBytes(), bytes);
+  for (uint64_t i = 0; i < 60; ++i){
+    ASSERT_EQ(i % 8, ps.Get(i)) << " i=" << i;
+  }
+}
+
+TEST(PrefixSumLeaf, compact){
+  PrefixSumLeaf ps;
+  for (uint64_t i = 0; i < 200; ++i){
+    ps.Insert(i, i % 1000);
+  }
+  ASSERT_EQ(8, ps.Width());
+  ASSERT_LT(ps.Width(), ps.Capacity());
+  ASSERT_LT(0, ps.Compact());
+  ASSERT_EQ(ps.Width(), ps.Capacity());
+  ASSERT_EQ(0, ps.Compact());
+  for (uint64_t i = 0; i < 200; ++i){
+    ASSERT_EQ(i % 1000, ps.Get(i)) << " i=" << i;
+  }
+}
+
+TEST(PrefixSumLeaf, merge){
+  for (uint64_t iter = 0; iter < 100; ++iter){
+    PrefixSumLeaf ps1;
+    PrefixSumLeaf ps2;
+    vector<uint64_t> vals;
+    uint64_t n1 = rand() % 257;
+    uint64_t n2 = rand() % (257 - n1);
+    for (uint64_t i = 0; i < n1; ++i){
+      uint64_t val = rand() % 10;
+      ps1.Insert(i, val);
+      vals.push_back(val);
+    }
+    for (uint64_t i = 0; i < n2; ++i){
+      uint64_t val = rand() % 10000;
+      ps2.Insert(i, val);
+      vals.push_back(val);
+    }
+    ASSERT_TRUE(ps1.CanMerge(ps2));
+    ps1.Merge(ps2);
+    ASSERT_EQ(0, ps2.Num());
+    ASSERT_EQ(vals.size(), ps1.Num());
+    for (uint64_t i = 0; i < vals.size(); ++i){
+      ASSERT_EQ(vals[i], ps1.Get(i)) << " i=" << i << " n1=" << n1;
+    }
+  }
+}
+
+TEST(PrefixSumLeaf, split){
+  PrefixSumLeaf ps1;
+  vector<uint64_t> vals;
+  for (uint64_t i = 0; i < 256; ++i){
+    uint64_t val = (i % 64 == 0) ? 100000 : rand() % 4;
+    ps1.Insert(i, val);
+    vals.push_back(val);
+  }
+  ASSERT_TRUE(ps1.IsFull());
+  PrefixSumLeaf ps2;
+  ps1.Split(ps2);
+  ASSERT_EQ(128, ps1.Num());
+  ASSERT_EQ(128, ps2.Num());
+  for (uint64_t i = 0; i < 128; ++i){
+    ASSERT_EQ(vals[i], ps1.Get(i)) << " i=" << i;
+    ASSERT_EQ(vals[i+128], ps2.Get(i)) << " i=" << i;
+  }
+}
+
+TEST(PrefixSumLeaf, build){
+  for (uint64_t num = 1; num <= 256; ++num){
+    vector<uint64_t> vals(num);
+    for (uint64_t i = 0; i < num; ++i){
+      vals[i] = rand() % (1LLU << (num % 64));
+    }
+    PrefixSumLeaf ps;
+    ps.Build(&vals[0], num);
+    ASSERT_EQ(num, ps.Num());
+    uint64_t cum = 0;
+    for (uint64_t i = 0; i < num; ++i){
+      ASSERT_EQ(vals[i], ps.Get(i)) << " i=" << i;
+      ASSERT_EQ(cum, ps.GetPrefixSum(i)) << " i=" << i;
+      cum += vals[i];
+    }
+    ASSERT_EQ(cum, ps.Sum());
+  }
+}
+
+namespace {
+
+vector<uint64_t> MakeValues(const string& dist, uint64_t num){
+  vector<uint64_t> vals(num);
+  for (uint64_t i = 0; i < num; ++i){
+    if (dist == "dense"){
+      vals[i] = rand() % 100;
+    } else if (dist == "sparse"){
+      vals[i] = (rand() % 50 == 0) ? rand() % (1 << 20) + 1 : 0;
+    } else {
+      vals[i] = (i > 0 && rand() % 64 > 0) ? vals[i-1] : rand() % 1000;
+    }
+  }
+  return vals;
+}
+
+template <class Leaf>
+void CheckLeaf(const Leaf& ps, const vector<uint64_t>& vals){
+  ASSERT_EQ(vals.size(), ps.Num());
+  vector<uint64_t> decoded(vals.size());
+  ps.Decode(&decoded[0]);
+  uint64_t cum = 0;
+  for (uint64_t i = 0; i < vals.size(); ++i){
+    ASSERT_EQ(vals[i], decoded[i]) << " i=" << i;
+    ASSERT_EQ(vals[i], ps.Get(i)) << " i=" << i;
+    ASSERT_EQ(cum, ps.GetPrefixSum(i)) << " i=" << i;
+    if (vals[i] > 0){
+      ASSERT_EQ(i, ps.Find(cum)) << " i=" << i;
+      ASSERT_EQ(i, ps.Find(cum + vals[i] - 1)) << " i=" << i;
+    }
+    cum += vals[i];
+  }
+  ASSERT_EQ(cum, ps.Sum());
+  ASSERT_EQ(vals.size(), ps.Find(cum));
+}
+
+}
+
+TEST(PrefixSumLeaf, encodings){
+  const char* dists[] = {"dense", "sparse", "runs"};
+  for (uint64_t d = 0; d < 3; ++d){
+    for (uint64_t num = 1; num <= PrefixSumLeaf::MAX_NUM; num += 37){
+      vector<uint64_t> vals = MakeValues(dists[d], num);
+      for (uint64_t e = 0; e < 4; ++e){
+        PrefixSumLeaf ps;
+        ps.Build(&vals[0], num, static_cast<PrefixSumLeaf::Encoding>(e));
+        ASSERT_EQ(e, ps.GetEncoding());
+        CheckLeaf(ps, vals);
+
+        // an update converts the leaf to BIT_SLICED
+        uint64_t pos = rand() % num;
+        ps.Increment(pos, 3);
+        vals[pos] += 3;
+        ASSERT_EQ(PrefixSumLeaf::BIT_SLICED, ps.GetEncoding());
+        CheckLeaf(ps, vals);
+        ps.Decrement(pos, 3);
+        vals[pos] -= 3;
+      }
+    }
+  }
+}
+
+TEST(PrefixSumLeaf, save_load){
+  const char* dists[] = {"dense", "sparse", "runs"};
+  for (uint64_t d = 0; d < 3; ++d){
+    vector<uint64_t> vals = MakeValues(dists[d], PrefixSumLeaf::MAX_NUM - 5);
+    vals[7] = 1LLU << 50;
+    for (uint64_t e = 0; e < 4; ++e){
+      PrefixSumLeaf ps;
+      ps.Build(&vals[0], vals.size(), static_cast<PrefixSumLeaf::Encoding>(e));
+      ostringstream os;
+      Writer writer(os);
+      ps.Save(writer);
+      istringstream is(os.str());
+      Reader reader(is);
+      PrefixSumLeaf loaded;
+      ASSERT_TRUE(loaded.Load(reader));
+      ASSERT_EQ(writer.Checksum(), reader.Checksum());
+      ASSERT_EQ(ps.GetEncoding(), loaded.GetEncoding());
+      ASSERT_EQ(ps.GetAllocatedBytes(), loaded.GetAllocatedBytes());
+      CheckLeaf(loaded, vals);
+
+      // a truncated leaf is not loaded
+      istringstream truncated(os.str().substr(0, os.str().size() - 8));
+      Reader truncated_reader(truncated);
+      ASSERT_FALSE(loaded.Load(truncated_reader));
+      ASSERT_EQ(0U, loaded.Num());
+    }
+  }
+}
+
+TEST(PrefixSumLeaf, choose_encoding){
+  vector<uint64_t> vals = MakeValues("dense", PrefixSumLeaf::MAX_NUM);
+  PrefixSumLeaf ps;
+  ps.Build(&vals[0], vals.size());
+  ASSERT_EQ(PrefixSumLeaf::BIT_SLICED, ps.GetEncoding());
+  ps.Build(&vals[0], 20);
+  ASSERT_EQ(PrefixSumLeaf::PACKED, ps.GetEncoding());
+
+  vals.assign(PrefixSumLeaf::MAX_NUM, 0);
+  for (uint64_t i = 0; i < 30; ++i){
+    vals[i * 7] = 1LLU << 40;
+  }
+  ps.Build(&vals[0], vals.size());
+  ASSERT_EQ(PrefixSumLeaf::SPARSE, ps.GetEncoding());
+  CheckLeaf(ps, vals);
+
+  for (uint64_t i = 0; i < vals.size(); ++i){
+    vals[i] = 1000 + i / 100;
+  }
+  ps.Build(&vals[0], vals.size());
+  ASSERT_EQ(PrefixSumLeaf::RUN_LENGTH, ps.GetEncoding());
+  CheckLeaf(ps, vals);
+}
+
+TEST(PrefixSumLeaf, split_merge_encodings){
+  vector<uint64_t> vals(PrefixSumLeaf::MAX_NUM);
+  for (uint64_t i = 0; i < vals.size(); ++i){
+    vals[i] = (i < vals.size() / 2) ? rand() % 100 : 0;
+  }
+  for (uint64_t i = vals.size() / 2; i < vals.size(); i += 4){
+    vals[i] = 1LLU << 20;
+  }
+  PrefixSumLeaf ps;
+  ps.Build(&vals[0], vals.size());
+  PrefixSumLeaf ps2;
+  ps.Split(ps2);
+  ASSERT_EQ(PrefixSumLeaf::BIT_SLICED, ps.GetEncoding());
+  ASSERT_EQ(PrefixSumLeaf::SPARSE, ps2.GetEncoding());
+  CheckLeaf(ps, vector<uint64_t>(vals.begin(), vals.begin() + vals.size() / 2));
+  CheckLeaf(ps2, vector<uint64_t>(vals.begin() + vals.size() / 2, vals.end()));
+  ps.Merge(ps2);
+  ASSERT_EQ(0, ps2.Num());
+  CheckLeaf(ps, vals);
+}
+
+TEST(PrefixSumLeaf, exceptions){
+  vector<uint64_t> vals(PrefixSumLeaf::MAX_NUM - 16);
+  for (uint64_t i = 0; i < vals.size(); ++i){
+    vals[i] = rand() % 16;
+  }
+  vals[3] = 1LLU << 40;
+  vals[100] = (1LLU << 50) + 5;
+  PrefixSumLeaf ps;
+  ps.Build(&vals[0], vals.size());
+  ASSERT_EQ(PrefixSumLeaf::BIT_SLICED, ps.GetEncoding());
+  ASSERT_EQ(4, ps.Width());
+  CheckLeaf(ps, vals);
+
+  // outliers from updates do not widen the planes
+  ps.Insert(10, 1LLU << 30);
+  vals.insert(vals.begin() + 10, 1LLU << 30);
+  ps.Increment(200, 1LLU << 35);
+  vals[200] += 1LLU << 35;
+  ps.Set(50, 1LLU << 45);
+  vals[50] = 1LLU << 45;
+  ASSERT_EQ(4, ps.Width());
+  CheckLeaf(ps, vals);
+
+  ps.Erase(3);
+  vals.erase(vals.begin() + 3);
+  ps.EraseRange(40, 60);
+  vals.erase(vals.begin() + 40, vals.begin() + 60);
+  ps.Decrement(80, 1LLU << 50);
+  vals[80] -= 1LLU << 50;
+  ps.Set(8, 3);
+  vals[8] = 3;
+  ASSERT_EQ(4, ps.Width());
+  CheckLeaf(ps, vals);
+
+  // exceptions are bounded by MAX_EXCEPTION, then the planes are widened
+  for (uint64_t i = 0; i < 2 * PrefixSumLeaf::MAX_EXCEPTION; ++i){
+    ps.Set(i * 5, 1LLU << 20);
+    vals[i * 5] = 1LLU << 20;
+  }
+  ASSERT_EQ(21, ps.Width());
+  CheckLeaf(ps, vals);
+
+  ps.Compact();
+  CheckLeaf(ps, vals);
+}
+
+TEST(PrefixSumLeaf, compact_exceptions){
+  // exceptions made by Insert are kept by Compact
+  PrefixSumLeaf ps;
+  vector<uint64_t> vals;
+  for (uint64_t i = 0; i < 240; ++i){
+    ps.Insert(i, i % 4);
+    vals.push_back(i % 4);
+  }
+  for (uint64_t i = 0; i < 16; ++i){
+    ps.Insert(i * 15, 1000);
+    vals.insert(vals.begin() + i * 15, 1000);
+  }
+  ASSERT_EQ(2, ps.Width());
+  uint64_t bytes = ps.GetAllocatedBytes();
+  ASSERT_EQ(bytes - ps.GetAllocatedBytes(), ps.Compact());
+  ASSERT_LE(ps.GetAllocatedBytes(), bytes);
+  ASSERT_EQ(2, ps.Width());
+  CheckLeaf(ps, vals);
+
+  // Compact never grows the leaf after any updates
+  for (uint64_t i = 0; i < 2000; ++i){
+    const uint64_t pos = rand() % vals.size();
+    const uint64_t val = (rand() % 10 == 0) ? 1LLU << (rand() % 20) : rand() % 8;
+    if (rand() % 2 == 0 && vals.size() < PrefixSumLeaf::MAX_NUM){
+      ps.Insert(pos, val);
+      vals.insert(vals.begin() + pos, val);
+    } else if (rand() % 2 == 0 && vals.size() > 64){
+      ps.Erase(pos);
+      vals.erase(vals.begin() + pos);
+    } else {
+      ps.Set(pos, val);
+      vals[pos] = val;
+    }
+    if (i % 50 == 0){
+      bytes = ps.GetAllocatedBytes();
+      const uint64_t freed = ps.Compact();
+      ASSERT_LE(ps.GetAllocatedBytes(), bytes) << " i=" << i;
+      ASSERT_EQ(bytes - ps.GetAllocatedBytes(), freed) << " i=" << i;
+      CheckLeaf(ps, vals);
+    }
+  }
+}
+
+TEST(PrefixSumLeaf, find_widths){
+  for (uint64_t width = 1; width <= 56; ++width){
+    vector<uint64_t> vals(PrefixSumLeaf::MAX_NUM - 50);
+    for (uint64_t i = 0; i < vals.size(); ++i){
+      vals[i] = ((((uint64_t)rand() << 32) ^ rand()) & ((1LLU << width) - 1)) * (rand() % 2);
+    }
+    PrefixSumLeaf ps;
+    ps.Build(&vals[0], vals.size(), PrefixSumLeaf::BIT_SLICED);
+    CheckLeaf(ps, vals);
+
+    if (width + 8 > 56) continue;
+    // outliers in the middle and at the ends of blocks and bytes
+    const uint64_t inds[] = {0, 7, 8, 63, 64, 100, 191, 205};
+    for (uint64_t i = 0; i < 8; ++i){
+      ps.Increment(inds[i], 1LLU << (width + 8));
+      vals[inds[i]] += 1LLU << (width + 8);
+    }
+    ASSERT_LE(ps.Width(), width);
+    CheckLeaf(ps, vals);
+  }
+}
+
+TEST(PrefixSumLeaf, cached_sums){
+  typedef BasicPrefixSumLeaf<64, 256, true> CachedLeaf;
+  vector<uint64_t> vals = MakeValues("dense", 200);
+  CachedLeaf ps;
+  ps.Build(&vals[0], vals.size());
+  CheckLeaf(ps, vals);
+  PrefixSumLeaf uncached;
+  uncached.Build(&vals[0], vals.size());
+  ASSERT_EQ(uncached.GetAllocatedBytes() + sizeof(uint64_t) * CachedLeaf::BLOCK_NUM,
+            ps.GetAllocatedBytes());
+
+  for (uint64_t i = 0; i < 2000; ++i){
+    const uint64_t pos = rand() % vals.size();
+    const uint64_t val = (rand() % 50 == 0) ? 1LLU << (rand() % 40) : rand() % 100;
+    switch (rand() % 5){
+    case 0:
+      if (vals.size() < CachedLeaf::MAX_NUM){
+        ps.Insert(pos, val);
+        vals.insert(vals.begin() + pos, val);
+      }
+      break;
+    case 1:
+      if (vals.size() > 64){
+        ps.Erase(pos);
+        vals.erase(vals.begin() + pos);
+      }
+      break;
+    case 2:
+      ps.Increment(pos, val);
+      vals[pos] += val;
+      break;
+    case 3:
+      ps.Decrement(pos, min(val, vals[pos]));
+      vals[pos] -= min(val, vals[pos]);
+      break;
+    default:
+      ps.Set(pos, val);
+      vals[pos] = val;
+    }
+    if (i % 100 == 0) CheckLeaf(ps, vals);
+  }
+  CheckLeaf(ps, vals);
+
+  CachedLeaf ps2;
+  ps.Split(ps2);
+  CheckLeaf(ps, vector<uint64_t>(vals.begin(), vals.begin() + vals.size() / 2));
+  CheckLeaf(ps2, vector<uint64_t>(vals.begin() + vals.size() / 2, vals.end()));
+  ps.Merge(ps2);
+  CheckLeaf(ps, vals);
+  ps.EraseRange(10, 100);
+  vals.erase(vals.begin() + 10, vals.begin() + 100);
+  CheckLeaf(ps, vals);
+  ps.Compact();
+  CheckLeaf(ps, vals);
+}
+
+TEST(PrefixSumLeaf, assign){
+  const char* kinds[] = {"dense", "sparse", "runs"};
+  for (uint64_t k = 0; k < 3; ++k){
+    vector<uint64_t> vals = MakeValues(kinds[k], 200);
+    PrefixSumLeaf ps;
+    ps.Build(&vals[0], vals.size());
+    PrefixSumLeaf copy;
+    copy.Insert(0, 1);
+    copy.Assign(ps);
+    CheckLeaf(copy, vals);
+    ASSERT_EQ(ps.GetEncoding(), copy.GetEncoding());
+    ASSERT_EQ(ps.GetAllocatedBytes(), copy.GetAllocatedBytes());
+
+    // the copy is updated independently of the original
+    copy.Increment(10, 5);
+    ASSERT_EQ(vals[10] + 5, copy.Get(10));
+    CheckLeaf(ps, vals);
+  }
+  PrefixSumLeaf empty;
+  PrefixSumLeaf copy;
+  copy.Insert(0, 3);
+  copy.Assign(empty);
+  ASSERT_EQ(0U, copy.Num());
+}
@@ -17,46 +17,81 @@
  *      software without specific prior written permission.
  */
 
-#include <iostream>
+#include <cassert>
 #include "PrefixSumNode.hpp"
 
 namespace prefixsum{
 
-PrefixSumNode::PrefixSumNode() : left_size(0), left_sum(0), children(NULL), leaf(NULL){
-}
+template <class IndexT, class SumT>
+const uint64_t BasicPrefixSumNode<IndexT, SumT>::MAX_CHILD;
+template <class IndexT, class SumT>
+const uint64_t BasicPrefixSumNode<IndexT, SumT>::MIN_CHILD;
+template <class IndexT, class SumT>
+const uint32_t BasicPrefixSumNode<IndexT, SumT>::LEAF_TAG;
 
-PrefixSumNode::~PrefixSumNode(){
-  Clear();
+template <class IndexT, class SumT>
+BasicPrefixSumNode<IndexT, SumT>::BasicPrefixSumNode() : num(0){
 }
 
-void PrefixSumNode::Clear(){
-  if (children){
-    delete children[0];
-    delete children[1];
+template <class IndexT, class SumT>
+void BasicPrefixSumNode<IndexT, SumT>::InsertChild(uint64_t pos, uint32_t child, IndexT size, SumT sum){
+  assert(num < MAX_CHILD);
+  assert(pos <= num);
+  for (uint64_t i = num; i > pos; --i){
+    sizes[i]    = sizes[i-1];
+    sums[i]     = sums[i-1];
+    adds[i]     = adds[i-1];
+    children[i] = children[i-1];
   }
-  delete children;
-  delete leaf;
-  children = NULL;
-  leaf = NULL;
-  left_size = 0;
-  left_sum = 0;
+  sizes[pos]    = size;
+  sums[pos]     = sum;
+  adds[pos]     = 0;
+  children[pos] = child;
+  ++num;
 }
 
+template <class IndexT, class SumT>
+void BasicPrefixSumNode<IndexT, SumT>::RemoveChild(uint64_t pos){
+  assert(pos < num);
+  for (uint64_t i = pos; i + 1 < num; ++i){
+    sizes[i]    = sizes[i+1];
+    sums[i]     = sums[i+1];
+    adds[i]     = adds[i+1];
+    children[i] = children[i+1];
+  }
+  --num;
+}
 
+template <class IndexT, class SumT>
+void BasicPrefixSumNode<IndexT, SumT>::Split(BasicPrefixSumNode& node){
+  assert(IsFull());
+  assert(node.num == 0);
+  const uint64_t half = num / 2;
+  for (uint64_t i = half; i < num; ++i){
+    node.sizes[i - half]    = sizes[i];
+    node.sums[i - half]     = sums[i];
+    node.adds[i - half]     = adds[i];
+    node.children[i - half] = children[i];
+  }
+  node.num = num - half;
+  num = half;
+}
 
-uint64_t PrefixSumNode::GetAllocatedBytes() const{
-  uint64_t bytes = 0;
-  if (children){
-    bytes += children[0]->GetAllocatedBytes();
-    bytes += children[1]->GetAllocatedBytes();
-  } else {
-    bytes += leaf->GetAllocatedBytes();
+template <class IndexT, class SumT>
+void BasicPrefixSumNode<IndexT, SumT>::Merge(BasicPrefixSumNode& node){
+  assert(num + node.num <= MAX_CHILD);
+  assert(LeafChild() == node.LeafChild());
+  for (uint64_t i = 0; i < node.num; ++i){
+    sizes[num + i]    = node.sizes[i];
+    sums[num + i]     = node.sums[i];
+    adds[num + i]     = node.adds[i];
+    children[num + i] = node.children[i];
   }
-  std::cout << "node:" << sizeof(left_size) + sizeof(left_sum) + 
-    sizeof(children) + sizeof(leaf) << std::endl;
-  return sizeof(left_size) + sizeof(left_sum) + 
-    sizeof(children) + sizeof(leaf) + bytes;
+  num += node.num;
+  node.num = 0;
 }
 
-} // namespace prefixsum
+template struct BasicPrefixSumNode<uint64_t, uint64_t>;
+template struct BasicPrefixSumNode<uint32_t, uint32_t>;
 
+} // namespace prefixsum
@@ -21,28 +21,88 @@
 #define PREFIX_SUM_PREFIX_SUM_NODE_HPP_
 
 #include <stdint.h>
-#include "PrefixSumLeaf.hpp"
 
 namespace prefixsum{
 
-struct PrefixSumNode{
-  PrefixSumNode();
-  ~PrefixSumNode();
+/**
+ * Internal node of the B+-tree.
+ * A node has 1...MAX_CHILD children. All children of a node are either
+ * nodes or leaves, so that every leaf is at the same depth.
+ * A child is a 32-bit index to the node pool, or to the leaf pool
+ * if LEAF_TAG is set.
+ * sizes[i] and sums[i] are the number and the sum of values under children[i].
+ * adds[i] is a pending addition to every value under children[i], which
+ * is included in sums[i] but not yet in the sums and values below.
+ * Every node except the root has at least MIN_CHILD children.
+ * IndexT and SumT are the types of sizes[] and sums[], and narrower types
+ * make a node smaller when the number and the sum of values are bounded.
+ */
+template <class IndexT, class SumT>
+struct BasicPrefixSumNode{
+  static const uint64_t MAX_CHILD = 16;
+  static const uint64_t MIN_CHILD = MAX_CHILD / 2;
+  static const uint32_t LEAF_TAG = 0x80000000U;
+
+  BasicPrefixSumNode();
+
+  static bool IsLeaf(uint32_t child){
+    return (child & LEAF_TAG) != 0;
+  }
+
+  static uint32_t GetIndex(uint32_t child){
+    return child & ~LEAF_TAG;
+  }
+
+  bool LeafChild() const{
+    return IsLeaf(children[0]);
+  }
 
-  void Clear();
-  bool IsLeaf() const {
-    return leaf != NULL;
+  bool IsFull() const {
+    return num == MAX_CHILD;
   }
-  
-  uint64_t GetAllocatedBytes() const;
-
-  uint64_t left_size;
-  uint64_t left_sum;
-  
-  PrefixSumNode** children;
-  PrefixSumLeaf* leaf;
+
+  /**
+   * Return the child i s.t. sizes[0] + ... + sizes[i-1] <= offset and
+   * offset < sizes[0] + ... + sizes[i]  (offset <= ... for the last child).
+   * offset is reduced to the offset in the child.
+   */
+  uint64_t FindChild(IndexT& offset) const{
+    uint64_t i = 0;
+    for (; i + 1 < num && offset >= sizes[i]; ++i){
+      offset -= sizes[i];
+    }
+    return i;
+  }
+
+  /**
+   * Insert a child at the position pos with no pending addition
+   */
+  void InsertChild(uint64_t pos, uint32_t child, IndexT size, SumT sum);
+
+  /**
+   * Remove the child at the position pos
+   */
+  void RemoveChild(uint64_t pos);
+
+  /**
+   * Move the upper half of children to node (assume IsFull())
+   */
+  void Split(BasicPrefixSumNode& node);
+
+  /**
+   * Append all children of node (assume num + node.num <= MAX_CHILD)
+   */
+  void Merge(BasicPrefixSumNode& node);
+
+  IndexT sizes[MAX_CHILD];
+  SumT sums[MAX_CHILD];
+  SumT adds[MAX_CHILD];
+  uint32_t children[MAX_CHILD];
+  uint8_t num;
 };
 
+typedef BasicPrefixSumNode<uint64_t, uint64_t> PrefixSumNode;
+
 } // namespace prefixsum
 
 #endif // PREFIX_SUM_PREFIX_SUM_NODE_HPP_
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <sstream>
+#include <pthread.h>
 #include <gtest/gtest.h>
 #include "PrefixSum.hpp"
 
@@ -173,3 +176,1002 @@ TEST(PrefixSum, random){
     ASSERT_LT(v, cums[ind+1]) << " ind=" << ind;
   }
 }
+
+namespace {
+
+template <class PrefixSumT>
+void CheckAll(const PrefixSumT& ps, const vector<uint64_t>& vals){
+  ASSERT_EQ(vals.size(), ps.Num());
+  uint64_t cum = 0;
+  for (uint64_t i = 0; i < vals.size(); ++i){
+    ASSERT_EQ(vals[i], ps.Get(i)) << " i=" << i;
+    ASSERT_EQ(cum, ps.GetPrefixSum(i)) << " i=" << i;
+    if (vals[i] > 0){
+      ASSERT_EQ(i, ps.Find(cum + vals[i] - 1)) << " i=" << i;
+    }
+    cum += vals[i];
+  }
+  ASSERT_EQ(cum, ps.Sum());
+  ASSERT_EQ(cum, ps.GetPrefixSum(vals.size()));
+  ASSERT_EQ(vals.size(), ps.Find(cum));
+}
+
+}
+
+TEST(PrefixSum, sequential_insert){
+  PrefixSum ps;
+  vector<uint64_t> vals;
+  uint64_t N = 100000;
+  for (uint64_t i = 0; i < N; ++i){
+    uint64_t val = rand() % 100;
+    ps.Insert(i, val);
+    vals.push_back(val);
+  }
+  CheckAll(ps, vals);
+  // N / 128 leaves, at least 8 children per node
+  ASSERT_LE(ps.Depth(), 6);
+}
+
+TEST(PrefixSum, reverse_insert){
+  PrefixSum ps;
+  vector<uint64_t> vals;
+  uint64_t N = 100000;
+  for (uint64_t i = 0; i < N; ++i){
+    uint64_t val = rand() % 100;
+    ps.Insert(0, val);
+    vals.insert(vals.begin(), val);
+  }
+  CheckAll(ps, vals);
+  ASSERT_LE(ps.Depth(), 6);
+}
+
+TEST(PrefixSum, random_insert){
+  PrefixSum ps;
+  vector<uint64_t> vals;
+  uint64_t N = 20000;
+  for (uint64_t i = 0; i < N; ++i){
+    uint64_t pos = rand() % (i+1);
+    uint64_t val = rand() % 4;
+    ps.Insert(pos, val);
+    vals.insert(vals.begin() + pos, val);
+  }
+  CheckAll(ps, vals);
+  ASSERT_LE(ps.Depth(), 5);
+}
+
+TEST(PrefixSum, erase){
+  PrefixSum ps;
+  vector<uint64_t> vals;
+  uint64_t N = 20000;
+  for (uint64_t i = 0; i < N; ++i){
+    uint64_t val = rand() % 1000;
+    ps.Insert(i, val);
+    vals.push_back(val);
+  }
+  for (uint64_t i = 0; i < N / 2; ++i){
+    uint64_t pos = rand() % vals.size();
+    ps.Erase(pos);
+    vals.erase(vals.begin() + pos);
+  }
+  CheckAll(ps, vals);
+  while (!vals.empty()){
+    uint64_t pos = rand() % vals.size();
+    ps.Erase(pos);
+    vals.erase(vals.begin() + pos);
+  }
+  ASSERT_EQ(0, ps.Num());
+  ASSERT_EQ(0, ps.Sum());
+  ASSERT_EQ(2, ps.Depth());
+  ps.Insert(0, 3);
+  ASSERT_EQ(3, ps.Get(0));
+}
+
+TEST(PrefixSum, erase_range){
+  Arena* arena = new Arena;
+  PrefixSum ps(arena);
+  vector<uint64_t> vals;
+  uint64_t N = 100000;
+  for (uint64_t i = 0; i < N; ++i){
+    uint64_t val = rand() % 100;
+    ps.Insert(i, val);
+    vals.push_back(val);
+  }
+  uint64_t bytes = arena->GetUsedBytes();
+  while (vals.size() > 1000){
+    uint64_t beg = rand() % vals.size();
+    uint64_t end = beg + rand() % min<uint64_t>(vals.size() - beg, 5000) + 1;
+    ps.EraseRange(beg, end);
+    vals.erase(vals.begin() + beg, vals.begin() + end);
+  }
+  CheckAll(ps, vals);
+  ASSERT_LE(ps.Depth(), 4);
+  ASSERT_LT(arena->GetUsedBytes(), bytes / 10);
+  ps.EraseRange(0, vals.size());
+  ASSERT_EQ(0, ps.Num());
+  ASSERT_EQ(2, ps.Depth());
+}
+
+TEST(PrefixSum, insert_erase){
+  PrefixSum ps;
+  vector<uint64_t> vals;
+  for (uint64_t i = 0; i < 100000; ++i){
+    if (vals.empty() || rand() % 3 > 0){
+      uint64_t pos = rand() % (vals.size() + 1);
+      uint64_t val = rand() % 1000;
+      ps.Insert(pos, val);
+      vals.insert(vals.begin() + pos, val);
+    } else {
+      uint64_t pos = rand() % vals.size();
+      ps.Erase(pos);
+      vals.erase(vals.begin() + pos);
+    }
+  }
+  CheckAll(ps, vals);
+}
+
+TEST(PrefixSum, build){
+  uint64_t Ns[] = {0, 1, 255, 256, 257, 4096, 4097, 100000};
+  for (uint64_t k = 0; k < sizeof(Ns) / sizeof(Ns[0]); ++k){
+    vector<uint64_t> vals(Ns[k]);
+    for (uint64_t i = 0; i < vals.size(); ++i){
+      vals[i] = (i % 1000 == 0) ? rand() : rand() % 100;
+    }
+    PrefixSum ps(vals.begin(), vals.end());
+    CheckAll(ps, vals);
+    ASSERT_LE(ps.Depth(), 4);
+  }
+}
+
+TEST(PrefixSum, build_update){
+  vector<uint64_t> vals(50000);
+  for (uint64_t i = 0; i < vals.size(); ++i){
+    vals[i] = rand() % 100;
+  }
+  PrefixSum ps;
+  ps.Insert(0, 12345);
+  ps.Build(vals.begin(), vals.end());
+  CheckAll(ps, vals);
+  for (uint64_t i = 0; i < 20000; ++i){
+    if (rand() % 2){
+      uint64_t pos = rand() % (vals.size() + 1);
+      uint64_t val = rand() % 1000;
+      ps.Insert(pos, val);
+      vals.insert(vals.begin() + pos, val);
+    } else {
+      uint64_t pos = rand() % vals.size();
+      ps.Erase(pos);
+      vals.erase(vals.begin() + pos);
+    }
+  }
+  CheckAll(ps, vals);
+}
+
+TEST(PrefixSum, clear_reuse){
+  Arena* arena = new Arena;
+  PrefixSum ps(arena);
+  for (uint64_t i = 0; i < 100000; ++i){
+    ps.Insert(i, rand() % 100);
+  }
+  uint64_t bytes = ps.GetAllocatedBytes();
+  ps.Clear();
+  ASSERT_EQ(0, ps.Num());
+  ASSERT_LT(arena->GetAllocatedBytes(), 4 * Arena::MIN_SLAB_BYTES);
+  for (uint64_t i = 0; i < 100000; ++i){
+    ps.Insert(0, rand() % 100);
+  }
+  ASSERT_LE(ps.GetAllocatedBytes(), bytes * 2);
+  ps.EraseRange(0, ps.Num() / 2);
+  uint64_t erased_bytes = ps.GetAllocatedBytes();
+  for (uint64_t i = 0; i < 50000; ++i){
+    ps.Insert(0, rand() % 100);
+  }
+  // freed nodes and leaves are reused
+  ASSERT_LE(ps.GetAllocatedBytes(), erased_bytes * 5 / 4);
+}
+
+TEST(PrefixSum, compact){
+  Arena* arena = new Arena;
+  PrefixSum ps(arena);
+  vector<uint64_t> vals(100000);
+  ps.Build(vals.begin(), vals.end());
+  for (uint64_t i = 0; i < 100000; ++i){
+    uint64_t pos = rand() % vals.size();
+    ps.Increment(pos, 1);
+    ++vals[pos];
+  }
+  // a transient spike is released when it decays
+  uint64_t used_bytes = arena->GetUsedBytes();
+  for (uint64_t i = 0; i < vals.size(); i += 1000){
+    ps.Increment(i, 1LLU << 40);
+  }
+  ASSERT_LT(used_bytes, arena->GetUsedBytes());
+  for (uint64_t i = 0; i < vals.size(); i += 1000){
+    ps.Decrement(i, 1LLU << 40);
+  }
+  ASSERT_GE(used_bytes, arena->GetUsedBytes());
+  used_bytes = arena->GetUsedBytes();
+
+  // the slack planes are released by Compact
+  uint64_t bytes = 0;
+  for (uint64_t i = 0; i < 10; ++i){
+    bytes += ps.Compact(10);
+  }
+  ASSERT_LT(0, bytes);
+  bytes += ps.Compact();
+  ASSERT_EQ(0, ps.Compact());
+  ASSERT_EQ(used_bytes - bytes, arena->GetUsedBytes());
+  CheckAll(ps, vals);
+}
+
+TEST(PrefixSum, build_encodings){
+  vector<uint64_t> vals(100000);
+  for (uint64_t i = 0; i < vals.size(); ++i){
+    if (i < vals.size() / 2){
+      vals[i] = (rand() % 100 == 0) ? rand() % 100000 : 0;
+    } else {
+      vals[i] = (rand() % 64 > 0) ? vals[i-1] : rand() % 1000;
+    }
+  }
+  PrefixSum ps(vals.begin(), vals.end());
+  CheckAll(ps, vals);
+  for (uint64_t i = 0; i < 10000; ++i){
+    uint64_t pos = rand() % vals.size();
+    if (rand() % 2 == 0){
+      uint64_t val = rand() % 1000;
+      ps.Insert(pos, val);
+      vals.insert(vals.begin() + pos, val);
+    } else {
+      ps.Erase(pos);
+      vals.erase(vals.begin() + pos);
+    }
+  }
+  CheckAll(ps, vals);
+  ps.Compact();
+  CheckAll(ps, vals);
+}
+
+TEST(PrefixSum, narrow_types){
+  PrefixSum32 ps;
+  ASSERT_LT(sizeof(PrefixSum32::Node), sizeof(PrefixSum::Node));
+  vector<uint64_t> vals;
+  for (uint64_t i = 0; i < 100000; ++i){
+    uint64_t op = rand() % 4;
+    if (vals.empty() || op == 0){
+      uint64_t pos = rand() % (vals.size() + 1);
+      uint64_t val = rand() % 10000;
+      ps.Insert(pos, val);
+      vals.insert(vals.begin() + pos, val);
+    } else if (op == 1){
+      uint64_t pos = rand() % vals.size();
+      ps.Erase(pos);
+      vals.erase(vals.begin() + pos);
+    } else if (op == 2){
+      uint64_t pos = rand() % vals.size();
+      uint64_t val = rand() % 10000;
+      ps.Set(pos, val);
+      vals[pos] = val;
+    } else {
+      uint64_t pos = rand() % vals.size();
+      ps.Increment(pos, 1);
+      ++vals[pos];
+    }
+  }
+  CheckAll(ps, vals);
+
+  // values of 32 bits
+  ps.Clear();
+  vals.clear();
+  for (uint64_t i = 0; i < 1000; ++i){
+    uint64_t val = (i % 2 == 0) ? 0xFFFFFFFFLLU : 0;
+    ps.Insert(i, val);
+    vals.push_back(val);
+  }
+  for (uint64_t i = 0; i < 1000; ++i){
+    ASSERT_EQ(vals[i], ps.Get(i)) << " i=" << i;
+  }
+}
+
+TEST(PrefixSum, cached_sums){
+  CachedPrefixSum ps;
+  vector<uint64_t> vals;
+  for (uint64_t i = 0; i < 100000; ++i){
+    uint64_t op = rand() % 4;
+    if (vals.empty() || op == 0){
+      uint64_t pos = rand() % (vals.size() + 1);
+      uint64_t val = rand() % 10000;
+      ps.Insert(pos, val);
+      vals.insert(vals.begin() + pos, val);
+    } else if (op == 1){
+      uint64_t pos = rand() % vals.size();
+      ps.Erase(pos);
+      vals.erase(vals.begin() + pos);
+    } else if (op == 2){
+      uint64_t pos = rand() % vals.size();
+      uint64_t val = 1LLU << (rand() % 40);
+      ps.Increment(pos, val);
+      vals[pos] += val;
+    } else {
+      uint64_t pos = rand() % vals.size();
+      uint64_t val = min(vals[pos], static_cast<uint64_t>(rand() % 100));
+      ps.Decrement(pos, val);
+      vals[pos] -= val;
+    }
+  }
+  CheckAll(ps, vals);
+  ps.Compact();
+  CheckAll(ps, vals);
+}
+
+namespace {
+
+template <class PrefixSumT, class IndexT, class SumT>
+void CheckBatch(const PrefixSumT& ps, uint64_t query_num, bool sorted){
+  vector<IndexT> inds(query_num);
+  vector<IndexT> prefix_inds(query_num);
+  vector<SumT> vals(query_num);
+  for (uint64_t i = 0; i < query_num; ++i){
+    inds[i] = rand() % ps.Num();
+    prefix_inds[i] = rand() % (ps.Num() + 1);
+    vals[i] = (((uint64_t)rand() << 32) ^ rand()) % (ps.Sum() + 10);
+  }
+  if (sorted){
+    sort(inds.begin(), inds.end());
+    sort(prefix_inds.begin(), prefix_inds.end());
+    sort(vals.begin(), vals.end());
+  }
+  vector<SumT> gets(query_num);
+  vector<SumT> sums(query_num);
+  vector<IndexT> finds(query_num);
+  ps.GetBatch(&inds[0], query_num, &gets[0]);
+  ps.GetPrefixSumBatch(&prefix_inds[0], query_num, &sums[0]);
+  ps.FindBatch(&vals[0], query_num, &finds[0]);
+  for (uint64_t i = 0; i < query_num; ++i){
+    ASSERT_EQ(ps.Get(inds[i]), gets[i]) << " i=" << i;
+    ASSERT_EQ(ps.GetPrefixSum(prefix_inds[i]), sums[i]) << " i=" << i;
+    ASSERT_EQ(ps.Find(vals[i]), finds[i]) << " i=" << i;
+  }
+}
+
+}
+
+TEST(PrefixSum, batch){
+  const uint64_t nums[] = {1, 100, 1000, 100000};
+  for (uint64_t n = 0; n < 4; ++n){
+    vector<uint64_t> vals(nums[n]);
+    for (uint64_t i = 0; i < vals.size(); ++i){
+      vals[i] = (rand() % 10 == 0) ? 0 : rand() % 1000;
+    }
+    PrefixSum ps(vals.begin(), vals.end());
+    PrefixSum32 ps32(vals.begin(), vals.end());
+    for (uint64_t query_num = 1; query_num <= 1000; query_num *= 10){
+      CheckBatch<PrefixSum, uint64_t, uint64_t>(ps, query_num, false);
+      CheckBatch<PrefixSum, uint64_t, uint64_t>(ps, query_num, true);
+      CheckBatch<PrefixSum32, uint32_t, uint32_t>(ps32, query_num, false);
+      CheckBatch<PrefixSum32, uint32_t, uint32_t>(ps32, query_num, true);
+    }
+  }
+
+  // a tree shaped by updates
+  PrefixSum ps;
+  for (uint64_t i = 0; i < 50000; ++i){
+    ps.Insert(rand() % (ps.Num() + 1), rand() % 100);
+  }
+  CheckBatch<PrefixSum, uint64_t, uint64_t>(ps, 10000, false);
+  CheckBatch<PrefixSum, uint64_t, uint64_t>(ps, 10000, true);
+  ps.GetBatch(NULL, 0, NULL);
+}
+
+TEST(PrefixSum, apply_batch){
+  vector<uint64_t> vals(100000);
+  for (uint64_t i = 0; i < vals.size(); ++i){
+    vals[i] = rand() % 1000;
+  }
+  PrefixSum ps(vals.begin(), vals.end());
+  PrefixSum32 ps32(vals.begin(), vals.end());
+  const uint64_t batch_nums[] = {0, 1, 10, 1000, 100000};
+  for (uint64_t b = 0; b < 5; ++b){
+    // few distinct indices in small ranges, so that updates of the same index mix
+    const uint64_t range = (b % 2 == 0) ? vals.size() : 50;
+    vector<PrefixSum::Update> updates(batch_nums[b]);
+    vector<PrefixSum32::Update> updates32(batch_nums[b]);
+    for (uint64_t i = 0; i < updates.size(); ++i){
+      PrefixSum::Update& update = updates[i];
+      update.ind = rand() % range;
+      const uint64_t op = rand() % 3;
+      if (op == 0){
+        update.type = PrefixSum::INCREMENT;
+        update.val = rand() % 100;
+        vals[update.ind] += update.val;
+      } else if (op == 1){
+        update.type = PrefixSum::DECREMENT;
+        update.val = min(vals[update.ind], static_cast<uint64_t>(rand() % 100));
+        vals[update.ind] -= update.val;
+      } else {
+        update.type = PrefixSum::SET;
+        update.val = (rand() % 100 == 0) ? 1LLU << 20 : rand() % 1000;
+        vals[update.ind] = update.val;
+      }
+      updates32[i].type = static_cast<PrefixSum32::UpdateType>(update.type);
+      updates32[i].ind = update.ind;
+      updates32[i].val = update.val;
+    }
+    ps.ApplyBatch(updates.empty() ? NULL : &updates[0], updates.size());
+    ps32.ApplyBatch(updates32.empty() ? NULL : &updates32[0], updates32.size());
+    CheckAll(ps, vals);
+    CheckAll(ps32, vals);
+  }
+}
+
+namespace {
+
+template <class PrefixSumT, class IndexT, class SumT>
+void CheckAddRange(){
+  vector<uint64_t> vals(20000);
+  for (uint64_t i = 0; i < vals.size(); ++i){
+    vals[i] = rand() % 100;
+  }
+  PrefixSumT ps(vals.begin(), vals.end());
+  for (uint64_t i = 0; i < 3000; ++i){
+    const uint64_t op = rand() % 8;
+    const uint64_t pos = rand() % vals.size();
+    if (op <= 2){
+      uint64_t beg = rand() % (vals.size() + 1);
+      uint64_t end = rand() % (vals.size() + 1);
+      if (beg > end) swap(beg, end);
+      if (op == 0) end = min(beg + rand() % 300, static_cast<uint64_t>(vals.size()));
+      const uint64_t val = rand() % 10;
+      ps.AddRange(beg, end, val);
+      for (uint64_t j = beg; j < end; ++j){
+        vals[j] += val;
+      }
+    } else if (op == 3){
+      const uint64_t val = rand() % 100;
+      ps.Insert(pos, val);
+      vals.insert(vals.begin() + pos, val);
+    } else if (op == 4){
+      ps.Erase(pos);
+      vals.erase(vals.begin() + pos);
+    } else if (op == 5){
+      const uint64_t val = min(vals[pos], static_cast<uint64_t>(rand() % 100));
+      ps.Decrement(pos, val);
+      vals[pos] -= val;
+    } else if (op == 6){
+      const uint64_t val = rand() % 100;
+      ps.Set(pos, val);
+      vals[pos] = val;
+    } else if (rand() % 2 == 0){
+      ps.Increment(pos, 5);
+      vals[pos] += 5;
+    } else {
+      typename PrefixSumT::Update updates[2];
+      updates[0].type = PrefixSumT::SET;
+      updates[0].ind = pos;
+      updates[0].val = 7;
+      updates[1].type = PrefixSumT::INCREMENT;
+      updates[1].ind = vals.size() - 1 - pos;
+      updates[1].val = 3;
+      ps.ApplyBatch(updates, 2);
+      vals[pos] = 7;
+      vals[vals.size() - 1 - pos] += 3;
+    }
+    ASSERT_EQ(vals[pos], ps.Get(pos)) << " i=" << i;
+    uint64_t beg = rand() % (vals.size() + 1);
+    uint64_t end = rand() % (vals.size() + 1);
+    if (beg > end) swap(beg, end);
+    uint64_t sum = 0;
+    for (uint64_t j = beg; j < end; ++j){
+      sum += vals[j];
+    }
+    ASSERT_EQ(sum, ps.RangeSum(beg, end)) << " i=" << i;
+    ASSERT_EQ(ps.GetPrefixSum(end) - ps.GetPrefixSum(beg), ps.RangeSum(beg, end)) << " i=" << i;
+  }
+  CheckAll(ps, vals);
+  CheckBatch<PrefixSumT, IndexT, SumT>(ps, 1000, false);
+  CheckBatch<PrefixSumT, IndexT, SumT>(ps, 1000, true);
+}
+
+}
+
+TEST(PrefixSum, add_range){
+  CheckAddRange<PrefixSum, uint64_t, uint64_t>();
+  CheckAddRange<PrefixSum32, uint32_t, uint32_t>();
+  CheckAddRange<CachedPrefixSum, uint64_t, uint64_t>();
+}
+
+TEST(PrefixSum, add_range_erase){
+  // erasures under pending additions merge nodes and move children
+  // between siblings, which keep the additions of the moved children
+  PrefixSum ps;
+  vector<uint64_t> vals;
+  for (uint64_t i = 0; i < 100000; ++i){
+    const uint64_t val = rand() % 100;
+    ps.Insert(i, val);
+    vals.push_back(val);
+  }
+  while (vals.size() > 1000){
+    uint64_t beg = rand() % vals.size();
+    uint64_t end = rand() % vals.size();
+    if (beg > end) swap(beg, end);
+    const uint64_t val = rand() % 10;
+    ps.AddRange(beg, end, val);
+    for (uint64_t j = beg; j < end; ++j){
+      vals[j] += val;
+    }
+    const uint64_t pos = rand() % vals.size();
+    const uint64_t len = min(static_cast<uint64_t>(rand() % 3000), static_cast<uint64_t>(vals.size()) - pos);
+    ps.EraseRange(pos, pos + len);
+    vals.erase(vals.begin() + pos, vals.begin() + pos + len);
+    for (uint64_t j = 0; j < 100; ++j){
+      const uint64_t ind = rand() % vals.size();
+      ASSERT_EQ(vals[ind], ps.Get(ind)) << " ind=" << ind;
+    }
+  }
+  CheckAll(ps, vals);
+}
+
+TEST(PrefixSum, iterator){
+  PrefixSum ps;
+  ASSERT_TRUE(ps.begin() == ps.end());
+  vector<uint64_t> vals;
+  for (uint64_t i = 0; i < 20000; ++i){
+    const uint64_t pos = rand() % (vals.size() + 1);
+    const uint64_t val = (rand() % 100 == 0) ? 1LLU << 30 : rand() % 100;
+    ps.Insert(pos, val);
+    vals.insert(vals.begin() + pos, val);
+  }
+  ps.AddRange(100, 10000, 3);
+  for (uint64_t i = 100; i < 10000; ++i){
+    vals[i] += 3;
+  }
+
+  uint64_t sum = 0;
+  uint64_t i = 0;
+  for (PrefixSum::const_iterator it = ps.begin(); it != ps.end(); ++it, ++i){
+    ASSERT_EQ(i, it.Index());
+    ASSERT_EQ(sum, it.PrefixSum()) << " i=" << i;
+    ASSERT_EQ(vals[i], *it) << " i=" << i;
+    sum += vals[i];
+  }
+  ASSERT_EQ(vals.size(), i);
+  ASSERT_EQ(sum, ps.end().PrefixSum());
+
+  // backward from the end and from the middle
+  PrefixSum::const_iterator it = ps.end();
+  for (uint64_t i = vals.size(); i > 0; --i){
+    --it;
+    ASSERT_EQ(vals[i - 1], *it) << " i=" << i;
+    sum -= vals[i - 1];
+    ASSERT_EQ(sum, it.PrefixSum()) << " i=" << i;
+  }
+  ASSERT_TRUE(it == ps.begin());
+  for (uint64_t j = 0; j < 100; ++j){
+    const uint64_t pos = rand() % vals.size();
+    PrefixSum::const_iterator it = ps.GetIterator(pos);
+    ASSERT_EQ(vals[pos], *it);
+    ASSERT_EQ(ps.GetPrefixSum(pos), it.PrefixSum());
+    if (pos > 0){
+      ASSERT_EQ(vals[pos - 1], *--it);
+      ASSERT_EQ(vals[pos - 1], *it++);
+      ASSERT_EQ(vals[pos], *it);
+    }
+  }
+
+  // STL algorithms
+  ASSERT_TRUE(equal(vals.begin(), vals.end(), ps.begin()));
+  ASSERT_EQ(distance(ps.begin(), ps.end()), static_cast<ptrdiff_t>(vals.size()));
+  vector<uint64_t> copied(ps.begin(), ps.end());
+  ASSERT_EQ(vals, copied);
+  ASSERT_EQ(count(vals.begin(), vals.end(), 1LLU << 30), count(ps.begin(), ps.end(), 1LLU << 30));
+#if __cplusplus >= 201103L
+  uint64_t total = 0;
+  for (auto val : ps){
+    total += val;
+  }
+  ASSERT_EQ(ps.Sum(), total);
+#endif
+}
+
+TEST(PrefixSum, decode_to){
+  PrefixSum ps;
+  vector<uint64_t> vals;
+  for (uint64_t i = 0; i < 20000; ++i){
+    const uint64_t pos = rand() % (vals.size() + 1);
+    const uint64_t val = (rand() % 100 == 0) ? 1LLU << 30 : rand() % 1000;
+    ps.Insert(pos, val);
+    vals.insert(vals.begin() + pos, val);
+  }
+  ps.AddRange(300, 15000, 5);
+  for (uint64_t i = 300; i < 15000; ++i){
+    vals[i] += 5;
+  }
+  vector<uint64_t> sums(vals.size() + 1);
+  for (uint64_t i = 0; i < vals.size(); ++i){
+    sums[i + 1] = sums[i] + vals[i];
+  }
+
+  vector<uint64_t> out(vals.size());
+  ps.DecodeTo(&out[0], 0, vals.size());
+  ASSERT_EQ(vals, out);
+  ps.PrefixSumsTo(&out[0], 0, vals.size());
+  ASSERT_TRUE(equal(out.begin(), out.end(), sums.begin()));
+  for (uint64_t i = 0; i < 100; ++i){
+    uint64_t beg = rand() % (vals.size() + 1);
+    uint64_t end = rand() % (vals.size() + 1);
+    if (beg > end) swap(beg, end);
+    ps.DecodeTo(&out[0], beg, end);
+    ASSERT_TRUE(equal(vals.begin() + beg, vals.begin() + end, out.begin())) << beg << " " << end;
+    ps.PrefixSumsTo(&out[0], beg, end);
+    ASSERT_TRUE(equal(sums.begin() + beg, sums.begin() + end, out.begin())) << beg << " " << end;
+  }
+
+  // the parts split at leaves cover the range
+  for (uint64_t part_num = 1; part_num <= 64; part_num *= 4){
+    vector<uint64_t> bounds;
+    ps.SplitByLeaf(100, vals.size() - 100, part_num, bounds);
+    ASSERT_LE(bounds.size(), part_num + 1);
+    ASSERT_EQ(100U, bounds.front());
+    ASSERT_EQ(vals.size() - 100, bounds.back());
+    fill(out.begin(), out.end(), 0);
+    for (uint64_t k = 0; k + 1 < bounds.size(); ++k){
+      ASSERT_LT(bounds[k], bounds[k + 1]);
+      ps.DecodeTo(&out[bounds[k]], bounds[k], bounds[k + 1]);
+    }
+    ASSERT_TRUE(equal(vals.begin() + 100, vals.end() - 100, out.begin() + 100));
+  }
+}
+
+namespace {
+
+template <class PrefixSumT, class SumT>
+void CheckSaveLoad(){
+  PrefixSumT ps;
+  vector<uint64_t> vals;
+  for (uint64_t i = 0; i < 30000; ++i){
+    const uint64_t pos = rand() % (vals.size() + 1);
+    const uint64_t val = (rand() % 100 == 0) ? 1LLU << 20 : rand() % 100;
+    ps.Insert(pos, val);
+    vals.insert(vals.begin() + pos, val);
+  }
+  // pending additions in the nodes are saved as they are
+  ps.AddRange(1000, 25000, 2);
+  for (uint64_t i = 1000; i < 25000; ++i){
+    vals[i] += 2;
+  }
+
+  ostringstream os;
+  ASSERT_TRUE(ps.Save(os));
+  const string saved = os.str();
+  istringstream is(saved);
+  PrefixSumT loaded;
+  ASSERT_TRUE(loaded.Load(is));
+  ASSERT_EQ(ps.Num(), loaded.Num());
+  ASSERT_EQ(ps.Sum(), loaded.Sum());
+  ASSERT_EQ(ps.Depth(), loaded.Depth());
+  vector<SumT> out(vals.size());
+  loaded.DecodeTo(&out[0], 0, vals.size());
+  ASSERT_TRUE(equal(vals.begin(), vals.end(), out.begin()));
+  for (uint64_t i = 0; i < 1000; ++i){
+    const uint64_t pos = rand() % (vals.size() + 1);
+    ASSERT_EQ(ps.GetPrefixSum(pos), loaded.GetPrefixSum(pos));
+  }
+
+  // the loaded tree is updated as usual, and saved to the same bytes
+  ostringstream os2;
+  ASSERT_TRUE(loaded.Save(os2));
+  ASSERT_EQ(saved, os2.str());
+  for (uint64_t i = 0; i < 1000; ++i){
+    const uint64_t pos = rand() % vals.size();
+    loaded.Insert(pos, 5);
+    vals.insert(vals.begin() + pos, 5);
+    loaded.Erase(pos + 1);
+    vals.erase(vals.begin() + pos + 1);
+  }
+  out.resize(vals.size());
+  loaded.DecodeTo(&out[0], 0, vals.size());
+  ASSERT_TRUE(equal(vals.begin(), vals.end(), out.begin()));
+
+  // every flip of a bit of a small tree, and a truncated stream, are
+  // rejected and leave an empty tree
+  PrefixSumT small;
+  for (uint64_t i = 0; i < 2000; ++i){
+    small.Insert(i, rand() % 100);
+  }
+  small.AddRange(100, 1500, 1);
+  ostringstream small_os;
+  ASSERT_TRUE(small.Save(small_os));
+  const string small_saved = small_os.str();
+  for (uint64_t i = 0; i < small_saved.size() * 8; ++i){
+    string corrupted = small_saved;
+    corrupted[i / 8] ^= 1 << (i % 8);
+    istringstream is(corrupted);
+    ASSERT_FALSE(loaded.Load(is)) << " bit=" << i;
+    ASSERT_EQ(0U, loaded.Num());
+  }
+  loaded.Insert(0, 1);
+  ASSERT_EQ(1U, loaded.Sum());
+  istringstream truncated(saved.substr(0, saved.size() / 2));
+  ASSERT_FALSE(loaded.Load(truncated));
+  ASSERT_EQ(0U, loaded.Num());
+
+  // an empty tree
+  PrefixSumT empty;
+  ostringstream empty_os;
+  ASSERT_TRUE(empty.Save(empty_os));
+  istringstream empty_is(empty_os.str());
+  ASSERT_TRUE(loaded.Load(empty_is));
+  ASSERT_EQ(0U, loaded.Num());
+  loaded.Insert(0, 3);
+  ASSERT_EQ(3U, loaded.Get(0));
+}
+
+}
+
+TEST(PrefixSum, save_load){
+  CheckSaveLoad<PrefixSum, uint64_t>();
+  CheckSaveLoad<PrefixSum32, uint32_t>();
+  CheckSaveLoad<CachedPrefixSum, uint64_t>();
+
+  // a tree of other template parameters is rejected
+  PrefixSum ps;
+  ps.Insert(0, 1);
+  ostringstream os;
+  ASSERT_TRUE(ps.Save(os));
+  istringstream is(os.str());
+  PrefixSum32 ps32;
+  ASSERT_FALSE(ps32.Load(is));
+}
+
+namespace {
+
+template <class Snapshot>
+void CheckSnapshot(const Snapshot& snapshot, const vector<uint64_t>& vals){
+  ASSERT_EQ(vals.size(), snapshot.Num());
+  uint64_t sum = 0;
+  for (uint64_t i = 0; i < vals.size(); ++i){
+    ASSERT_EQ(vals[i], snapshot.Get(i)) << " i=" << i;
+    ASSERT_EQ(sum, snapshot.GetPrefixSum(i)) << " i=" << i;
+    if (vals[i] > 0){
+      ASSERT_EQ(i, snapshot.Find(sum)) << " i=" << i;
+    }
+    sum += vals[i];
+  }
+  ASSERT_EQ(sum, snapshot.GetPrefixSum(vals.size()));
+  ASSERT_EQ(sum, snapshot.Sum());
+}
+
+template <class PrefixSumT>
+void CheckSnapshots(bool built){
+  typedef typename PrefixSumT::Snapshot Snapshot;
+  vector<uint64_t> vals(20000);
+  for (uint64_t i = 0; i < vals.size(); ++i){
+    vals[i] = rand() % 100;
+  }
+  // a tree built from the range, or inserted into after an empty range
+  PrefixSumT ps(vals.begin(), vals.begin() + (built ? vals.size() : 0));
+  if (!built){
+    for (uint64_t i = 0; i < vals.size(); ++i){
+      ps.Insert(i, vals[i]);
+    }
+  }
+
+  vector<Snapshot> snapshots;
+  vector<vector<uint64_t> > snapshot_vals;
+  for (uint64_t i = 0; i < 3000; ++i){
+    if (i % 200 == 0){
+      snapshots.push_back(ps.GetSnapshot());
+      snapshot_vals.push_back(vals);
+    } else if (i % 200 == 100 && snapshots.size() > 1){
+      const uint64_t j = rand() % snapshots.size();
+      snapshots.erase(snapshots.begin() + j);
+      snapshot_vals.erase(snapshot_vals.begin() + j);
+    }
+    const uint64_t op = rand() % 8;
+    const uint64_t pos = rand() % vals.size();
+    const uint64_t val = rand() % 100;
+    if (op == 0){
+      ps.Insert(pos, val);
+      vals.insert(vals.begin() + pos, val);
+    } else if (op == 1){
+      ps.Erase(pos);
+      vals.erase(vals.begin() + pos);
+    } else if (op == 2){
+      const uint64_t end = min(pos + rand() % 1000, static_cast<uint64_t>(vals.size()));
+      ps.EraseRange(pos, end);
+      vals.erase(vals.begin() + pos, vals.begin() + end);
+      for (uint64_t j = pos; j < end; ++j){
+        ps.Insert(j, val);
+        vals.insert(vals.begin() + j, val);
+      }
+    } else if (op == 3){
+      ps.Set(pos, val);
+      vals[pos] = val;
+    } else if (op == 4){
+      ps.Increment(pos, val);
+      vals[pos] += val;
+    } else if (op == 5){
+      ps.Decrement(pos, min(val, vals[pos]));
+      vals[pos] -= min(val, vals[pos]);
+    } else if (op == 6){
+      const uint64_t end = min(pos + rand() % 5000, static_cast<uint64_t>(vals.size()));
+      ps.AddRange(pos, end, 1);
+      for (uint64_t j = pos; j < end; ++j){
+        vals[j] += 1;
+      }
+    } else {
+      typename PrefixSumT::Update updates[2];
+      updates[0].type = PrefixSumT::SET;
+      updates[0].ind = pos;
+      updates[0].val = val;
+      updates[1].type = PrefixSumT::INCREMENT;
+      updates[1].ind = vals.size() - 1 - pos;
+      updates[1].val = 3;
+      ps.ApplyBatch(updates, 2);
+      vals[pos] = val;
+      vals[vals.size() - 1 - pos] += 3;
+    }
+    if (i % 500 == 499){
+      for (uint64_t j = 0; j < snapshots.size(); ++j){
+        CheckSnapshot(snapshots[j], snapshot_vals[j]);
+      }
+    }
+  }
+  CheckAll(ps, vals);
+  for (uint64_t j = 0; j < snapshots.size(); ++j){
+    CheckSnapshot(snapshots[j], snapshot_vals[j]);
+  }
+
+  // a copy outlives the snapshot it was copied from
+  Snapshot copy = snapshots[0];
+  copy = snapshots.back();
+  snapshots.clear();
+  ps.Increment(0, 1);
+  CheckSnapshot(copy, snapshot_vals.back());
+  vals[0] += 1;
+  CheckAll(ps, vals);
+}
+
+
+
+template <class PrefixSumT>
+struct SnapshotState{
+  typedef typename PrefixSumT::Snapshot Snapshot;
+
+  pthread_mutex_t mutex;
+  Snapshot* latest;  // and latest_vals, under mutex
+  vector<uint64_t> latest_vals;
+  uint64_t finished;
+  uint64_t checked;
+  uint64_t errors;
+};
+
+// check copies of the latest snapshot, and release them and
+// sometimes the latest one in this thread
+template <class PrefixSumT>
+void* SnapshotReader(void* p){
+  typedef typename PrefixSumT::Snapshot Snapshot;
+  SnapshotState<PrefixSumT>& state = *static_cast<SnapshotState<PrefixSumT>*>(p);
+  unsigned int seed = 12345;
+  while (!__atomic_load_n(&state.finished, __ATOMIC_ACQUIRE)){
+    pthread_mutex_lock(&state.mutex);
+    if (state.latest == NULL){
+      pthread_mutex_unlock(&state.mutex);
+      continue;
+    }
+    Snapshot* snapshot = new Snapshot(*state.latest);
+    const vector<uint64_t> vals = state.latest_vals;
+    if (rand_r(&seed) % 2 == 0){
+      delete state.latest;
+      state.latest = NULL;
+    }
+    pthread_mutex_unlock(&state.mutex);
+
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < vals.size(); ++i){
+      if (snapshot->Get(i) != vals[i] || snapshot->GetPrefixSum(i) != sum ||
+          (vals[i] > 0 && snapshot->Find(sum) != i)){
+        __atomic_fetch_add(&state.errors, 1, __ATOMIC_RELAXED);
+      }
+      sum += vals[i];
+    }
+    if (snapshot->Num() != vals.size() || snapshot->Sum() != sum){
+      __atomic_fetch_add(&state.errors, 1, __ATOMIC_RELAXED);
+    }
+    delete snapshot;
+    __atomic_fetch_add(&state.checked, 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+// the snapshots are read and released by other threads while the
+// tree grows, shrinks and is compacted
+template <class PrefixSumT>
+void CheckSnapshotReaders(){
+  typedef typename PrefixSumT::Snapshot Snapshot;
+  const uint64_t reader_num = 3;
+  vector<uint64_t> vals(5000);
+  for (uint64_t i = 0; i < vals.size(); ++i){
+    vals[i] = rand() % 100;
+  }
+  PrefixSumT ps(vals.begin(), vals.end());
+  SnapshotState<PrefixSumT> state;
+  pthread_mutex_init(&state.mutex, NULL);
+  state.latest = NULL;
+  state.finished = 0;
+  state.checked = 0;
+  state.errors = 0;
+  vector<pthread_t> threads(reader_num);
+  for (uint64_t t = 0; t < reader_num; ++t){
+    ASSERT_EQ(0, pthread_create(&threads[t], NULL, SnapshotReader<PrefixSumT>, &state));
+  }
+
+  for (uint64_t i = 0; i < 30000; ++i){
+    if (i % 50 == 0){
+      Snapshot* snapshot = new Snapshot(ps.GetSnapshot());
+      pthread_mutex_lock(&state.mutex);
+      delete state.latest;
+      state.latest = snapshot;
+      state.latest_vals = vals;
+      pthread_mutex_unlock(&state.mutex);
+    }
+    const uint64_t pos = rand() % vals.size();
+    const uint64_t val = rand() % 100;
+    switch (rand() % 8){
+    case 0: case 1: case 2:
+      ps.Insert(pos, val);
+      vals.insert(vals.begin() + pos, val);
+      break;
+    case 3:
+      if (vals.size() > 1000){
+        ps.Erase(pos);
+        vals.erase(vals.begin() + pos);
+      }
+      break;
+    case 4:
+      ps.Set(pos, val);
+      vals[pos] = val;
+      break;
+    case 5: {
+      const uint64_t end = min(pos + rand() % 3000, static_cast<uint64_t>(vals.size()));
+      ps.AddRange(pos, end, 1);
+      for (uint64_t j = pos; j < end; ++j){
+        vals[j] += 1;
+      }
+      break;
+    }
+    case 6:
+      ps.Compact(4);
+      break;
+    default:
+      ps.Increment(pos, val);
+      vals[pos] += val;
+    }
+  }
+  __atomic_store_n(&state.finished, 1, __ATOMIC_RELEASE);
+  for (uint64_t t = 0; t < reader_num; ++t){
+    pthread_join(threads[t], NULL);
+  }
+  delete state.latest;
+  pthread_mutex_destroy(&state.mutex);
+  ASSERT_EQ(0, state.errors);
+  ASSERT_LT(0, state.checked);
+
+  // Compact frees what the released snapshots kept
+  ps.Compact();
+  CheckAll(ps, vals);
+}
+}
+
+TEST(PrefixSum, snapshot){
+  CheckSnapshots<PrefixSum>(false);
+  CheckSnapshots<PrefixSum32>(false);
+  CheckSnapshots<CachedPrefixSum>(false);
+  CheckSnapshots<PrefixSum>(true);
+  CheckSnapshots<PrefixSum32>(true);
+  CheckSnapshots<CachedPrefixSum>(true);
+}
+
+TEST(PrefixSum, snapshot_readers){
+  CheckSnapshotReaders<PrefixSum>();
+  CheckSnapshotReaders<PrefixSum32>();
+  CheckSnapshotReaders<CachedPrefixSum>();
+}
@@ -0,0 +1,71 @@
+/* 
+ *  Copyright (c) 2012 Daisuke Okanohara
+  * 
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ * 
+ *   1. Redistributions of source code must retain the above Copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above Copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the authors nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ */
+
+#include "Serializer.hpp"
+
+namespace prefixsum{
+
+namespace {
+
+const uint64_t PRIME1 = 0x9E3779B185EBCA87LLU;
+const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FLLU;
+const uint64_t PRIME3 = 0x165667B19E3779F9LLU;
+
+void AddChecksum(const uint64_t* words, uint64_t num, uint64_t& hash){
+  for (uint64_t i = 0; i < num; ++i){
+    hash += words[i] * PRIME2;
+    hash = (hash << 31) | (hash >> 33);
+    hash *= PRIME1;
+  }
+}
+
+// the avalanche of xxHash64
+uint64_t MixChecksum(uint64_t hash){
+  hash ^= hash >> 33;
+  hash *= PRIME2;
+  hash ^= hash >> 29;
+  hash *= PRIME3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+}
+
+void Writer::Write(const uint64_t* words, uint64_t num){
+  AddChecksum(words, num, hash_);
+  num_ += num;
+  os_.write(reinterpret_cast<const char*>(words), sizeof(uint64_t) * num);
+}
+
+uint64_t Writer::Checksum() const{
+  return MixChecksum(hash_);
+}
+
+bool Reader::Read(uint64_t* words, uint64_t num){
+  const std::streamsize bytes = sizeof(uint64_t) * num;
+  if (!is_.read(reinterpret_cast<char*>(words), bytes) || is_.gcount() != bytes) return false;
+  AddChecksum(words, num, hash_);
+  return true;
+}
+
+uint64_t Reader::Checksum() const{
+  return MixChecksum(hash_);
+}
+
+} // namespace prefixsum
@@ -0,0 +1,92 @@
+/* 
+ *  Copyright (c) 2012 Daisuke Okanohara
+  * 
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ * 
+ *   1. Redistributions of source code must retain the above Copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above Copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the authors nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ */
+
+#ifndef PREFIX_SUM_SERIALIZER_HPP_
+#define PREFIX_SUM_SERIALIZER_HPP_
+
+#include <iostream>
+#include <stdint.h>
+
+namespace prefixsum{
+
+/**
+ * Writer and Reader of the binary format of Save and Load, which is a
+ * sequence of 64-bit words in the native byte order. Both keep a
+ * checksum of the words by the round of xxHash64, which is a bijection
+ * of both the state and the word, so that a change confined to a single
+ * word is always detected.
+ */
+class Writer{
+public:
+  explicit Writer(std::ostream& os) : os_(os), num_(0), hash_(0){
+  }
+
+  void Write(const uint64_t* words, uint64_t num);
+
+  void Write(uint64_t word){
+    Write(&word, 1);
+  }
+
+  // return the checksum of the words written so far
+  uint64_t Checksum() const;
+
+  // return the number of words written so far
+  uint64_t Num() const{
+    return num_;
+  }
+
+  bool Good() const{
+    return os_.good();
+  }
+
+private:
+  Writer(const Writer&);
+  Writer& operator=(const Writer&);
+
+  std::ostream& os_;
+  uint64_t num_;
+  uint64_t hash_;
+};
+
+class Reader{
+public:
+  explicit Reader(std::istream& is) : is_(is), hash_(0){
+  }
+
+  // read num words, and return false if the stream ends before them
+  bool Read(uint64_t* words, uint64_t num);
+
+  bool Read(uint64_t& word){
+    return Read(&word, 1);
+  }
+
+  // return the checksum of the words read so far
+  uint64_t Checksum() const;
+
+private:
+  Reader(const Reader&);
+  Reader& operator=(const Reader&);
+
+  std::istream& is_;
+  uint64_t hash_;
+};
+
+} // namespace prefixsum
+
+#endif // PREFIX_SUM_SERIALIZER_HPP_
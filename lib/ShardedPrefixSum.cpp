@@ -0,0 +1,329 @@
+/* 
+ *  Copyright (c) 2012 Daisuke Okanohara
+  * 
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ * 
+ *   1. Redistributions of source code must retain the above Copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above Copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the authors nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ */
+
+#include <algorithm>
+#include <cassert>
+#include "ShardedPrefixSum.hpp"
+
+namespace prefixsum{
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+BasicShardedPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::BasicShardedPrefixSum(uint64_t shard_num) :
+  shards_(new ShardEntry[shard_num]), sizes_(shard_num), shard_num_(shard_num), rebalance_num_(0){
+  assert(shard_num > 0);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+BasicShardedPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::~BasicShardedPrefixSum(){
+  delete[] shards_;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint64_t BasicShardedPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Route(IndexT ind, bool insert, IndexT& offset) const{
+  // a torn layout gives a wrong shard, which the caller discards by
+  // validating the layout before using it
+  IndexT beg = 0;
+  for (uint64_t shard = 0; shard + 1 < shard_num_; ++shard){
+    const IndexT size = LoadSize(shard);
+    if (ind < beg + size || (insert && ind == beg + size)){
+      offset = ind - beg;
+      return shard;
+    }
+    beg += size;
+  }
+  offset = ind - beg;
+  return shard_num_ - 1;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint64_t BasicShardedPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::LockShard(IndexT ind, bool insert, IndexT& offset) const{
+  for (;;){
+    const uint64_t version = layout_lock_.ReadLock();
+    const uint64_t shard = Route(ind, insert, offset);
+    shards_[shard].lock.Lock();
+    if (layout_lock_.Validate(version)) return shard;
+    shards_[shard].lock.Unlock();
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint64_t BasicShardedPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::LockLayout(IndexT ind, bool insert, IndexT& offset){
+  // the shard is locked before the layout, and Rebalance locks shards
+  // while holding the layout, so that the layout is only tried here
+  for (;;){
+    const uint64_t version = layout_lock_.ReadLock();
+    const uint64_t shard = Route(ind, insert, offset);
+    shards_[shard].lock.Lock();
+    if (layout_lock_.TryLock(version)) return shard;
+    shards_[shard].lock.Unlock();
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicShardedPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Insert(IndexT ind, SumT val){
+  IndexT offset = 0;
+  const uint64_t shard = LockLayout(ind, true, offset);
+  ShardEntry& entry = shards_[shard];
+  assert(offset <= entry.ps.Num());
+  const IndexT size = sizes_[shard] + 1;
+  StoreSize(shard, size);
+  StoreSum(shard, entry.ps.Sum() + val);
+  layout_lock_.Unlock();
+  entry.ps.Insert(offset, val);
+  entry.lock.Unlock();
+  if (IsUnbalanced(size, Num(), shard_num_)) Rebalance(shard);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicShardedPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Erase(IndexT ind){
+  IndexT offset = 0;
+  const uint64_t shard = LockLayout(ind, false, offset);
+  ShardEntry& entry = shards_[shard];
+  assert(offset < entry.ps.Num());
+  const IndexT size = sizes_[shard] - 1;
+  StoreSize(shard, size);
+  StoreSum(shard, entry.ps.Sum() - entry.ps.Get(offset));
+  layout_lock_.Unlock();
+  entry.ps.Erase(offset);
+  entry.lock.Unlock();
+  if (IsUnbalanced(size, Num(), shard_num_)) Rebalance(shard);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicShardedPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Increment(IndexT ind, SumT val){
+  Update(INCREMENT, ind, val);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicShardedPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Decrement(IndexT ind, SumT val){
+  Update(DECREMENT, ind, val);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicShardedPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Set(IndexT ind, SumT val){
+  Update(SET, ind, val);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicShardedPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Update(UpdateType type, IndexT ind, SumT val){
+  IndexT offset = 0;
+  const uint64_t shard = LockShard(ind, false, offset);
+  Shard& ps = shards_[shard].ps;
+  assert(offset < ps.Num());
+  if (type == INCREMENT){
+    ps.Increment(offset, val);
+  } else if (type == DECREMENT){
+    ps.Decrement(offset, val);
+  } else {
+    ps.Set(offset, val);
+  }
+  StoreSum(shard, ps.Sum());
+  shards_[shard].lock.Unlock();
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+SumT BasicShardedPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Get(IndexT ind) const{
+  IndexT offset = 0;
+  const uint64_t shard = LockShard(ind, false, offset);
+  assert(offset < shards_[shard].ps.Num());
+  const SumT val = shards_[shard].ps.Get(offset);
+  shards_[shard].lock.Unlock();
+  return val;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+SumT BasicShardedPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::GetPrefixSum(IndexT ind) const{
+  for (;;){
+    const uint64_t version = layout_lock_.ReadLock();
+    IndexT offset = 0;
+    const uint64_t shard = Route(ind, true, offset);
+    SumT sum = 0;
+    for (uint64_t i = 0; i < shard; ++i){
+      sum += LoadSum(i);
+    }
+    ShardEntry& entry = shards_[shard];
+    entry.lock.Lock();
+    if (layout_lock_.Validate(version)){
+      assert(offset <= entry.ps.Num());
+      sum += entry.ps.GetPrefixSum(offset);
+      entry.lock.Unlock();
+      return sum;
+    }
+    entry.lock.Unlock();
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+IndexT BasicShardedPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Find(SumT val) const{
+  for (;;){
+    const uint64_t version = layout_lock_.ReadLock();
+    IndexT beg = 0;
+    SumT remain = val;
+    uint64_t shard = 0;
+    for (; shard + 1 < shard_num_; ++shard){
+      const SumT sum = LoadSum(shard);
+      if (remain < sum) break;
+      remain -= sum;
+      beg += LoadSize(shard);
+    }
+    ShardEntry& entry = shards_[shard];
+    entry.lock.Lock();
+    // retry also if the shard has been decremented below remain
+    // since its sum was read
+    if (layout_lock_.Validate(version) &&
+        (remain < entry.ps.Sum() || shard + 1 == shard_num_)){
+      const IndexT ind = beg + entry.ps.Find(remain);
+      entry.lock.Unlock();
+      return ind;
+    }
+    entry.lock.Unlock();
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+IndexT BasicShardedPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Num() const{
+  for (;;){
+    const uint64_t version = layout_lock_.ReadLock();
+    IndexT num = 0;
+    for (uint64_t shard = 0; shard < shard_num_; ++shard){
+      num += LoadSize(shard);
+    }
+    if (layout_lock_.Validate(version)) return num;
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+SumT BasicShardedPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Sum() const{
+  for (;;){
+    const uint64_t version = layout_lock_.ReadLock();
+    SumT sum = 0;
+    for (uint64_t shard = 0; shard < shard_num_; ++shard){
+      sum += LoadSum(shard);
+    }
+    if (layout_lock_.Validate(version)) return sum;
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint64_t BasicShardedPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::GetShard(IndexT ind) const{
+  for (;;){
+    const uint64_t version = layout_lock_.ReadLock();
+    IndexT offset = 0;
+    const uint64_t shard = Route(ind, false, offset);
+    if (layout_lock_.Validate(version)) return shard;
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+IndexT BasicShardedPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::GetShardSize(uint64_t shard) const{
+  assert(shard < shard_num_);
+  return LoadSize(shard);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint64_t BasicShardedPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::GetRebalanceNum() const{
+  return __atomic_load_n(&rebalance_num_, __ATOMIC_RELAXED);
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+bool BasicShardedPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::IsUnbalanced(IndexT size, IndexT num, uint64_t shard_num){
+  const uint64_t average = num / shard_num;
+  return 2 * static_cast<uint64_t>(size) > 3 * average + 2 * LeafNum ||
+    2 * static_cast<uint64_t>(size) + LeafNum < average;
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicShardedPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Rebalance(uint64_t shard){
+  layout_lock_.Lock();
+  uint64_t num = 0;
+  for (uint64_t i = 0; i < shard_num_; ++i){
+    num += sizes_[i];
+  }
+  if (!IsUnbalanced(sizes_[shard], num, shard_num_)){
+    layout_lock_.Unlock();
+    return;
+  }
+
+  // the smallest window of 2, 4, 8... shards around the shard whose
+  // average is within [3/4, 5/4] of the average (with half the slack),
+  // or all shards, so that the rebuilt shards are balanced and a window
+  // is rebuilt again only after updates of a fraction of its values
+  const uint64_t average = num / shard_num_;
+  uint64_t beg = 0;
+  uint64_t end = shard_num_;
+  for (uint64_t width = 2; width < shard_num_; width *= 2){
+    const uint64_t first = std::min(shard - std::min(shard, width / 2), shard_num_ - width);
+    uint64_t window_num = 0;
+    for (uint64_t i = first; i < first + width; ++i){
+      window_num += sizes_[i];
+    }
+    if (4 * window_num >= 3 * average * width &&
+        4 * window_num <= (5 * average + 2 * LeafNum) * width){
+      beg = first;
+      end = first + width;
+      break;
+    }
+  }
+
+  for (uint64_t i = beg; i < end; ++i){
+    shards_[i].lock.Lock();
+  }
+  std::vector<SumT> vals;
+  for (uint64_t i = beg; i < end; ++i){
+    const uint64_t size = sizes_[i];
+    if (size == 0) continue;
+    vals.resize(vals.size() + size);
+    shards_[i].ps.DecodeTo(&vals[vals.size() - size], 0, size);
+  }
+  Distribute(vals, beg, end);
+  __atomic_store_n(&rebalance_num_, rebalance_num_ + 1, __ATOMIC_RELAXED);
+  for (uint64_t i = beg; i < end; ++i){
+    shards_[i].lock.Unlock();
+  }
+  layout_lock_.Unlock();
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+void BasicShardedPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::Distribute(const std::vector<SumT>& vals, uint64_t beg, uint64_t end){
+  const uint64_t width = end - beg;
+  for (uint64_t i = beg; i < end; ++i){
+    const uint64_t first = vals.size() * (i - beg) / width;
+    const uint64_t last  = vals.size() * (i - beg + 1) / width;
+    shards_[i].ps.Build(vals.begin() + first, vals.begin() + last);
+    StoreSize(i, last - first);
+    StoreSum(i, shards_[i].ps.Sum());
+  }
+}
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+uint64_t BasicShardedPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::GetAllocatedBytes() const{
+  uint64_t bytes = sizeof(*this) + sizeof(ShardEntry) * shard_num_ + sizeof(IndexT) * sizes_.capacity();
+  for (uint64_t shard = 0; shard < shard_num_; ++shard){
+    shards_[shard].lock.Lock();
+    bytes += shards_[shard].ps.GetAllocatedBytes() - sizeof(Shard);
+    shards_[shard].lock.Unlock();
+  }
+  return bytes;
+}
+
+template class BasicShardedPrefixSum<uint64_t, uint64_t, 64, 256>;
+template class BasicShardedPrefixSum<uint32_t, uint32_t, 32, 256>;
+template class BasicShardedPrefixSum<uint64_t, uint64_t, 64, 256, true>;
+
+} // namespace prefixsum
@@ -0,0 +1,217 @@
+/* 
+ *  Copyright (c) 2012 Daisuke Okanohara
+  * 
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ * 
+ *   1. Redistributions of source code must retain the above Copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above Copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the authors nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ */
+
+#ifndef PREFIX_SUM_SHARDED_PREFIX_SUM_HPP_
+#define PREFIX_SUM_SHARDED_PREFIX_SUM_HPP_
+
+#include <stdint.h>
+#include <vector>
+#include "PrefixSum.hpp"
+#include "VersionLock.hpp"
+
+namespace prefixsum{
+
+/**
+ * Prefix sum updated by concurrent threads, which range-partitions the
+ * values into shards of independent BasicPrefixSum, each with its own
+ * lock, so that threads updating different shards never wait for each
+ * other. vs is the concatenation of the shards.
+ *
+ * The sizes of the shards are the layout, which routes an index to its
+ * shard. A query or an update reads the layout optimistically, locks the
+ * shard and retries if the layout has changed meanwhile, so that it
+ * works on the shard of a consistent layout. Insert and Erase change
+ * the size and the sum of their shard under the layout lock, which
+ * they hold only for those two stores, and then update the shard under
+ * its lock alone. The sums of the shards are kept beside them for
+ * GetPrefixSum, Find and Sum, which add up the preceding shards without
+ * locking them: each shard is seen atomically, but updates of different
+ * shards may be seen in a different order than they were applied.
+ *
+ * A shard is rebalanced after an Insert or an Erase if its size is more
+ * than 3/2, or less than half, of the average size (with a slack of
+ * LeafNum values). The smallest window of shards around it whose
+ * average is close to the overall average is then rebuilt with equal
+ * sizes, while the layout is locked.
+ */
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums = false>
+class BasicShardedPrefixSum{
+public:
+  typedef BasicPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums> Shard;
+
+  /**
+   * Constructor with shard_num (> 0) empty shards
+   */
+  explicit BasicShardedPrefixSum(uint64_t shard_num);
+
+  /**
+   * Constructor with values [first, last) divided equally into shard_num shards
+   */
+  template <class Iterator>
+  BasicShardedPrefixSum(uint64_t shard_num, Iterator first, Iterator last);
+
+  /**
+   * Destructor
+   */
+  ~BasicShardedPrefixSum();
+
+  /**
+   * Insert val between vs[ind-1] and vs[ind] (ind <= Num())
+   */
+  void Insert(IndexT ind, SumT val);
+
+  /**
+   * Remove vs[ind]
+   */
+  void Erase(IndexT ind);
+
+  /**
+   * vs[ind] <- vs[ind] + val
+   */
+  void Increment(IndexT ind, SumT val);
+
+  /**
+   * vs[ind] <- vs[ind] - val
+   */
+  void Decrement(IndexT ind, SumT val);
+
+  /**
+   * vs[ind] <- val
+   */
+  void Set(IndexT ind, SumT val);
+
+  /**
+   * Return vs[ind]
+   */
+  SumT Get(IndexT ind) const;
+
+  /**
+   * Return vs[0] + ... + vs[ind-1]
+   */
+  SumT GetPrefixSum(IndexT ind) const;
+
+  /**
+   * Return ind s.t. GetPrefixSum(ind) <= val < GetPrefixSum(ind+1)
+   */
+  IndexT Find(SumT val) const;
+
+  IndexT Num() const;
+  SumT Sum() const;
+
+  uint64_t ShardNum() const{
+    return shard_num_;
+  }
+
+  /**
+   * Return the shard of vs[ind], so that threads partitioning their
+   * updates by shard do not contend
+   */
+  uint64_t GetShard(IndexT ind) const;
+
+  /**
+   * Return the number of values in the shard
+   */
+  IndexT GetShardSize(uint64_t shard) const;
+
+  /**
+   * Return the number of rebalances so far
+   */
+  uint64_t GetRebalanceNum() const;
+
+  uint64_t GetAllocatedBytes() const;
+
+private:
+  BasicShardedPrefixSum(const BasicShardedPrefixSum&);
+  BasicShardedPrefixSum& operator=(const BasicShardedPrefixSum&);
+
+  struct ShardEntry{
+    ShardEntry() : sum(0){
+    }
+
+    VersionLock lock;
+    Shard ps;
+    SumT sum;             // ps.Sum(), read without the lock
+    char padding[64];     // keeps the locks of the shards in different cache lines
+  };
+
+  enum UpdateType{
+    INCREMENT = 0,
+    DECREMENT = 1,
+    SET       = 2
+  };
+
+  // return the shard of vs[ind] in the current layout and set offset
+  // to the index in the shard. If insert is true, an index at the end
+  // of a shard goes to the shard.
+  uint64_t Route(IndexT ind, bool insert, IndexT& offset) const;
+
+  // lock the shard of vs[ind] in a layout which has not changed since
+  // the routing, and return it
+  uint64_t LockShard(IndexT ind, bool insert, IndexT& offset) const;
+
+  // lock the shard of vs[ind] and the layout, and return the shard
+  uint64_t LockLayout(IndexT ind, bool insert, IndexT& offset);
+
+  void Update(UpdateType type, IndexT ind, SumT val);
+
+  // divide vals equally into the shards [beg, end), whose locks are held
+  void Distribute(const std::vector<SumT>& vals, uint64_t beg, uint64_t end);
+
+  static bool IsUnbalanced(IndexT size, IndexT num, uint64_t shard_num);
+
+  // rebalance the shard and its neighbours if it is still unbalanced
+  void Rebalance(uint64_t shard);
+
+  IndexT LoadSize(uint64_t shard) const{
+    return __atomic_load_n(&sizes_[shard], __ATOMIC_RELAXED);
+  }
+
+  void StoreSize(uint64_t shard, IndexT size){
+    __atomic_store_n(&sizes_[shard], size, __ATOMIC_RELAXED);
+  }
+
+  SumT LoadSum(uint64_t shard) const{
+    return __atomic_load_n(&shards_[shard].sum, __ATOMIC_RELAXED);
+  }
+
+  void StoreSum(uint64_t shard, SumT sum){
+    __atomic_store_n(&shards_[shard].sum, sum, __ATOMIC_RELAXED);
+  }
+
+  ShardEntry* shards_;
+  std::vector<IndexT> sizes_;  // separate from shards_, since they change rarely
+  uint64_t shard_num_;
+  VersionLock layout_lock_;
+  uint64_t rebalance_num_;
+};
+
+template <class IndexT, class SumT, uint64_t MaxWidth, uint64_t LeafNum, bool CacheSums>
+template <class Iterator>
+BasicShardedPrefixSum<IndexT, SumT, MaxWidth, LeafNum, CacheSums>::BasicShardedPrefixSum(uint64_t shard_num, Iterator first, Iterator last) :
+  shards_(new ShardEntry[shard_num]), sizes_(shard_num), shard_num_(shard_num), rebalance_num_(0){
+  Distribute(std::vector<SumT>(first, last), 0, shard_num);
+}
+
+typedef BasicShardedPrefixSum<uint64_t, uint64_t, 64, 256> ShardedPrefixSum;
+typedef BasicShardedPrefixSum<uint32_t, uint32_t, 32, 256> ShardedPrefixSum32;
+typedef BasicShardedPrefixSum<uint64_t, uint64_t, 64, 256, true> CachedShardedPrefixSum;
+
+} // namespace prefixsum
+
+#endif // PREFIX_SUM_SHARDED_PREFIX_SUM_HPP_
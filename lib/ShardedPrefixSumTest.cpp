@@ -0,0 +1,205 @@
+/* 
+ *  Copyright (c) 2012 Daisuke Okanohara
+  * 
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ * 
+ *   1. Redistributions of source code must retain the above Copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above Copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the authors nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ */
+
+#include <vector>
+#include <cstdlib>
+#include <gtest/gtest.h>
+#include "ShardedPrefixSum.hpp"
+#include "StressTest.hpp"
+
+using namespace std;
+using namespace prefixsum;
+using namespace stress;
+
+namespace {
+
+template <class PrefixSumT, class SumT>
+void CheckAll(const PrefixSumT& ps, const vector<SumT>& vals){
+  ASSERT_EQ(vals.size(), ps.Num());
+  uint64_t size_sum = 0;
+  for (uint64_t shard = 0; shard < ps.ShardNum(); ++shard){
+    size_sum += ps.GetShardSize(shard);
+  }
+  ASSERT_EQ(vals.size(), size_sum);
+  SumT sum = 0;
+  for (uint64_t i = 0; i < vals.size(); ++i){
+    ASSERT_EQ(vals[i], ps.Get(i)) << " i=" << i;
+    ASSERT_EQ(sum, ps.GetPrefixSum(i)) << " i=" << i;
+    if (vals[i] > 0){
+      ASSERT_EQ(i, ps.Find(sum)) << " i=" << i;
+      ASSERT_EQ(i, ps.Find(sum + vals[i] - 1)) << " i=" << i;
+    }
+    sum += vals[i];
+  }
+  ASSERT_EQ(sum, ps.GetPrefixSum(vals.size()));
+  ASSERT_EQ(sum, ps.Sum());
+  ASSERT_EQ(vals.size(), ps.Find(sum));
+}
+
+// no shard is more than 3/2 of the average (with the slack of a leaf)
+template <class PrefixSumT>
+void CheckBalanced(const PrefixSumT& ps){
+  const uint64_t average = ps.Num() / ps.ShardNum();
+  for (uint64_t shard = 0; shard < ps.ShardNum(); ++shard){
+    ASSERT_LE(2 * ps.GetShardSize(shard), 3 * average + 2 * 256) << " shard=" << shard;
+  }
+}
+
+template <class PrefixSumT, class SumT>
+void CheckSequential(uint64_t shard_num){
+  PrefixSumT ps(shard_num);
+  vector<SumT> vals;
+  CheckAll(ps, vals);
+
+  // appends and insertions at the front go to the end shards until rebalanced
+  for (uint64_t i = 0; i < 10000; ++i){
+    const uint64_t val = rand() % 100;
+    const uint64_t pos = (i % 2 == 0) ? vals.size() : 0;
+    ps.Insert(pos, val);
+    vals.insert(vals.begin() + pos, val);
+  }
+  CheckAll(ps, vals);
+  CheckBalanced(ps);
+  if (shard_num > 1){
+    ASSERT_LT(0U, ps.GetRebalanceNum());
+  }
+
+  for (uint64_t i = 0; i < 20000; ++i){
+    const uint64_t pos = vals.empty() ? 0 : rand() % vals.size();
+    const uint64_t val = (rand() % 100 == 0) ? 1LLU << 20 : rand() % 100;
+    switch (rand() % 6){
+    case 0:
+      ps.Insert(pos, val);
+      vals.insert(vals.begin() + pos, val);
+      break;
+    case 1:
+      if (!vals.empty()){
+        ps.Erase(pos);
+        vals.erase(vals.begin() + pos);
+      }
+      break;
+    case 2:
+      if (!vals.empty()){
+        ps.Increment(pos, val);
+        vals[pos] += val;
+      }
+      break;
+    case 3:
+      if (!vals.empty() && vals[pos] >= val){
+        ps.Decrement(pos, val);
+        vals[pos] -= val;
+      }
+      break;
+    case 4:
+      if (!vals.empty()){
+        ps.Set(pos, val);
+        vals[pos] = val;
+      }
+      break;
+    default:
+      if (!vals.empty()){
+        ASSERT_EQ(vals[pos], ps.Get(pos));
+        ASSERT_EQ(ps.GetShard(pos), ps.GetShard(pos));
+      }
+    }
+  }
+  CheckAll(ps, vals);
+
+  // erasures from the front leave the shards there empty until rebalanced
+  while (vals.size() > 1000){
+    ps.Erase(0);
+    vals.erase(vals.begin());
+  }
+  CheckAll(ps, vals);
+  while (!vals.empty()){
+    ps.Erase(vals.size() - 1);
+    vals.pop_back();
+  }
+  CheckAll(ps, vals);
+  ASSERT_EQ(0U, ps.Find(0));
+
+  vector<SumT> built(5000);
+  for (uint64_t i = 0; i < built.size(); ++i){
+    built[i] = rand() % 1000;
+  }
+  PrefixSumT ps2(shard_num, built.begin(), built.end());
+  CheckAll(ps2, built);
+  CheckBalanced(ps2);
+  ASSERT_EQ(0U, ps2.GetRebalanceNum());
+}
+
+// Insert at the end of the tagged values rebalances their shards
+struct ShardedOps{
+  static const bool ERASE = true;
+
+  template <class PrefixSumT>
+  static bool Insert(PrefixSumT& ps, uint64_t pos){
+    ps.Insert(pos, 0);
+    return true;
+  }
+
+  template <class PrefixSumT>
+  static void Erase(PrefixSumT& ps, uint64_t pos){
+    ps.Erase(pos);
+  }
+};
+
+template <class PrefixSumT>
+void CheckStress(bool monotone){
+  const uint64_t num = 5000;
+  const uint64_t writer_num = 4;
+  const uint64_t reader_num = 4;
+  StressState<PrefixSumT> state;
+  state.num = num;
+  state.writer_num = writer_num;
+  state.op_num = 50000;
+  state.monotone = monotone;
+  state.expected.resize(num);
+  for (uint64_t i = 0; i < num; ++i){
+    state.expected[i] = i % TAG_MOD;
+  }
+  PrefixSumT ps(writer_num, state.expected.begin(), state.expected.end());
+  state.ps = &ps;
+  RunStress<PrefixSumT, ShardedOps>(state, reader_num);
+  ASSERT_LT(0U, ps.GetRebalanceNum());
+
+  vector<uint64_t> vals(state.expected);
+  vals.resize(num + state.inserted - state.erased, 0);
+  CheckAll(ps, vals);
+}
+
+}
+
+TEST(ShardedPrefixSum, sequential){
+  for (uint64_t shard_num = 1; shard_num <= 16; shard_num *= 2){
+    CheckSequential<ShardedPrefixSum, uint64_t>(shard_num);
+    CheckSequential<ShardedPrefixSum32, uint32_t>(shard_num);
+    CheckSequential<CachedShardedPrefixSum, uint64_t>(shard_num);
+  }
+}
+
+TEST(ShardedPrefixSum, stress_increment){
+  CheckStress<ShardedPrefixSum>(true);
+  CheckStress<ShardedPrefixSum32>(true);
+}
+
+TEST(ShardedPrefixSum, stress_mixed){
+  CheckStress<ShardedPrefixSum>(false);
+  CheckStress<CachedShardedPrefixSum>(false);
+}
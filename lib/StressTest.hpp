@@ -0,0 +1,182 @@
+/* 
+ *  Copyright (c) 2012 Daisuke Okanohara
+  * 
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ * 
+ *   1. Redistributions of source code must retain the above Copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above Copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the authors nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ */
+
+#ifndef PREFIX_SUM_STRESS_TEST_HPP_
+#define PREFIX_SUM_STRESS_TEST_HPP_
+
+#include <vector>
+#include <cstdlib>
+#include <pthread.h>
+#include <gtest/gtest.h>
+
+/**
+ * Stress test of a prefix sum updated and read by threads at once,
+ * shared by the tests of the concurrent containers. Ops adapts the
+ * container: Ops::Insert(ps, pos) inserts 0 at pos and returns false if
+ * it is full, and Ops::Erase(ps, pos) erases vs[pos] if Ops::ERASE.
+ */
+namespace stress{
+
+// vs[i] = i % TAG_MOD (mod TAG_MOD) for i < num, which every update keeps,
+// and the values inserted after them are 0
+const uint64_t TAG_MOD = 8;
+
+template <class PrefixSumT>
+struct StressState{
+  PrefixSumT* ps;
+  uint64_t num;          // the tagged values
+  uint64_t writer_num;
+  uint64_t op_num;
+  bool monotone;         // only Increment and Insert
+  std::vector<uint64_t> expected;
+  uint64_t inserted;
+  uint64_t erased;
+  uint64_t finished;     // writers
+  uint64_t errors;
+};
+
+template <class PrefixSumT>
+struct WriterArg{
+  StressState<PrefixSumT>* state;
+  uint64_t id;
+};
+
+inline void AddError(uint64_t& errors){
+  __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+}
+
+// the writer id updates vs[i] for i = id (mod writer_num), and only the
+// writer 0 erases, so that the inserted values it erases are there
+template <class PrefixSumT, class Ops>
+void* StressWriter(void* p){
+  WriterArg<PrefixSumT>* arg = static_cast<WriterArg<PrefixSumT>*>(p);
+  StressState<PrefixSumT>& state = *arg->state;
+  PrefixSumT& ps = *state.ps;
+  unsigned int seed = arg->id;
+  for (uint64_t k = 0; k < state.op_num; ++k){
+    const uint64_t i = (rand_r(&seed) % (state.num / state.writer_num)) * state.writer_num + arg->id;
+    const uint64_t delta = TAG_MOD * (rand_r(&seed) % 100);
+    uint64_t& val = state.expected[i];
+    switch (rand_r(&seed) % (state.monotone ? 2 : (Ops::ERASE ? 5 : 4))){
+    case 0:
+      // at the end of the tagged values
+      if (Ops::Insert(ps, state.num + rand_r(&seed) % (ps.Num() - state.num + 1))){
+        __atomic_fetch_add(&state.inserted, 1, __ATOMIC_RELAXED);
+      }
+      break;
+    case 1:
+      ps.Increment(i, delta);
+      val += delta;
+      break;
+    case 2:
+      if (val >= delta){
+        ps.Decrement(i, delta);
+        val -= delta;
+      }
+      break;
+    case 3:
+      ps.Set(i, i % TAG_MOD + delta);
+      val = i % TAG_MOD + delta;
+      break;
+    case 4: {
+      const uint64_t cur_num = ps.Num();
+      if (arg->id == 0 && cur_num > state.num){
+        Ops::Erase(ps, state.num + rand_r(&seed) % (cur_num - state.num));
+        __atomic_fetch_add(&state.erased, 1, __ATOMIC_RELAXED);
+      }
+      break;
+    }
+    }
+  }
+  __atomic_fetch_add(&state.finished, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+// check the invariants of every state, and in the monotone case,
+// that no query goes back in time
+template <class PrefixSumT, class Ops>
+void* StressReader(void* p){
+  StressState<PrefixSumT>& state = *static_cast<StressState<PrefixSumT>*>(p);
+  const PrefixSumT& ps = *state.ps;
+  const uint64_t num = state.num;
+  unsigned int seed = 12345;
+  std::vector<uint64_t> tag_sums(num + 1, 0);  // of the first values
+  for (uint64_t i = 0; i < num; ++i){
+    tag_sums[i+1] = tag_sums[i] + i % TAG_MOD;
+  }
+  const uint64_t tag_sum = tag_sums[num];
+  std::vector<uint64_t> last_sums(num + 1, 0);
+  std::vector<uint64_t> last_finds(tag_sum, num);
+  uint64_t last_num = 0;
+  while (__atomic_load_n(&state.finished, __ATOMIC_ACQUIRE) < state.writer_num){
+    const uint64_t i = rand_r(&seed) % num;
+    const uint64_t val = ps.Get(i);
+    if (val % TAG_MOD != i % TAG_MOD) AddError(state.errors);
+
+    // the values after the tagged ones may be erased meanwhile
+    const uint64_t cur_num = ps.Num();
+    if (cur_num < num || ((!Ops::ERASE || state.monotone) && cur_num < last_num)) AddError(state.errors);
+    last_num = cur_num;
+    if (!Ops::ERASE && cur_num > num && ps.Get(num + rand_r(&seed) % (cur_num - num)) != 0){
+      AddError(state.errors);
+    }
+
+    const uint64_t j = rand_r(&seed) % (num + 1);
+    const uint64_t sum = ps.GetPrefixSum(j);
+    if (sum % TAG_MOD != tag_sums[j] % TAG_MOD) AddError(state.errors);
+    if (state.monotone && sum < last_sums[j]) AddError(state.errors);
+    last_sums[j] = sum;
+    if (ps.Sum() % TAG_MOD != tag_sum % TAG_MOD) AddError(state.errors);
+
+    // the tags are the least values, so Find in their sum is in the tagged values
+    const uint64_t v = rand_r(&seed) % tag_sum;
+    const uint64_t f = ps.Find(v);
+    if (f >= num) AddError(state.errors);
+    if (state.monotone && f > last_finds[v]) AddError(state.errors);
+    last_finds[v] = f;
+  }
+  return NULL;
+}
+
+// initialize the counters of state, and run its writers and reader_num readers
+template <class PrefixSumT, class Ops>
+void RunStress(StressState<PrefixSumT>& state, uint64_t reader_num){
+  state.inserted = 0;
+  state.erased = 0;
+  state.finished = 0;
+  state.errors = 0;
+  std::vector<WriterArg<PrefixSumT> > args(state.writer_num);
+  std::vector<pthread_t> threads(state.writer_num + reader_num);
+  for (uint64_t t = 0; t < state.writer_num; ++t){
+    args[t].state = &state;
+    args[t].id = t;
+    ASSERT_EQ(0, pthread_create(&threads[t], NULL, StressWriter<PrefixSumT, Ops>, &args[t]));
+  }
+  for (uint64_t t = state.writer_num; t < threads.size(); ++t){
+    ASSERT_EQ(0, pthread_create(&threads[t], NULL, StressReader<PrefixSumT, Ops>, &state));
+  }
+  for (uint64_t t = 0; t < threads.size(); ++t){
+    pthread_join(threads[t], NULL);
+  }
+  ASSERT_EQ(0U, state.errors);
+}
+
+} // namespace stress
+
+#endif // PREFIX_SUM_STRESS_TEST_HPP_
@@ -0,0 +1,101 @@
+/* 
+ *  Copyright (c) 2012 Daisuke Okanohara
+  * 
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ * 
+ *   1. Redistributions of source code must retain the above Copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above Copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the authors nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ */
+
+#ifndef PREFIX_SUM_VERSION_LOCK_HPP_
+#define PREFIX_SUM_VERSION_LOCK_HPP_
+
+#include <sched.h>
+#include <stdint.h>
+
+namespace prefixsum{
+
+/**
+ * Lock for optimistic lock coupling.
+ * The version is odd while a writer holds the lock and every Unlock()
+ * advances it, so that a reader takes the version by ReadLock(), reads
+ * the protected data without locking, and retries if Validate() fails.
+ * A waiting thread yields after a few spins, since the holder may have
+ * been preempted.
+ */
+class VersionLock{
+public:
+  static const uint64_t SPIN_NUM = 64;
+
+  VersionLock() : version_(0){
+  }
+
+  // wait until no writer holds the lock, and return the version
+  uint64_t ReadLock() const{
+    for (uint64_t spin = 0; ; ++spin){
+      const uint64_t version = __atomic_load_n(&version_, __ATOMIC_ACQUIRE);
+      if ((version & 1) == 0) return version;
+      Wait(spin);
+    }
+  }
+
+  // return true if no writer has locked since ReadLock() returned version
+  bool Validate(uint64_t version) const{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&version_, __ATOMIC_RELAXED) == version;
+  }
+
+  void Lock(){
+    for (uint64_t spin = 0; ; ++spin){
+      uint64_t version = __atomic_load_n(&version_, __ATOMIC_RELAXED);
+      if ((version & 1) == 0 &&
+          __atomic_compare_exchange_n(&version_, &version, version + 1, false,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+        // the odd version is visible before the following writes
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        return;
+      }
+      Wait(spin);
+    }
+  }
+
+  // lock if no writer has locked since ReadLock() returned version,
+  // or return false without waiting
+  bool TryLock(uint64_t version){
+    if (!__atomic_compare_exchange_n(&version_, &version, version + 1, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+      return false;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return true;
+  }
+
+  // the waiting threads access version_ meanwhile, so it is read atomically
+  void Unlock(){
+    __atomic_store_n(&version_, __atomic_load_n(&version_, __ATOMIC_RELAXED) + 1, __ATOMIC_RELEASE);
+  }
+
+private:
+  VersionLock(const VersionLock&);
+  VersionLock& operator=(const VersionLock&);
+
+  static void Wait(uint64_t spin){
+    if (spin >= SPIN_NUM) sched_yield();
+  }
+
+  uint64_t version_;
+};
+
+} // namespace prefixsum
+
+#endif // PREFIX_SUM_VERSION_LOCK_HPP_
@@ -1,10 +1,32 @@
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
 #include "../lib/PrefixSum.hpp"
 #include "../lib/BitUtil.hpp"
+#include "../lib/BitKernel.hpp"
+#include "../lib/FrozenPrefixSum.hpp"
+#include "../lib/EliasFanoPrefixSum.hpp"
+#include "../lib/ConcurrentPrefixSum.hpp"
+#include "../lib/ShardedPrefixSum.hpp"
 
 using namespace std;
 
-int main(int argc, char* argv[]){
+namespace {
+
+double GetTime(){
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+int MemoryTest(){
   prefixsum::PrefixSum ps;
   uint64_t num = 1000000;
   uint64_t maxval = 100;
@@ -24,3 +46,1071 @@ int main(int argc, char* argv[]){
        << "           ratio " << (float)alloc_bytes / optimal_bytes << endl;
   return 0;
 }
+
+void DepthTestOrder(const string& order){
+  prefixsum::PrefixSum ps;
+  uint64_t num = 1000000;
+  uint64_t maxval = 100;
+  double start = GetTime();
+  for (uint64_t i = 0; i < num; ++i){
+    uint64_t pos = 0;
+    if      (order == "sequential") pos = i;
+    else if (order == "reverse")    pos = 0;
+    else                            pos = rand() % (i+1);
+    ps.Insert(pos, rand() % maxval);
+  }
+  double insert_time = GetTime() - start;
+
+  uint64_t query_num = 1000000;
+  vector<uint64_t> inds(query_num);
+  vector<uint64_t> vals(query_num);
+  for (uint64_t i = 0; i < query_num; ++i){
+    inds[i] = rand() % num;
+    vals[i] = rand() % ps.Sum();
+  }
+  uint64_t dummy = 0;
+  start = GetTime();
+  for (uint64_t i = 0; i < query_num; ++i){
+    dummy += ps.Get(inds[i]);
+  }
+  double get_time = GetTime() - start;
+  start = GetTime();
+  for (uint64_t i = 0; i < query_num; ++i){
+    dummy += ps.GetPrefixSum(inds[i]);
+  }
+  double prefix_sum_time = GetTime() - start;
+  start = GetTime();
+  for (uint64_t i = 0; i < query_num; ++i){
+    dummy += ps.Find(vals[i]);
+  }
+  double find_time = GetTime() - start;
+
+  cout << "           order " << order << endl
+       << "           depth " << ps.Depth() << endl
+       << "    insert ns/op " << insert_time * 1e9 / num << endl
+       << "       get ns/op " << get_time * 1e9 / query_num << endl
+       << " prefixsum ns/op " << prefix_sum_time * 1e9 / query_num << endl
+       << "      find ns/op " << find_time * 1e9 / query_num << endl
+       << "           dummy " << dummy << endl;
+}
+
+int DepthTest(){
+  DepthTestOrder("sequential");
+  DepthTestOrder("reverse");
+  DepthTestOrder("random");
+  return 0;
+}
+
+int BuildTest(){
+  uint64_t num = 10000000;
+  uint64_t maxval = 100;
+  vector<uint64_t> vals(num);
+  for (uint64_t i = 0; i < num; ++i){
+    vals[i] = rand() % maxval;
+  }
+
+  double start = GetTime();
+  prefixsum::PrefixSum ps_insert;
+  for (uint64_t i = 0; i < num; ++i){
+    ps_insert.Insert(i, vals[i]);
+  }
+  double insert_time = GetTime() - start;
+
+  start = GetTime();
+  prefixsum::PrefixSum ps_build(vals.begin(), vals.end());
+  double build_time = GetTime() - start;
+
+  cout << "             num " << num << endl
+       << "     insert time " << insert_time << endl
+       << "      build time " << build_time << endl
+       << "         speedup " << insert_time / build_time << endl
+       << "    insert bytes " << ps_insert.GetAllocatedBytes() << endl
+       << "     build bytes " << ps_build.GetAllocatedBytes() << endl;
+  return 0;
+}
+
+// count the number of allocations for the increment benchmark
+class CountingAllocator : public prefixsum::Allocator{
+public:
+  CountingAllocator() : allocate_num(0){
+  }
+  void* Allocate(uint64_t bytes){
+    ++allocate_num;
+    return arena.Allocate(bytes);
+  }
+  void Free(void* ptr, uint64_t bytes){
+    arena.Free(ptr, bytes);
+  }
+  void Clear(){
+    arena.Clear();
+  }
+  uint64_t GetAllocatedBytes() const{
+    return arena.GetAllocatedBytes();
+  }
+
+  prefixsum::Arena arena;
+  uint64_t allocate_num;
+};
+
+void IncrementTestDist(const string& dist){
+  uint64_t num = 1000000;
+  uint64_t op_num = 10000000;
+  CountingAllocator* allocator = new CountingAllocator;
+  prefixsum::PrefixSum ps(allocator);
+  vector<uint64_t> zeros(num);
+  ps.Build(zeros.begin(), zeros.end());
+
+  vector<uint64_t> inds(op_num);
+  for (uint64_t i = 0; i < op_num; ++i){
+    if (dist == "hot"){
+      inds[i] = (rand() % 10 > 0) ? rand() % 1000 : rand() % num;
+    } else {
+      inds[i] = rand() % num;
+    }
+  }
+  uint64_t allocate_num = allocator->allocate_num;
+  double start = GetTime();
+  for (uint64_t i = 0; i < op_num; ++i){
+    ps.Increment(inds[i], 1);
+  }
+  double time = GetTime() - start;
+  allocate_num = allocator->allocate_num - allocate_num;
+
+  cout << "            dist " << dist << endl
+       << " increment ns/op " << time * 1e9 / op_num << endl
+       << "    allocs/M ops " << (double)allocate_num * 1000000 / op_num << endl
+       << " allocated_bytes " << ps.GetAllocatedBytes() << endl;
+}
+
+int IncrementTest(){
+  IncrementTestDist("hot");
+  IncrementTestDist("uniform");
+  return 0;
+}
+
+void EncodingTestDist(const string& dist){
+  typedef prefixsum::PrefixSumLeaf Leaf;
+  uint64_t leaf_num = 4096;
+  uint64_t num = leaf_num * Leaf::MAX_NUM;
+  vector<uint64_t> vals(num);
+  for (uint64_t i = 0; i < num; ++i){
+    if (dist == "dense"){
+      vals[i] = rand() % 100;
+    } else if (dist == "sparse"){
+      vals[i] = (rand() % 100 == 0) ? rand() % (1 << 20) : 0;
+    } else if (dist == "skewed"){
+      vals[i] = (rand() % 256 == 0) ? 1LLU << 40 : rand() % 16;
+    } else {
+      vals[i] = (i == 0 || rand() % 64 > 0) ? vals[i-1 + (i == 0)] : rand() % 1000;
+    }
+  }
+  uint64_t query_num = 1000000;
+  vector<uint64_t> leaf_inds(query_num);
+  vector<uint64_t> inds(query_num);
+  for (uint64_t i = 0; i < query_num; ++i){
+    leaf_inds[i] = rand() % leaf_num;
+    inds[i] = rand() % Leaf::MAX_NUM;
+  }
+
+  const char* names[] = {"bit_sliced", "packed", "sparse", "run_length", "adaptive"};
+  cout << "            dist " << dist << endl;
+  for (uint64_t e = 0; e < 5; ++e){
+    Leaf* leaves = new Leaf[leaf_num];
+    uint64_t bytes = 0;
+    uint64_t encoding_num[4] = {0, 0, 0, 0};
+    for (uint64_t i = 0; i < leaf_num; ++i){
+      if (e < 4){
+        leaves[i].Build(&vals[i * Leaf::MAX_NUM], Leaf::MAX_NUM, static_cast<Leaf::Encoding>(e));
+      } else {
+        leaves[i].Build(&vals[i * Leaf::MAX_NUM], Leaf::MAX_NUM);
+      }
+      bytes += leaves[i].GetAllocatedBytes();
+      ++encoding_num[leaves[i].GetEncoding()];
+    }
+    vector<uint64_t> sums(query_num);
+    for (uint64_t i = 0; i < query_num; ++i){
+      const Leaf& leaf = leaves[leaf_inds[i]];
+      sums[i] = (leaf.Sum() == 0) ? 0 : rand() % leaf.Sum();
+    }
+    uint64_t dummy = 0;
+    double start = GetTime();
+    for (uint64_t i = 0; i < query_num; ++i){
+      dummy += leaves[leaf_inds[i]].Get(inds[i]);
+    }
+    double get_time = GetTime() - start;
+    start = GetTime();
+    for (uint64_t i = 0; i < query_num; ++i){
+      dummy += leaves[leaf_inds[i]].GetPrefixSum(inds[i]);
+    }
+    double prefix_sum_time = GetTime() - start;
+    start = GetTime();
+    for (uint64_t i = 0; i < query_num; ++i){
+      dummy += leaves[leaf_inds[i]].Find(sums[i]);
+    }
+    double find_time = GetTime() - start;
+    delete[] leaves;
+
+    cout << "        encoding " << names[e] << endl
+         << "   bytes/element " << (double)bytes / num << endl
+         << "       get ns/op " << get_time * 1e9 / query_num << endl
+         << " prefixsum ns/op " << prefix_sum_time * 1e9 / query_num << endl
+         << "      find ns/op " << find_time * 1e9 / query_num << endl;
+    if (e == 4){
+      cout << "          leaves " << encoding_num[0] << " " << encoding_num[1] << " "
+           << encoding_num[2] << " " << encoding_num[3] << endl;
+    }
+    cout << "           dummy " << dummy << endl;
+  }
+}
+
+int EncodingTest(){
+  EncodingTestDist("dense");
+  EncodingTestDist("sparse");
+  EncodingTestDist("skewed");
+  EncodingTestDist("runs");
+  return 0;
+}
+
+template <class PrefixSumT>
+void CacheTestType(const string& name){
+  uint64_t num = 1000000;
+  uint64_t op_num = 1000000;
+  vector<uint64_t> vals(num);
+  for (uint64_t i = 0; i < num; ++i){
+    vals[i] = rand() % 100;
+  }
+  PrefixSumT ps(vals.begin(), vals.end());
+  vector<uint64_t> inds(op_num);
+  vector<uint64_t> sums(op_num);
+  for (uint64_t i = 0; i < op_num; ++i){
+    inds[i] = rand() % num;
+    sums[i] = rand() % ps.Sum();
+  }
+
+  uint64_t dummy = 0;
+  double start = GetTime();
+  for (uint64_t i = 0; i < op_num; ++i){
+    dummy += ps.GetPrefixSum(inds[i]);
+  }
+  double prefix_sum_time = GetTime() - start;
+  start = GetTime();
+  for (uint64_t i = 0; i < op_num; ++i){
+    dummy += ps.Find(sums[i]);
+  }
+  double find_time = GetTime() - start;
+  start = GetTime();
+  for (uint64_t i = 0; i < op_num; ++i){
+    ps.Increment(inds[i], 1);
+  }
+  double increment_time = GetTime() - start;
+  start = GetTime();
+  for (uint64_t i = 0; i < op_num; ++i){
+    ps.Set(inds[i], i % 100);
+  }
+  double set_time = GetTime() - start;
+  start = GetTime();
+  for (uint64_t i = 0; i < op_num; ++i){
+    ps.Insert(inds[i], i % 100);
+  }
+  double insert_time = GetTime() - start;
+  start = GetTime();
+  for (uint64_t i = 0; i < op_num; ++i){
+    ps.Erase(inds[i]);
+  }
+  double erase_time = GetTime() - start;
+
+  cout << "           cache " << name << endl
+       << " allocated_bytes " << ps.GetAllocatedBytes() << endl
+       << " prefixsum ns/op " << prefix_sum_time * 1e9 / op_num << endl
+       << "      find ns/op " << find_time * 1e9 / op_num << endl
+       << " increment ns/op " << increment_time * 1e9 / op_num << endl
+       << "       set ns/op " << set_time * 1e9 / op_num << endl
+       << "    insert ns/op " << insert_time * 1e9 / op_num << endl
+       << "     erase ns/op " << erase_time * 1e9 / op_num << endl
+       << "           dummy " << dummy << endl;
+}
+
+// read and write costs of the cached block sums in leaves
+int CacheTest(){
+  CacheTestType<prefixsum::PrefixSum>("off");
+  CacheTestType<prefixsum::CachedPrefixSum>("on");
+  return 0;
+}
+
+// leaf queries and kernels at every level supported by the cpu
+int KernelTest(){
+  typedef prefixsum::BitKernel BitKernel;
+  typedef prefixsum::PrefixSumLeaf Leaf;
+  const BitKernel::Level supported = BitKernel::GetSupportedLevel();
+  uint64_t op_num = 1000000;
+  vector<uint64_t> planes(64 * 1024);
+  for (uint64_t i = 0; i < planes.size(); ++i){
+    planes[i] = ((uint64_t)rand() << 32) ^ rand();
+  }
+  vector<uint64_t> offsets(op_num);
+  vector<uint64_t> ranks(op_num);
+  for (uint64_t i = 0; i < op_num; ++i){
+    offsets[i] = rand() % 1024 * 64;
+    ranks[i] = rand() % prefixsum::BitUtil::PopCount(planes[offsets[i]]);
+  }
+
+  uint64_t leaf_num = 4096;
+  uint64_t num = leaf_num * Leaf::MAX_NUM;
+  const uint64_t maxvals[] = {2, 100, 1LLU << 20};
+  vector<uint64_t> leaf_inds(op_num);
+  vector<uint64_t> inds(op_num);
+  for (uint64_t i = 0; i < op_num; ++i){
+    leaf_inds[i] = rand() % leaf_num;
+    inds[i] = rand() % Leaf::MAX_NUM;
+  }
+
+  cout << "       supported " << BitKernel::GetLevelName(supported) << endl;
+  for (uint64_t l = 0; l <= supported; ++l){
+    BitKernel::SetLevel(static_cast<BitKernel::Level>(l));
+    cout << "           level " << BitKernel::GetLevelName(BitKernel::GetLevel()) << endl;
+    uint64_t dummy = 0;
+    const uint64_t widths[] = {1, 4, 8, 16, 32, 64};
+    for (uint64_t w = 0; w < 6; ++w){
+      double start = GetTime();
+      for (uint64_t i = 0; i < op_num; ++i){
+        dummy += BitKernel::PlaneSum(&planes[offsets[i]], widths[w], 0xFFFFFFFFFFFFFFFFLLU);
+      }
+      cout << "  planesum" << (widths[w] < 10 ? " " : "") << widths[w] << " ns/op "
+           << (GetTime() - start) * 1e9 / op_num << endl;
+    }
+    double start = GetTime();
+    for (uint64_t i = 0; i < op_num; ++i){
+      dummy += BitKernel::Select(planes[offsets[i]], ranks[i]);
+    }
+    cout << "    select ns/op " << (GetTime() - start) * 1e9 / op_num << endl;
+
+    for (uint64_t m = 0; m < 3; ++m){
+      vector<uint64_t> vals(num);
+      for (uint64_t i = 0; i < num; ++i){
+        vals[i] = rand() % maxvals[m];
+      }
+      Leaf* leaves = new Leaf[leaf_num];
+      for (uint64_t i = 0; i < leaf_num; ++i){
+        leaves[i].Build(&vals[i * Leaf::MAX_NUM], Leaf::MAX_NUM, Leaf::BIT_SLICED);
+      }
+      vector<uint64_t> sums(op_num);
+      for (uint64_t i = 0; i < op_num; ++i){
+        sums[i] = rand() % leaves[leaf_inds[i]].Sum();
+      }
+      start = GetTime();
+      for (uint64_t i = 0; i < op_num; ++i){
+        dummy += leaves[leaf_inds[i]].GetPrefixSum(inds[i]);
+      }
+      double prefix_sum_time = GetTime() - start;
+      start = GetTime();
+      for (uint64_t i = 0; i < op_num; ++i){
+        dummy += leaves[leaf_inds[i]].Find(sums[i]);
+      }
+      double find_time = GetTime() - start;
+      delete[] leaves;
+      cout << "           width " << prefixsum::BitUtil::GetBinaryLen(maxvals[m] - 1) << endl
+           << " prefixsum ns/op " << prefix_sum_time * 1e9 / op_num << endl
+           << "      find ns/op " << find_time * 1e9 / op_num << endl;
+    }
+    cout << "           dummy " << dummy << endl;
+  }
+  BitKernel::SetLevel(supported);
+  return 0;
+}
+
+// inserts and erases per second by the width of values, at every kernel level
+int InsertTest(){
+  typedef prefixsum::BitKernel BitKernel;
+  const BitKernel::Level supported = BitKernel::GetSupportedLevel();
+  uint64_t num = 1000000;
+  uint64_t op_num = 1000000;
+  const uint64_t widths[] = {1, 4, 8, 16, 32, 64};
+  vector<uint64_t> inds(op_num);
+  for (uint64_t i = 0; i < op_num; ++i){
+    inds[i] = rand() % (num + i);
+  }
+  for (uint64_t w = 0; w < 6; ++w){
+    const uint64_t mask = (widths[w] == 64) ? 0xFFFFFFFFFFFFFFFFLLU : (1LLU << widths[w]) - 1;
+    vector<uint64_t> vals(num + op_num);
+    for (uint64_t i = 0; i < vals.size(); ++i){
+      vals[i] = (((uint64_t)rand() << 32) ^ rand()) & mask;
+    }
+    cout << "           width " << widths[w] << endl;
+    for (uint64_t l = 0; l <= supported; ++l){
+      BitKernel::SetLevel(static_cast<BitKernel::Level>(l));
+      prefixsum::PrefixSum ps(vals.begin(), vals.begin() + num);
+      double start = GetTime();
+      for (uint64_t i = 0; i < op_num; ++i){
+        ps.Insert(inds[i], vals[num + i]);
+      }
+      double insert_time = GetTime() - start;
+      start = GetTime();
+      for (uint64_t i = op_num; i > 0; --i){
+        ps.Erase(inds[i - 1]);
+      }
+      double erase_time = GetTime() - start;
+      cout << "  " << BitKernel::GetLevelName(BitKernel::GetLevel()) << " insert M/s "
+           << op_num / insert_time / 1e6 << " erase M/s " << op_num / erase_time / 1e6 << endl;
+    }
+  }
+  BitKernel::SetLevel(supported);
+  return 0;
+}
+
+// leaf Find by the width of values
+int FindTest(){
+  typedef prefixsum::PrefixSumLeaf Leaf;
+  uint64_t leaf_num = 4096;
+  uint64_t num = leaf_num * Leaf::MAX_NUM;
+  uint64_t op_num = 1000000;
+  // 56 is the largest width whose leaf sums fit in 64 bits
+  const uint64_t widths[] = {1, 2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 56};
+  vector<uint64_t> leaf_inds(op_num);
+  for (uint64_t i = 0; i < op_num; ++i){
+    leaf_inds[i] = rand() % leaf_num;
+  }
+  uint64_t dummy = 0;
+  for (uint64_t w = 0; w < 12; ++w){
+    const uint64_t width = widths[w];
+    const uint64_t mask = (1LLU << width) - 1;
+    vector<uint64_t> vals(num);
+    for (uint64_t i = 0; i < num; ++i){
+      vals[i] = ((((uint64_t)rand() << 32) ^ rand()) & mask) | (1LLU << (width - 1));
+    }
+    Leaf* leaves = new Leaf[leaf_num];
+    for (uint64_t i = 0; i < leaf_num; ++i){
+      leaves[i].Build(&vals[i * Leaf::MAX_NUM], Leaf::MAX_NUM, Leaf::BIT_SLICED);
+    }
+    vector<uint64_t> sums(op_num);
+    for (uint64_t i = 0; i < op_num; ++i){
+      sums[i] = (((uint64_t)rand() << 32) ^ rand()) % leaves[leaf_inds[i]].Sum();
+    }
+    double start = GetTime();
+    for (uint64_t i = 0; i < op_num; ++i){
+      dummy += leaves[leaf_inds[i]].Find(sums[i]);
+    }
+    double find_time = GetTime() - start;
+    delete[] leaves;
+    cout << "           width " << width << endl
+         << "      find ns/op " << find_time * 1e9 / op_num << endl;
+  }
+  cout << "           dummy " << dummy << endl;
+  return 0;
+}
+
+// single queries against the batch queries, in random and sorted order
+int BatchTest(){
+  uint64_t num = 20000000;
+  uint64_t op_num = 4000000;
+  vector<uint64_t> vals(num);
+  for (uint64_t i = 0; i < num; ++i){
+    vals[i] = rand() % 1000;
+  }
+  prefixsum::PrefixSum ps(vals.begin(), vals.end());
+  vector<uint64_t> inds(op_num);
+  vector<uint64_t> sums(op_num);
+  vector<uint64_t> results(op_num);
+  for (int sorted = 0; sorted < 2; ++sorted){
+    for (uint64_t i = 0; i < op_num; ++i){
+      inds[i] = (((uint64_t)rand() << 32) ^ rand()) % num;
+      sums[i] = (((uint64_t)rand() << 32) ^ rand()) % ps.Sum();
+    }
+    if (sorted){
+      sort(inds.begin(), inds.end());
+      sort(sums.begin(), sums.end());
+    }
+    uint64_t dummy = 0;
+    double start = GetTime();
+    for (uint64_t i = 0; i < op_num; ++i){
+      dummy += ps.Get(inds[i]);
+    }
+    double get_time = GetTime() - start;
+    start = GetTime();
+    ps.GetBatch(&inds[0], op_num, &results[0]);
+    double get_batch_time = GetTime() - start;
+    start = GetTime();
+    for (uint64_t i = 0; i < op_num; ++i){
+      dummy += ps.GetPrefixSum(inds[i]);
+    }
+    double prefix_sum_time = GetTime() - start;
+    start = GetTime();
+    ps.GetPrefixSumBatch(&inds[0], op_num, &results[0]);
+    double prefix_sum_batch_time = GetTime() - start;
+    start = GetTime();
+    for (uint64_t i = 0; i < op_num; ++i){
+      dummy += ps.Find(sums[i]);
+    }
+    double find_time = GetTime() - start;
+    start = GetTime();
+    ps.FindBatch(&sums[0], op_num, &results[0]);
+    double find_batch_time = GetTime() - start;
+    dummy += results[op_num / 2];
+    cout << "           order " << (sorted ? "sorted" : "random") << endl
+         << "         get M/s " << op_num / get_time / 1e6
+         << " batch " << op_num / get_batch_time / 1e6 << endl
+         << "   prefixsum M/s " << op_num / prefix_sum_time / 1e6
+         << " batch " << op_num / prefix_sum_batch_time / 1e6 << endl
+         << "        find M/s " << op_num / find_time / 1e6
+         << " batch " << op_num / find_batch_time / 1e6 << endl
+         << "           dummy " << dummy << endl;
+  }
+  return 0;
+}
+
+// single updates against ApplyBatch by the batch size
+int ApplyTest(){
+  typedef prefixsum::PrefixSum PrefixSum;
+  uint64_t num = 10000000;
+  uint64_t op_num = 4000000;
+  vector<uint64_t> vals(num);
+  for (uint64_t i = 0; i < num; ++i){
+    vals[i] = rand() % 1000;
+  }
+  vector<PrefixSum::Update> updates(op_num);
+  for (uint64_t i = 0; i < op_num; ++i){
+    updates[i].type = static_cast<PrefixSum::UpdateType>(rand() % 3);
+    updates[i].ind = (((uint64_t)rand() << 32) ^ rand()) % num;
+    updates[i].val = (updates[i].type == PrefixSum::DECREMENT) ? 0 : rand() % 1000;
+  }
+  PrefixSum ps(vals.begin(), vals.end());
+  double start = GetTime();
+  for (uint64_t i = 0; i < op_num; ++i){
+    const PrefixSum::Update& update = updates[i];
+    if (update.type == PrefixSum::INCREMENT){
+      ps.Increment(update.ind, update.val);
+    } else if (update.type == PrefixSum::DECREMENT){
+      ps.Decrement(update.ind, update.val);
+    } else {
+      ps.Set(update.ind, update.val);
+    }
+  }
+  cout << "          single M/s " << op_num / (GetTime() - start) / 1e6 << endl;
+  const uint64_t sum = ps.Sum();
+
+  const uint64_t batch_nums[] = {10, 100, 1000, 10000, 100000, 1000000};
+  for (uint64_t b = 0; b < 6; ++b){
+    PrefixSum batch_ps(vals.begin(), vals.end());
+    start = GetTime();
+    for (uint64_t i = 0; i < op_num; i += batch_nums[b]){
+      batch_ps.ApplyBatch(&updates[i], min(batch_nums[b], op_num - i));
+    }
+    cout << "   batch " << batch_nums[b] << " M/s " << op_num / (GetTime() - start) / 1e6
+         << ((batch_ps.Sum() == sum) ? "" : " (wrong sum)") << endl;
+  }
+  return 0;
+}
+
+// AddRange against increments, and RangeSum against two prefix sums
+int RangeTest(){
+  uint64_t num = 10000000;
+  uint64_t op_num = 100000;
+  vector<uint64_t> vals(num);
+  for (uint64_t i = 0; i < num; ++i){
+    vals[i] = rand() % 1000;
+  }
+  prefixsum::PrefixSum ps(vals.begin(), vals.end());
+  const uint64_t lens[] = {10, 1000, 100000};
+  for (uint64_t l = 0; l < 3; ++l){
+    vector<uint64_t> begs(op_num);
+    for (uint64_t i = 0; i < op_num; ++i){
+      begs[i] = (((uint64_t)rand() << 32) ^ rand()) % (num - lens[l]);
+    }
+    const uint64_t increment_num = min(op_num, 10000000 / lens[l]);
+    double start = GetTime();
+    for (uint64_t i = 0; i < increment_num; ++i){
+      for (uint64_t j = begs[i]; j < begs[i] + lens[l]; ++j){
+        ps.Increment(j, 1);
+      }
+    }
+    double increment_time = (GetTime() - start) / increment_num;
+    start = GetTime();
+    for (uint64_t i = 0; i < op_num; ++i){
+      ps.AddRange(begs[i], begs[i] + lens[l], 1);
+    }
+    double add_range_time = (GetTime() - start) / op_num;
+    uint64_t dummy = 0;
+    start = GetTime();
+    for (uint64_t i = 0; i < op_num; ++i){
+      dummy += ps.GetPrefixSum(begs[i] + lens[l]) - ps.GetPrefixSum(begs[i]);
+    }
+    double prefix_sum_time = (GetTime() - start) / op_num;
+    start = GetTime();
+    for (uint64_t i = 0; i < op_num; ++i){
+      dummy -= ps.RangeSum(begs[i], begs[i] + lens[l]);
+    }
+    double range_sum_time = (GetTime() - start) / op_num;
+    cout << "          length " << lens[l] << endl
+         << "  increments us/op " << increment_time * 1e6 << endl
+         << "    addrange us/op " << add_range_time * 1e6 << endl
+         << "  prefixsums ns/op " << prefix_sum_time * 1e9 << endl
+         << "    rangesum ns/op " << range_sum_time * 1e9 << endl
+         << "           dummy " << dummy << endl;
+  }
+  return 0;
+}
+
+// full scans by the iterator against a loop of Get
+int ScanTest(){
+  uint64_t num = 10000000;
+  const uint64_t maxvals[] = {2, 1000, 1LLU << 20};
+  for (uint64_t m = 0; m < 3; ++m){
+    vector<uint64_t> vals(num);
+    for (uint64_t i = 0; i < num; ++i){
+      vals[i] = rand() % maxvals[m];
+    }
+    prefixsum::PrefixSum ps(vals.begin(), vals.end());
+    uint64_t dummy = 0;
+    double start = GetTime();
+    for (uint64_t i = 0; i < num; ++i){
+      dummy += ps.Get(i);
+    }
+    double get_time = GetTime() - start;
+    start = GetTime();
+    for (prefixsum::PrefixSum::const_iterator it = ps.begin(); it != ps.end(); ++it){
+      dummy += *it;
+    }
+    double scan_time = GetTime() - start;
+    start = GetTime();
+    for (prefixsum::PrefixSum::const_iterator it = ps.begin(); it != ps.end(); ++it){
+      dummy += it.PrefixSum();
+    }
+    double prefix_sum_time = GetTime() - start;
+    cout << "           width " << prefixsum::BitUtil::GetBinaryLen(maxvals[m] - 1) << endl
+         << "         get M/s " << num / get_time / 1e6 << endl
+         << "        scan M/s " << num / scan_time / 1e6 << endl
+         << "   prefixsum M/s " << num / prefix_sum_time / 1e6 << endl
+         << "           dummy " << dummy << endl;
+  }
+  return 0;
+}
+
+// export of all values and prefix sums to arrays against the iterator,
+// with the scalar and the supported kernels
+int ExportTest(){
+  typedef prefixsum::BitKernel BitKernel;
+  const BitKernel::Level supported = BitKernel::GetSupportedLevel();
+  uint64_t num = 10000000;
+  const uint64_t maxvals[] = {2, 1000, 1LLU << 20, 1LLU << 40};
+  vector<uint64_t> out(num);
+  for (uint64_t m = 0; m < 4; ++m){
+    vector<uint64_t> vals(num);
+    for (uint64_t i = 0; i < num; ++i){
+      vals[i] = (((uint64_t)rand() << 32) ^ rand()) % maxvals[m];
+    }
+    prefixsum::PrefixSum ps(vals.begin(), vals.end());
+    double start = GetTime();
+    prefixsum::PrefixSum::const_iterator it = ps.begin();
+    for (uint64_t i = 0; i < num; ++i, ++it){
+      out[i] = *it;
+    }
+    double scan_time = GetTime() - start;
+    cout << "           width " << prefixsum::BitUtil::GetBinaryLen(maxvals[m] - 1) << endl
+         << "        scan M/s " << num / scan_time / 1e6 << endl;
+    const BitKernel::Level levels[] = {BitKernel::SCALAR, supported};
+    for (uint64_t l = 0; l < 2; ++l){
+      BitKernel::SetLevel(levels[l]);
+      start = GetTime();
+      ps.DecodeTo(&out[0], 0, num);
+      double decode_time = GetTime() - start;
+      start = GetTime();
+      ps.PrefixSumsTo(&out[0], 0, num);
+      double prefix_sums_time = GetTime() - start;
+      cout << "          kernel " << BitKernel::GetLevelName(levels[l]) << endl
+           << "      decode M/s " << num / decode_time / 1e6 << endl
+           << "  prefixsums M/s " << num / prefix_sums_time / 1e6 << endl;
+    }
+    cout << "           check " << (out[num - 1] + vals[num - 1] == ps.Sum()) << endl;
+  }
+  return 0;
+}
+
+// Load of a saved tree against rebuilding it by insertions and by Build
+int SaveTest(){
+  uint64_t num = 10000000;
+  vector<uint64_t> vals(num);
+  for (uint64_t i = 0; i < num; ++i){
+    vals[i] = rand() % 1000;
+  }
+  prefixsum::PrefixSum ps;
+  double start = GetTime();
+  for (uint64_t i = 0; i < num; ++i){
+    ps.Insert(i, vals[i]);
+  }
+  double insert_time = GetTime() - start;
+  start = GetTime();
+  prefixsum::PrefixSum built(vals.begin(), vals.end());
+  double build_time = GetTime() - start;
+
+  ostringstream os;
+  start = GetTime();
+  ps.Save(os);
+  double save_time = GetTime() - start;
+  const string saved = os.str();
+  istringstream is(saved);
+  prefixsum::PrefixSum loaded;
+  start = GetTime();
+  bool ok = loaded.Load(is);
+  double load_time = GetTime() - start;
+
+  cout << "           bytes " << saved.size() << endl
+       << "     insert time " << insert_time << endl
+       << "      build time " << build_time << endl
+       << "       save time " << save_time << endl
+       << "       load time " << load_time << endl
+       << "       load MB/s " << saved.size() / load_time / 1e6 << endl
+       << "              ok " << (ok && loaded.Sum() == ps.Sum()) << endl;
+  return 0;
+}
+
+// Open of a frozen image against Load, and queries on the mapping
+// against those on the tree
+int FrozenTest(){
+  const char* path = "/tmp/prefixsum_performance_test.img";
+  uint64_t num = 10000000;
+  uint64_t op_num = 1000000;
+  vector<uint64_t> vals(num);
+  for (uint64_t i = 0; i < num; ++i){
+    vals[i] = rand() % 1000;
+  }
+  prefixsum::PrefixSum ps(vals.begin(), vals.end());
+  double start = GetTime();
+  ps.Freeze(path);
+  double freeze_time = GetTime() - start;
+  ostringstream os;
+  ps.Save(os);
+  istringstream is(os.str());
+  prefixsum::PrefixSum loaded;
+  start = GetTime();
+  loaded.Load(is);
+  double load_time = GetTime() - start;
+  prefixsum::FrozenPrefixSum frozen;
+  start = GetTime();
+  frozen.Open(path);
+  double open_time = GetTime() - start;
+
+  vector<uint64_t> inds(op_num);
+  vector<uint64_t> sums(op_num);
+  for (uint64_t i = 0; i < op_num; ++i){
+    inds[i] = rand() % num;
+    sums[i] = (((uint64_t)rand() << 32) ^ rand()) % ps.Sum();
+  }
+  uint64_t dummy = 0;
+  start = GetTime();
+  for (uint64_t i = 0; i < op_num; ++i){
+    dummy += ps.GetPrefixSum(inds[i]) + ps.Find(sums[i]);
+  }
+  double tree_time = GetTime() - start;
+  start = GetTime();
+  for (uint64_t i = 0; i < op_num; ++i){
+    dummy -= frozen.GetPrefixSum(inds[i]) + frozen.Find(sums[i]);
+  }
+  double frozen_time = GetTime() - start;
+  frozen.Close();
+  remove(path);
+
+  cout << "     freeze time " << freeze_time << endl
+       << "       load time " << load_time << endl
+       << "       open time " << open_time << endl
+       << "   tree ns/query " << tree_time * 1e9 / (op_num * 2) << endl
+       << " frozen ns/query " << frozen_time * 1e9 / (op_num * 2) << endl
+       << "           dummy " << dummy << endl;
+  return 0;
+}
+
+// queries on the Elias-Fano sequence against those on the tree
+int EliasFanoTest(){
+  uint64_t num = 10000000;
+  uint64_t op_num = 1000000;
+  uint64_t maxval = 100;
+  vector<uint64_t> vals(num);
+  for (uint64_t i = 0; i < num; ++i){
+    vals[i] = rand() % maxval;
+  }
+  prefixsum::PrefixSum ps(vals.begin(), vals.end());
+  prefixsum::EliasFanoPrefixSum ef;
+  double start = GetTime();
+  ef.Build(ps);
+  double build_time = GetTime() - start;
+
+  vector<uint64_t> inds(op_num);
+  vector<uint64_t> sums(op_num);
+  for (uint64_t i = 0; i < op_num; ++i){
+    inds[i] = rand() % num;
+    sums[i] = (((uint64_t)rand() << 32) ^ rand()) % ps.Sum();
+  }
+  uint64_t dummy = 0;
+  start = GetTime();
+  for (uint64_t i = 0; i < op_num; ++i){
+    dummy += ps.GetPrefixSum(inds[i]);
+  }
+  double tree_prefix_sum_time = GetTime() - start;
+  start = GetTime();
+  for (uint64_t i = 0; i < op_num; ++i){
+    dummy += ps.Find(sums[i]);
+  }
+  double tree_find_time = GetTime() - start;
+  start = GetTime();
+  for (uint64_t i = 0; i < op_num; ++i){
+    dummy -= ef.GetPrefixSum(inds[i]);
+  }
+  double ef_prefix_sum_time = GetTime() - start;
+  start = GetTime();
+  for (uint64_t i = 0; i < op_num; ++i){
+    dummy -= ef.Find(sums[i]);
+  }
+  double ef_find_time = GetTime() - start;
+  prefixsum::PrefixSum thawed;
+  start = GetTime();
+  ef.Thaw(thawed);
+  double thaw_time = GetTime() - start;
+
+  cout << "   optimal_bytes " << prefixsum::BitUtil::GetBinaryLen(maxval) * num / 8 << endl
+       << "      tree_bytes " << ps.GetAllocatedBytes() << endl
+       << "        ef_bytes " << ef.GetAllocatedBytes() << endl
+       << "      build time " << build_time << endl
+       << "       thaw time " << thaw_time << endl
+       << " tree psum ns/op " << tree_prefix_sum_time * 1e9 / op_num << endl
+       << "   ef psum ns/op " << ef_prefix_sum_time * 1e9 / op_num << endl
+       << " tree find ns/op " << tree_find_time * 1e9 / op_num << endl
+       << "   ef find ns/op " << ef_find_time * 1e9 / op_num << endl
+       << "           dummy " << dummy << endl;
+  return 0;
+}
+
+// the operations of a thread in ConcurrentTest
+template <class PrefixSumT>
+struct MixArg{
+  PrefixSumT* ps;
+  pthread_mutex_t* mutex;  // held around every operation if not NULL
+  uint64_t num;
+  uint64_t op_num;
+  uint64_t read_percent;
+  unsigned int seed;
+  uint64_t dummy;
+};
+
+// queries (Get, GetPrefixSum and Find in turn) and increments
+template <class PrefixSumT>
+void* RunMix(void* p){
+  MixArg<PrefixSumT>& arg = *static_cast<MixArg<PrefixSumT>*>(p);
+  for (uint64_t i = 0; i < arg.op_num; ++i){
+    const uint64_t r = rand_r(&arg.seed);
+    const uint64_t ind = rand_r(&arg.seed) % arg.num;
+    if (arg.mutex != NULL) pthread_mutex_lock(arg.mutex);
+    if (r % 100 >= arg.read_percent){
+      arg.ps->Increment(ind, 1);
+    } else if (r % 3 == 0){
+      arg.dummy += arg.ps->Get(ind);
+    } else if (r % 3 == 1){
+      arg.dummy += arg.ps->GetPrefixSum(ind);
+    } else {
+      arg.dummy += arg.ps->Find(ind * 400);
+    }
+    if (arg.mutex != NULL) pthread_mutex_unlock(arg.mutex);
+  }
+  return NULL;
+}
+
+// return the operations per second of op_num operations by thread_num threads
+template <class PrefixSumT>
+double MixThroughput(PrefixSumT& ps, pthread_mutex_t* mutex, uint64_t num,
+                     uint64_t thread_num, uint64_t op_num, uint64_t read_percent, uint64_t& dummy){
+  vector<MixArg<PrefixSumT> > args(thread_num);
+  vector<pthread_t> threads(thread_num);
+  double start = GetTime();
+  for (uint64_t t = 0; t < thread_num; ++t){
+    MixArg<PrefixSumT>& arg = args[t];
+    arg.ps = &ps;
+    arg.mutex = mutex;
+    arg.num = num;
+    arg.op_num = op_num / thread_num;
+    arg.read_percent = read_percent;
+    arg.seed = t + 1;
+    arg.dummy = 0;
+    pthread_create(&threads[t], NULL, RunMix<PrefixSumT>, &arg);
+  }
+  for (uint64_t t = 0; t < thread_num; ++t){
+    pthread_join(threads[t], NULL);
+    dummy += args[t].dummy;
+  }
+  return op_num / (GetTime() - start);
+}
+
+// PrefixSum behind a global mutex against ConcurrentPrefixSum and
+// ShardedPrefixSum of max_threads shards, from 1 to max_threads threads
+// (the processors if 0)
+int ConcurrentTest(uint64_t max_threads, uint64_t read_percent){
+  uint64_t num = 1000000;
+  uint64_t op_num = 4000000;
+  if (max_threads == 0) max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  vector<uint64_t> vals(num);
+  prefixsum::ConcurrentPrefixSum cps(num);
+  for (uint64_t i = 0; i < num; ++i){
+    vals[i] = rand() % 1000;
+    cps.Insert(i, vals[i]);
+  }
+  prefixsum::PrefixSum ps(vals.begin(), vals.end());
+  prefixsum::ShardedPrefixSum sps(max_threads, vals.begin(), vals.end());
+  pthread_mutex_t mutex;
+  pthread_mutex_init(&mutex, NULL);
+
+  uint64_t dummy = 0;
+  cout << "    read_percent " << read_percent << endl;
+  for (uint64_t thread_num = 1; ; thread_num *= 2){
+    if (thread_num > max_threads) thread_num = max_threads;
+    double mutex_ops = MixThroughput(ps, &mutex, num, thread_num, op_num, read_percent, dummy);
+    double olc_ops = MixThroughput(cps, static_cast<pthread_mutex_t*>(NULL), num,
+                                   thread_num, op_num, read_percent, dummy);
+    double sharded_ops = MixThroughput(sps, static_cast<pthread_mutex_t*>(NULL), num,
+                                       thread_num, op_num, read_percent, dummy);
+    cout << "         threads " << thread_num << endl
+         << "    mutex Mops/s " << mutex_ops * 1e-6 << endl
+         << "      olc Mops/s " << olc_ops * 1e-6 << endl
+         << "  sharded Mops/s " << sharded_ops * 1e-6 << endl;
+    if (thread_num == max_threads) break;
+  }
+  cout << "           dummy " << dummy << endl;
+  pthread_mutex_destroy(&mutex);
+  return 0;
+}
+
+// decaying counters with transient spikes
+int CompactTest(){
+  uint64_t num = 1000000;
+  uint64_t op_num = 10000000;
+  prefixsum::Arena* arena = new prefixsum::Arena;
+  prefixsum::PrefixSum ps(arena);
+  vector<uint64_t> vals(num);
+  ps.Build(vals.begin(), vals.end());
+  for (uint64_t i = 0; i < op_num; ++i){
+    uint64_t pos = rand() % num;
+    if (i % 1000 == 0){
+      ps.Increment(pos, 1LLU << 32);
+      ps.Decrement(pos, 1LLU << 32);
+    } else if (rand() % 2 == 0){
+      ps.Increment(pos, 1);
+      ++vals[pos];
+    } else if (vals[pos] > 0){
+      ps.Decrement(pos, 1);
+      --vals[pos];
+    }
+  }
+  uint64_t used_bytes = arena->GetUsedBytes();
+  double start = GetTime();
+  uint64_t compact_bytes = ps.Compact();
+  double compact_time = GetTime() - start;
+
+  cout << "      used_bytes " << used_bytes << endl
+       << "   compact_bytes " << compact_bytes << endl
+       << "    compact time " << compact_time << endl
+       << " allocated_bytes " << ps.GetAllocatedBytes() << endl;
+  return 0;
+}
+
+
+// Increments while a snapshot is alive against those without one, and
+// the bytes of the copies against those of the tree
+int SnapshotTest(){
+  uint64_t num = 10000000;
+  uint64_t op_num = 1000000;
+  vector<uint64_t> vals(num);
+  for (uint64_t i = 0; i < num; ++i){
+    vals[i] = rand() % 1000;
+  }
+  prefixsum::PrefixSum ps(vals.begin(), vals.end());
+  vector<uint64_t> inds(op_num);
+  for (uint64_t i = 0; i < op_num; ++i){
+    inds[i] = rand() % num;
+  }
+  const uint64_t tree_bytes = ps.GetAllocatedBytes();
+  double start = GetTime();
+  for (uint64_t i = 0; i < op_num; ++i){
+    ps.Increment(inds[i], 1);
+  }
+  double plain_time = GetTime() - start;
+
+  // the first update of a leaf after GetSnapshot() copies its path,
+  // and the copies of the first 10000 updates are measured
+  uint64_t copied_bytes = 0;
+  start = GetTime();
+  {
+    prefixsum::PrefixSum::Snapshot snapshot = ps.GetSnapshot();
+    for (uint64_t i = 0; i < op_num; ++i){
+      ps.Increment(inds[i], 1);
+      if (i + 1 == 10000){
+        copied_bytes = ps.GetAllocatedBytes() - tree_bytes;
+      }
+    }
+  }
+  double copy_time = GetTime() - start;
+
+  start = GetTime();
+  uint64_t snapshot_num = 0;
+  for (uint64_t i = 0; i < op_num; i += 1000, ++snapshot_num){
+    prefixsum::PrefixSum::Snapshot snapshot = ps.GetSnapshot();
+    for (uint64_t j = i; j < i + 1000; ++j){
+      ps.Increment(inds[j], 1);
+    }
+  }
+  double frequent_time = GetTime() - start;
+
+  cout << "      tree_bytes " << tree_bytes << endl
+       << "    copied_bytes " << copied_bytes << endl
+       << "   copied_per_op " << copied_bytes / 10000 << endl
+       << "      plain Mops " << op_num / plain_time / 1e6 << endl
+       << "   snapshot Mops " << op_num / copy_time / 1e6 << endl
+       << "   frequent Mops " << op_num / frequent_time / 1e6 << endl
+       << "       snapshots " << snapshot_num << endl
+       << "           check " << (ps.Sum() == ps.GetPrefixSum(num)) << endl;
+  return 0;
+}
+
+}
+
+int main(int argc, char* argv[]){
+  string mode = (argc >= 2) ? argv[1] : "memory";
+  if (mode == "memory"){
+    return MemoryTest();
+  } else if (mode == "depth"){
+    return DepthTest();
+  } else if (mode == "build"){
+    return BuildTest();
+  } else if (mode == "increment"){
+    return IncrementTest();
+  } else if (mode == "compact"){
+    return CompactTest();
+  } else if (mode == "encoding"){
+    return EncodingTest();
+  } else if (mode == "cache"){
+    return CacheTest();
+  } else if (mode == "kernel"){
+    return KernelTest();
+  } else if (mode == "insert"){
+    return InsertTest();
+  } else if (mode == "find"){
+    return FindTest();
+  } else if (mode == "batch"){
+    return BatchTest();
+  } else if (mode == "apply"){
+    return ApplyTest();
+  } else if (mode == "range"){
+    return RangeTest();
+  } else if (mode == "scan"){
+    return ScanTest();
+  } else if (mode == "export"){
+    return ExportTest();
+  } else if (mode == "save"){
+    return SaveTest();
+  } else if (mode == "frozen"){
+    return FrozenTest();
+  } else if (mode == "eliasfano"){
+    return EliasFanoTest();
+  } else if (mode == "concurrent"){
+    // concurrent [max_threads] [read_percent]
+    return ConcurrentTest((argc >= 3) ? atoi(argv[2]) : 0, (argc >= 4) ? atoi(argv[3]) : 90);
+  } else if (mode == "snapshot"){
+    return SnapshotTest();
+  }
+  cerr << "usage: " << argv[0] << " [memory|depth|build|increment|compact|encoding|cache|kernel|insert|find|batch|apply|range|scan|export|save|frozen|eliasfano|concurrent|snapshot]" << endl;
+  return -1;
+}